@@ -1,9 +1,14 @@
 #pragma once
 
 #include <iostream>
+#include <functional>
 #include <memory>
 #include <string>
 #include <mutex>
+#include <map>
+#include <list>
+#include <chrono>
+#include <atomic>
 #include <boost/thread/shared_mutex.hpp>
 #include <syslog.h>
 
@@ -13,11 +18,18 @@
 #include "http/libcurl_http_client.h"
 #include "tinyxml2_parser.h"
 #include "executor.h"
+#include "put_blob_request_base.h"
 #include "put_block_list_request_base.h"
 #include "get_blob_property_request_base.h"
 #include "get_blob_request_base.h"
 #include "get_container_property_request_base.h"
 #include "list_blobs_request_base.h"
+#include "compact_blob_property.h"
+#include "striped_lru_map.h"
+#include "lock_table.h"
+#include "single_flight.h"
+#include "transfer_scheduler.h"
+#include "transfer_tuner.h"
 
 namespace microsoft_azure { namespace storage {
 
@@ -37,6 +49,8 @@ namespace microsoft_azure { namespace storage {
         {
             m_context = std::make_shared<executor_context>(std::make_shared<tinyxml2_parser>(), std::make_shared<retry_policy>());
             m_client = std::make_shared<CurlEasyClient>(max_concurrency);
+            m_client->start_event_loops(curl_multi_engine::default_loop_count());
+            m_client->warm_up(account->get_url(storage_account::service::blob).to_string());
         }
 
         /// <summary>
@@ -50,6 +64,8 @@ namespace microsoft_azure { namespace storage {
         {
             m_context = std::make_shared<executor_context>(std::make_shared<tinyxml2_parser>(), std::make_shared<retry_policy>());
             m_client = std::make_shared<CurlEasyClient>(max_concurrency, ca_path);
+            m_client->start_event_loops(curl_multi_engine::default_loop_count());
+            m_client->warm_up(account->get_url(storage_account::service::blob).to_string());
         }
 
         /// <summary>
@@ -60,6 +76,15 @@ namespace microsoft_azure { namespace storage {
             return m_client;
         }
 
+        /// <summary>
+        /// Sets the policy requests are retried by, in place of the default.  Only for use before any request is made.
+        /// </summary>
+        /// <param name="retry">The retry policy.</param>
+        void set_retry_policy(std::shared_ptr<retry_policy_base> retry)
+        {
+            m_context = std::make_shared<executor_context>(std::make_shared<tinyxml2_parser>(), retry);
+        }
+
         /// <summary>
         /// Gets the storage account used to store the base uri and credentails.
         /// </summary>
@@ -85,6 +110,30 @@ namespace microsoft_azure { namespace storage {
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
         AZURE_STORAGE_API storage_outcome<chunk_property> get_chunk_to_stream_sync(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os);
 
+        /// <summary>
+        /// Synchronously download the contents of a blob straight into a file or buffer, without going through a stream.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
+        /// <param name="size">The size of the data to download from the blob, in bytes.</param>
+        /// <param name="sink">The target file range or buffer.</param>
+        /// <param name="if_match">If not empty, the range is only downloaded if the blob's etag is still this; otherwise the request fails with 412.</param>
+        /// <returns>The properties of the downloaded range, or the error.</returns>
+        AZURE_STORAGE_API storage_outcome<chunk_property> get_chunk_to_sink_sync(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, storage_sink sink, const std::string &if_match = std::string());
+
+        /// <summary>
+        /// Downloads the contents of a blob straight into a file or buffer, and calls on_done with the outcome once it is over, rather than waiting for it.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
+        /// <param name="size">The size of the data to download from the blob, in bytes.</param>
+        /// <param name="sink">The target file range or buffer.</param>
+        /// <param name="if_match">If not empty, the range is only downloaded if the blob's etag is still this; otherwise the request fails with 412.</param>
+        /// <param name="on_done">Called with the properties of the downloaded range, or the error, on the thread the request finished on.  See async_executor.</param>
+        AZURE_STORAGE_API void get_chunk_to_sink(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, storage_sink sink, const std::string &if_match, std::function<void(const storage_outcome<chunk_property> &)> on_done);
+
         /// <summary>
         /// Intitiates an asynchronous operation  to download the contents of a blob to a stream.
         /// </summary>
@@ -106,6 +155,26 @@ namespace microsoft_azure { namespace storage {
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
         AZURE_STORAGE_API std::future<storage_outcome<void>> upload_block_blob_from_stream(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata);
 
+        /// <summary>
+        /// Synchronously upload the contents of a blob from a stream.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="is">The source stream.</param>
+        /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
+        /// <returns>A <see cref="storage_outcome" /> object that represents the etag, last modified time and MD5 of the blob as written.</returns>
+        AZURE_STORAGE_API storage_outcome<blob_write_property> upload_block_blob_from_stream_sync(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata);
+
+        /// <summary>
+        /// Uploads a block blob straight from a range of a file, in one request, and calls on_done with the outcome once it is over, rather than waiting for it.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="source">The file range to upload.</param>
+        /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
+        /// <param name="on_done">Called with the properties of the written blob, or the error, on the thread the request finished on.  See async_executor.</param>
+        AZURE_STORAGE_API void upload_block_blob_from_source(const std::string &container, const std::string &blob, storage_source source, const std::vector<std::pair<std::string, std::string>> &metadata, std::function<void(const storage_outcome<blob_write_property> &)> on_done);
+
         /// <summary>
         /// Intitiates an asynchronous operation  to delete a directory blob.
         /// </summary>
@@ -196,6 +265,26 @@ namespace microsoft_azure { namespace storage {
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
         AZURE_STORAGE_API std::future<storage_outcome<void>> upload_block_from_stream(const std::string &container, const std::string &blob, const std::string &blockid, std::istream &is);
 
+        /// <summary>
+        /// Intitiates an asynchronous operation  to upload a block of a blob straight from a range of a file.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="blockid">A Base64-encoded block ID that identifies the block.</param>
+        /// <param name="source">The file range to upload.</param>
+        /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
+        AZURE_STORAGE_API std::future<storage_outcome<void>> upload_block_from_source(const std::string &container, const std::string &blob, const std::string &blockid, storage_source source);
+
+        /// <summary>
+        /// Uploads a block of a blob straight from a range of a file, and calls on_done with the outcome once it is over, rather than waiting for it.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="blockid">A Base64-encoded block ID that identifies the block.</param>
+        /// <param name="source">The file range to upload.</param>
+        /// <param name="on_done">Called with the outcome on the thread the request finished on.  See async_executor.</param>
+        AZURE_STORAGE_API void upload_block_from_source(const std::string &container, const std::string &blob, const std::string &blockid, storage_source source, std::function<void(const storage_outcome<void> &)> on_done);
+
         /// <summary>
         /// Intitiates an asynchronous operation  to create a block blob with existing blocks.
         /// </summary>
@@ -206,6 +295,16 @@ namespace microsoft_azure { namespace storage {
         /// <returns>A <see cref="std::future" /> object that represents the current operation.</returns>
         AZURE_STORAGE_API std::future<storage_outcome<void>> put_block_list(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata);
 
+        /// <summary>
+        /// Synchronously commit a list of blocks to a block blob.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="block_list">The block list.</param>
+        /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
+        /// <returns>A <see cref="storage_outcome" /> object that represents the etag and last modified time of the blob as committed.</returns>
+        AZURE_STORAGE_API storage_outcome<blob_write_property> put_block_list_sync(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata);
+
         /// <summary>
         /// Intitiates an asynchronous operation  to create an append blob.
         /// </summary>
@@ -274,11 +373,66 @@ namespace microsoft_azure { namespace storage {
         AZURE_STORAGE_API std::future<storage_outcome<void>> start_copy(const std::string &sourceContainer, const std::string &sourceBlob, const std::string &destContainer, const std::string &destBlob);
 
     private:
+        // Downloads a range of a blob to wherever the handle's output has been set to.
+        storage_outcome<chunk_property> get_chunk_sync(std::shared_ptr<CurlEasyRequest> http, const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, const std::string &if_match = std::string());
+        void get_chunk(std::shared_ptr<CurlEasyRequest> http, const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, const std::string &if_match, std::function<void(const storage_outcome<chunk_property> &)> on_done);
+
         std::shared_ptr<CurlEasyClient> m_client;
         std::shared_ptr<storage_account> m_account;
         std::shared_ptr<executor_context> m_context;
     };
 
+    /// <summary>
+    /// A download of a blob into a local file that may still be running (see sync_blob_client::start_download_blob_to_file.)
+    /// </summary>
+    class download_progress
+    {
+    public:
+        virtual ~download_progress() {}
+
+        /// <summary>
+        /// The file the blob is being written to.  With a partial download directory this is a file of its own there until the download
+        /// finishes, when it is moved to the destination; a descriptor opened on it before then stays on the data.
+        /// </summary>
+        virtual const std::string &path() const = 0;
+
+        /// <summary>
+        /// The size of the blob, in bytes.
+        /// </summary>
+        virtual unsigned long long length() const = 0;
+
+        /// <summary>
+        /// The blob's last modified time.
+        /// </summary>
+        virtual time_t last_modified() const = 0;
+
+        /// <summary>
+        /// Waits until a range of the blob has been written to the file, having the chunks it needs downloaded ahead of the others.
+        /// </summary>
+        /// <param name="offset">The offset of the range, in bytes.</param>
+        /// <param name="size">The size of the range, in bytes.  Any part of the range past the end of the blob is ignored.</param>
+        /// <returns>0 once the range is in the file, or the errno the download failed with if it never will be.</returns>
+        virtual int wait_for_range(unsigned long long offset, unsigned long long size) = 0;
+
+        /// <summary>
+        /// Waits until the download has finished.
+        /// </summary>
+        /// <returns>0 if the whole blob is at the destination, or the errno the download failed with.</returns>
+        virtual int wait() = 0;
+
+        /// <summary>
+        /// Whether the download has finished, successfully or not.
+        /// </summary>
+        virtual bool finished() = 0;
+
+        /// <summary>
+        /// Stops the download, and drops what it has downloaded, so that nothing is left at the destination.  Returns without waiting for the
+        /// chunks already being downloaded: they are discarded when they come in.  Only waits if the download was already moving the finished
+        /// file into place.  Does nothing if it has already finished.
+        /// </summary>
+        virtual void cancel() = 0;
+    };
+
     /// <summary>
     /// Abstract layer of the blob_client class for the attribute cache layer,
     /// Provides a client-side logical representation of blob storage service on Windows Azure.
@@ -310,7 +464,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        virtual void put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>()) = 0;
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        virtual blob_property put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>()) = 0;
  
         /// <summary>
         /// Uploads the contents of a blob from a stream.
@@ -319,7 +474,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="blob">The blob name.</param>
         /// <param name="is">The source stream.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        virtual void upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>()) = 0;
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        virtual blob_property upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>()) = 0;
 
         /// <summary>
         /// Uploads the contents of a blob from a local file.
@@ -328,8 +484,9 @@ namespace microsoft_azure { namespace storage {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
-        virtual void upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 8) = 0;
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        virtual blob_property upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 0) = 0;
 
         /// <summary>
         /// Downloads the contents of a blob to a stream.
@@ -349,8 +506,20 @@ namespace microsoft_azure { namespace storage {
         /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
         /// <param name="size">The size of the data to download from the blob, in bytes.</param>
         /// <param name="destPath">The target file path.</param>
-        /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
-        virtual void download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel = 9) = 0;
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
+        virtual void download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel = 0) = 0;
+
+        /// <summary>
+        /// Starts downloading the contents of a blob to a local file, and returns once the first chunk is in, leaving the rest to download
+        /// in the background.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="destPath">The target file path.</param>
+        /// <param name="on_finished">Called once the download has finished, with 0 or the errno it failed with, and the blob's last modified time, on whichever thread finished it (which may be before this returns.)  May be empty.</param>
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
+        /// <returns>The download, or nullptr (with errno set) if it failed before the first chunk was in.</returns>
+        virtual std::shared_ptr<download_progress> start_download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished = nullptr, size_t parallel = 0) = 0;
 
         /// <summary>
         /// Gets the property of a blob.
@@ -391,6 +560,8 @@ namespace microsoft_azure { namespace storage {
         virtual void start_copy(const std::string &sourceContainer, const std::string &sourceBlob, const std::string &destContainer, const std::string &destBlob) = 0;
     };
 
+    class partial_download_store;
+
     /// <summary>
     /// Provides a wrapper for client-side logical representation of blob storage service on Windows Azure. This wrappered client is used to configure and execute requests against the service.
     /// </summary>
@@ -409,6 +580,7 @@ namespace microsoft_azure { namespace storage {
             if (blobClient != NULL)
             {
                 m_concurrency = blobClient->concurrency();
+                init_transfers();
             }
         }
 
@@ -428,6 +600,11 @@ namespace microsoft_azure { namespace storage {
         blob_client_wrapper(blob_client_wrapper &&other)
         {
             m_blobClient = other.m_blobClient;
+            m_scheduler = other.m_scheduler;
+            m_upload_tuner = other.m_upload_tuner;
+            m_download_tuner = other.m_download_tuner;
+            m_partial_downloads = other.m_partial_downloads;
+            m_upload_journal_directory = other.m_upload_journal_directory;
             m_concurrency = other.m_concurrency;
             m_valid = other.m_valid;
         }
@@ -435,6 +612,11 @@ namespace microsoft_azure { namespace storage {
         blob_client_wrapper& operator=(blob_client_wrapper&& other)
         {
             m_blobClient = other.m_blobClient;
+            m_scheduler = other.m_scheduler;
+            m_upload_tuner = other.m_upload_tuner;
+            m_download_tuner = other.m_download_tuner;
+            m_partial_downloads = other.m_partial_downloads;
+            m_upload_journal_directory = other.m_upload_journal_directory;
             m_concurrency = other.m_concurrency;
             m_valid = other.m_valid;
             return *this;
@@ -444,6 +626,28 @@ namespace microsoft_azure { namespace storage {
         {
             return m_valid && (m_blobClient != NULL);
         }
+
+        /// <summary>
+        /// Keeps the data of downloads that fail part way through in the given directory, so that the next download of the blob to the same
+        /// file picks up where the last left off.  Downloads then go into a file in that directory, and are moved into place once complete, so
+        /// it must be on the same file system as their destinations.  Applies to wrappers created afterwards.  Empty (the default) to turn off.
+        /// </summary>
+        static void set_partial_download_directory(const std::string &directory)
+        {
+            s_partial_download_directory = directory;
+        }
+
+        /// <summary>
+        /// Keeps a journal in the given directory for each upload of a file in blocks, until the blocks are committed, so that if the upload
+        /// fails or the process dies part way through, the next upload of the same file to the blob only sends the blocks not already staged.
+        /// A journal is only of use to a later process if both it and the file outlive this one.  Applies to wrappers created afterwards.
+        /// Empty (the default) to turn off.
+        /// </summary>
+        static void set_upload_journal_directory(const std::string &directory)
+        {
+            s_upload_journal_directory = directory;
+        }
+
         /* C++ wrappers without exception but error codes instead */
 
         /* container level*/
@@ -492,7 +696,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        void put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        blob_property put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
 
         /// <summary>
         /// Uploads the contents of a blob from a stream.
@@ -501,7 +706,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="blob">The blob name.</param>
         /// <param name="is">The source stream.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        void upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        blob_property upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
 
         /// <summary>
         /// Uploads the contents of a blob from a local file.
@@ -510,8 +716,9 @@ namespace microsoft_azure { namespace storage {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
-        void upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 8);
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        blob_property upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 0);
 
         /// <summary>
         /// Downloads the contents of a blob to a stream.
@@ -531,9 +738,21 @@ namespace microsoft_azure { namespace storage {
         /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
         /// <param name="size">The size of the data to download from the blob, in bytes.</param>
         /// <param name="destPath">The target file path.</param>
-        /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
         /// <returns>A <see cref="storage_outcome" /> object that represents the properties (etag, last modified time and size) from the first chunk retrieved.</returns>
-        void download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel = 9);
+        void download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel = 0);
+
+        /// <summary>
+        /// Starts downloading the contents of a blob to a local file, and returns once the first chunk is in, leaving the rest to download
+        /// in the background.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="destPath">The target file path.</param>
+        /// <param name="on_finished">Called once the download has finished, with 0 or the errno it failed with, and the blob's last modified time, on whichever thread finished it (which may be before this returns.)  May be empty.</param>
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
+        /// <returns>The download, or nullptr (with errno set) if it failed before the first chunk was in.</returns>
+        std::shared_ptr<download_progress> start_download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished = nullptr, size_t parallel = 0);
 
         /// <summary>
         /// Gets the property of a blob.
@@ -576,7 +795,21 @@ namespace microsoft_azure { namespace storage {
     private:
         blob_client_wrapper() {}
 
+        // Creates the scheduler that runs block and chunk transfers, the tuners that size them, the store for partial downloads, and where upload journals go.
+        void init_transfers();
+
+        // Does the work of start_download_blob_to_file.  With wait_for_all, the caller is about to wait for the whole file, so every chunk is
+        // downloaded as one a reader is waiting on, rather than in the background.
+        std::shared_ptr<download_progress> start_download(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished, size_t parallel, bool wait_for_all);
+
         std::shared_ptr<blob_client> m_blobClient;
+        std::shared_ptr<transfer_scheduler> m_scheduler; // Runs the blocks and chunks of every file this client uploads or downloads.
+        std::shared_ptr<transfer_tuner> m_upload_tuner;
+        std::shared_ptr<transfer_tuner> m_download_tuner;
+        std::shared_ptr<partial_download_store> m_partial_downloads; // Null unless there is a partial download directory.
+        static std::string s_partial_download_directory;
+        std::string m_upload_journal_directory; // Empty unless uploads are journaled.
+        static std::string s_upload_journal_directory;
         std::mutex s_mutex;
         unsigned int m_concurrency;
         bool m_valid;
@@ -629,6 +862,7 @@ namespace microsoft_azure { namespace storage {
         const std::string &blob_endpoint = "");
 
     // A wrapper around the "blob_client_wrapper" that provides in-memory caching for "get_blob_properties" calls.
+    // Concurrent cache misses for the same blob, and concurrent identical listings, are collapsed into a single call to the service, whose result (and errno) all the callers share.
     class blob_client_attr_cache_wrapper : public sync_blob_client
     {
     public:
@@ -636,8 +870,10 @@ namespace microsoft_azure { namespace storage {
         /// Constructs a blob client wrapper from a blob client instance.
         /// </summary>
         /// <param name="blobClient">A <see cref="microsoft_azure::storage::blob_client"> object stored in shared_ptr.</param>
-        explicit blob_client_attr_cache_wrapper(std::shared_ptr<sync_blob_client> blob_client_wrapper)
-            : m_blob_client_wrapper(blob_client_wrapper), attr_cache()
+        /// <param name="cache_timeout_in_seconds">Number of seconds a cached item stays valid after it was last confirmed against the service.  0 means items never expire.</param>
+        /// <param name="cache_max_entries">Maximum number of blobs (and, separately, directories) to keep in the cache before evicting the least recently used ones.  0 means no limit.</param>
+        explicit blob_client_attr_cache_wrapper(std::shared_ptr<sync_blob_client> blob_client_wrapper, unsigned int cache_timeout_in_seconds = 0, size_t cache_max_entries = 0)
+            : m_blob_client_wrapper(blob_client_wrapper), attr_cache(cache_timeout_in_seconds, cache_max_entries)
         {
         }
 
@@ -646,6 +882,7 @@ namespace microsoft_azure { namespace storage {
         /// </summary>
         /// <param name="other">A <see cref="microsoft_azure::storage::blob_client_attr_cache_wrapper"> object.</param>
         blob_client_attr_cache_wrapper(blob_client_attr_cache_wrapper &&other)
+            : attr_cache(other.attr_cache.timeout_in_seconds(), other.attr_cache.max_entries())
         {
             m_blob_client_wrapper = other.m_blob_client_wrapper;
         }
@@ -653,6 +890,7 @@ namespace microsoft_azure { namespace storage {
         blob_client_attr_cache_wrapper& operator=(blob_client_attr_cache_wrapper&& other)
         {
             m_blob_client_wrapper = other.m_blob_client_wrapper;
+            attr_cache.configure(other.attr_cache.timeout_in_seconds(), other.attr_cache.max_entries());
             return *this;
         }
 
@@ -661,62 +899,146 @@ namespace microsoft_azure { namespace storage {
             return m_blob_client_wrapper != NULL;
         }
 
-        // Represents a blob on the service
+        // Represents a blob on the service.  Held by value in the cache's map, and only read or written under the lock of the map shard it is in.
         class blob_cache_item
         {
         public:
-            blob_cache_item(std::string name, blob_property props) : m_confirmed(false), m_mutex(), m_name(name), m_props(props)
+            blob_cache_item() : m_last_confirmed(), m_props()
             {
 
             }
 
+            // Marks the item as accurately representing the blob on the service as of now.
+            void confirm()
+            {
+                m_last_confirmed = std::chrono::steady_clock::now();
+            }
+
+            // Marks the item as no longer known to represent the blob on the service.  This is invalidating the cache.
+            void unconfirm()
+            {
+                m_last_confirmed = std::chrono::steady_clock::time_point();
+            }
 
             // True if this item should accurately represent a blob on the service.
-            // False if not (or unknown).  Marking an item as not confirmed is invalidating the cache.
-            bool m_confirmed;
+            // False if not (or unknown).
+            bool confirmed() const
+            {
+                return m_last_confirmed != std::chrono::steady_clock::time_point();
+            }
+
+            // The time at which the item was last confirmed, used to expire items after the cache timeout, or the clock's epoch if it isn't confirmed.
+            // (Rather than a separate flag, which would cost each of millions of items another 8 bytes with padding.)
+            std::chrono::steady_clock::time_point m_last_confirmed;
+
+            // The (cached) properties of the blob, stored compactly as there may be tens of millions of these.
+            compact_blob_property m_props;
+        };
+
+        // Represents a directory known to the cache.
+        class dir_cache_item
+        {
+        public:
+            dir_cache_item() : m_mutex()
+            {
 
-            // A mutex that can be locked in shared or unique mode (reader/writer lock)
-            // TODO: Consider switching this to be a regular mutex
+            }
+
+            // Locked in unique mode by listings of the directory, and in shared mode by operations on the blobs in it.
             boost::shared_mutex m_mutex;
+        };
+
+        // Identifies a cached blob by its directory and its name within that directory.  The directory's path is only stored once, as the key of
+        // its entry in the directory map, however many of its blobs are cached.
+        struct blob_cache_key
+        {
+            std::shared_ptr<dir_cache_item> dir; // Holding the directory's entry keeps it from being evicted while any blob in it is cached.
+            std::string name;
 
-            // Name of the blob
-            std::string m_name;
+            bool operator==(const blob_cache_key &other) const
+            {
+                return dir == other.dir && name == other.name;
+            }
+        };
 
-            // The (cached) properties of the blob
-            blob_property m_props;
+        struct blob_cache_key_hash
+        {
+            size_t operator()(const blob_cache_key &key) const noexcept
+            {
+                size_t hash = std::hash<std::string>()(key.name);
+                return hash ^ (std::hash<dir_cache_item *>()(key.dir.get()) + 0x9e3779b9 + (hash << 6) + (hash >> 2));
+            }
         };
 
         // A thread-safe cache of the properties of the blobs in a container on the service.
-        // In order to access or update a single cache item, you must lock on the mutex in the relevant blob_cache_item, and also on the mutex representing the parent directory.
-        // This is due to the single cache item being linked to the directory
+        // Every operation on a blob locks the mutex representing the parent directory, and then the blob's own lock, taken from the blob lock table.
+        // For example, to operate on the blob "dir1/dir2/blobname", you need to lock the mutex of the item returned by get_dir_item("dir1/dir2"), and then the mutex
+        // of the handle returned by lock_blob("dir1/dir2/blobname").
         // The directory mutex must always be locked before the blob mutex, and no thread should ever have more than one blob mutex (or directory) held at once - this will prevent deadlocks.
-        // For example, to access the properties of a blob "dir1/dir2/blobname", you need to access and lock the mutex returned by get_dir_item("dir1/dir2"), and then the mutex in the blob_cache_item
-        // returned by get_blob_item("dir1/dir2/blobname").
-        // 
+        //
         // To read the properties of the blob from the cache, lock both mutexes in shared mode.
         // To update the properties of a single blob (or to invalidate a cache item), grab the directory mutex in shared mode, and the blob mutex in unique mode.  The mutexes must be held during both the
         // relevant service call and the following cache update.
-        // For a 'list blobs' request, first grab the mutex for the directory in unique mode.  Then, make the request and parse the response.  For each blob in the response, grab the blob mutex for that item in unique mode 
+        // For a 'list blobs' request, first grab the mutex for the directory in unique mode.  Then, make the request and parse the response.  For each blob in the response, grab the blob mutex for that item in unique mode
         // before updating it.  Don't release the directory mutex until all blobs have been updated.
-        // 
-        // TODO: Currently, the maps holding the cached information grow without bound; this should be fixed.
-        // TODO: Implement a cache timeout
+        //
+        // The locks above order operations on a blob against each other; the cached records themselves are only touched under the map's shard locks,
+        // through get_fresh / store / invalidate.  A blob's lock exists only while an operation on the blob holds or waits for it, so a cached blob costs
+        // no more than its record in the map.
+        //
+        // Items confirmed more than the configured timeout ago are treated as unconfirmed, and both maps are bounded by a maximum number of entries,
+        // past which the least recently used entries are evicted.  A directory entry is only ever evicted while no other thread holds a reference to it,
+        // so nobody can hold or be waiting on the mutex of an evicted directory.  The key of every cached blob holds a reference to its directory's entry,
+        // so the directory map keeps every directory with a blob in the cache, past its own limit if need be.  An evicted blob is simply unknown to the
+        // cache, and will be fetched from the service on next access.
+        //
         // TODO: When we no longer use an internal copy of cpplite, the attrib cache code should stay with blobfuse - it's not really applicable in the general cpplite use case.
         class attribute_cache
         {
         public:
-            attribute_cache() : blob_cache(), blobs_mutex(), dir_cache(), dirs_mutex()
+            attribute_cache(unsigned int timeout_in_seconds = 0, size_t max_entries = 0)
+                : blob_cache(max_entries), dir_cache(max_entries), blob_locks(), m_timeout_in_seconds(timeout_in_seconds), m_string_pool()
             {
             }
 
-            std::shared_ptr<boost::shared_mutex> get_dir_item(const std::string& path);
-            std::shared_ptr<blob_cache_item> get_blob_item(const std::string& path);
+            std::shared_ptr<dir_cache_item> get_dir_item(const std::string& path);
+
+            // Returns a handle on the lock for operations on the blob.  The handle must outlive any lock taken on its mutex.
+            lock_table<boost::shared_mutex>::handle lock_blob(const std::string& path) { return blob_locks.get(path); }
+
+            // True if an operation on the blob holds or is waiting for its lock.
+            bool blob_busy(const std::string& path) { return blob_locks.busy(path); }
+
+            // The following take the blob's directory, as returned by get_dir_item, along with its path.
+
+            // Copies the cached properties of the blob into props, if the item was confirmed and the confirmation has not yet timed out.
+            bool get_fresh(const std::shared_ptr<dir_cache_item>& dir, const std::string& path, blob_property& props);
+
+            // Stores the properties of the blob, confirmed as of now.  A record too large to store leaves the item unconfirmed instead.
+            void store(const std::shared_ptr<dir_cache_item>& dir, const std::string& path, blob_property& props);
+
+            // Marks the blob's item (if there is one) as not confirmed.
+            void invalidate(const std::shared_ptr<dir_cache_item>& dir, const std::string& path);
+
+            // May be called while other threads are using the cache.
+            void configure(unsigned int timeout_in_seconds, size_t max_entries);
+            unsigned int timeout_in_seconds() const { return m_timeout_in_seconds.load(); }
+            size_t max_entries() const { return blob_cache.max_entries(); }
+            size_t blob_count() { return blob_cache.size(); }
+            size_t dir_count() { return dir_cache.size(); }
 
         private:
-            std::map<std::string, std::shared_ptr<blob_cache_item>> blob_cache;
-            std::mutex blobs_mutex; // Used to protect the blob_cache map itself, not items in the map.
-            std::map<std::string, std::shared_ptr<boost::shared_mutex>> dir_cache;
-            std::mutex dirs_mutex;// Used to protect the dir_cache map itself, not items in the map.
+            // True if the item was confirmed, and the confirmation has not yet timed out.
+            bool is_fresh(const blob_cache_item& item) const;
+
+            static blob_cache_key key_for(const std::shared_ptr<dir_cache_item>& dir, const std::string& path);
+
+            // The maps and the lock table are internally synchronized.
+            striped_lru_map<blob_cache_item, blob_cache_key, blob_cache_key_hash> blob_cache;
+            striped_lru_map<std::shared_ptr<dir_cache_item>> dir_cache;
+            lock_table<boost::shared_mutex> blob_locks;
+            std::atomic<unsigned int> m_timeout_in_seconds; // 0 means items never expire.  Read without the shard locks, so atomic.
+            string_intern_pool m_string_pool; // Pool for the low-cardinality strings in the cached properties (content type, encoding, etc.)
         };
 
         /// <summary>
@@ -726,13 +1048,17 @@ namespace microsoft_azure { namespace storage {
         /// <param name="account_key">The storage account key.</param>
         /// <param name="sas_token">A sas token for the container.</param>
         /// <param name="concurrency">The maximum number requests could be executed in the same time.</param>
+        /// <param name="cache_timeout_in_seconds">Number of seconds a cached item stays valid.  0 means items never expire.</param>
+        /// <param name="cache_max_entries">Maximum number of entries to keep in the cache.  0 means no limit.</param>
         /// <returns>Return a <see cref="microsoft_azure::storage::blob_client_wrapper"> object.</returns>
         static blob_client_attr_cache_wrapper blob_client_attr_cache_wrapper_init_accountkey(
             const std::string &account_name,
             const std::string &account_key,
             const unsigned int concurrency,
             bool use_https = true,
-            const std::string &blob_endpoint = "");
+            const std::string &blob_endpoint = "",
+            unsigned int cache_timeout_in_seconds = 0,
+            size_t cache_max_entries = 0);
 
         /// <summary>
         /// Constructs a blob client wrapper from storage account credential.
@@ -743,13 +1069,17 @@ namespace microsoft_azure { namespace storage {
         /// <param name="concurrency">The maximum number requests could be executed in the same time.</param>
         /// <param name="use_https">True if https should be used (instead of HTTP).  Note that this may cause a sizable perf loss, due to issues in libcurl.</param>
         /// <param name="blob_endpoint">Blob endpoint URI to allow non-public clouds as well as custom domains.</param>
+        /// <param name="cache_timeout_in_seconds">Number of seconds a cached item stays valid.  0 means items never expire.</param>
+        /// <param name="cache_max_entries">Maximum number of entries to keep in the cache.  0 means no limit.</param>
         /// <returns>Return a <see cref="microsoft_azure::storage::blob_client_wrapper"> object.</returns>
         static blob_client_attr_cache_wrapper blob_client_attr_cache_wrapper_init_sastoken(
             const std::string &account_name,
             const std::string &sas_token,
             const unsigned int concurrency,
             bool use_https = true,
-            const std::string &blob_endpoint = "");
+            const std::string &blob_endpoint = "",
+            unsigned int cache_timeout_in_seconds = 0,
+            size_t cache_max_entries = 0);
 
         /// <summary>
         /// Constructs a blob client wrapper from storage account credential.
@@ -758,11 +1088,15 @@ namespace microsoft_azure { namespace storage {
         /// <param name="account_key">The storage account key.</param>
         /// <param name="sas_token">A sas token for the container.</param>
         /// <param name="concurrency">The maximum number requests could be executed in the same time.</param>
+        /// <param name="cache_timeout_in_seconds">Number of seconds a cached item stays valid.  0 means items never expire.</param>
+        /// <param name="cache_max_entries">Maximum number of entries to keep in the cache.  0 means no limit.</param>
         /// <returns>Return a <see cref="microsoft_azure::storage::blob_client_wrapper"> object.</returns>
         static blob_client_attr_cache_wrapper blob_client_attr_cache_wrapper_oauth(
         const std::string &account_name,
         const unsigned int concurrency,
-        const std::string &blob_endpoint = "");
+        const std::string &blob_endpoint = "",
+        unsigned int cache_timeout_in_seconds = 0,
+        size_t cache_max_entries = 0);
 
         /// <summary>
         /// List blobs in segments.
@@ -782,7 +1116,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        void put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        blob_property put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
 
         /// <summary>
         /// Uploads the contents of a blob from a stream.
@@ -791,7 +1126,8 @@ namespace microsoft_azure { namespace storage {
         /// <param name="blob">The blob name.</param>
         /// <param name="is">The source stream.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        void upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        blob_property upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>());
 
         /// <summary>
         /// Uploads the contents of a blob from a local file.
@@ -800,8 +1136,9 @@ namespace microsoft_azure { namespace storage {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
-        void upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 8);
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
+        /// <returns>The properties of the blob as written, taken from the response.  Invalid if the upload failed (errno is set in that case.)</returns>
+        blob_property upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata = std::vector<std::pair<std::string, std::string>>(), size_t parallel = 0);
 
         /// <summary>
         /// Downloads the contents of a blob to a stream.
@@ -821,9 +1158,21 @@ namespace microsoft_azure { namespace storage {
         /// <param name="offset">The offset at which to begin downloading the blob, in bytes.</param>
         /// <param name="size">The size of the data to download from the blob, in bytes.</param>
         /// <param name="destPath">The target file path.</param>
-        /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
         /// <returns>A <see cref="storage_outcome" /> object that represents the properties (etag, last modified time and size) from the first chunk retrieved.</returns>
-        void download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel = 8);
+        void download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel = 0);
+
+        /// <summary>
+        /// Starts downloading the contents of a blob to a local file, and returns once the first chunk is in, leaving the rest to download
+        /// in the background.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="destPath">The target file path.</param>
+        /// <param name="on_finished">Called once the download has finished, with 0 or the errno it failed with, and the blob's last modified time, on whichever thread finished it (which may be before this returns.)  May be empty.</param>
+        /// <param name="parallel">The most blocks to transfer at once, or 0 to let the client tune it to the link.</param>
+        /// <returns>The download, or nullptr (with errno set) if it failed before the first chunk was in.</returns>
+        std::shared_ptr<download_progress> start_download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished = nullptr, size_t parallel = 0);
 
         /// <summary>
         /// Gets the property of a blob.
@@ -871,9 +1220,28 @@ namespace microsoft_azure { namespace storage {
         /// <param name="destContainer">The destination container name.</param>
         /// <param name="destBlob">The destination blob name.</param>
         void start_copy(const std::string &sourceContainer, const std::string &sourceBlob, const std::string &destContainer, const std::string &destBlob);
+
+        /// <summary>
+        /// Marks the cached properties of a blob as out of date, so that the next request for them goes to the service.
+        /// For use when the caller learns of a change to the blob by some other means (such as its absence from a listing.)
+        /// </summary>
+        /// <param name="blob">The blob name.</param>
+        void invalidate_cached_blob(const std::string &blob);
+
+        /// <summary>
+        /// The number of callers waiting to share the answer of a property fetch for a blob that another caller started, or 0 if none is running.
+        /// Lets tests line up overlapping calls without relying on timing.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        size_t property_fetch_waiters(const std::string &container, const std::string &blob);
         
         private:
+        void update_from_write(const std::shared_ptr<dir_cache_item> &dir_item, const std::string &blob, blob_property &properties);
+
         std::shared_ptr<sync_blob_client> m_blob_client_wrapper;
         attribute_cache attr_cache;
+        single_flight<list_blobs_hierarchical_response> m_list_flights;
+        single_flight<blob_property> m_property_flights;
     };
 } } // microsoft_azure::storage
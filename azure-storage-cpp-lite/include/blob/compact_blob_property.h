@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "storage_EXPORTS.h"
+
+#include "get_blob_property_request_base.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// A thread-safe, append-only pool of strings.  Interning the same value twice returns the same pointer.
+        /// </summary>
+        /// <remarks>Strings are never removed from the pool, so it should only be used for values with few distinct instances (content types, encodings, copy status and the like.)</remarks>
+        class string_intern_pool
+        {
+        public:
+            string_intern_pool() : m_strings(), m_index(), m_mutex()
+            {
+            }
+
+            /// <summary>
+            /// Returns a pointer to the pooled copy of the input string, adding it to the pool if needed.
+            /// The pointer stays valid for the lifetime of the pool, and can be read without locking.
+            /// </summary>
+            /// <param name="value">The string to intern.</param>
+            AZURE_STORAGE_API const std::string *intern(const std::string &value);
+
+            /// <summary>
+            /// The number of distinct strings in the pool.
+            /// </summary>
+            AZURE_STORAGE_API size_t size();
+
+        private:
+            std::deque<std::string> m_strings; // std::deque never moves its elements when growing at the end.
+            std::unordered_map<std::string, const std::string *> m_index;
+            std::mutex m_mutex;
+        };
+
+        /// <summary>
+        /// A space-efficient copy of a <see cref="blob_property"/>, used to hold the properties of a blob in the attribute cache.
+        /// </summary>
+        /// <remarks>
+        /// Strings with few distinct values (content type, encoding, language and copy status) are interned in a shared <see cref="string_intern_pool"/>, and the etag and MD5
+        /// are stored inline as they are short and fixed-width for blobs created by the service.  Everything else of variable length (cache control and content disposition,
+        /// which can differ for every blob, metadata, and etag / MD5 values that do not fit inline) is packed into a single allocation.
+        /// This keeps the record to 112 bytes plus its variable-length values, compared to 500+ bytes for a blob_property.  What the attribute cache
+        /// spends per blob on top of that (its map node, key and LRU link) is measured by AttribCacheFootprintTest.
+        /// </remarks>
+        class compact_blob_property
+        {
+        public:
+            /// <summary>
+            /// Constructs an invalid record.
+            /// </summary>
+            compact_blob_property()
+                : m_size(0), m_last_modified(0),
+                m_content_encoding(nullptr), m_content_language(nullptr), m_content_type(nullptr), m_copy_status(nullptr),
+                m_arena(), m_metadata_count(0), m_etag_length(0), m_content_md5_length(0), m_cache_control_length(0), m_content_disposition_length(0), m_valid(false)
+            {
+            }
+
+            /// <summary>
+            /// Replaces the contents of this record with the given properties.
+            /// </summary>
+            /// <param name="props">The properties to store.</param>
+            /// <param name="pool">The pool used to intern the low-cardinality string properties.</param>
+            /// <returns>False, leaving the record invalid, if a value is too long for the record to hold (65535 bytes for the etag, MD5, cache control and content disposition, and 65535 metadata pairs.)</returns>
+            AZURE_STORAGE_API bool assign(blob_property &props, string_intern_pool &pool);
+
+            /// <summary>
+            /// Rebuilds the full set of properties held in this record.
+            /// </summary>
+            AZURE_STORAGE_API blob_property to_blob_property() const;
+
+            bool valid() const
+            {
+                return m_valid;
+            }
+
+            unsigned long long size() const
+            {
+                return m_size;
+            }
+
+            time_t last_modified() const
+            {
+                return static_cast<time_t>(m_last_modified);
+            }
+
+        private:
+            // An Azure etag is "0x" followed by 15 or 16 hex digits, with enclosing quotes on the wire.
+            // A base64-encoded MD5 is always 24 characters.
+            static const size_t inline_etag_capacity = 20;
+            static const size_t inline_content_md5_capacity = 24;
+
+            static const std::string &pooled(const std::string *value);
+            const char *etag_data() const;
+            const char *content_md5_data() const;
+
+            uint64_t m_size;
+            int64_t m_last_modified;
+
+            const std::string *m_content_encoding;
+            const std::string *m_content_language;
+            const std::string *m_content_type;
+            const std::string *m_copy_status;
+
+            // Holds, in order: the etag if longer than inline_etag_capacity, the MD5 if longer than inline_content_md5_capacity,
+            // the cache control and content disposition, then each metadata pair as <uint32 key length><key><uint32 value length><value>.
+            std::unique_ptr<char[]> m_arena;
+            uint16_t m_metadata_count;
+
+            uint16_t m_etag_length;
+            uint16_t m_content_md5_length;
+            uint16_t m_cache_control_length;
+            uint16_t m_content_disposition_length;
+            char m_etag[inline_etag_capacity];
+            char m_content_md5[inline_content_md5_capacity];
+            bool m_valid;
+        };
+    }
+}
@@ -29,6 +29,10 @@ namespace microsoft_azure {
                 return m_end_byte; 
             }
 
+            std::string if_match() const override {
+                return m_if_match;
+            }
+
             download_blob_request &set_start_byte(unsigned long long start_byte) {
                 m_start_byte = start_byte;
                 return *this;
@@ -39,11 +43,18 @@ namespace microsoft_azure {
                 return *this;
             }
 
+            // Only download if the blob's etag still matches; otherwise the request fails with 412 (Precondition Failed).
+            download_blob_request &set_if_match(const std::string &etag) {
+                m_if_match = etag;
+                return *this;
+            }
+
         private:
             std::string m_container;
             std::string m_blob;
             unsigned long long m_start_byte;
             unsigned long long m_end_byte;
+            std::string m_if_match;
         };
     }
 }
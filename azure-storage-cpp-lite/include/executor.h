@@ -1,6 +1,7 @@
 #pragma once
 
 #include <chrono>
+#include <functional>
 #include <future>
 #include <iterator>
 #include <sstream>
@@ -65,7 +66,7 @@ namespace microsoft_azure {
             }
 
             static void submit_helper(
-                std::shared_ptr<std::promise<storage_outcome<RESPONSE_TYPE>>> promise,
+                std::function<void(const storage_outcome<RESPONSE_TYPE> &)> on_done,
                 std::shared_ptr<storage_outcome<RESPONSE_TYPE>> outcome,
                 std::shared_ptr<storage_account> account,
                 std::shared_ptr<storage_request_base> request,
@@ -78,7 +79,7 @@ namespace microsoft_azure {
                 retry_info info = context->retry_policy()->evaluate(*retry);
                 if (info.should_retry())
                 {
-                    http->submit([promise, outcome, account, request, http, context, retry](http_base::http_code result, storage_istream s, CURLcode code)
+                    http->submit([on_done, outcome, account, request, http, context, retry](http_base::http_code result, storage_istream s, CURLcode code)
                     {
                         bool retry_response = false;
                         std::string str(std::istreambuf_iterator<char>(s.istream()), std::istreambuf_iterator<char>());
@@ -135,7 +136,7 @@ namespace microsoft_azure {
                             }
                             if(!retry_response)
                             {
-                                promise->set_value(*outcome);
+                                on_done(*outcome);
                             }
                         }
                         //if we receive an error response or a parser error then retry the request for a better response
@@ -143,13 +144,13 @@ namespace microsoft_azure {
                         {
                             http->reset_input_stream();
                             http->reset_output_stream();
-                            async_executor<RESPONSE_TYPE>::submit_helper(promise, outcome, account, request, http, context, retry);
+                            async_executor<RESPONSE_TYPE>::submit_helper(on_done, outcome, account, request, http, context, retry);
                         }
                     }, info.interval());
                 }
                 else
                 {
-                    promise->set_value(*outcome);
+                    on_done(*outcome);
                 }
             }
 
@@ -162,9 +163,25 @@ namespace microsoft_azure {
                 auto retry = std::make_shared<retry_context>();
                 auto outcome = std::make_shared<storage_outcome<RESPONSE_TYPE>>();
                 auto promise = std::make_shared<std::promise<storage_outcome<RESPONSE_TYPE>>>();
-                async_executor<RESPONSE_TYPE>::submit_helper(promise, outcome, account, request, http, context, retry);
+                async_executor<RESPONSE_TYPE>::submit_helper([promise](const storage_outcome<RESPONSE_TYPE> &result) { promise->set_value(result); }, outcome, account, request, http, context, retry);
                 return promise->get_future();
             }
+
+            /// <summary>
+            /// Like submit, but calls on_done with the outcome instead of returning a future, so that nothing has to wait for it.
+            /// on_done is called on whichever thread the request finished on - with the curl engine running, a loop thread - so it must follow the rules for the engine's callbacks (see curl_multi_engine).
+            /// </summary>
+            static void submit(
+                std::shared_ptr<storage_account> account,
+                std::shared_ptr<storage_request_base> request,
+                std::shared_ptr<http_base> http,
+                std::shared_ptr<executor_context> context,
+                std::function<void(const storage_outcome<RESPONSE_TYPE> &)> on_done)
+            {
+                auto retry = std::make_shared<retry_context>();
+                auto outcome = std::make_shared<storage_outcome<RESPONSE_TYPE>>();
+                async_executor<RESPONSE_TYPE>::submit_helper(on_done, outcome, account, request, http, context, retry);
+            }
         };
 
         template<>
@@ -209,7 +226,7 @@ namespace microsoft_azure {
             }
 
             static void submit_helper(
-                std::shared_ptr<std::promise<storage_outcome<void>>> promise,
+                std::function<void(const storage_outcome<void> &)> on_done,
                 std::shared_ptr<storage_outcome<void>> outcome,
                 std::shared_ptr<storage_account> account,
                 std::shared_ptr<storage_request_base> request,
@@ -224,7 +241,7 @@ namespace microsoft_azure {
                 retry_info info = context->retry_policy()->evaluate(*retry);
                 if (info.should_retry())
                 {
-                    http->submit([promise, outcome, account, request, http, context, retry](http_base::http_code result, storage_istream s, CURLcode code)
+                    http->submit([on_done, outcome, account, request, http, context, retry](http_base::http_code result, storage_istream s, CURLcode code)
                     {
                         std::string str(std::istreambuf_iterator<char>(s.istream()), std::istreambuf_iterator<char>());
                         if (code != CURLE_OK || unsuccessful(result))
@@ -254,18 +271,18 @@ namespace microsoft_azure {
                             retry->add_result(code == CURLE_OK ? result: HTTP_CODE_SERVICE_UNAVAILABLE);
                             http->reset_input_stream();
                             http->reset_output_stream();
-                            async_executor<void>::submit_helper(promise, outcome, account, request, http, context, retry);
+                            async_executor<void>::submit_helper(on_done, outcome, account, request, http, context, retry);
                         }
                         else
                         {
                             *outcome = storage_outcome<void>();
-                            promise->set_value(*outcome);
+                            on_done(*outcome);
                         }
                     }, info.interval());
                 }
                 else
                 {
-                    promise->set_value(*outcome);
+                    on_done(*outcome);
                 }
             }
 
@@ -278,9 +295,25 @@ namespace microsoft_azure {
                 auto retry = std::make_shared<retry_context>();
                 auto outcome = std::make_shared<storage_outcome<void>>();
                 auto promise = std::make_shared<std::promise<storage_outcome<void>>>();
-                async_executor<void>::submit_helper(promise, outcome, account, request, http, context, retry);
+                async_executor<void>::submit_helper([promise](const storage_outcome<void> &result) { promise->set_value(result); }, outcome, account, request, http, context, retry);
                 return promise->get_future();
             }
+
+            /// <summary>
+            /// Like submit, but calls on_done with the outcome instead of returning a future, so that nothing has to wait for it.
+            /// on_done is called on whichever thread the request finished on - with the curl engine running, a loop thread - so it must follow the rules for the engine's callbacks (see curl_multi_engine).
+            /// </summary>
+            static void submit(
+                std::shared_ptr<storage_account> account,
+                std::shared_ptr<storage_request_base> request,
+                std::shared_ptr<http_base> http,
+                std::shared_ptr<executor_context> context,
+                std::function<void(const storage_outcome<void> &)> on_done)
+            {
+                auto retry = std::make_shared<retry_context>();
+                auto outcome = std::make_shared<storage_outcome<void>>();
+                async_executor<void>::submit_helper(on_done, outcome, account, request, http, context, retry);
+            }
         };
     }
 }
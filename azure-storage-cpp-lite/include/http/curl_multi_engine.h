@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "storage_EXPORTS.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// Runs curl transfers on a small, fixed set of event-loop threads, rather than blocking a thread in curl_easy_perform for each request.
+        /// </summary>
+        /// <remarks>
+        /// Each loop thread owns a curl multi handle, an epoll instance and a queue of timers.  curl tells the loop which sockets to watch and when it next needs to
+        /// be woken for a timeout, and the loop drives the multi handle from those events with curl_multi_socket_action.  Idle connections stay in
+        /// the multi handle's connection cache, so they are reused by every easy handle run on that loop.  Loops never share connections: easy
+        /// handles run on the engine must not share a connection cache through a curl share, though sharing DNS and TLS session caches is fine.
+        /// A finished transfer is reported by calling its callback on the loop thread.  Callbacks hold up every other transfer on the loop while
+        /// they run, so they must be short, and must never wait for another transfer to finish.  Starting another transfer from a callback is fine.
+        /// A caller that waits for the result, as the synchronous blob client calls do, still holds its own thread until the transfer finishes.
+        /// Block and chunk transfers don't: the transfer scheduler's workers only start their requests, and each transfer ends in its request's callback.
+        /// </remarks>
+        class curl_multi_engine
+        {
+        public:
+            /// <summary>
+            /// Starts the event loops.  If none can be started (for example, if epoll is unavailable) the engine is not running, and must not be used.
+            /// </summary>
+            /// <param name="loop_count">The number of event-loop threads to run.</param>
+            AZURE_STORAGE_API explicit curl_multi_engine(int loop_count);
+
+            /// <summary>
+            /// Stops the event loops.  Must not be called while any transfer is still running.
+            /// </summary>
+            AZURE_STORAGE_API ~curl_multi_engine();
+
+            curl_multi_engine(const curl_multi_engine &) = delete;
+            curl_multi_engine &operator=(const curl_multi_engine &) = delete;
+
+            bool running() const
+            {
+                return !m_loops.empty();
+            }
+
+            /// <summary>
+            /// Starts a transfer on an easy handle, and calls on_done with its result when it finishes.
+            /// </summary>
+            /// <param name="handle">A fully set up easy handle.  It belongs to the engine, and must not be used, until on_done is called.</param>
+            /// <param name="on_done">Called on a loop thread once the transfer has finished and the handle has been handed back.</param>
+            AZURE_STORAGE_API void add(CURL *handle, std::function<void(CURLcode)> on_done);
+
+            /// <summary>
+            /// Starts a transfer that may be hedged: if it is still running after hedge_after, make_hedge is called for a duplicate to race it.
+            /// The first of the two to succeed wins, and the other is dropped.  If both fail, the result of the last to fail is reported.
+            /// </summary>
+            /// <param name="handle">A fully set up easy handle.  It belongs to the engine, and must not be used, until on_done is called.</param>
+            /// <param name="hedge_after">How long to let the transfer run alone.</param>
+            /// <param name="make_hedge">Called on the loop thread.  Returns a duplicate easy handle to start, which the engine cleans up when done with,
+            /// or nullptr for no duplicate.  The two transfers must make sure between them that only one ever writes anything.</param>
+            /// <param name="on_done">Called on the loop thread once the race is decided, with the handle of the transfer that decided it.
+            /// All other transfers have been dropped by then, but the handle is only valid until on_done returns.</param>
+            AZURE_STORAGE_API void add_hedged(CURL *handle, std::chrono::milliseconds hedge_after, std::function<CURL *()> make_hedge, std::function<void(CURL *, CURLcode)> on_done);
+
+            /// <summary>
+            /// Calls a function on a loop thread once the given delay has passed.  Waiting does not hold up a thread.
+            /// </summary>
+            /// <param name="delay">How long to wait.</param>
+            /// <param name="fn">The function to call.  The same rules apply as for transfer callbacks.</param>
+            AZURE_STORAGE_API void run_after(std::chrono::milliseconds delay, std::function<void()> fn);
+
+            /// <summary>
+            /// The number of event loops to run by default: one for every four cores, and between one and four in all.
+            /// </summary>
+            AZURE_STORAGE_API static int default_loop_count();
+
+        private:
+            class loop;
+
+            std::vector<std::shared_ptr<loop>> m_loops;
+            std::vector<std::thread> m_threads;
+            std::atomic<size_t> m_next_loop;
+        };
+    }
+}
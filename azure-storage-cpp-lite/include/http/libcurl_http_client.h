@@ -1,7 +1,10 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <future>
 #include <map>
@@ -20,6 +23,7 @@
 #include "storage_EXPORTS.h"
 
 #include "http_base.h"
+#include "http/curl_multi_engine.h"
 
 namespace microsoft_azure {
     namespace storage {
@@ -28,13 +32,82 @@ namespace microsoft_azure {
 
         class CurlEasyClient;
 
-        class CurlEasyRequest final : public http_base
+        // Keeps the times to first byte of the most recent successful reads, to judge when a read has waited long enough to be worth hedging.
+        class first_byte_tracker
+        {
+        public:
+            first_byte_tracker() : m_samples(), m_next(0), m_mutex()
+            {
+            }
+
+            void record(long long time_in_ms)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_samples.size() < 256)
+                {
+                    m_samples.push_back(time_in_ms);
+                }
+                else
+                {
+                    m_samples[m_next] = time_in_ms;
+                    m_next = (m_next + 1) % m_samples.size();
+                }
+            }
+
+            // Returns the given percentile (1-99) of the recorded times, or -1 until there are enough of them to go on.
+            long long percentile(int p)
+            {
+                std::vector<long long> samples;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (m_samples.size() < 32)
+                    {
+                        return -1;
+                    }
+                    samples = m_samples;
+                }
+                auto nth = samples.begin() + (samples.size() - 1) * p / 100;
+                std::nth_element(samples.begin(), nth, samples.end());
+                return *nth;
+            }
+
+        private:
+            std::vector<long long> m_samples; // A ring of the latest 256 times, in milliseconds.
+            size_t m_next;
+            std::mutex m_mutex;
+        };
+
+        // The classes of request that compete for a client's handles, most urgent first.
+        enum class request_priority {
+            metadata,   // Lookups and listings someone is waiting on, such as for a getattr or readdir.
+            foreground, // Block and chunk transfers someone is waiting on.
+            background  // Work nobody is waiting on, such as polling for changes.
+        };
+
+        // While one of these is in scope, requests made on the current thread get no more than the given priority, whatever they ask for.
+        // For threads that only do background work.
+        class request_priority_scope {
+        public:
+            AZURE_STORAGE_API explicit request_priority_scope(request_priority ceiling);
+            AZURE_STORAGE_API ~request_priority_scope();
+
+            request_priority_scope(const request_priority_scope &) = delete;
+            request_priority_scope &operator=(const request_priority_scope &) = delete;
+
+            // The lowest priority set on the current thread.
+            AZURE_STORAGE_API static request_priority ceiling();
+
+        private:
+            request_priority m_previous;
+        };
+
+        class CurlEasyRequest final : public http_base, public std::enable_shared_from_this<CurlEasyRequest>
         {
 
             using REQUEST_TYPE = CurlEasyRequest;
 
             public:
-                AZURE_STORAGE_API CurlEasyRequest(std::shared_ptr<CurlEasyClient> client, CURL *h);
+                AZURE_STORAGE_API CurlEasyRequest(std::shared_ptr<CurlEasyClient> client, CURL *h, request_priority priority = request_priority::metadata);
 
                 AZURE_STORAGE_API ~CurlEasyRequest();
 
@@ -83,14 +156,10 @@ namespace microsoft_azure {
 
                 AZURE_STORAGE_API CURLcode perform() override;
 
-                void submit(std::function<void(http_code, storage_istream, CURLcode)> cb, std::chrono::seconds interval) override {
-                    std::this_thread::sleep_for(interval);
-                    const auto curlCode = perform();
-
-                    syslog(curlCode != CURLE_OK || unsuccessful(m_code) ? LOG_ERR : LOG_DEBUG, "%s", format_request_response().c_str());
-
-                    cb(m_code, m_error_stream, curlCode);
-                }
+                // If the client is running event loops, this hands the request to them and returns straight away, and cb is called on a loop thread
+                // once the response is in.  Otherwise the request is performed on the calling thread, and cb has been called by the time this returns.
+                // On the event loops, a GET or HEAD may be hedged (see CurlEasyClient::set_hedge_percentile).
+                AZURE_STORAGE_API void submit(std::function<void(http_code, storage_istream, CURLcode)> cb, std::chrono::milliseconds interval) override;
 
                 void reset() override {
                     m_headers.clear();
@@ -123,6 +192,12 @@ namespace microsoft_azure {
                     check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this));
                 }
 
+                void set_output_sink(storage_sink s) override {
+                    m_output_sink = s;
+                    check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, write));
+                    check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this));
+                }
+
                 void set_error_stream(std::function<bool(http_code)> f, storage_iostream s) override {
                     m_switch_error_callback = f;
                     m_error_stream = s;
@@ -145,6 +220,14 @@ namespace microsoft_azure {
                     check_code(curl_easy_setopt(m_curl, CURLOPT_POSTFIELDS, nullptr)); // CURL won't actually read data on POSTs unless this is explicitly set.
                 }
 
+                void set_input_source(storage_source s) override
+                {
+                    m_input_source = s;
+                    check_code(curl_easy_setopt(m_curl, CURLOPT_READFUNCTION, read));
+                    check_code(curl_easy_setopt(m_curl, CURLOPT_READDATA, this));
+                    check_code(curl_easy_setopt(m_curl, CURLOPT_POSTFIELDS, nullptr)); // CURL won't actually read data on POSTs unless this is explicitly set.
+                }
+
                 void set_input_content_length(size_t content_length)
                 {
                     m_input_content_length=content_length;
@@ -166,10 +249,12 @@ namespace microsoft_azure {
                 }
                 void reset_input_stream() override {
                     m_input_stream.reset();
+                    m_input_source.reset();
                 }
 
                 void reset_output_stream() override {
                     m_output_stream.reset();
+                    m_output_sink.reset();
                 }
 
                 storage_ostream get_output_stream() const override {
@@ -202,16 +287,30 @@ namespace microsoft_azure {
                 }
 
             private:
+                // A transfer made for the request: the request's own handle, or a duplicate racing it when the request is hedged.
+                // The first to receive a response header claims the request, and any other is aborted.
+                struct attempt
+                {
+                    CurlEasyRequest *request;
+                    CURL *handle;
+                    int index;
+                };
+
                 std::shared_ptr<CurlEasyClient> m_client;
                 CURL *m_curl;
                 curl_slist *m_slist;
+                attempt m_attempts[2];
+                int m_winner; // Index of the attempt that claimed the request, or -1.
+                request_priority m_priority; // The priority the handle was taken from the pool with.
 
                 http_method m_method;
                 std::string m_url;
                 char* m_input_buffer = NULL;
                 int m_input_buffer_pos = 0;
                 storage_istream m_input_stream;
+                storage_source m_input_source;
                 storage_ostream m_output_stream;
+                storage_sink m_output_sink;
                 storage_iostream m_error_stream;
                 size_t m_input_content_length;
                 bool m_is_input_length_known;
@@ -219,6 +318,9 @@ namespace microsoft_azure {
                 http_code m_code;
                 std::map<std::string, std::string, case_insensitive_compare> m_headers;
 
+                // Applies the method, URL and headers to the handle, ready for a transfer.
+                void prepare();
+
                 std::string format_request_response()
                 {
                     std::string out;
@@ -281,9 +383,20 @@ namespace microsoft_azure {
 
                 AZURE_STORAGE_API static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata);
 
+                // Aborts an attempt that has lost the race.  Also called while an attempt is still waiting for its first byte, so a stalled loser goes quickly.
+                static int progress_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+                {
+                    attempt *a = static_cast<attempt *>(userdata);
+                    return a->request->m_winner >= 0 && a->request->m_winner != a->index ? 1 : 0;
+                }
+
                 static size_t write(char *buffer, size_t size, size_t nitems, void *userdata)
                 {
                     REQUEST_TYPE *p = static_cast<REQUEST_TYPE *>(userdata);
+                    if (p->m_output_sink.valid()) {
+                        // A short count makes curl fail the transfer.
+                        return p->m_output_sink.write(buffer, size * nitems);
+                    }
                     p->m_output_stream.ostream().write(buffer, size * nitems);
                     return size * nitems;
                 }
@@ -298,6 +411,10 @@ namespace microsoft_azure {
                 static size_t read(char *buffer, size_t size, size_t nitems, void *userdata)
                 {
                     REQUEST_TYPE *p = static_cast<REQUEST_TYPE *>(userdata);
+                    if (p->m_input_source.valid()) {
+                        const size_t read = p->m_input_source.read(buffer, size * nitems);
+                        return read == 0 && p->m_input_source.error() != 0 ? CURL_READFUNC_ABORT : read;
+                    }
                     auto &s = p->m_input_stream.istream();
                     size_t contentlen = p->get_input_content_length();
                     size_t actual_size = 0 ;
@@ -343,56 +460,198 @@ namespace microsoft_azure {
                 }
             };
 
+        // A snapshot of a CurlEasyClient's handle pool.
+        struct curl_pool_stats {
+            int handles; // Handles in existence, idle or in use.
+            int idle;
+            unsigned long long waits; // How many get_handle calls had to wait for a handle.
+            unsigned long long total_wait_in_ms;
+            long long max_wait_in_ms;
+            unsigned long long fresh_connections; // Requests sent on a new connection, rather than a cached one, as requests to the host kept failing to connect.
+            unsigned long long hedges; // Duplicate requests started to race slow reads.
+        };
+
+        // Hands out easy handles from an elastic pool.  The pool keeps at least the configured number of warm handles (see set_warm_handles), and
+        // creates more on demand up to its size; handles above the minimum are freed once they have sat idle for a minute.
+        // All of a client's handles share one DNS cache and TLS session cache, so a handle can resume a TLS session that another opened.
+        // Connections are reused through the connection cache of the event loop a request runs on (see curl_multi_engine).
         class CurlEasyClient : public std::enable_shared_from_this<CurlEasyClient> {
         public:
-            CurlEasyClient(int size) : m_size(size) {
-                curl_global_init(CURL_GLOBAL_DEFAULT);
-                for (int i = 0; i < m_size; i++) {
-                    CURL *h = curl_easy_init();
-                    m_handles.push(h);
-                }
+            CurlEasyClient(int size) : CurlEasyClient(size, std::string()) {
             }
+
             //Sets CURL CA BUNDLE location for all the curl handlers.
-            CurlEasyClient(int size, const std::string& ca_path) : m_size(size)
+            AZURE_STORAGE_API CurlEasyClient(int size, const std::string& ca_path);
+
+            AZURE_STORAGE_API ~CurlEasyClient();
+
+            // The most handles the pool will have in use at once (not counting requests backing off).
+            int size()
             {
-                curl_global_init(CURL_GLOBAL_DEFAULT);
-                for (int i = 0; i < m_size; i++) {
-                    CURL *h = curl_easy_init();
-                    curl_easy_setopt(h, CURLOPT_CAPATH, ca_path.c_str());
-                    m_handles.push(h);
+                return m_size;
+            }
+
+            // Keep at least this many handles in each client's pool, and open a connection for each when the client is started (see warm_up),
+            // so that a burst at start-up or after a quiet spell doesn't wait on handshakes.  Applies to clients created afterwards.  Defaults to 0.
+            static void set_warm_handles(int count) {
+                s_warm_handles = count;
+            }
+
+            // Opens a connection to the given URL for each warm handle, in the background, with a HEAD request whose response is ignored.
+            // The connections then sit in the connection caches of the event loops they were opened on, for requests on those loops to reuse.
+            // Does nothing without event loops.
+            AZURE_STORAGE_API void warm_up(const std::string &url);
+
+            // The pool's statistics since the client was created.  They are also logged every few minutes while requests are waiting for handles.
+            AZURE_STORAGE_API curl_pool_stats pool_stats();
+
+            // Frees idle handles above the minimum after this long, rather than after a minute.
+            void set_idle_handle_lifetime(std::chrono::milliseconds lifetime) {
+                std::lock_guard<std::mutex> lg(m_handles_mutex);
+                m_idle_handle_lifetime = lifetime;
+            }
+
+            // Hedge GETs and HEADs on the event loops: a read that has not had its first byte after this percentile (1-99) of recent
+            // reads' times to first byte gets a duplicate request racing it, and whichever answers first is used.  0 (the default) disables hedging.
+            // Applies to all clients.
+            static void set_hedge_percentile(int percentile) {
+                s_hedge_percentile = percentile;
+            }
+
+            // How long a read may wait for its first byte before it is hedged, or a negative value if it shouldn't be.
+            long long hedge_delay_in_ms() {
+                const int percentile = s_hedge_percentile;
+                if (percentile <= 0 || m_engine == nullptr) {
+                    return -1;
                 }
+                const long long delay = m_first_byte_times.percentile(std::min(percentile, 99));
+                // Below this, a duplicate is more likely to add load than to save time.
+                return delay < 0 ? -1 : std::max(delay, 10LL);
+            }
+
+            // Hedging is skipped whenever the condition returns false.  The transfer scheduler uses this to stop hedging while the service is
+            // throttling the account, when a duplicate would only add to the load.  The condition is called on the event loops, and must be quick.
+            void set_hedge_condition(std::function<bool()> condition) {
+                std::atomic_store(&m_hedge_condition, std::make_shared<std::function<bool()>>(std::move(condition)));
             }
 
-            ~CurlEasyClient() {
-                while (!m_handles.empty()) {
-                    curl_easy_cleanup(m_handles.front());
-                    m_handles.pop();
+            // Takes a place in the pool for a hedge, if hedging is allowed, and a place is free without waiting.  A hedge counts as a background
+            // request, and only runs while the pool has room for background requests and nothing is waiting, so it never takes a handle
+            // another request wants.  Each successful call must be matched by a call to end_hedge.
+            AZURE_STORAGE_API bool begin_hedge();
+
+            AZURE_STORAGE_API void end_hedge();
+
+            void record_first_byte(long long time_in_ms) {
+                if (s_hedge_percentile > 0) {
+                    m_first_byte_times.record(time_in_ms);
                 }
-                curl_global_cleanup();
             }
 
-            int size()
-            {
-                return m_size;
+            // Waits for a handle if the pool is at its size, and none is idle, or if requests of the given priority already have all the handles
+            // they may.  Part of the pool is kept for metadata requests, so that a getattr or readdir isn't stuck behind a large file transfer,
+            // and background requests may use only half of the rest.  A request also waits while any more urgent request is waiting.
+            AZURE_STORAGE_API std::shared_ptr<CurlEasyRequest> get_handle(request_priority priority = request_priority::metadata);
+
+            // Hands a handle back to the pool.  The priority must be the one it was taken with.
+            AZURE_STORAGE_API void release_handle(CURL *h, request_priority priority);
+
+            // Attaches a handle made outside the pool, such as a duplicate of a pooled one, to the pool's shared caches.
+            void share_caches(CURL *h) {
+                if (m_share != NULL) {
+                    curl_easy_setopt(h, CURLOPT_SHARE, m_share);
+                }
             }
 
-            std::shared_ptr<CurlEasyRequest> get_handle() {
-                std::unique_lock<std::mutex> lk(m_handles_mutex);
-                m_cv.wait(lk, [this]() { return !m_handles.empty(); });
-                auto res = std::make_shared<CurlEasyRequest>(shared_from_this(), m_handles.front());
-                m_handles.pop();
-                return res;
+            // Records how a request to the URL went.  Connections live in the event loops' caches rather than in handles, so health is kept
+            // by host: once several requests in a row to a host have failed to connect, requests to it use new connections until one succeeds.
+            AZURE_STORAGE_API void report_result(const std::string &url, CURLcode code);
+
+            // Whether a request to the URL should be sent on a new connection, rather than on one from the cache.  Counted in the pool statistics when it should.
+            AZURE_STORAGE_API bool needs_fresh_connection(const std::string &url);
+
+            // Calls the observer with the outcome of every request attempt made through the client, retries included, on whichever thread
+            // finished it.  The observer must be quick, and must not make requests.
+            void set_response_observer(std::function<void(http_base::http_code, CURLcode)> observer) {
+                std::atomic_store(&m_response_observer, std::make_shared<std::function<void(http_base::http_code, CURLcode)>>(std::move(observer)));
+            }
+
+            void observe_response(http_base::http_code status, CURLcode code) {
+                auto observer = std::atomic_load(&m_response_observer);
+                if (observer != nullptr) {
+                    (*observer)(status, code);
+                }
+            }
+
+            // Called when a request starts, and finishes, waiting out a retry back-off.
+            void begin_backoff() {
+                std::lock_guard<std::mutex> lg(m_handles_mutex);
+                m_backing_off++;
+                m_cv.notify_all();
             }
 
-            void release_handle(CURL *h) {
+            void end_backoff() {
                 std::lock_guard<std::mutex> lg(m_handles_mutex);
-                m_handles.push(h);
-                m_cv.notify_one();
+                m_backing_off--;
+            }
+
+            // Runs requests submitted through this client on the given number of curl event loops, instead of on the submitting thread.
+            // Only for clients whose requests are all submitted through async_executor, as submit no longer waits for the response.
+            // Must be called before any request is submitted.
+            void start_event_loops(int loop_count) {
+                m_engine.reset(new curl_multi_engine(loop_count));
+                if (!m_engine->running()) {
+                    syslog(LOG_WARNING, "Failed to start curl event loops; requests will be performed on the calling thread.");
+                    m_engine.reset();
+                }
+            }
+
+            curl_multi_engine *engine() {
+                return m_engine.get();
             }
 
         private:
+            struct idle_handle {
+                CURL *handle;
+                std::chrono::steady_clock::time_point since;
+            };
+
+            // Creates a handle, or sets up a reused one again (a request resets its handle when done with it).
+            void configure_handle(CURL *h);
+
+            // Frees idle handles above the minimum that have not been used for a while.  Must be called with m_handles_mutex held.
+            void trim_idle_handles();
+
+            // Logs the statistics for the interval since they were last logged, if it has been long enough.  Must be called with m_handles_mutex held.
+            void report_stats();
+
+            // The most handles requests of the given priority may have in use at once (not counting requests backing off).
+            int handle_limit(request_priority priority) const;
+
+            static void lock_share(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+            static void unlock_share(CURL *handle, curl_lock_data data, void *userptr);
+
             int m_size;
-            std::queue<CURL *> m_handles;
+            int m_min_handles;
+            std::string m_ca_path;
+            int m_handle_count; // Handles in existence, idle or in use.
+            int m_backing_off; // Requests waiting out a retry back-off.
+            int m_in_use[3]; // Handles in use, by priority.
+            int m_waiting[3]; // Requests waiting for a handle, by priority.
+            CURLSH *m_share;
+            std::mutex m_share_locks[CURL_LOCK_DATA_LAST]; // One for each kind of data shared, so that, say, a DNS lookup doesn't hold up the TLS session cache.
+            std::unique_ptr<curl_multi_engine> m_engine;
+            std::shared_ptr<std::function<void(http_base::http_code, CURLcode)>> m_response_observer;
+            std::shared_ptr<std::function<bool()>> m_hedge_condition;
+            first_byte_tracker m_first_byte_times;
+            static std::atomic<int> s_hedge_percentile;
+            static std::atomic<int> s_warm_handles;
+            std::deque<idle_handle> m_idle_handles; // Most recently used at the back.
+            std::map<std::string, int> m_connection_failures; // Consecutive requests that failed to connect, by scheme, host and port.
+            std::chrono::steady_clock::duration m_idle_handle_lifetime;
+            curl_pool_stats m_stats;
+            curl_pool_stats m_reported_stats; // The statistics as of the last report, except that the maximum wait is the one since.
+            std::chrono::steady_clock::time_point m_last_stats_report;
             std::mutex m_handles_mutex;
             std::condition_variable m_cv;
         };
@@ -47,7 +47,7 @@ namespace microsoft_azure {
 
             virtual CURLcode perform() = 0;
 
-            virtual void submit(std::function<void(http_code, storage_istream, CURLcode)> cb, std::chrono::seconds interval) = 0;
+            virtual void submit(std::function<void(http_code, storage_istream, CURLcode)> cb, std::chrono::milliseconds interval) = 0;
 
             virtual void reset() = 0;
 
@@ -57,12 +57,18 @@ namespace microsoft_azure {
 
             virtual void set_input_buffer(char* buff) = 0;
 
+            // Reads the request body from the source instead of an input stream or buffer.
+            virtual void set_input_source(storage_source s) = 0;
+
             virtual void reset_input_stream() = 0;
 
             virtual void reset_output_stream() = 0;
 
             virtual void set_output_stream(storage_ostream s) = 0;
 
+            // Writes the response body to the sink instead of an output stream.
+            virtual void set_output_sink(storage_sink s) = 0;
+
             virtual void set_error_stream(std::function<bool(http_code)> f, storage_iostream s) = 0;
 
             virtual storage_istream get_input_stream() const = 0;
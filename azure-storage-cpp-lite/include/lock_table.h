@@ -0,0 +1,147 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// A thread-safe table of locks, one per string key, where a key's lock only exists while somebody holds it or is waiting for it.
+        /// </summary>
+        /// <remarks>
+        /// This gives every key a lock of its own without paying for a lock per key: a table of millions of keys, few of them busy at once,
+        /// costs memory in proportion to the busy ones.  Keys are spread over independently locked shards, as in striped_lru_map.
+        /// A caller takes a <see cref="handle"/> for the key and locks the mutex it refers to; the handle must outlive the lock.
+        /// </remarks>
+        template <typename Mutex>
+        class lock_table
+        {
+            struct entry
+            {
+                entry() : mutex(), users(0)
+                {
+                }
+
+                Mutex mutex;
+                size_t users; // Handles referring to this entry.  Protected by the shard mutex.
+            };
+
+            struct shard
+            {
+                shard() : mutex(), entries()
+                {
+                }
+
+                std::mutex mutex;
+                std::unordered_map<std::string, std::unique_ptr<entry>> entries;
+            };
+
+        public:
+            /// <summary>
+            /// Keeps the lock for one key in the table for as long as it exists.
+            /// </summary>
+            class handle
+            {
+            public:
+                handle(handle &&other) : m_shard(other.m_shard), m_key(std::move(other.m_key)), m_entry(other.m_entry)
+                {
+                    other.m_entry = nullptr;
+                }
+
+                handle(const handle &) = delete;
+                handle &operator=(const handle &) = delete;
+                handle &operator=(handle &&) = delete;
+
+                ~handle()
+                {
+                    if (m_entry == nullptr)
+                    {
+                        return;
+                    }
+                    std::lock_guard<std::mutex> lock(m_shard->mutex);
+                    if (--m_entry->users == 0)
+                    {
+                        m_shard->entries.erase(m_key);
+                    }
+                }
+
+                Mutex &mutex()
+                {
+                    return m_entry->mutex;
+                }
+
+            private:
+                friend class lock_table;
+
+                handle(shard *s, const std::string &key, entry *e) : m_shard(s), m_key(key), m_entry(e)
+                {
+                }
+
+                shard *m_shard;
+                std::string m_key;
+                entry *m_entry;
+            };
+
+            lock_table() : m_shards(new shard[shard_count])
+            {
+            }
+
+            lock_table(const lock_table &) = delete;
+            lock_table &operator=(const lock_table &) = delete;
+
+            /// <summary>
+            /// Returns a handle on the lock for the given key, creating the lock if nobody else has a handle on it.
+            /// </summary>
+            handle get(const std::string &key)
+            {
+                shard &s = shard_for(key);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                std::unique_ptr<entry> &slot = s.entries[key];
+                if (!slot)
+                {
+                    slot.reset(new entry());
+                }
+                slot->users++;
+                return handle(&s, key, slot.get());
+            }
+
+            /// <summary>
+            /// True if anybody has a handle on the lock for the given key - that is, holds the lock or is about to wait for it.
+            /// </summary>
+            bool busy(const std::string &key)
+            {
+                shard &s = shard_for(key);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                return s.entries.find(key) != s.entries.end();
+            }
+
+            /// <summary>
+            /// The number of keys whose locks are currently in the table.
+            /// </summary>
+            size_t size()
+            {
+                size_t total = 0;
+                for (size_t i = 0; i < shard_count; i++)
+                {
+                    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+                    total += m_shards[i].entries.size();
+                }
+                return total;
+            }
+
+        private:
+            static const size_t shard_count = 64;
+
+            shard &shard_for(const std::string &key)
+            {
+                return m_shards[std::hash<std::string>()(key) % shard_count];
+            }
+
+            std::unique_ptr<shard[]> m_shards;
+        };
+    }
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// A thread-safe map from '/'-separated paths to shared entries, stored as a tree of path components.
+        /// </summary>
+        /// <remarks>
+        /// Each path component is stored once, in the node for its directory, however many paths pass through it; full paths are never stored.
+        /// Because everything under a directory hangs off that directory's node, erasing a whole subtree costs time proportional to the
+        /// size of the subtree, rather than a scan of every path in the map.
+        /// Empty components are ignored, so "/a/b", "a/b", "a//b" and "a/b/" all name the same entry, and "/" (or "") names the root.
+        /// </remarks>
+        template <typename T>
+        class path_tree
+        {
+        public:
+            path_tree() : m_root(new node()), m_size(0), m_mutex()
+            {
+            }
+
+            path_tree(const path_tree &) = delete;
+            path_tree &operator=(const path_tree &) = delete;
+
+            /// <summary>
+            /// Returns the entry for the given path, creating it with the factory if it does not exist.
+            /// </summary>
+            /// <param name="path">The path to look up.</param>
+            /// <param name="factory">A callable returning a std::shared_ptr<T>, called (under the tree lock) only if the path has no entry.</param>
+            template <typename Factory>
+            std::shared_ptr<T> get_or_create(const std::string &path, Factory factory)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                node *n = m_root.get();
+                for_each_component(path, [&n](const std::string &component) {
+                    n = child_of(n, component);
+                    return true;
+                });
+                if (!n->value)
+                {
+                    n->value = factory();
+                    m_size++;
+                }
+                return n->value;
+            }
+
+            /// <summary>
+            /// Returns the entry for the given path, or an empty pointer if there is none.
+            /// </summary>
+            std::shared_ptr<T> find(const std::string &path)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                node *n = find_node(path);
+                return n != nullptr ? n->value : std::shared_ptr<T>();
+            }
+
+            /// <summary>
+            /// Removes the entry for the given path, leaving anything under it in place.
+            /// </summary>
+            /// <returns>True if there was an entry to remove.</returns>
+            bool erase(const std::string &path)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                node *n = find_node(path);
+                if (n == nullptr || !n->value)
+                {
+                    return false;
+                }
+                n->value.reset();
+                m_size--;
+                prune(n);
+                return true;
+            }
+
+            /// <summary>
+            /// Removes the entry for the given path and the entries for everything under it.
+            /// </summary>
+            /// <returns>The number of entries removed.</returns>
+            size_t erase_subtree(const std::string &path)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                node *n = find_node(path);
+                if (n == nullptr)
+                {
+                    return 0;
+                }
+                size_t removed = count(n);
+                m_size -= removed;
+                if (n == m_root.get())
+                {
+                    m_root.reset(new node());
+                    return removed;
+                }
+                detach(n);
+                return removed;
+            }
+
+            /// <summary>
+            /// Calls the given function with the path and entry of everything at or under the given path.
+            /// The tree is locked for the duration, so the function must not call back into it.
+            /// </summary>
+            /// <param name="path">The root of the subtree to visit.</param>
+            /// <param name="f">A callable taking (const std::string &path, const std::shared_ptr<T> &entry).  Paths are passed with a leading '/'.</param>
+            template <typename F>
+            void for_each(const std::string &path, F f)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                node *n = find_node(path);
+                if (n == nullptr)
+                {
+                    return;
+                }
+                std::string prefix;
+                for_each_component(path, [&prefix](const std::string &component) {
+                    prefix.append("/").append(component);
+                    return true;
+                });
+                visit(n, prefix, f);
+            }
+
+            /// <summary>
+            /// The number of entries in the tree.
+            /// </summary>
+            size_t size()
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                return m_size;
+            }
+
+        private:
+            struct node
+            {
+                node() : parent(nullptr), name(nullptr), children(), value()
+                {
+                }
+
+                node *parent;
+                const std::string *name; // Points at this node's key in its parent's children.  Nodes of a std::map never move, so this stays valid.
+                std::map<std::string, std::unique_ptr<node>> children; // Keyed by path component; the key is the only copy of the component.
+                std::shared_ptr<T> value;
+            };
+
+            // Returns the child of the node for the given component, creating it if needed.
+            static node *child_of(node *parent, const std::string &component)
+            {
+                auto iter = parent->children.emplace(component, std::unique_ptr<node>()).first;
+                if (!iter->second)
+                {
+                    iter->second.reset(new node());
+                    iter->second->parent = parent;
+                    iter->second->name = &iter->first;
+                }
+                return iter->second.get();
+            }
+
+            // Calls f with each non-empty component of the path in turn, stopping early if f returns false.
+            template <typename F>
+            static void for_each_component(const std::string &path, F f)
+            {
+                size_t start = 0;
+                while (start < path.size())
+                {
+                    size_t end = path.find('/', start);
+                    if (end == std::string::npos)
+                    {
+                        end = path.size();
+                    }
+                    if (end > start && !f(path.substr(start, end - start)))
+                    {
+                        return;
+                    }
+                    start = end + 1;
+                }
+            }
+
+            node *find_node(const std::string &path) const
+            {
+                node *n = m_root.get();
+                for_each_component(path, [&n](const std::string &component) {
+                    auto iter = n->children.find(component);
+                    n = iter != n->children.end() ? iter->second.get() : nullptr;
+                    return n != nullptr;
+                });
+                return n;
+            }
+
+            static size_t count(const node *n)
+            {
+                size_t total = n->value ? 1 : 0;
+                for (auto iter = n->children.begin(); iter != n->children.end(); ++iter)
+                {
+                    total += count(iter->second.get());
+                }
+                return total;
+            }
+
+            // Unlinks a (non-root) node from its parent and frees it with everything under it, pruning any ancestors left empty.
+            void detach(node *n)
+            {
+                node *parent = n->parent;
+                parent->children.erase(*n->name);
+                prune(parent);
+            }
+
+            // Removes the node, and then each of its ancestors, for as long as they hold no entry and have no children.
+            void prune(node *n)
+            {
+                while (n != m_root.get() && !n->value && n->children.empty())
+                {
+                    node *parent = n->parent;
+                    parent->children.erase(*n->name);
+                    n = parent;
+                }
+            }
+
+            template <typename F>
+            static void visit(const node *n, const std::string &path, F &f)
+            {
+                if (n->value)
+                {
+                    f(path.empty() ? std::string("/") : path, n->value);
+                }
+                for (auto iter = n->children.begin(); iter != n->children.end(); ++iter)
+                {
+                    visit(iter->second.get(), path + "/" + iter->first, f);
+                }
+            }
+
+            std::unique_ptr<node> m_root;
+            size_t m_size;
+            std::mutex m_mutex;
+        };
+    }
+}
@@ -50,5 +50,18 @@ public:
 
 //AZURE_STORAGE_API void build_request(const storage_account &a, const put_blob_request_base &r, http_base &h);
 
+// The properties of a blob that the service returns when the blob is created or overwritten (by put blob or put block list.)
+class blob_write_property
+{
+public:
+    blob_write_property()
+       :last_modified{0}
+    {
+    }
+    std::string etag;
+    time_t last_modified;
+    std::string content_md5; // Only returned by put blob.
+};
+
 }
 }
@@ -2,7 +2,7 @@
 
 #include <chrono>
 #include <algorithm>
-#include <math.h>
+#include <random>
 
 #include "storage_EXPORTS.h"
 
@@ -14,7 +14,7 @@ namespace microsoft_azure {
 
         class retry_info final{
         public:
-            retry_info(bool should_retry, std::chrono::seconds interval)
+            retry_info(bool should_retry, std::chrono::milliseconds interval)
                 : m_should_retry(should_retry),
                 m_interval(interval) {}
 
@@ -22,24 +22,32 @@ namespace microsoft_azure {
                 return m_should_retry;
             }
 
-            std::chrono::seconds interval() const {
+            std::chrono::milliseconds interval() const {
                 return m_interval;
             }
 
         private:
             bool m_should_retry;
-            std::chrono::seconds m_interval;
+            std::chrono::milliseconds m_interval;
         };
 
         class retry_context final {
         public:
             retry_context()
                 : m_numbers(0),
-                m_result(0) {}
+                m_result(0),
+                m_start(std::chrono::steady_clock::now()) {}
 
             retry_context(int numbers, http_base::http_code result)
                 : m_numbers(numbers),
-                m_result(result) {}
+                m_result(result),
+                m_start(std::chrono::steady_clock::now()) {}
+
+            // For an operation first attempted at the given time.
+            retry_context(int numbers, http_base::http_code result, std::chrono::steady_clock::time_point start)
+                : m_numbers(numbers),
+                m_result(result),
+                m_start(start) {}
 
             int numbers() const {
                 return m_numbers;
@@ -54,9 +62,15 @@ namespace microsoft_azure {
                 m_numbers++;
             }
 
+            // How long it has been since the operation was first attempted.
+            std::chrono::milliseconds elapsed() const {
+                return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start);
+            }
+
         private:
             int m_numbers;
             http_base::http_code m_result;
+            std::chrono::steady_clock::time_point m_start;
         };
 
         class retry_policy_base {
@@ -65,24 +79,53 @@ namespace microsoft_azure {
             virtual retry_info evaluate(const retry_context &context) const = 0;
         };
 
+        /// <summary>
+        /// Retries retryable failures with exponential back-off, up to a limit on both the number of retries and the total time spent on the operation.
+        /// </summary>
+        /// <remarks>
+        /// The back-off window starts at base_delay and doubles with each retry up to max_delay, and each wait is a random point in the upper half
+        /// of the window ("equal jitter"), so that requests throttled together don't all come back together.
+        /// An operation is given up on, rather than retried, if waiting out the next back-off would take it past its time budget.
+        /// </remarks>
         class retry_policy final : public retry_policy_base {
         public:
+            /// <param name="max_retries">The most times a request is retried.</param>
+            /// <param name="budget">The most time an operation may take, from its first attempt to the start of its last.</param>
+            retry_policy(int max_retries = 25, std::chrono::milliseconds budget = std::chrono::minutes(5))
+                : m_max_retries(max_retries),
+                m_budget(budget) {}
+
             retry_info evaluate(const retry_context &context) const override {
                 if (context.numbers() == 0) {
-                    return retry_info(true, std::chrono::seconds(0));
-                } else if (context.numbers() < 26 && can_retry(context.result())) {
-                    double delay = (pow(1.2, context.numbers()-1)-1);
-                    delay = std::min(delay, 60.0); // Maximum backoff delay of 1 minute
-                    delay *= (((double)rand())/RAND_MAX)/2 + 0.75;
-                    return retry_info(true, std::chrono::seconds((int)delay));
+                    return retry_info(true, std::chrono::milliseconds(0));
+                } else if (context.numbers() <= m_max_retries && can_retry(context.result())) {
+                    const auto delay = backoff(context.numbers());
+                    if (context.elapsed() + delay <= m_budget) {
+                        return retry_info(true, delay);
+                    }
                 }
-                return retry_info(false, std::chrono::seconds(0));
+                return retry_info(false, std::chrono::milliseconds(0));
             }
 
         private:
+            static std::chrono::milliseconds backoff(int retry) {
+                const long long base_delay_in_ms = 200;
+                const long long max_delay_in_ms = 30 * 1000;
+                long long window = max_delay_in_ms;
+                if (retry <= 16) {
+                    window = std::min(max_delay_in_ms, base_delay_in_ms << (retry - 1));
+                }
+                static thread_local std::mt19937 generator{std::random_device()()};
+                std::uniform_int_distribution<long long> distribution(window / 2, window);
+                return std::chrono::milliseconds(distribution(generator));
+            }
+
             bool can_retry(http_base::http_code code) const {
                 return retryable(code);
             }
+
+            int m_max_retries;
+            std::chrono::milliseconds m_budget;
         };
 
     }
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cerrno>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// Collapses concurrent identical calls into one: while a call for a key is running, further calls for the same key wait for it and share its result.
+        /// </summary>
+        /// <remarks>
+        /// The errno left by the call is handed to every waiter along with the result, as the wrappers report errors through errno.
+        /// Only calls that overlap are collapsed; nothing is remembered once a call finishes, so a call that starts after another has finished always runs.
+        /// A caller must join before taking any lock the call takes, or it can queue behind the call on that lock and only arrive once the call is over.
+        /// Each waiter holds on to the call's result, so it stays readable until the last of them has copied it, however soon another call for the key starts.
+        /// </remarks>
+        template <typename Result>
+        class single_flight
+        {
+        public:
+            single_flight() : m_flights(), m_mutex()
+            {
+            }
+
+            single_flight(const single_flight &) = delete;
+            single_flight &operator=(const single_flight &) = delete;
+
+            /// <summary>
+            /// Runs the given function, unless a call for the same key is already running, in which case waits for that call and returns a copy of its result.
+            /// </summary>
+            /// <param name="key">Identifies the call.  Calls with the same key must be interchangeable.</param>
+            /// <param name="fn">A callable returning a Result.  Run on the calling thread, and only if no call for the key is running.</param>
+            template <typename F>
+            Result run(const std::string &key, F fn)
+            {
+                std::shared_ptr<flight> current;
+                bool leader = false;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    std::shared_ptr<flight> &slot = m_flights[key];
+                    if (!slot)
+                    {
+                        slot = std::make_shared<flight>();
+                        leader = true;
+                    }
+                    current = slot;
+                }
+
+                if (!leader)
+                {
+                    std::unique_lock<std::mutex> lock(current->mutex);
+                    current->waiters++;
+                    current->finished.wait(lock, [&current]() { return current->done; });
+                    if (current->result)
+                    {
+                        errno = current->error;
+                        return *current->result;
+                    }
+                    // The call we were waiting for didn't produce a result (it threw), so make our own.
+                    return fn();
+                }
+
+                // Whatever happens, the flight must be taken out of the map and its waiters released, or later calls for the key would hang.
+                struct finisher
+                {
+                    ~finisher()
+                    {
+                        {
+                            std::lock_guard<std::mutex> lock(owner->m_mutex);
+                            owner->m_flights.erase(*key);
+                        }
+                        std::lock_guard<std::mutex> lock(current->mutex);
+                        current->done = true;
+                        current->finished.notify_all();
+                    }
+
+                    single_flight *owner;
+                    const std::string *key;
+                    flight *current;
+                } finish = { this, &key, current.get() };
+
+                Result result = fn();
+                int error = errno;
+                {
+                    std::lock_guard<std::mutex> lock(current->mutex);
+                    current->result = std::make_shared<Result>(result);
+                    current->error = error;
+                }
+                errno = error;
+                return result;
+            }
+
+            /// <summary>
+            /// The number of callers waiting for the running call for the key, or 0 if none is running.
+            /// </summary>
+            size_t waiting(const std::string &key)
+            {
+                std::shared_ptr<flight> current;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    auto iter = m_flights.find(key);
+                    if (iter == m_flights.end())
+                    {
+                        return 0;
+                    }
+                    current = iter->second;
+                }
+                std::lock_guard<std::mutex> lock(current->mutex);
+                return current->waiters;
+            }
+
+        private:
+            struct flight
+            {
+                flight() : mutex(), finished(), done(false), waiters(0), result(), error(0)
+                {
+                }
+
+                std::mutex mutex;
+                std::condition_variable finished;
+                bool done;
+                size_t waiters;
+                std::shared_ptr<Result> result; // Empty if the call threw.
+                int error;
+            };
+
+            std::unordered_map<std::string, std::shared_ptr<flight>> m_flights;
+            std::mutex m_mutex;
+        };
+    }
+}
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
 #include <memory>
 #include <sstream>
 
+#include <sys/types.h>
+#include <unistd.h>
+
 #include "storage_EXPORTS.h"
 
 namespace microsoft_azure {
@@ -101,6 +106,174 @@ namespace microsoft_azure {
             std::shared_ptr<storage_ostream_helper> m_helper;
         };
 
+        /// <summary>
+        /// Somewhere to write a response body to without going through an iostream: a file descriptor, written with pwrite from a given offset,
+        /// so that requests can write different ranges of one file in parallel.  Copies share their position, as storage_ostream's do.
+        /// </summary>
+        class storage_sink {
+        public:
+            storage_sink() {}
+
+            /// <summary>
+            /// A sink that writes to a file from the given offset on.  The descriptor is not owned, and may be shared by sinks writing to other ranges.
+            /// </summary>
+            static storage_sink file(int fd, off_t offset) {
+                storage_sink sink;
+                sink.m_state = std::make_shared<state>();
+                sink.m_state->fd = fd;
+                sink.m_state->initial = offset;
+                return sink;
+            }
+
+            /// <summary>
+            /// Writes the data at the current position.  Returns the number of bytes written, which is less than size only on failure.
+            /// </summary>
+            size_t write(const char *data, size_t size) {
+                state &st = *m_state;
+                size_t done = 0;
+                while (done < size) {
+                    const ssize_t result = pwrite(st.fd, data + done, size - done, st.initial + static_cast<off_t>(st.written + done));
+                    if (result < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        st.error = errno;
+                        break;
+                    }
+                    done += static_cast<size_t>(result);
+                }
+                st.written += done;
+                return done;
+            }
+
+            /// <summary>
+            /// Goes back to the start, so that a retried request overwrites what the failed one wrote.
+            /// </summary>
+            void reset() {
+                if (!valid()) {
+                    return;
+                }
+                m_state->written = 0;
+                m_state->error = 0;
+            }
+
+            bool valid() const {
+                return m_state != nullptr;
+            }
+
+            /// <summary>
+            /// The number of bytes written since the start, or the last reset.
+            /// </summary>
+            size_t written() const {
+                return m_state->written;
+            }
+
+            /// <summary>
+            /// The errno of the last failed write, or 0 if none has failed.
+            /// </summary>
+            int error() const {
+                return m_state->error;
+            }
+
+        private:
+            struct state {
+                state() : fd(-1), initial(0), written(0), error(0) {}
+
+                int fd;
+                off_t initial;
+                size_t written;
+                int error;
+            };
+
+            std::shared_ptr<state> m_state;
+        };
+
+        /// <summary>
+        /// Where to read a request body from without going through an iostream: a range of a file, read with pread, so that requests can read
+        /// from one descriptor in parallel.  Copies share their position, as storage_istream's do.
+        /// </summary>
+        class storage_source {
+        public:
+            storage_source() {}
+
+            /// <summary>
+            /// A source that reads length bytes of a file from the given offset on.  The descriptor is not owned, and may be shared by sources reading other ranges.
+            /// </summary>
+            static storage_source file(int fd, off_t offset, size_t length) {
+                storage_source source;
+                source.m_state = std::make_shared<state>();
+                source.m_state->fd = fd;
+                source.m_state->initial = offset;
+                source.m_state->length = length;
+                return source;
+            }
+
+            /// <summary>
+            /// Reads up to size bytes from the current position.  Returns 0 at the end of the range, and also on failure, which error() then reports.
+            /// A file that ends before the range does counts as a failure.
+            /// </summary>
+            size_t read(char *data, size_t size) {
+                state &st = *m_state;
+                size = std::min(size, st.length - st.read);
+                while (size > 0) {
+                    const ssize_t result = pread(st.fd, data, size, st.initial + static_cast<off_t>(st.read));
+                    if (result < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        st.error = errno;
+                        return 0;
+                    }
+                    if (result == 0) {
+                        st.error = EIO;
+                        return 0;
+                    }
+                    st.read += static_cast<size_t>(result);
+                    return static_cast<size_t>(result);
+                }
+                return 0;
+            }
+
+            /// <summary>
+            /// Goes back to the start of the range, so that a retried request sends it all again.
+            /// </summary>
+            void reset() {
+                if (!valid()) {
+                    return;
+                }
+                m_state->read = 0;
+                m_state->error = 0;
+            }
+
+            bool valid() const {
+                return m_state != nullptr;
+            }
+
+            size_t length() const {
+                return m_state->length;
+            }
+
+            /// <summary>
+            /// The errno of the last failed read, or 0 if none has failed.
+            /// </summary>
+            int error() const {
+                return m_state->error;
+            }
+
+        private:
+            struct state {
+                state() : fd(-1), initial(0), length(0), read(0), error(0) {}
+
+                int fd;
+                off_t initial;
+                size_t length;
+                size_t read;
+                int error;
+            };
+
+            std::shared_ptr<state> m_state;
+        };
+
         class storage_iostream : public storage_istream, public storage_ostream {
         public:
             static storage_iostream create_storage_stream() {
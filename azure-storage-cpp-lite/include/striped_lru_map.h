@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// A thread-safe map from keys (strings, by default) to entries stored by value, bounded in size with least-recently-used eviction.
+        /// </summary>
+        /// <remarks>
+        /// Keys are spread over a number of independently locked shards, so lookups of different keys rarely contend with each other.
+        /// Each shard holds an equal share of the size limit and keeps its own recency order, so eviction is LRU within a shard, and approximately LRU overall.
+        /// Entries live in the map's own nodes and are only reached through a callback run under the shard lock, so nothing outside the map
+        /// can hold on to one; evicting an entry just forgets it.  The exception is an entry that is a std::shared_ptr: it is only evicted
+        /// when the map holds the last reference to it, so anything a caller still holds stays valid and keeps its key.
+        /// </remarks>
+        template <typename T, typename Key = std::string, typename Hash = std::hash<Key>>
+        class striped_lru_map
+        {
+        public:
+            /// <summary>
+            /// Constructs an empty map.
+            /// </summary>
+            /// <param name="max_entries">The maximum number of entries to keep.  0 means no limit.</param>
+            explicit striped_lru_map(size_t max_entries)
+                : m_shard_count(shard_count_for(max_entries)), m_shards(new shard[shard_count_for(max_entries)]), m_max_entries(0)
+            {
+                set_max_entries(max_entries);
+            }
+
+            striped_lru_map(const striped_lru_map &) = delete;
+            striped_lru_map &operator=(const striped_lru_map &) = delete;
+
+            /// <summary>
+            /// Calls the given function with the entry for the given key, value-initializing the entry first if it does not exist, and marks it as the most recently used.
+            /// </summary>
+            /// <param name="key">The key to look up.</param>
+            /// <param name="f">A callable taking a T&, run under the shard lock; it must not call back into the map.</param>
+            /// <returns>Whatever f returns.</returns>
+            template <typename F>
+            auto access(const Key &key, F f) -> decltype(f(std::declval<T &>()))
+            {
+                shard &s = shard_for(key);
+                std::lock_guard<std::mutex> lock(s.mutex);
+
+                auto iter = s.entries.find(key);
+                if (iter != s.entries.end())
+                {
+                    s.lru.splice(s.lru.begin(), s.lru, iter->second.second);
+                }
+                else
+                {
+                    iter = s.entries.emplace(key, std::make_pair(T(), typename std::list<const Key *>::iterator())).first;
+                    s.lru.push_front(&iter->first); // Nodes of an unordered_map are never moved, even on rehash, so the key's address is stable.
+                    iter->second.second = s.lru.begin();
+                    s.evict(); // Never evicts the most recently used entry, so iter stays valid.
+                }
+                return f(iter->second.first);
+            }
+
+            /// <summary>
+            /// Calls the given function with the entry for the given key, if there is one, and marks it as the most recently used.  Does not create an entry.
+            /// </summary>
+            /// <param name="key">The key to look up.</param>
+            /// <param name="f">A callable taking a T&, run under the shard lock; it must not call back into the map.</param>
+            /// <returns>True if there was an entry.</returns>
+            template <typename F>
+            bool find(const Key &key, F f)
+            {
+                shard &s = shard_for(key);
+                std::lock_guard<std::mutex> lock(s.mutex);
+
+                auto iter = s.entries.find(key);
+                if (iter == s.entries.end())
+                {
+                    return false;
+                }
+                s.lru.splice(s.lru.begin(), s.lru, iter->second.second);
+                f(iter->second.first);
+                return true;
+            }
+
+            /// <summary>
+            /// The total number of entries currently in the map.
+            /// </summary>
+            size_t size()
+            {
+                size_t total = 0;
+                for (size_t i = 0; i < m_shard_count; i++)
+                {
+                    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+                    total += m_shards[i].entries.size();
+                }
+                return total;
+            }
+
+            size_t max_entries() const
+            {
+                return m_max_entries.load();
+            }
+
+            /// <summary>
+            /// The number of shards the keys are spread over, fixed at construction.
+            /// </summary>
+            size_t shard_count() const
+            {
+                return m_shard_count;
+            }
+
+            /// <summary>
+            /// Changes the size limit.  Shrinking the limit evicts unused entries immediately.
+            /// The number of shards is fixed at construction, so this should not be used to go from a small limit to a large one on a busy map.
+            /// </summary>
+            /// <param name="max_entries">The maximum number of entries to keep.  0 means no limit.</param>
+            void set_max_entries(size_t max_entries)
+            {
+                m_max_entries.store(max_entries);
+                size_t per_shard = (max_entries + m_shard_count - 1) / m_shard_count;
+                for (size_t i = 0; i < m_shard_count; i++)
+                {
+                    std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+                    m_shards[i].max_entries = per_shard;
+                    m_shards[i].evict();
+                }
+            }
+
+        private:
+            // An entry that is a shared_ptr may be held outside the map; anything else is only ever touched under the shard lock.
+            template <typename U>
+            static bool in_use(const std::shared_ptr<U> &entry)
+            {
+                return entry.use_count() > 1;
+            }
+
+            template <typename U>
+            static bool in_use(const U &)
+            {
+                return false;
+            }
+
+            struct shard
+            {
+                shard() : mutex(), entries(), lru(), max_entries(0)
+                {
+                }
+
+                // Walks from the least recently used end, dropping entries nobody else references until we are back under the limit.
+                // Entries in use are skipped rather than waited on; the shard may temporarily exceed the limit if everything old is busy.
+                // The most recently used entry is never dropped, as the caller may be about to hand it out.
+                // Must be called with the shard mutex held.
+                void evict()
+                {
+                    if (max_entries == 0)
+                    {
+                        return;
+                    }
+                    auto lru_iter = lru.end();
+                    while (entries.size() > max_entries && lru_iter != lru.begin())
+                    {
+                        --lru_iter;
+                        if (lru_iter == lru.begin())
+                        {
+                            break;
+                        }
+                        auto iter = entries.find(**lru_iter);
+                        if (!in_use(iter->second.first))
+                        {
+                            lru_iter = lru.erase(lru_iter);
+                            entries.erase(iter);
+                        }
+                    }
+                }
+
+                std::mutex mutex; // Protects the shard's containers and the entries in them.
+                std::unordered_map<Key, std::pair<T, typename std::list<const Key *>::iterator>, Hash> entries;
+                std::list<const Key *> lru; // Most recently used first.  Points at the keys of entries.
+                size_t max_entries;
+            };
+
+            // Small maps are not worth striping, and striping them would make their eviction order noticeably less exact.
+            // Give each shard at least a thousand or so entries, up to 64 shards.
+            static size_t shard_count_for(size_t max_entries)
+            {
+                const size_t max_shards = 64;
+                const size_t min_entries_per_shard = 1024;
+                if (max_entries == 0)
+                {
+                    return max_shards;
+                }
+                size_t count = max_entries / min_entries_per_shard;
+                return count < 1 ? 1 : (count > max_shards ? max_shards : count);
+            }
+
+            shard &shard_for(const Key &key)
+            {
+                return m_shards[Hash()(key) % m_shard_count];
+            }
+
+            const size_t m_shard_count;
+            std::unique_ptr<shard[]> m_shards;
+            std::atomic<size_t> m_max_entries; // Can be changed while other threads use the map, so atomic.  Each shard's own limit is protected by its mutex.
+        };
+    }
+}
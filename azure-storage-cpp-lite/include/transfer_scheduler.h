@@ -0,0 +1,143 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "storage_EXPORTS.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// Runs block and chunk transfers for every file on one fixed set of worker threads, taking turns between files.
+        /// </summary>
+        /// <remarks>
+        /// Each file transfer opens a flow, queues its blocks or chunks on that flow, and closes it when done.  Workers take one transfer at a time from each flow
+        /// with work queued, round-robin, so a large file with hundreds of blocks queued doesn't hold up a small file queued behind it, and a
+        /// file alone gets every worker.  The number of threads stays the same however many files are being transferred.
+        /// A file small enough to go up in one request, and the first chunk of each download, are run on flows of their own too.
+        /// A transfer must not wait for another transfer queued on the scheduler, or it could wait for a worker that never comes.
+        /// A transfer queued with submit_async only holds its worker while it is being started: it keeps its place in the window and its
+        /// flow until it says it is done, which it may do from any thread, such as the curl engine's loop thread its request finished on.
+        /// So when every transfer is asynchronous, a few threads can keep as many transfers in flight as the window allows.
+        /// The number of transfers run at once is also held to a congestion window, fed with the status of every response from the service
+        /// (see record_response).  The window is halved when the service says it is busy, and grows by one transfer for each window's worth of
+        /// successes, up to the number of workers.  So when the account is throttled, fewer transfers are sent, rather than each of them retrying
+        /// on its own and adding to the load that is being throttled.
+        /// </remarks>
+        class transfer_scheduler
+        {
+        public:
+            /// <summary>
+            /// Creates a scheduler.  The workers are started when the first transfer is queued.
+            /// </summary>
+            /// <param name="worker_count">The most transfers to run at once.</param>
+            /// <param name="thread_count">The number of worker threads to start transfers on, or 0 for one for each transfer that may run at once.</param>
+            AZURE_STORAGE_API explicit transfer_scheduler(int worker_count, int thread_count = 0);
+
+            /// <summary>
+            /// Stops the workers, after every transfer already queued has run, and every asynchronous one has said it is done.
+            /// </summary>
+            AZURE_STORAGE_API ~transfer_scheduler();
+
+            transfer_scheduler(const transfer_scheduler &) = delete;
+            transfer_scheduler &operator=(const transfer_scheduler &) = delete;
+
+            /// <summary>
+            /// Returns a new flow to queue one file's transfers on.
+            /// </summary>
+            /// <param name="max_running">The most of the flow's transfers to run at once, or 0 for as many as there are workers.</param>
+            AZURE_STORAGE_API unsigned long long open_flow(size_t max_running = 0);
+
+            /// <summary>
+            /// Forgets a flow once every transfer queued on it has run.  No more may be queued on it, except by its own transfers before they are done.
+            /// </summary>
+            AZURE_STORAGE_API void close_flow(unsigned long long flow);
+
+            /// <summary>
+            /// Queues a transfer on a flow.
+            /// </summary>
+            /// <param name="flow">A flow from open_flow.</param>
+            /// <param name="transfer">Runs the transfer on a worker thread, and returns 0 or an errno.</param>
+            /// <returns>The transfer's result, once it has run.</returns>
+            AZURE_STORAGE_API std::future<int> submit(unsigned long long flow, std::function<int()> transfer);
+
+            /// <summary>
+            /// Queues a transfer that finishes asynchronously.  It counts as running from when a worker starts it until it calls done.
+            /// </summary>
+            /// <param name="flow">A flow from open_flow.</param>
+            /// <param name="transfer">Starts the transfer on a worker thread, and must not throw.  It must call the function it is given exactly once,
+            /// with 0 or an errno, when the transfer is over, on any thread, before or after it returns.</param>
+            /// <returns>The transfer's result, once it is done.</returns>
+            AZURE_STORAGE_API std::future<int> submit_async(unsigned long long flow, std::function<void(std::function<void(int)>)> transfer);
+
+            /// <summary>
+            /// Tells the scheduler how a request to the service went, whether or not it was for a transfer.
+            /// </summary>
+            /// <param name="status">The HTTP status of the response.  503 and 500 shrink the window; success grows it; others are ignored.</param>
+            AZURE_STORAGE_API void record_response(int status);
+
+            /// <summary>
+            /// The most transfers currently allowed to run at once.
+            /// </summary>
+            AZURE_STORAGE_API size_t window();
+
+            /// <summary>
+            /// Whether busy responses have cut the window below the number of workers, and it has not yet grown back.
+            /// </summary>
+            AZURE_STORAGE_API bool throttled();
+
+            /// <summary>
+            /// The number of flows open, or closed with transfers still queued or running.
+            /// </summary>
+            AZURE_STORAGE_API size_t flow_count();
+
+        private:
+            struct flow_state
+            {
+                flow_state() : max_running(0), running(0), closed(false) {}
+
+                size_t max_running;
+                size_t running;
+                bool closed;
+                std::deque<std::function<void(std::function<void()>)>> queue; // Each starts its transfer, and calls the function it is given once it is over.
+            };
+
+            void enqueue(unsigned long long flow, std::function<void(std::function<void()>)> task);
+            void run();
+            void finish(unsigned long long flow);
+
+            // Whether the flow should be given turns.  Must be called with m_mutex held.
+            static bool ready(const flow_state &state)
+            {
+                return !state.queue.empty() && (state.max_running == 0 || state.running < state.max_running);
+            }
+
+            // Must be called with m_mutex held.
+            size_t allowed_running() const
+            {
+                return m_window < 1 ? 1 : static_cast<size_t>(m_window);
+            }
+
+            const int m_worker_count;
+            const int m_thread_count;
+            unsigned long long m_next_flow;
+            std::map<unsigned long long, flow_state> m_flows; // Open flows, and closed ones with transfers still queued or running.
+            std::deque<unsigned long long> m_turns; // Each ready flow, once, in the order they get their next turn.
+            std::vector<std::thread> m_workers;
+            size_t m_running; // Transfers running, across all flows, including asynchronous ones no worker is running any more.
+            double m_window; // Congestion window: the most transfers to run at once, in fractions of a transfer.
+            std::chrono::steady_clock::time_point m_last_decrease;
+            bool m_stopping;
+            std::mutex m_mutex;
+            std::condition_variable m_cv;
+        };
+    }
+}
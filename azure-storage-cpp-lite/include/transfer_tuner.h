@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+
+#include "storage_EXPORTS.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        /// <summary>
+        /// Picks the block size, and the number of blocks to have in flight, for one direction of transfer, from how recent transfers went.
+        /// </summary>
+        /// <remarks>
+        /// The block size follows the throughput of single requests: blocks are sized so that each request takes about two seconds, long enough
+        /// for the round trip at its start not to matter, whether the link is slow or fast.
+        /// The number of blocks in flight is found by hill climbing on the throughput of whole files.  After each file it is stepped further
+        /// the same way if that made files faster (or, when stepping down, no slower), and turned around if not.  It settles around the point
+        /// where the link is full, near the bandwidth-delay product, without queueing more requests than the link can carry.
+        /// A larger file spreads its first round trip and its commit over more bytes, so is faster whatever the setting; a file is therefore only
+        /// compared with the one before if their sizes are within a factor of two of each other.  Otherwise it takes the last one's place
+        /// as what the next is compared with, and the setting is left as it is.
+        /// </remarks>
+        class transfer_tuner
+        {
+        public:
+            /// <summary>
+            /// Creates a tuner that starts from the given settings.
+            /// </summary>
+            /// <param name="initial_streams">The number of blocks to have in flight until there is something to go on.</param>
+            /// <param name="max_streams">The most blocks ever to have in flight.</param>
+            /// <param name="initial_block_size">The block size to use until there is something to go on.</param>
+            /// <param name="min_block_size">The smallest block size to use.</param>
+            /// <param name="max_block_size">The largest block size to use.</param>
+            AZURE_STORAGE_API transfer_tuner(size_t initial_streams, size_t max_streams, unsigned long long initial_block_size, unsigned long long min_block_size, unsigned long long max_block_size);
+
+            transfer_tuner(const transfer_tuner &) = delete;
+            transfer_tuner &operator=(const transfer_tuner &) = delete;
+
+            /// <summary>
+            /// The number of blocks to have in flight for the next file.
+            /// </summary>
+            AZURE_STORAGE_API size_t streams();
+
+            /// <summary>
+            /// The block size to use for the next file.  Always a multiple of 4MB.
+            /// </summary>
+            AZURE_STORAGE_API unsigned long long block_size();
+
+            /// <summary>
+            /// Records a block or chunk request that succeeded.  Requests smaller than the smallest block size are ignored.
+            /// </summary>
+            /// <param name="bytes">The bytes transferred.</param>
+            /// <param name="elapsed">How long the request took, from being sent to the last byte.</param>
+            AZURE_STORAGE_API void record_request(unsigned long long bytes, std::chrono::steady_clock::duration elapsed);
+
+            /// <summary>
+            /// Records a file transfer that succeeded.  Only transfers made with the current number of blocks in flight count.  Its throughput is
+            /// compared with the last counted file's if the two are of similar size.
+            /// </summary>
+            /// <param name="bytes">The size of the file.</param>
+            /// <param name="elapsed">How long the whole transfer took.</param>
+            /// <param name="streams">The number of blocks the transfer had in flight, which is fewer than asked for if the file had fewer blocks.</param>
+            AZURE_STORAGE_API void record_transfer(unsigned long long bytes, std::chrono::steady_clock::duration elapsed, size_t streams);
+
+        private:
+            const size_t m_max_streams;
+            const unsigned long long m_min_block_size;
+            const unsigned long long m_max_block_size;
+            size_t m_streams;
+            int m_direction; // 1 or -1: the way m_streams was last stepped.
+            double m_last_throughput; // Bytes per second of the last file counted, or 0 if none has been.
+            unsigned long long m_last_bytes; // The size of the last file counted.
+            unsigned long long m_block_size;
+            double m_request_rate; // A moving average of single requests' bytes per second, or 0 if none has been recorded.
+            std::mutex m_mutex;
+        };
+    }
+}
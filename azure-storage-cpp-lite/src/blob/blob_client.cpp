@@ -44,11 +44,44 @@ ssize_t get_length_from_content_range(const std::string &header) {
    return result;
 }
 
+// Reads the properties of a blob that was just created or overwritten from the response headers.
+blob_write_property get_blob_write_property(const http_base &h) {
+   blob_write_property property;
+   property.etag = h.get_header(constants::header_etag);
+   property.last_modified = curl_getdate(h.get_header(constants::header_last_modified).c_str(), NULL);
+   property.content_md5 = h.get_header(constants::header_content_md5);
+   return property;
+}
+
 } // noname namespace
 
 storage_outcome<chunk_property> blob_client::get_chunk_to_stream_sync(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os) {
-    auto http = m_client->get_handle();
+    auto http = m_client->get_handle(request_priority::foreground);
+    http->set_output_stream(storage_ostream(os));
+    return get_chunk_sync(http, container, blob, offset, size);
+}
+
+storage_outcome<chunk_property> blob_client::get_chunk_to_sink_sync(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, storage_sink sink, const std::string &if_match) {
+    auto http = m_client->get_handle(request_priority::foreground);
+    http->set_output_sink(sink);
+    return get_chunk_sync(http, container, blob, offset, size, if_match);
+}
+
+void blob_client::get_chunk_to_sink(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, storage_sink sink, const std::string &if_match, std::function<void(const storage_outcome<chunk_property> &)> on_done) {
+    auto http = m_client->get_handle(request_priority::foreground);
+    http->set_output_sink(sink);
+    get_chunk(http, container, blob, offset, size, if_match, on_done);
+}
+
+storage_outcome<chunk_property> blob_client::get_chunk_sync(std::shared_ptr<CurlEasyRequest> http, const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, const std::string &if_match) {
+    std::promise<storage_outcome<chunk_property>> promise;
+    get_chunk(http, container, blob, offset, size, if_match, [&promise](const storage_outcome<chunk_property> &result) { promise.set_value(result); });
+    return promise.get_future().get();
+}
+
+void blob_client::get_chunk(std::shared_ptr<CurlEasyRequest> http, const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, const std::string &if_match, std::function<void(const storage_outcome<chunk_property> &)> on_done) {
     auto request = std::make_shared<download_blob_request>(container, blob);
+    request->set_if_match(if_match);
     if (size > 0) {
         request->set_start_byte(offset);
         request->set_end_byte(offset + size - 1);
@@ -57,23 +90,23 @@ storage_outcome<chunk_property> blob_client::get_chunk_to_stream_sync(const std:
         request->set_start_byte(offset);
     }
 
-    http->set_output_stream(storage_ostream(os));
-
-    const auto response = async_executor<void>::submit(m_account, request, http, m_context).get();
-    if (response.success())
-    {
-        chunk_property property{};
-        property.etag = http->get_header(constants::header_etag);
-        property.totalSize = get_length_from_content_range(http->get_header(constants::header_content_range));
-        std::istringstream(http->get_header(constants::header_content_length)) >> property.size;
-        property.last_modified = curl_getdate(http->get_header(constants::header_last_modified).c_str(), NULL);
-        return storage_outcome<chunk_property>(property);
-    }
-    return storage_outcome<chunk_property>(storage_error(response.error()));
+    async_executor<void>::submit(m_account, request, http, m_context, [http, on_done](const storage_outcome<void> &response) {
+        if (response.success())
+        {
+            chunk_property property{};
+            property.etag = http->get_header(constants::header_etag);
+            property.totalSize = get_length_from_content_range(http->get_header(constants::header_content_range));
+            std::istringstream(http->get_header(constants::header_content_length)) >> property.size;
+            property.last_modified = curl_getdate(http->get_header(constants::header_last_modified).c_str(), NULL);
+            on_done(storage_outcome<chunk_property>(property));
+            return;
+        }
+        on_done(storage_outcome<chunk_property>(storage_error(response.error())));
+    });
 }
 
 std::future<storage_outcome<void>> blob_client::download_blob_to_stream(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os) {
-    auto http = m_client->get_handle();
+    auto http = m_client->get_handle(request_priority::foreground);
 
     auto request = std::make_shared<download_blob_request>(container, blob);
 
@@ -91,7 +124,7 @@ std::future<storage_outcome<void>> blob_client::download_blob_to_stream(const st
 }
 
 std::future<storage_outcome<void>> blob_client::upload_block_blob_from_stream(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata) {
-    auto http = m_client->get_handle();
+    auto http = m_client->get_handle(request_priority::foreground);
 
     auto request = std::make_shared<create_block_blob_request>(container, blob);
 
@@ -111,6 +144,55 @@ std::future<storage_outcome<void>> blob_client::upload_block_blob_from_stream(co
     return async_executor<void>::submit(m_account, request, http, m_context);
 }
 
+storage_outcome<blob_write_property> blob_client::upload_block_blob_from_stream_sync(const std::string &container, const std::string &blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata) {
+    auto http = m_client->get_handle(request_priority::foreground);
+
+    auto request = std::make_shared<create_block_blob_request>(container, blob);
+
+    auto cur = is.tellg();
+    is.seekg(0, std::ios_base::end);
+    auto end = is.tellg();
+    is.seekg(cur);
+    //check < 2^32
+    request->set_content_length(static_cast<unsigned int>(end - cur));
+    if (metadata.size() > 0)
+    {
+        request->set_metadata(metadata);
+    }
+
+    http->set_input_stream(storage_istream(is));
+
+    const auto response = async_executor<void>::submit(m_account, request, http, m_context).get();
+    if (response.success())
+    {
+        return storage_outcome<blob_write_property>(get_blob_write_property(*http));
+    }
+    return storage_outcome<blob_write_property>(storage_error(response.error()));
+}
+
+void blob_client::upload_block_blob_from_source(const std::string &container, const std::string &blob, storage_source source, const std::vector<std::pair<std::string, std::string>> &metadata, std::function<void(const storage_outcome<blob_write_property> &)> on_done) {
+    auto http = m_client->get_handle(request_priority::foreground);
+
+    auto request = std::make_shared<create_block_blob_request>(container, blob);
+    //check < 2^32
+    request->set_content_length(static_cast<unsigned int>(source.length()));
+    if (metadata.size() > 0)
+    {
+        request->set_metadata(metadata);
+    }
+
+    http->set_input_source(source);
+
+    async_executor<void>::submit(m_account, request, http, m_context, [http, on_done](const storage_outcome<void> &response) {
+        if (response.success())
+        {
+            on_done(storage_outcome<blob_write_property>(get_blob_write_property(*http)));
+            return;
+        }
+        on_done(storage_outcome<blob_write_property>(storage_error(response.error())));
+    });
+}
+
 std::future<storage_outcome<void>> blob_client::delete_blob(const std::string &container, const std::string &blob, bool delete_snapshots) {
     auto http = m_client->get_handle();
 
@@ -277,7 +359,7 @@ storage_outcome<blob_property> blob_client::get_blob_property(const std::string
 }
 
 std::future<storage_outcome<void>> blob_client::upload_block_from_stream(const std::string &container, const std::string &blob, const std::string &blockid, std::istream &is) {
-    auto http = m_client->get_handle();
+    auto http = m_client->get_handle(request_priority::foreground);
 
     auto request = std::make_shared<put_block_request>(container, blob, blockid);
 
@@ -294,6 +376,30 @@ std::future<storage_outcome<void>> blob_client::upload_block_from_stream(const s
     return async_executor<void>::submit(m_account, request, http, m_context);
 }
 
+std::future<storage_outcome<void>> blob_client::upload_block_from_source(const std::string &container, const std::string &blob, const std::string &blockid, storage_source source) {
+    auto http = m_client->get_handle(request_priority::foreground);
+
+    auto request = std::make_shared<put_block_request>(container, blob, blockid);
+    //check < 2^32
+    request->set_content_length(static_cast<unsigned int>(source.length()));
+
+    http->set_input_source(source);
+
+    return async_executor<void>::submit(m_account, request, http, m_context);
+}
+
+void blob_client::upload_block_from_source(const std::string &container, const std::string &blob, const std::string &blockid, storage_source source, std::function<void(const storage_outcome<void> &)> on_done) {
+    auto http = m_client->get_handle(request_priority::foreground);
+
+    auto request = std::make_shared<put_block_request>(container, blob, blockid);
+    //check < 2^32
+    request->set_content_length(static_cast<unsigned int>(source.length()));
+
+    http->set_input_source(source);
+
+    async_executor<void>::submit(m_account, request, http, m_context, on_done);
+}
+
 std::future<storage_outcome<void>> blob_client::put_block_list(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata) {
     auto http = m_client->get_handle();
 
@@ -307,6 +413,27 @@ std::future<storage_outcome<void>> blob_client::put_block_list(const std::string
     return async_executor<void>::submit(m_account, request, http, m_context);
 }
 
+storage_outcome<blob_write_property> blob_client::put_block_list_sync(const std::string &container, const std::string &blob, const std::vector<put_block_list_request_base::block_item> &block_list, const std::vector<std::pair<std::string, std::string>> &metadata) {
+    auto http = m_client->get_handle();
+
+    auto request = std::make_shared<put_block_list_request>(container, blob);
+    request->set_block_list(block_list);
+    if (metadata.size() > 0)
+    {
+        request->set_metadata(metadata);
+    }
+
+    const auto response = async_executor<void>::submit(m_account, request, http, m_context).get();
+    if (response.success())
+    {
+        blob_write_property property = get_blob_write_property(*http);
+        // The MD5 header on a commit is of the request body, not the blob.
+        property.content_md5.clear();
+        return storage_outcome<blob_write_property>(property);
+    }
+    return storage_outcome<blob_write_property>(storage_error(response.error()));
+}
+
 std::future<storage_outcome<void>> blob_client::create_append_blob(const std::string &container, const std::string &blob) {
     auto http = m_client->get_handle();
 
@@ -316,7 +443,7 @@ std::future<storage_outcome<void>> blob_client::create_append_blob(const std::st
 }
 
 std::future<storage_outcome<void>> blob_client::append_block_from_stream(const std::string &container, const std::string &blob, std::istream &is) {
-    auto http = m_client->get_handle();
+    auto http = m_client->get_handle(request_priority::foreground);
 
     auto request = std::make_shared<append_block_request>(container, blob);
 
@@ -342,7 +469,7 @@ std::future<storage_outcome<void>> blob_client::create_page_blob(const std::stri
 }
 
 std::future<storage_outcome<void>> blob_client::put_page_from_stream(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::istream &is) {
-    auto http = m_client->get_handle();
+    auto http = m_client->get_handle(request_priority::foreground);
 
     auto request = std::make_shared<put_page_request>(container, blob);
     if (size > 0) {
@@ -15,39 +15,80 @@ namespace microsoft_azure {
         }
 
         // Performs a thread-safe map lookup of the input key in the directory map.
-        // Will create new entries if necessary before returning.
-        std::shared_ptr<boost::shared_mutex> blob_client_attr_cache_wrapper::attribute_cache::get_dir_item(const std::string& path)
+        // Will create new entries if necessary before returning, evicting the least recently used ones if the map is full.
+        std::shared_ptr<blob_client_attr_cache_wrapper::dir_cache_item> blob_client_attr_cache_wrapper::attribute_cache::get_dir_item(const std::string& path)
         {
-            std::lock_guard<std::mutex> lock(dirs_mutex);
-            auto iter = dir_cache.find(path);
-            if(iter == dir_cache.end())
+            return dir_cache.access(path, [](std::shared_ptr<dir_cache_item>& item)
             {
-                auto dir_item = std::make_shared<boost::shared_mutex>();
-                dir_cache[path] = dir_item;
-                return dir_item;
-            }
-            else
+                if (!item)
+                {
+                    item = std::make_shared<dir_cache_item>();
+                }
+                return item;
+            });
+        }
+
+        // Blobs are keyed by their directory's entry and the last component of their path.
+        blob_client_attr_cache_wrapper::blob_cache_key blob_client_attr_cache_wrapper::attribute_cache::key_for(const std::shared_ptr<dir_cache_item>& dir, const std::string& path)
+        {
+            size_t last_slash_idx = path.rfind('/');
+            blob_cache_key key;
+            key.dir = dir;
+            key.name = std::string::npos != last_slash_idx ? path.substr(last_slash_idx + 1) : path;
+            return key;
+        }
+
+        bool blob_client_attr_cache_wrapper::attribute_cache::get_fresh(const std::shared_ptr<dir_cache_item>& dir, const std::string& path, blob_property& props)
+        {
+            bool fresh = false;
+            blob_cache.find(key_for(dir, path), [&](blob_cache_item& item)
             {
-                return iter->second;
-            }
+                if (is_fresh(item))
+                {
+                    props = item.m_props.to_blob_property();
+                    fresh = true;
+                }
+            });
+            return fresh;
         }
 
-        // Performs a thread-safe map lookup of the input key in the blob map.
-        // Will create new entries if necessary before returning.
-        std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> blob_client_attr_cache_wrapper::attribute_cache::get_blob_item(const std::string& path)
+        // Stores the record in the blob map, evicting the least recently used ones if the map is full.
+        void blob_client_attr_cache_wrapper::attribute_cache::store(const std::shared_ptr<dir_cache_item>& dir, const std::string& path, blob_property& props)
         {
-            std::lock_guard<std::mutex> lock(blobs_mutex);
-            auto iter = blob_cache.find(path);
-            if(iter == blob_cache.end())
+            blob_cache.access(key_for(dir, path), [&](blob_cache_item& item)
             {
-                auto blob_item = std::make_shared<blob_client_attr_cache_wrapper::blob_cache_item>("", blob_property(false));
-                blob_cache[path] = blob_item;
-                return blob_item;
-            }
-            else
+                if (item.m_props.assign(props, m_string_pool))
+                {
+                    item.confirm();
+                }
+                else
+                {
+                    item.unconfirm();
+                }
+            });
+        }
+
+        void blob_client_attr_cache_wrapper::attribute_cache::invalidate(const std::shared_ptr<dir_cache_item>& dir, const std::string& path)
+        {
+            blob_cache.find(key_for(dir, path), [](blob_cache_item& item) { item.unconfirm(); });
+        }
+
+        bool blob_client_attr_cache_wrapper::attribute_cache::is_fresh(const blob_cache_item& item) const
+        {
+            if (!item.confirmed())
             {
-                return iter->second;
+                return false;
             }
+            const unsigned int timeout_in_seconds = m_timeout_in_seconds.load();
+            return timeout_in_seconds == 0 || (std::chrono::steady_clock::now() - item.m_last_confirmed) < std::chrono::seconds(timeout_in_seconds);
+        }
+
+        // Changes the timeout and size limit of the cache.  Shrinking the limit evicts unused entries immediately.
+        void blob_client_attr_cache_wrapper::attribute_cache::configure(unsigned int timeout_in_seconds, size_t max_entries)
+        {
+            blob_cache.set_max_entries(max_entries);
+            dir_cache.set_max_entries(max_entries);
+            m_timeout_in_seconds.store(timeout_in_seconds);
         }
 
         /// <summary>
@@ -61,43 +102,49 @@ namespace microsoft_azure {
         /// <returns>A response from list_blobs_hierarchical that contains a list of blobs and their details</returns>
         list_blobs_hierarchical_response blob_client_attr_cache_wrapper::list_blobs_hierarchical(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix, int maxresults)
         {
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(prefix);
-            std::unique_lock<boost::shared_mutex> uniquelock(*dir_mutex);
-
-            errno = 0;
-            list_blobs_hierarchical_response response = m_blob_client_wrapper->list_blobs_hierarchical(container, delimiter, continuation_token, prefix, maxresults);
-            if (errno == 0)
+            // The listing is keyed on every argument; '\0' can't appear in any of them, so it keeps the fields apart.
+            std::string key = container + '\0' + delimiter + '\0' + continuation_token + '\0' + prefix + '\0' + std::to_string(maxresults);
+            return m_list_flights.run(key, [&]() -> list_blobs_hierarchical_response
             {
-                for (size_t i = 0; i < response.blobs.size(); i++)
+                std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(prefix);
+                std::unique_lock<boost::shared_mutex> uniquelock(dir_item->m_mutex);
+
+                errno = 0;
+                list_blobs_hierarchical_response response = m_blob_client_wrapper->list_blobs_hierarchical(container, delimiter, continuation_token, prefix, maxresults);
+                if (errno == 0)
                 {
-                    if (!response.blobs[i].is_directory)
+                    for (size_t i = 0; i < response.blobs.size(); i++)
                     {
-                        // TODO - modify list_blobs to return blob_property items; simplifying this logic.
-                        blob_property properties(true);
-
-                        properties.cache_control = response.blobs[i].cache_control;
-//                        properties.content_disposition = response.blobs[i].content_disposition;  // TODO - once this is available in cpplite.
-                        properties.content_encoding = response.blobs[i].content_encoding;
-                        properties.content_language = response.blobs[i].content_language;
-                        properties.size = response.blobs[i].content_length;
-                        properties.content_md5 = response.blobs[i].content_md5;
-                        properties.content_type = response.blobs[i].content_type;
-                        properties.etag = response.blobs[i].etag;
-                        properties.metadata = response.blobs[i].metadata;
-                        properties.copy_status = response.blobs[i].copy_status;
-                        properties.last_modified = curl_getdate(response.blobs[i].last_modified.c_str(), NULL);
-
-                        // Note that this internally locks the mutex protecting the attr_cache blob list.  Normally this is fine, but here it's a bit concerning, because we've already 
-                        // taken a lock on the directory string.
-                        // It should be fine, there should be no chance of deadlock, as the internal mutex is released before get_blob_item returns, but we should take care when modifying.
-                        std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(response.blobs[i].name);
-                        std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
-                        cache_item->m_props = properties;
-                        cache_item->m_confirmed = true;
+                        if (!response.blobs[i].is_directory)
+                        {
+                            // TODO - modify list_blobs to return blob_property items; simplifying this logic.
+                            blob_property properties(true);
+
+                            properties.cache_control = response.blobs[i].cache_control;
+//                            properties.content_disposition = response.blobs[i].content_disposition;  // TODO - once this is available in cpplite.
+                            properties.content_encoding = response.blobs[i].content_encoding;
+                            properties.content_language = response.blobs[i].content_language;
+                            properties.size = response.blobs[i].content_length;
+                            properties.content_md5 = response.blobs[i].content_md5;
+                            properties.content_type = response.blobs[i].content_type;
+                            properties.etag = response.blobs[i].etag;
+                            properties.metadata = response.blobs[i].metadata;
+                            properties.copy_status = response.blobs[i].copy_status;
+                            properties.last_modified = curl_getdate(response.blobs[i].last_modified.c_str(), NULL);
+
+                            // Note that this internally locks the shards of the blob lock table and the blob map.  Normally this is fine, but here it's a bit concerning, because we've already
+                            // taken a lock on the directory string.
+                            // It should be fine, there should be no chance of deadlock, as the internal mutexes are released before each call returns, but we should take care when modifying.
+                            // The prefix needn't be spelled the way the blob's parent is, so look up the directory the blob is keyed under.
+                            std::shared_ptr<dir_cache_item> blob_dir_item = attr_cache.get_dir_item(get_parent_str(response.blobs[i].name));
+                            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(response.blobs[i].name);
+                            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
+                            attr_cache.store(blob_dir_item, response.blobs[i].name, properties);
+                        }
                     }
                 }
-            }
-            return response;
+                return response;
+            });
         }
 
         /// <summary>
@@ -113,7 +160,9 @@ namespace microsoft_azure {
             const std::string &account_key,
             const unsigned int concurrency,
             bool use_https,
-            const std::string &blob_endpoint)
+            const std::string &blob_endpoint,
+            unsigned int cache_timeout_in_seconds,
+            size_t cache_max_entries)
         {
             std::shared_ptr<blob_client_wrapper> wrapper = blob_client_wrapper_init_accountkey(
                 account_name,
@@ -121,7 +170,7 @@ namespace microsoft_azure {
                 concurrency,
                 use_https,
                 blob_endpoint);
-            return blob_client_attr_cache_wrapper(wrapper);
+            return blob_client_attr_cache_wrapper(wrapper, cache_timeout_in_seconds, cache_max_entries);
         }
 
         /// <summary>
@@ -139,7 +188,9 @@ namespace microsoft_azure {
             const std::string &sas_token,
             const unsigned int concurrency,
             bool use_https,
-            const std::string &blob_endpoint)
+            const std::string &blob_endpoint,
+            unsigned int cache_timeout_in_seconds,
+            size_t cache_max_entries)
         {
             std::shared_ptr<blob_client_wrapper> wrapper = blob_client_wrapper_init_sastoken(
                 account_name,
@@ -147,7 +198,7 @@ namespace microsoft_azure {
                 concurrency,
                 use_https,
                 blob_endpoint);
-            return blob_client_attr_cache_wrapper(wrapper);
+            return blob_client_attr_cache_wrapper(wrapper, cache_timeout_in_seconds, cache_max_entries);
         }
 
         /// <summary>
@@ -161,13 +212,28 @@ namespace microsoft_azure {
         blob_client_attr_cache_wrapper blob_client_attr_cache_wrapper::blob_client_attr_cache_wrapper_oauth(
             const std::string &account_name,
             const unsigned int concurrency,
-            const std::string &blob_endpoint)
+            const std::string &blob_endpoint,
+            unsigned int cache_timeout_in_seconds,
+            size_t cache_max_entries)
         {
             std::shared_ptr<blob_client_wrapper> wrapper = blob_client_wrapper_init_oauth(
                     account_name,
                     concurrency,
                     blob_endpoint);
-            return blob_client_attr_cache_wrapper(wrapper);
+            return blob_client_attr_cache_wrapper(wrapper, cache_timeout_in_seconds, cache_max_entries);
+        }
+
+        // Records the result of an upload in the cache.  Must be called with the blob's lock held exclusively.
+        // If the upload failed, or didn't tell us what the blob now looks like, fall back to fetching the properties on next use.
+        // errno is left as the upload set it.
+        void blob_client_attr_cache_wrapper::update_from_write(const std::shared_ptr<dir_cache_item> &dir_item, const std::string &blob, blob_property &properties)
+        {
+            if (errno != 0 || !properties.valid())
+            {
+                attr_cache.invalidate(dir_item, blob);
+                return;
+            }
+            attr_cache.store(dir_item, blob, properties);
         }
 
         /// <summary>
@@ -177,16 +243,16 @@ namespace microsoft_azure {
         /// <param name="container">The container name.</param>
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        void blob_client_attr_cache_wrapper::put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata)
+        blob_property blob_client_attr_cache_wrapper::put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata)
         {
-            // Invalidate the cache.
-            // TODO: consider updating the cache with the new values.  Will require modifying cpplite to return info from put_blob.
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(get_parent_str(blob));
-            std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(blob);
-            boost::shared_lock<boost::shared_mutex> dirlock(*dir_mutex);
-            std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
-            m_blob_client_wrapper->put_blob(sourcePath, container, blob, metadata);
-            cache_item->m_confirmed = false;
+            // The response to the upload tells us everything we cache about the blob, so store it rather than fetching it again on the next get_blob_property.
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(blob));
+            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(blob);
+            boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
+            blob_property properties = m_blob_client_wrapper->put_blob(sourcePath, container, blob, metadata);
+            update_from_write(dir_item, blob, properties);
+            return properties;
         }
 
         /// <summary>
@@ -196,16 +262,16 @@ namespace microsoft_azure {
         /// <param name="blob">The blob name.</param>
         /// <param name="is">The source stream.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
-        void blob_client_attr_cache_wrapper::upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata)
+        blob_property blob_client_attr_cache_wrapper::upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata)
         {
-            // Invalidate the cache.
-            // TODO: consider updating the cache with the new values.  Will require modifying cpplite to return info from put_blob.
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(get_parent_str(blob));
-            std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(blob);
-            boost::shared_lock<boost::shared_mutex> dirlock(*dir_mutex);
-            std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
-            m_blob_client_wrapper->upload_block_blob_from_stream(container, blob, is, metadata);
-            cache_item->m_confirmed = false;
+            // The response to the upload tells us everything we cache about the blob, so store it rather than fetching it again on the next get_blob_property.
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(blob));
+            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(blob);
+            boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
+            blob_property properties = m_blob_client_wrapper->upload_block_blob_from_stream(container, blob, is, metadata);
+            update_from_write(dir_item, blob, properties);
+            return properties;
         }
 
         /// <summary>
@@ -216,16 +282,16 @@ namespace microsoft_azure {
         /// <param name="blob">The blob name.</param>
         /// <param name="metadata">A <see cref="std::vector"> that respresents metadatas.</param>
         /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
-        void blob_client_attr_cache_wrapper::upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel)
+        blob_property blob_client_attr_cache_wrapper::upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel)
         {
-            // Invalidate the cache.
-            // TODO: consider updating the cache with the new values.  Will require modifying cpplite to return info from put_blob.
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(get_parent_str(blob));
-            std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(blob);
-            boost::shared_lock<boost::shared_mutex> dirlock(*dir_mutex);
-            std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
-            m_blob_client_wrapper->upload_file_to_blob(sourcePath, container, blob, metadata, parallel);
-            cache_item->m_confirmed = false;
+            // The response to the upload tells us everything we cache about the blob, so store it rather than fetching it again on the next get_blob_property.
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(blob));
+            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(blob);
+            boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
+            blob_property properties = m_blob_client_wrapper->upload_file_to_blob(sourcePath, container, blob, metadata, parallel);
+            update_from_write(dir_item, blob, properties);
+            return properties;
         }
 
         /// <summary>
@@ -258,6 +324,21 @@ namespace microsoft_azure {
             m_blob_client_wrapper->download_blob_to_file(container, blob, destPath, returned_last_modified, parallel);
         }
 
+        /// <summary>
+        /// Starts downloading the contents of a blob to a local file, and returns once the first chunk is in, leaving the rest to download
+        /// in the background.
+        /// </summary>
+        /// <param name="container">The container name.</param>
+        /// <param name="blob">The blob name.</param>
+        /// <param name="destPath">The target file path.</param>
+        /// <param name="on_finished">Called once the download has finished, with 0 or the errno it failed with, and the blob's last modified time.</param>
+        /// <param name="parallel">A size_t value indicates the maximum parallelism can be used in this request.</param>
+        /// <returns>The download, or nullptr (with errno set) if it failed before the first chunk was in.</returns>
+        std::shared_ptr<download_progress> blob_client_attr_cache_wrapper::start_download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished, size_t parallel)
+        {
+            return m_blob_client_wrapper->start_download_blob_to_file(container, blob, destPath, on_finished, parallel);
+        }
+
         /// <summary>
         /// Gets the property of a blob.
         /// </summary>
@@ -277,30 +358,50 @@ namespace microsoft_azure {
         /// Useful if there is reason to suspect the properties may have changed behind the scenes (specifically, if there's a pending copy operation.)</param>
         blob_property blob_client_attr_cache_wrapper::get_blob_property(const std::string &container, const std::string &blob, bool assume_cache_invalid)
         {
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(get_parent_str(blob));
-            std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(blob);
-            boost::shared_lock<boost::shared_mutex> dirlock(*dir_mutex);
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(blob));
 
+            // Only a hit that needn't wait for a lock is answered here.  Waiting here for a fetch in progress to let go of the blob would mean
+            // arriving once it's over, too late to share its answer, so anything else joins the flight below first.
             if (!assume_cache_invalid)
             {
-                boost::shared_lock<boost::shared_mutex> sharedlock(cache_item->m_mutex);
-                if (cache_item->m_confirmed)
+                boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex, boost::try_to_lock);
+                blob_property cached(false);
+                if (dirlock.owns_lock() && !attr_cache.blob_busy(blob) && attr_cache.get_fresh(dir_item, blob, cached))
                 {
-                    return cache_item->m_props;
+                    return cached;
                 }
             }
 
+            // Anyone else who misses on this blob while we're fetching it waits for, and shares, our answer - including a "not found".
+            // A caller that doesn't trust the cache mustn't be handed an answer from it, so it only shares with others like it.
+            std::string key = container + '/' + blob;
+            if (assume_cache_invalid)
             {
-                std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
+                key += '\0';
+            }
+            return m_property_flights.run(key, [&]() -> blob_property
+            {
+                lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(blob);
+                boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+                std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
+                // A fetch that finished just before this one started may have filled in the item already.
+                blob_property cached(false);
+                if (!assume_cache_invalid && attr_cache.get_fresh(dir_item, blob, cached))
+                {
+                    errno = 0;
+                    return cached;
+                }
+
                 errno = 0;
-                cache_item->m_props = m_blob_client_wrapper->get_blob_property(container, blob);
+                blob_property properties = m_blob_client_wrapper->get_blob_property(container, blob);
                 if (errno != 0)
                 {
+                    attr_cache.invalidate(dir_item, blob);
                     return blob_property(false); // keep errno unchanged
                 }
-                cache_item->m_confirmed = true;
-                return cache_item->m_props;
-            }
+                attr_cache.store(dir_item, blob, properties);
+                return properties;
+            });
         }
 
         /// <summary>
@@ -328,12 +429,12 @@ namespace microsoft_azure {
         void blob_client_attr_cache_wrapper::delete_blob(const std::string &container, const std::string &blob)
         {
             // These calls cannot be cached because we do not have a negative cache - blobs in the cache are either valid/confirmed, or unknown (which could be deleted, or not checked on the service.)
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(get_parent_str(blob));
-            std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(blob);
-            boost::shared_lock<boost::shared_mutex> dirlock(*dir_mutex);
-            std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(blob));
+            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(blob);
+            boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
             m_blob_client_wrapper->delete_blob(container, blob);
-            cache_item->m_confirmed = false;
+            attr_cache.invalidate(dir_item, blob);
         }
 
         /// <summary>
@@ -344,12 +445,12 @@ namespace microsoft_azure {
         void blob_client_attr_cache_wrapper::delete_blobdir(const std::string &container, const std::string &blob)
         {
             // These calls cannot be cached because we do not have a negative cache - blobs in the cache are either valid/confirmed, or unknown (which could be deleted, or not checked on the service.)
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(get_parent_str(blob));
-            std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(blob);
-            boost::shared_lock<boost::shared_mutex> dirlock(*dir_mutex);
-            std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(blob));
+            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(blob);
+            boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
             m_blob_client_wrapper->delete_blobdir(container, blob);
-            cache_item->m_confirmed = false;
+            attr_cache.invalidate(dir_item, blob);
         }
 
         /// <summary>
@@ -363,12 +464,30 @@ namespace microsoft_azure {
         {
             // No need to lock on the source, as we're neither modifying nor querying the source blob or its cached content.
             // We do need to lock on the destination, because if the start copy operation succeeds we need to invalidate the cached data.
-            std::shared_ptr<boost::shared_mutex> dir_mutex = attr_cache.get_dir_item(get_parent_str(destBlob));
-            std::shared_ptr<blob_client_attr_cache_wrapper::blob_cache_item> cache_item = attr_cache.get_blob_item(destBlob);
-            boost::shared_lock<boost::shared_mutex> dirlock(*dir_mutex);
-            std::unique_lock<boost::shared_mutex> uniquelock(cache_item->m_mutex);
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(destBlob));
+            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(destBlob);
+            boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
             errno = 0;
             m_blob_client_wrapper->start_copy(sourceContainer, sourceBlob, destContainer, destBlob);
-            cache_item->m_confirmed = false;
+            attr_cache.invalidate(dir_item, destBlob);
+        }
+
+        /// <summary>
+        /// Marks the cached properties of a blob as out of date, so that the next request for them goes to the service.
+        /// </summary>
+        /// <param name="blob">The blob name.</param>
+        void blob_client_attr_cache_wrapper::invalidate_cached_blob(const std::string &blob)
+        {
+            std::shared_ptr<dir_cache_item> dir_item = attr_cache.get_dir_item(get_parent_str(blob));
+            lock_table<boost::shared_mutex>::handle blob_lock = attr_cache.lock_blob(blob);
+            boost::shared_lock<boost::shared_mutex> dirlock(dir_item->m_mutex);
+            std::unique_lock<boost::shared_mutex> uniquelock(blob_lock.mutex());
+            attr_cache.invalidate(dir_item, blob);
+        }
+
+        size_t blob_client_attr_cache_wrapper::property_fetch_waiters(const std::string &container, const std::string &blob)
+        {
+            return m_property_flights.waiting(container + '/' + blob);
         }
 }}
\ No newline at end of file
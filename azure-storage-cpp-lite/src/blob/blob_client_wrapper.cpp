@@ -5,8 +5,12 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <sstream>
 #include <uuid/uuid.h>
 
 #include "blob/blob_client.h"
@@ -15,51 +19,346 @@
 
 namespace microsoft_azure {
     namespace storage {
-        const unsigned long long DOWNLOAD_CHUNK_SIZE = 16 * 1024 * 1024;
-        const long long MIN_UPLOAD_CHUNK_SIZE = 16 * 1024 * 1024;
+        // Block sizes start here, until the tuners have some transfers to go on, and stay between these bounds.
+        const unsigned long long INITIAL_BLOCK_SIZE = 16 * 1024 * 1024;
+        const unsigned long long MIN_BLOCK_SIZE = 4 * 1024 * 1024;
+        const unsigned long long MAX_UPLOAD_BLOCK_SIZE = 100 * 1024 * 1024; // The most one Put Block takes.
+        const unsigned long long MAX_DOWNLOAD_CHUNK_SIZE = 256 * 1024 * 1024;
+        const long long MAX_PUT_BLOB_SIZE = 256 * 1024 * 1024; // The most one Put Blob takes.
+        const size_t INITIAL_UPLOAD_STREAMS = 8;
+        const size_t INITIAL_DOWNLOAD_STREAMS = 9;
         const long long MAX_BLOB_SIZE = 5242880000000; // 4.77TB 
 
-        class mempool
+        // Closes a file descriptor when it goes out of scope.
+        class fd_closer
         {
         public:
-            ~mempool()
+            explicit fd_closer(int fd) : m_fd(fd) {}
+
+            ~fd_closer()
+            {
+                close(m_fd);
+            }
+
+            fd_closer(const fd_closer &) = delete;
+            fd_closer &operator=(const fd_closer &) = delete;
+
+        private:
+            int m_fd;
+        };
+
+        // One file's blocks or chunks, queued on the client's transfer scheduler.  Waits for them all to run before going out of scope, as
+        // they refer to the caller's file descriptor and strings.  The transfers' requests get no more than the priority the caller's thread
+        // was limited to when this was made.
+        class scheduled_transfers
+        {
+        public:
+            scheduled_transfers(std::shared_ptr<transfer_scheduler> scheduler, size_t max_running)
+                : m_scheduler(scheduler),
+                m_flow(scheduler->open_flow(max_running)),
+                m_failed(std::make_shared<std::atomic<bool>>(false)),
+                m_priority(request_priority_scope::ceiling())
+            {
+            }
+
+            ~scheduled_transfers()
+            {
+                wait();
+                m_scheduler->close_flow(m_flow);
+            }
+
+            scheduled_transfers(const scheduled_transfers &) = delete;
+            scheduled_transfers &operator=(const scheduled_transfers &) = delete;
+
+            // Queues a transfer that starts a request and calls the function it is given with 0 or an errno once the request is over, without
+            // waiting for it.  Once one has failed, those still queued are skipped.
+            void submit(std::function<void(std::function<void(int)>)> transfer)
+            {
+                auto failed = m_failed;
+                const request_priority priority = m_priority;
+                m_results.push_back(m_scheduler->submit_async(m_flow, [transfer, failed, priority](std::function<void(int)> done) {
+                    request_priority_scope scope(priority);
+                    if (*failed)
+                    {
+                        done(0);
+                        return;
+                    }
+                    try
+                    {
+                        transfer([failed, done](int result) {
+                            if (result != 0)
+                            {
+                                *failed = true;
+                            }
+                            done(result);
+                        });
+                    }
+                    catch(std::exception& ex)
+                    {
+                        // Thrown while the request was being set up, before it could end.
+                        syslog(LOG_ERR, "Unknown failure in a block transfer.  ex.what() = %s.", ex.what());
+                        *failed = true;
+                        done(unknown_error);
+                    }
+                }));
+            }
+
+            // Waits for every transfer queued so far, and returns the first error in the order they were queued, or 0.
+            int wait()
+            {
+                int first_error = 0;
+                for (auto &result : m_results)
+                {
+                    int error;
+                    try
+                    {
+                        error = result.get();
+                    }
+                    catch(std::exception& ex)
+                    {
+                        syslog(LOG_ERR, "Unknown failure in a block transfer.  ex.what() = %s.", ex.what());
+                        error = unknown_error;
+                    }
+                    if (error != 0 && first_error == 0)
+                    {
+                        first_error = error;
+                    }
+                }
+                m_results.clear();
+                return first_error;
+            }
+
+        private:
+            std::shared_ptr<transfer_scheduler> m_scheduler;
+            const unsigned long long m_flow;
+            std::shared_ptr<std::atomic<bool>> m_failed;
+            const request_priority m_priority;
+            std::vector<std::future<int>> m_results;
+        };
+
+        // Runs a single request for a file on the transfer workers and waits for it, so that small files and first chunks are held to the
+        // congestion window like the blocks and chunks of larger ones.  The transfer is as for scheduled_transfers::submit.  The caller must not
+        // be a transfer itself.
+        int run_scheduled(std::shared_ptr<transfer_scheduler> scheduler, std::function<void(std::function<void(int)>)> transfer)
+        {
+            scheduled_transfers transfers(scheduler, 1);
+            transfers.submit(transfer);
+            return transfers.wait();
+        }
+
+        // The errno for a request that failed.  Doesn't throw, so it is safe in callbacks run on the curl engine's threads.
+        int request_error(const storage_error &error)
+        {
+            int code = 0;
+            std::istringstream(error.code) >> code;
+            // It seems that timeouted requests has no code setup
+            return 0 == code ? 503 : code;
+        }
+
+        // A download into a file that hasn't finished yet.
+        struct partial_download
+        {
+            std::string container;
+            std::string blob;
+            std::string path; // The file the data is going into.
+            std::string etag; // The version of the blob being downloaded.  Every chunk after the first is only downloaded if the blob is still this version.
+            unsigned long long length;
+            unsigned long long chunk_size;
+            time_t last_modified;
+            std::vector<char> done; // Whether each chunk has been written, by index.  Kept up to date by the download while it runs, not here.
+
+            size_t chunks_done() const
+            {
+                return static_cast<size_t>(std::count(done.begin(), done.end(), 1));
+            }
+        };
+
+        // Downloads that failed part way through, kept so that the next download to the same file picks up where the last left off.
+        // Their data is kept in files of their own, in a directory set aside for them, and only moved to the destination once complete,
+        // so that a half-downloaded file is never taken for a whole one.
+        class partial_download_store
+        {
+        public:
+            explicit partial_download_store(const std::string &directory)
+                : m_directory(directory)
+            {
+            }
+
+            ~partial_download_store()
             {
-                while(!m_buffers.empty())
+                for (auto &entry : m_downloads)
                 {
-                    auto buffer = m_buffers.front();
-                    delete[] buffer;
-                    m_buffers.pop();
+                    unlink(entry.second->path.c_str());
                 }
             }
 
-            char* get_buffer()
+            partial_download_store(const partial_download_store &) = delete;
+            partial_download_store &operator=(const partial_download_store &) = delete;
+
+            // Starts a new download, with a new file for its data, opened for writing in fd.  Returns nullptr (with errno set) if the file
+            // couldn't be created.
+            std::unique_ptr<partial_download> create(const std::string &container, const std::string &blob, int &fd)
             {
-                std::lock_guard<std::mutex> lg(m_buffers_mutex);
-                if(m_buffers.empty())
+                if (mkdir(m_directory.c_str(), 0700) != 0 && errno != EEXIST)
                 {
-                    char* buffer = new char[s_block_size];
-                    return buffer;
+                    return nullptr;
                 }
-                else
+                std::vector<char> path(m_directory.begin(), m_directory.end());
+                const std::string name_template = "/download-XXXXXX";
+                path.insert(path.end(), name_template.begin(), name_template.end());
+                path.push_back('\0');
+                fd = mkstemp(path.data());
+                if (fd == -1)
                 {
-                    char* buffer = m_buffers.front();
-                    m_buffers.pop();
-                    return buffer;
+                    return nullptr;
                 }
+
+                std::unique_ptr<partial_download> download(new partial_download());
+                download->container = container;
+                download->blob = blob;
+                download->path = path.data();
+                download->length = 0;
+                download->chunk_size = 0;
+                download->last_modified = 0;
+                return download;
             }
-            void release_buffer(char *buffer)
+
+            // Takes out the unfinished download of the blob to the given file, if there is one.
+            std::unique_ptr<partial_download> take(const std::string &destPath, const std::string &container, const std::string &blob)
             {
-                std::lock_guard<std::mutex> lg(m_buffers_mutex);
-                m_buffers.push(buffer);
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (auto it = m_downloads.begin(); it != m_downloads.end(); ++it)
+                {
+                    if (it->first != destPath)
+                    {
+                        continue;
+                    }
+                    std::unique_ptr<partial_download> download(std::move(it->second));
+                    m_downloads.erase(it);
+                    if (download->container != container || download->blob != blob)
+                    {
+                        // The file is being reused for another blob.
+                        discard(*download);
+                        return nullptr;
+                    }
+                    return download;
+                }
+                return nullptr;
             }
+
+            // Keeps an unfinished download to pick up later, forgetting the oldest if there are too many.
+            void keep(const std::string &destPath, std::unique_ptr<partial_download> download)
+            {
+                const size_t max_kept = 8;
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_downloads.emplace_back(destPath, std::move(download));
+                while (m_downloads.size() > max_kept)
+                {
+                    discard(*m_downloads.front().second);
+                    m_downloads.pop_front();
+                }
+            }
+
+            void discard(const partial_download &download)
+            {
+                unlink(download.path.c_str());
+            }
+
         private:
-            std::queue<char*> m_buffers;
-            std::mutex m_buffers_mutex;
-            static const size_t s_block_size = 4*1024*1024;
+            const std::string m_directory;
+            std::list<std::pair<std::string, std::unique_ptr<partial_download>>> m_downloads; // By destination file, oldest first.
+            std::mutex m_mutex;
         };
-        static mempool mpool;
+
+        // What an upload of a file in blocks needs to pick up where it left off: its block IDs all end with upload_id, and block idx covers
+        // the bytes from idx * block_size.  Kept in a file until the blocks are committed.  Whether each block was staged isn't kept, as the
+        // service has the final say on that: uncommitted blocks are dropped when the blob is written some other way, or after a week.
+        struct upload_journal
+        {
+            std::string container;
+            std::string blob;
+            std::string source; // The source file's device, inode, size and modification time, so its blocks are only reused if it hasn't changed.
+            long long block_size;
+            std::string upload_id;
+
+            // The journal file for uploads to the blob.  Named after a hash of the blob's name, as that may be too long for a file name.
+            static std::string path(const std::string &directory, const std::string &container, const std::string &blob)
+            {
+                // 64-bit FNV-1a.  A collision only means the journal is taken for another blob's, and ignored.
+                unsigned long long hash = 14695981039346656037ULL;
+                const std::string name = container + "/" + blob;
+                for (const char c : name)
+                {
+                    hash ^= static_cast<unsigned char>(c);
+                    hash *= 1099511628211ULL;
+                }
+                char file_name[32];
+                snprintf(file_name, sizeof(file_name), "/upload-%016llx", hash);
+                return directory + file_name;
+            }
+
+            static std::string source_identity(const struct stat &st)
+            {
+                return std::to_string(st.st_dev) + " " + std::to_string(st.st_ino) + " " + std::to_string(st.st_size) + " " +
+                    std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+            }
+
+            // Returns false if there is no journal at the path, or it can't be read.
+            bool read(const std::string &path)
+            {
+                std::ifstream file(path);
+                std::string block_size_line;
+                if (!std::getline(file, container) || !std::getline(file, blob) || !std::getline(file, source) ||
+                    !std::getline(file, block_size_line) || !std::getline(file, upload_id))
+                {
+                    return false;
+                }
+                block_size = std::atoll(block_size_line.c_str());
+                return block_size > 0 && !upload_id.empty();
+            }
+
+            // Writes the journal to the path, replacing any there, and makes sure it is on disk before returning, as it is only of any use
+            // after a crash if it is.  Returns false, with errno set, if it couldn't be written.
+            bool write(const std::string &path) const
+            {
+                const std::string contents = container + "\n" + blob + "\n" + source + "\n" + std::to_string(block_size) + "\n" + upload_id + "\n";
+                const std::string temp_path = path + ".new";
+                int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+                if (fd == -1)
+                {
+                    return false;
+                }
+                const bool written = ::write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size()) && fsync(fd) == 0;
+                const int write_errno = errno;
+                close(fd);
+                if (!written)
+                {
+                    unlink(temp_path.c_str());
+                    errno = write_errno;
+                    return false;
+                }
+                return rename(temp_path.c_str(), path.c_str()) == 0;
+            }
+        };
+
         off_t get_file_size(const char* path);
 
+        std::string blob_client_wrapper::s_partial_download_directory;
+        std::string blob_client_wrapper::s_upload_journal_directory;
+
+        // Combines what the service tells us about a blob we just wrote with what we sent it, into the blob's properties.  The content type
+        // isn't in the response, so it is left empty rather than guessed.
+        blob_property written_blob_property(const blob_write_property &written, unsigned long long size, const std::vector<std::pair<std::string, std::string>> &metadata)
+        {
+            blob_property properties(true);
+            properties.etag = written.etag;
+            properties.last_modified = written.last_modified;
+            properties.content_md5 = written.content_md5;
+            properties.size = size;
+            properties.metadata = metadata;
+            return properties;
+        }
+
         sync_blob_client::~sync_blob_client() {}
 
         std::shared_ptr<blob_client_wrapper> blob_client_wrapper_init_accountkey(
@@ -361,17 +660,17 @@ namespace microsoft_azure {
             }
         }
 
-        void blob_client_wrapper::put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata)
+        blob_property blob_client_wrapper::put_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata)
         {
             if(!is_valid())
             {
                 errno = client_not_init;
-                return;
+                return blob_property(false);
             }
             if(sourcePath.empty() || container.empty() || blob.empty())
             {
                 errno = invalid_parameters;
-                return;
+                return blob_property(false);
             }
 
             std::ifstream ifs;
@@ -384,13 +683,13 @@ namespace microsoft_azure {
                 // TODO open failed
                 syslog(LOG_ERR, "Failure to open the input stream in put_blob.  ex.what() = %s, sourcePath = %s.", ex.what(), sourcePath.c_str());
                 errno = unknown_error;
-                return;
+                return blob_property(false);
             }
 
+            blob_property properties(false);
             try
             {
-                auto task = m_blobClient->upload_block_blob_from_stream(container, blob, ifs, metadata);
-                auto result = task.get();
+                auto result = m_blobClient->upload_block_blob_from_stream_sync(container, blob, ifs, metadata);
                 if(!result.success())
                 {
                     errno = std::stoi(result.error().code);
@@ -398,6 +697,7 @@ namespace microsoft_azure {
                 else
                 {
                     errno = 0;
+                    properties = written_blob_property(result.response(), static_cast<unsigned long long>(get_file_size(sourcePath.c_str())), metadata);
                 }
             }
             catch(std::exception& ex)
@@ -415,70 +715,167 @@ namespace microsoft_azure {
                 // TODO close failed
                 syslog(LOG_ERR, "Failure to close the input stream in put_blob.  ex.what() = %s, container = %s, blob = %s, sourcePath = %s.", ex.what(), container.c_str(), blob.c_str(), sourcePath.c_str());
                 errno = unknown_error;
+                return blob_property(false);
             }
+            return properties;
         }
 
-        void blob_client_wrapper::upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata)
+        blob_property blob_client_wrapper::upload_block_blob_from_stream(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata)
         {
             if(!is_valid())
             {
                 errno = client_not_init;
-                return;
+                return blob_property(false);
             }
             if(container.empty() || blob.empty())
             {
                 errno = invalid_parameters;
-                return;
+                return blob_property(false);
             }
 
             try
             {
-                auto task = m_blobClient->upload_block_blob_from_stream(container, blob, is, metadata);
-                auto result = task.get();
+                auto cur = is.tellg();
+                is.seekg(0, std::ios_base::end);
+                auto end = is.tellg();
+                is.seekg(cur);
+
+                auto result = m_blobClient->upload_block_blob_from_stream_sync(container, blob, is, metadata);
                 if(!result.success())
                 {
                     errno = std::stoi(result.error().code);
                     if (errno == 0) {
                         errno = 503;
                     }
+                    return blob_property(false);
                 }
                 else
                 {
                     errno = 0;
+                    return written_blob_property(result.response(), static_cast<unsigned long long>(end - cur), metadata);
                 }
             }
             catch(std::exception& ex)
             {
                 syslog(LOG_ERR, "Unknown failure in upload_block_blob_from_stream.  ex.what() = %s, container = %s, blob = %s", ex.what(), container.c_str(), blob.c_str());
                 errno = unknown_error;
+                return blob_property(false);
             }
         }
 
-        void blob_client_wrapper::upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel)
+        void blob_client_wrapper::init_transfers()
+        {
+            // With the curl engine running, a transfer only holds a worker while its request is started, so a few workers keep the whole window
+            // in flight.  Without it, each request blocks the worker it is started on until it is over.
+            const int transfer_threads = m_blobClient->client()->engine() != nullptr ? std::min(static_cast<int>(m_concurrency), 4) : static_cast<int>(m_concurrency);
+            m_scheduler = std::make_shared<transfer_scheduler>(m_concurrency, transfer_threads);
+            // Every response the client gets, for transfers or not, tells the scheduler whether the account is being throttled.
+            std::weak_ptr<transfer_scheduler> scheduler = m_scheduler;
+            m_blobClient->client()->set_response_observer([scheduler](http_base::http_code status, CURLcode code) {
+                auto s = scheduler.lock();
+                if (s != nullptr && code == CURLE_OK)
+                {
+                    s->record_response(status);
+                }
+            });
+            // A hedge is a request the window doesn't know about, so none are made while the window is cut back.
+            m_blobClient->client()->set_hedge_condition([scheduler]() {
+                auto s = scheduler.lock();
+                return s == nullptr || !s->throttled();
+            });
+            m_upload_tuner = std::make_shared<transfer_tuner>(INITIAL_UPLOAD_STREAMS, m_concurrency, INITIAL_BLOCK_SIZE, MIN_BLOCK_SIZE, MAX_UPLOAD_BLOCK_SIZE);
+            m_download_tuner = std::make_shared<transfer_tuner>(INITIAL_DOWNLOAD_STREAMS, m_concurrency, INITIAL_BLOCK_SIZE, MIN_BLOCK_SIZE, MAX_DOWNLOAD_CHUNK_SIZE);
+            if (!s_partial_download_directory.empty())
+            {
+                m_partial_downloads = std::make_shared<partial_download_store>(s_partial_download_directory);
+            }
+            m_upload_journal_directory = s_upload_journal_directory;
+        }
+
+        blob_property blob_client_wrapper::upload_file_to_blob(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel)
         {
             if(!is_valid())
             {
                 errno = client_not_init;
-                return;
+                return blob_property(false);
             }
             if(sourcePath.empty() || container.empty() || blob.empty())
             {
                 errno = invalid_parameters;
-                return;
+                return blob_property(false);
             }
 
             off_t fileSize = get_file_size(sourcePath.c_str());
             if(fileSize < 0)
             {
                 /*errno already set by get_file_size*/
-                return;
+                return blob_property(false);
             }
 
-            if(fileSize <= 64*1024*1024)
+            long long block_size = static_cast<long long>(m_upload_tuner->block_size());
+
+            // Pick up where an earlier upload of the file to this blob left off, if it was journaled and the file hasn't changed since.
+            upload_journal journal;
+            std::string journal_path;
+            bool resuming = false;
+            struct stat st;
+            if(!m_upload_journal_directory.empty() && stat(sourcePath.c_str(), &st) == 0)
             {
-                put_blob(sourcePath, container, blob, metadata);
-                // put_blob sets errno
-                return;
+                journal_path = upload_journal::path(m_upload_journal_directory, container, blob);
+                resuming = journal.read(journal_path) && journal.container == container && journal.blob == blob && journal.source == upload_journal::source_identity(st);
+                if(resuming)
+                {
+                    // The blocks staged so far are only of use cut the same way.
+                    block_size = journal.block_size;
+                }
+            }
+
+            // A file of up to two blocks goes up in one request, which takes about as long as the blocks would in parallel plus the
+            // put_block_list to commit them.
+            if(!resuming && fileSize <= std::min(2 * block_size, MAX_PUT_BLOB_SIZE))
+            {
+                // The request reads the file itself, with pread, like a block's does.
+                int fd = open(sourcePath.c_str(), O_RDONLY);
+                if(fd == -1)
+                {
+                    syslog(LOG_ERR, "Failed to open the source file in upload_file_to_blob.  errno = %d, sourcePath = %s.", errno, sourcePath.c_str());
+                    errno = unknown_error;
+                    return blob_property(false);
+                }
+                fd_closer closer(fd);
+
+                blob_property properties(false);
+                errno = run_scheduled(m_scheduler, [&](std::function<void(int)> done) {
+                    storage_source source = storage_source::file(fd, 0, static_cast<size_t>(fileSize));
+                    // Timed from here rather than from the call, so that the tuner sees how long the request took, not how long it was queued.
+                    const auto request_start = std::chrono::steady_clock::now();
+                    m_blobClient->upload_block_blob_from_source(container, blob, source, metadata, [&, source, request_start, done](const storage_outcome<blob_write_property> &result) {
+                        if(source.error() != 0)
+                        {
+                            syslog(LOG_ERR, "Failed to read from the source file in upload_file_to_blob.  errno = %d, sourcePath = %s, container = %s, blob = %s.", source.error(), sourcePath.c_str(), container.c_str(), blob.c_str());
+                            done(unknown_error);
+                            return;
+                        }
+                        if(!result.success())
+                        {
+                            done(request_error(result.error()));
+                            return;
+                        }
+                        m_upload_tuner->record_request(static_cast<unsigned long long>(fileSize), std::chrono::steady_clock::now() - request_start);
+                        properties = written_blob_property(result.response(), static_cast<unsigned long long>(fileSize), metadata);
+                        done(0);
+                    });
+                });
+                if(properties.valid())
+                {
+                    if(!journal_path.empty())
+                    {
+                        // Writing the blob has dropped any blocks an earlier upload left uncommitted.  There is usually no journal to remove.
+                        unlink(journal_path.c_str());
+                        errno = 0;
+                    }
+                }
+                return properties;
             }
 
             int result = 0;
@@ -488,128 +885,131 @@ namespace microsoft_azure {
             if(fileSize > MAX_BLOB_SIZE)
             {
                 errno = EFBIG;
-                return;
+                return blob_property(false);
             }
 
-            long long block_size = MIN_UPLOAD_CHUNK_SIZE;
-
-            if(fileSize > (50000 * MIN_UPLOAD_CHUNK_SIZE))
+            if(fileSize > (50000 * block_size))
             {
-                long long min_block = fileSize / 50000; 
-                int remainder = min_block % 4*1024*1024;
+                // A blob can have at most 50000 blocks, so use the smallest multiple of 4MB that fits the file in that many.
+                long long min_block = fileSize / 50000;
+                long long remainder = min_block % (4*1024*1024);
                 min_block += 4*1024*1024 - remainder;
-                block_size = min_block < MIN_UPLOAD_CHUNK_SIZE ? MIN_UPLOAD_CHUNK_SIZE : min_block;
+                block_size = std::max(min_block, block_size);
             }
 
-            std::ifstream ifs(sourcePath, std::ios::in | std::ios::binary);
-            if(!ifs)
+            // Each block's request reads its range of the file itself, with pread, so blocks are read in parallel, with no copy in between.
+            int fd = open(sourcePath.c_str(), O_RDONLY);
+            if(fd == -1)
             {
-                syslog(LOG_ERR, "Failed to open the input stream in upload_file_to_blob.  errno = %d, sourcePath = %s.", errno, sourcePath.c_str());
+                syslog(LOG_ERR, "Failed to open the source file in upload_file_to_blob.  errno = %d, sourcePath = %s.", errno, sourcePath.c_str());
                 errno = unknown_error;
-                return;
+                return blob_property(false);
             }
+            fd_closer closer(fd);
 
-            std::vector<put_block_list_request_base::block_item> block_list;
-            std::deque<std::future<int>> task_list;
-            std::mutex mutex;
-            std::condition_variable cv;
-            std::mutex cv_mutex;
-
-            for(long long offset = 0, idx = 0; offset < fileSize; offset += block_size, ++idx)
+            std::map<std::string, unsigned long long> staged; // The blocks already on the service, by ID, with their sizes.
+            if(resuming)
             {
-                // control the number of submitted jobs.
-                while(task_list.size() > m_concurrency)
+                try
                 {
-                    auto r = task_list.front().get();
-                    task_list.pop_front();
-                    if (0 == result) {
-                        result = r;
+                    const auto blocks = m_blobClient->get_block_list(container, blob).get();
+                    if(blocks.success())
+                    {
+                        for(const auto &staged_block : blocks.response().uncommitted)
+                        {
+                            staged[staged_block.name] = staged_block.size;
+                        }
                     }
+                    else
+                    {
+                        syslog(LOG_WARNING, "get_block_list failed in upload_file_to_blob, so every block will be sent again.  error code = %s, container = %s, blob = %s.", blocks.error().code.c_str(), container.c_str(), blob.c_str());
+                    }
+                }
+                catch(std::exception& ex)
+                {
+                    syslog(LOG_WARNING, "get_block_list failed in upload_file_to_blob, so every block will be sent again.  ex.what() = %s, container = %s, blob = %s.", ex.what(), container.c_str(), blob.c_str());
                 }
-                if (0 != result) {
-                    break;
+            }
+            else
+            {
+                journal.container = container;
+                journal.blob = blob;
+                journal.block_size = block_size;
+                journal.upload_id = get_uuid();
+                if(!journal_path.empty())
+                {
+                    journal.source = upload_journal::source_identity(st);
+                    if((mkdir(m_upload_journal_directory.c_str(), 0700) != 0 && errno != EEXIST) || !journal.write(journal_path))
+                    {
+                        syslog(LOG_WARNING, "Failed to write the journal for the upload of %s to blob %s, so it can't be resumed.  errno = %d, journal = %s.", sourcePath.c_str(), blob.c_str(), errno, journal_path.c_str());
+                        journal_path.clear();
+                    }
                 }
+            }
+
+            std::vector<put_block_list_request_base::block_item> block_list;
+            size_t blocks_sent = 0;
+
+            // Each block is uploaded on the client's transfer workers, taking turns with the blocks and chunks of other files.
+            const size_t streams = parallel == 0 ? m_upload_tuner->streams() : std::min(parallel, static_cast<size_t>(m_concurrency));
+            const auto start = std::chrono::steady_clock::now();
+            scheduled_transfers uploads(m_scheduler, streams);
+            for(long long offset = 0, idx = 0; offset < fileSize; offset += block_size, ++idx)
+            {
                 long long length = block_size;
                 if(offset + length > fileSize)
                 {
                     length = fileSize - offset;
                 }
 
-                char* buffer = (char*)malloc(static_cast<size_t>(block_size)); // This cast is save because block size should always be lower than 4GB
-                if (!buffer) {
-                    result = 12;
-                    break;
-                }
-                if(!ifs.read(buffer, length))
-                {
-                    syslog(LOG_ERR, "Failed to read from input stream in upload_file_to_blob.  sourcePath = %s, container = %s, blob = %s, offset = %lld, length = %d.", sourcePath.c_str(), container.c_str(), blob.c_str(), offset, (int)length);
-                    result = unknown_error;
-                    break;
-                }
                 std::string raw_block_id = std::to_string(idx);
                 //pad the string to length of 6.
                 raw_block_id.insert(raw_block_id.begin(), 12 - raw_block_id.length(), '0');
-                const std::string block_id_un_base64 = raw_block_id + get_uuid();
+                // Block IDs are the same every time the upload is tried, so the journal only needs to keep the part they share.
+                const std::string block_id_un_base64 = raw_block_id + journal.upload_id;
                 const std::string block_id(to_base64(reinterpret_cast<const unsigned char*>(block_id_un_base64.c_str()), block_id_un_base64.size()));
                 put_block_list_request_base::block_item block;
                 block.id = block_id;
                 block.type = put_block_list_request_base::block_type::uncommitted;
                 block_list.push_back(block);
-                auto single_put = std::async(std::launch::async, [block_id, this, buffer, length, &container, &blob, &parallel, &mutex, &cv_mutex, &cv](){
-                        {
-                            std::unique_lock<std::mutex> lk(cv_mutex);
-                            cv.wait(lk, [&parallel, &mutex]() {
-                                    std::lock_guard<std::mutex> lock(mutex);
-                                    if(parallel > 0)
-                                    {
-                                        --parallel;
-                                        return true;
-                                    }
-                                    return false;
-                                });
-                        }
 
-                        std::istringstream in;
-                        in.rdbuf()->pubsetbuf(buffer, length);
-                        const auto blockResult = m_blobClient->upload_block_from_stream(container, blob, block_id, in).get();
-                        free(buffer);
+                const auto staged_block = staged.find(block_id);
+                if(staged_block != staged.end() && staged_block->second == static_cast<unsigned long long>(length))
+                {
+                    continue;
+                }
+                blocks_sent++;
 
+                uploads.submit([this, fd, offset, length, block_id, &sourcePath, &container, &blob](std::function<void(int)> done) {
+                    storage_source source = storage_source::file(fd, static_cast<off_t>(offset), static_cast<size_t>(length)); // This cast is safe because block size should always be lower than 4GB
+                    const auto block_start = std::chrono::steady_clock::now();
+                    m_blobClient->upload_block_from_source(container, blob, block_id, source, [this, source, offset, length, block_start, done, &sourcePath, &container, &blob](const storage_outcome<void> &blockResult) {
+                        if(source.error() != 0)
                         {
-                            std::lock_guard<std::mutex> lock(mutex);
-                            ++parallel;
-                            cv.notify_one();
+                            syslog(LOG_ERR, "Failed to read from the source file in upload_file_to_blob.  errno = %d, sourcePath = %s, container = %s, blob = %s, offset = %lld.", source.error(), sourcePath.c_str(), container.c_str(), blob.c_str(), offset);
+                            done(unknown_error);
+                            return;
                         }
-
-                        int result = 0;
                         if(!blockResult.success())
                         {
-                            // std::cout << blob << " upload failed " << blockResult.error().code << std::endl;
-                            result = std::stoi(blockResult.error().code);
-                            if (0 == result) {
-                                // It seems that timeouted requests has no code setup
-                                result = 503;
-                            }
+                            done(request_error(blockResult.error()));
+                            return;
                         }
-                        return result;
+                        m_upload_tuner->record_request(static_cast<unsigned long long>(length), std::chrono::steady_clock::now() - block_start);
+                        done(0);
                     });
-                task_list.push_back(std::move(single_put));
+                });
             }
-
-            // wait for the rest of tasks
-            for(auto &task: task_list)
+            if(blocks_sent < block_list.size())
             {
-                const auto r = task.get();
-                if(0 == result)
-                {
-                    result = r;
-                }
-            }
-            if (0 != result) {
-                //std::cout << blob << " request failed " << std::endl;
+                syslog(LOG_INFO, "Resuming the upload of %s to blob %s: %d of its %d blocks are already staged.", sourcePath.c_str(), blob.c_str(), static_cast<int>(block_list.size() - blocks_sent), static_cast<int>(block_list.size()));
             }
+            result = uploads.wait();
+
+            blob_property properties(false);
             if(result == 0)
             {
-                const auto r = m_blobClient->put_block_list(container, blob, block_list, metadata).get();
+                const auto r = m_blobClient->put_block_list_sync(container, blob, block_list, metadata);
                 if(!r.success())
                 {
                     result = std::stoi(r.error().code);
@@ -618,10 +1018,26 @@ namespace microsoft_azure {
                         result = unknown_error;
                     }
                 }
+                else
+                {
+                    properties = written_blob_property(r.response(), static_cast<unsigned long long>(fileSize), metadata);
+                    if(blocks_sent == block_list.size())
+                    {
+                        m_upload_tuner->record_transfer(static_cast<unsigned long long>(fileSize), std::chrono::steady_clock::now() - start, std::min(streams, block_list.size()));
+                    }
+                    if(!journal_path.empty())
+                    {
+                        unlink(journal_path.c_str());
+                    }
+                }
+            }
+            if(result != 0 && !journal_path.empty())
+            {
+                syslog(LOG_INFO, "Keeping the journal of the upload of %s to blob %s, to resume it later.  journal = %s.", sourcePath.c_str(), blob.c_str(), journal_path.c_str());
             }
 
-            ifs.close();
             errno = result;
+            return properties;
         }
 
         off_t get_file_size(const char* path)
@@ -666,107 +1082,604 @@ namespace microsoft_azure {
             }
         }
 
-        void blob_client_wrapper::download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel)
+        // A chunk's request has been retried already, but a chunk is still worth a few more tries before giving up on the whole file.
+        const int max_chunk_attempts = 3;
+
+        // Tries once to download one chunk of a download into its file, and calls on_done with 0, EAGAIN if the blob is no longer the version
+        // being downloaded, or the error the try failed with, and whether another try might succeed.  on_done is called on the thread the
+        // request finished on.  The tuner and the download must outlive the request.
+        void download_chunk(blob_client &client, transfer_tuner &tuner, const partial_download &d, int fd, size_t index, std::function<void(int, bool)> on_done)
         {
-            if(!is_valid())
+            const unsigned long long offset = index * d.chunk_size;
+            const unsigned long long range = std::min(d.chunk_size, d.length - offset);
+            storage_sink sink = storage_sink::file(fd, static_cast<off_t>(offset));
+            const auto chunk_start = std::chrono::steady_clock::now();
+            // Only download the version of the blob the first chunk came from, so that a blob changed part way through fails fast.
+            client.get_chunk_to_sink(d.container, d.blob, offset, range, sink, d.etag, [&tuner, &d, sink, offset, range, chunk_start, on_done](const storage_outcome<chunk_property> &chunk) {
+                // Check for any writing errors.
+                if (sink.error() != 0) {
+                    syslog(LOG_ERR, "get_chunk_to_sink failed to write in download_blob_to_file.  container = %s, blob = %s, path = %s, offset = %llu, range = %llu, write errno = %d.", d.container.c_str(), d.blob.c_str(), d.path.c_str(), offset, range, sink.error());
+                    on_done(unknown_error, false);
+                    return;
+                }
+                if (chunk.success())
+                {
+                    tuner.record_request(range, std::chrono::steady_clock::now() - chunk_start);
+                    on_done(0, false);
+                    return;
+                }
+                // The blob has been changed, or replaced by a smaller one - ask user to retry.
+                if (constants::code_precondition_failed == chunk.error().code || constants::code_request_range_not_satisfiable == chunk.error().code) {
+                    on_done(EAGAIN, false);
+                    return;
+                }
+                const int code = request_error(chunk.error());
+                on_done(code, retryable(code));
+            });
+        }
+
+        void log_chunk_retry(const partial_download &d, size_t index, int error, int attempt)
+        {
+            const unsigned long long offset = index * d.chunk_size;
+            syslog(LOG_WARNING, "Retrying a chunk of blob %s after error %d.  offset = %llu, range = %llu, attempt = %d.", d.blob.c_str(), error, offset, std::min(d.chunk_size, d.length - offset), attempt);
+        }
+
+        // A download running on the client's transfer workers.  A transfer is queued for each chunk still to download, and each downloads
+        // whichever chunk is wanted soonest when it gets to run: first those readers are waiting on, then the rest in order.  Nobody is waiting
+        // on the rest yet, so their requests are background ones, and give way to those somebody is.  A worker only starts a chunk's request;
+        // the request's callback ends the transfer.  The last of them to end queues a transfer to finish the download.
+        class background_download : public download_progress, public std::enable_shared_from_this<background_download>
+        {
+        public:
+            background_download(std::shared_ptr<blob_client> client, std::shared_ptr<transfer_tuner> tuner, std::shared_ptr<partial_download_store> store, std::unique_ptr<partial_download> download, int fd, const std::string &destPath, bool resumed, std::function<void(int, time_t)> on_finished)
+                : m_client(client),
+                m_tuner(tuner),
+                m_store(store),
+                m_download(std::move(download)),
+                m_fd(fd),
+                m_dest_path(destPath),
+                m_path(m_download->path),
+                m_length(m_download->length),
+                m_chunk_size(m_download->chunk_size),
+                m_last_modified(m_download->last_modified),
+                m_resumed(resumed),
+                m_on_finished(on_finished),
+                m_start(std::chrono::steady_clock::now()),
+                m_scheduler(nullptr),
+                m_flow(0),
+                m_done(m_download->done),
+                m_started(m_download->done),
+                m_next(0),
+                m_transfers(0),
+                m_streams(0),
+                m_error(0),
+                m_all_wanted(false),
+                m_cancelled(false),
+                m_finishing(false),
+                m_finished(false)
             {
-                errno = client_not_init;
-                return;
             }
 
-            const size_t downloaders = std::min(parallel, static_cast<size_t>(m_concurrency));
-            storage_outcome<chunk_property> firstChunk;
-            try
+            background_download(const background_download &) = delete;
+            background_download &operator=(const background_download &) = delete;
+
+            const std::string &path() const override
             {
-                // Download the first chunk of the blob. The response will contain required blob metadata as well.
-                int errcode = 0;
-                std::ofstream os(destPath.c_str(), std::ofstream::binary | std::ofstream::out);
-                firstChunk = m_blobClient->get_chunk_to_stream_sync(container, blob, 0, DOWNLOAD_CHUNK_SIZE, os);
-                os.close();
-                if (!os) {
-                    syslog(LOG_ERR, "get_chunk_to_stream_async failed for firstchunk in download_blob_to_file.  container = %s, blob = %s, destPath = %s.", container.c_str(), blob.c_str(), destPath.c_str());
-                    errno = unknown_error;
-                    return;
+                return m_path;
+            }
+
+            unsigned long long length() const override
+            {
+                return m_length;
+            }
+
+            time_t last_modified() const override
+            {
+                return m_last_modified;
+            }
+
+            int wait_for_range(unsigned long long offset, unsigned long long size) override
+            {
+                if (size == 0 || offset >= m_length)
+                {
+                    return 0;
                 }
-                if (!firstChunk.success())
+                const size_t first = static_cast<size_t>(offset / m_chunk_size);
+                const size_t last = static_cast<size_t>((std::min(offset + size, m_length) - 1) / m_chunk_size);
+
+                std::unique_lock<std::mutex> lock(m_mutex);
+                // Have the chunks that haven't been started on downloaded next, in order.
+                for (size_t index = last + 1; index-- > first; )
                 {
-                    if (constants::code_request_range_not_satisfiable != firstChunk.error().code) {
-                        errno = std::stoi(firstChunk.error().code);
-                        return;
+                    if (!m_started[index])
+                    {
+                        m_wanted.push_front(index);
                     }
-                    // The only reason for constants::code_request_range_not_satisfiable on the first chunk is zero
-                    // blob size, so proceed as there is no error.
                 }
-                // Smoke check if the total size is known, otherwise - fail.
-                if (firstChunk.response().totalSize < 0) {
-                    errno = blob_no_content_range;
+                m_cv.wait(lock, [this, first, last]() { return m_error != 0 || range_done(first, last); });
+                return range_done(first, last) ? 0 : m_error;
+            }
+
+            int wait() override
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                // Chunks already started in the background stay there; the rest are waited on.
+                m_all_wanted = true;
+                m_cv.wait(lock, [this]() { return m_finished; });
+                return m_error;
+            }
+
+            bool finished() override
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                return m_finished;
+            }
+
+            void cancel() override
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (m_finishing)
+                {
+                    // The file is in place already, and all that is left is quick, but it must be done before anything else touches the file.
+                    m_cv.wait(lock, [this]() { return m_finished; });
+                    return;
+                }
+                if (m_cancelled)
+                {
+                    return;
+                }
+                m_cancelled = true;
+                if (m_error == 0)
+                {
+                    m_error = ECANCELED;
+                }
+                if (m_store == nullptr)
+                {
+                    // The chunks still being downloaded write straight into the destination, so take it away now, leaving them writing to a
+                    // file nobody can open, and the path free for a new one.  Otherwise they write into a file of the store's, which finish discards.
+                    unlink(m_dest_path.c_str());
+                }
+                lock.unlock();
+                // Readers waiting on chunks that will never come.
+                m_cv.notify_all();
+            }
+
+            // Has every chunk downloaded as one a reader is waiting on, for a caller that will wait for the whole file.  Call before start.
+            void want_all()
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_all_wanted = true;
+            }
+
+            // Queues a transfer on the scheduler for each chunk still to download, or finishes the download if there are none.
+            void start(transfer_scheduler &scheduler, size_t streams)
+            {
+                size_t chunks;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    chunks = static_cast<size_t>(std::count(m_started.begin(), m_started.end(), 0));
+                    m_transfers = chunks;
+                    m_streams = std::min(streams, chunks);
+                }
+                if (chunks == 0)
+                {
+                    finish();
                     return;
                 }
 
-                // Get required metadata - etag to verify all future chunks and the total blob size.
-                const auto originalEtag = firstChunk.response().etag;
-                const auto length = static_cast<unsigned long long>(firstChunk.response().totalSize);
+                std::shared_ptr<background_download> self = shared_from_this();
+                m_scheduler = &scheduler;
+                m_flow = scheduler.open_flow(streams);
+                for (size_t i = 0; i < chunks; i++)
+                {
+                    scheduler.submit_async(m_flow, [self](std::function<void(int)> done) {
+                        self->download_next_chunk(done);
+                    });
+                }
+                scheduler.close_flow(m_flow);
+            }
 
-                // Create or resize the target file if already exist.
-                create_or_resize_file(destPath, length);
+        private:
+            // Must be called with m_mutex held.
+            bool range_done(size_t first, size_t last) const
+            {
+                return std::find(m_done.begin() + first, m_done.begin() + last + 1, 0) == m_done.begin() + last + 1;
+            }
 
-                // Download the rest.
-                const auto left = length - firstChunk.response().size;
-                const auto chunk_size = std::max(DOWNLOAD_CHUNK_SIZE, (left + downloaders - 1)/ downloaders);
-                std::vector<std::future<int>> task_list;
-                for(unsigned long long offset = firstChunk.response().size; offset < length; offset += chunk_size)
+            // Picks the next chunk to download, marks it started, and says whether a reader is waiting on it.  Must be called with m_mutex held.
+            bool next_chunk(size_t &index, bool &wanted)
+            {
+                wanted = true;
+                while (!m_wanted.empty())
                 {
-                    const auto range = std::min(chunk_size, length - offset);
-                    auto single_download = std::async(std::launch::async, [originalEtag, offset, range, this, &destPath, &container, &blob](){
-                            // Note, keep std::ios_base::in to prevent truncating of the file.
-                            std::ofstream output(destPath.c_str(), std::ios_base::out |  std::ios_base::in);
-                            output.seekp(offset);
-                            auto chunk = m_blobClient->get_chunk_to_stream_sync(container, blob, offset, range, output);
-                            output.close();
-                            if(!chunk.success())
+                    index = m_wanted.front();
+                    m_wanted.pop_front();
+                    if (!m_started[index])
+                    {
+                        m_started[index] = 1;
+                        return true;
+                    }
+                }
+                wanted = m_all_wanted;
+                while (m_next < m_started.size() && m_started[m_next])
+                {
+                    m_next++;
+                }
+                if (m_next == m_started.size())
+                {
+                    return false;
+                }
+                index = m_next;
+                m_started[index] = 1;
+                return true;
+            }
+
+            void download_next_chunk(std::function<void(int)> done)
+            {
+                size_t index = 0;
+                bool wanted = false;
+                bool download;
+                {
+                    // Once a chunk has failed, the download has, so those not yet started are skipped.
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    download = m_error == 0 && next_chunk(index, wanted);
+                }
+                if (download)
+                {
+                    download_chunk_attempt(index, 1, wanted, done);
+                }
+                else
+                {
+                    end_transfer(done);
+                }
+            }
+
+            void download_chunk_attempt(size_t index, int attempt, bool wanted, std::function<void(int)> done)
+            {
+                std::shared_ptr<background_download> self = shared_from_this();
+                request_priority_scope scope(wanted ? request_priority::foreground : request_priority::background);
+                try
+                {
+                    download_chunk(*m_client, *m_tuner, *m_download, m_fd, index, [self, index, attempt, wanted, done](int result, bool retry) {
+                        self->chunk_ended(index, attempt, wanted, result, retry, done);
+                    });
+                }
+                catch(std::exception& ex)
+                {
+                    syslog(LOG_ERR, "Unknown failure in download_blob_to_file.  ex.what() = %s, container = %s, blob = %s, destPath = %s.", ex.what(), m_download->container.c_str(), m_download->blob.c_str(), m_dest_path.c_str());
+                    chunk_ended(index, attempt, wanted, unknown_error, false, done);
+                }
+            }
+
+            // Called once a try at a chunk is over, usually on the curl engine's loop thread.
+            void chunk_ended(size_t index, int attempt, bool wanted, int result, bool retry, std::function<void(int)> done)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (result != 0 && retry && attempt < max_chunk_attempts && m_error == 0)
+                    {
+                        // Starting a request may wait for a handle, which must not be done on a loop thread, so the next try is a transfer of its
+                        // own, queued before this one ends so that the flow is still open.
+                        log_chunk_retry(*m_download, index, result, attempt);
+                        m_transfers++;
+                        std::shared_ptr<background_download> self = shared_from_this();
+                        m_scheduler->submit_async(m_flow, [self, index, attempt, wanted](std::function<void(int)> next) {
+                            self->download_chunk_attempt(index, attempt + 1, wanted, next);
+                        });
+                    }
+                    else if (result == 0)
+                    {
+                        m_done[index] = 1;
+                    }
+                    else if (m_error == 0)
+                    {
+                        m_error = result;
+                    }
+                }
+                m_cv.notify_all();
+                end_transfer(done);
+            }
+
+            void end_transfer(std::function<void(int)> done)
+            {
+                bool last;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    last = --m_transfers == 0;
+                }
+                if (last)
+                {
+                    // Moving the file and calling on_finished may wait on the caller's locks, which must not be done on a loop thread either.
+                    std::shared_ptr<background_download> self = shared_from_this();
+                    m_scheduler->submit(m_flow, [self]() {
+                        self->finish();
+                        return 0;
+                    });
+                }
+                done(0);
+            }
+
+            // Moves the file into place, or keeps what was downloaded to resume later, once every chunk's transfer has ended.
+            void finish()
+            {
+                close(m_fd);
+                int error;
+                {
+                    // Holding the lock while the file is moved, so that a cancel comes either before it, and nothing is moved, or after.
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_finishing = true;
+                    error = m_error;
+                    m_download->done = m_done;
+                    if (m_store != nullptr)
+                    {
+                        if (error == 0 && rename(m_path.c_str(), m_dest_path.c_str()) != 0)
+                        {
+                            syslog(LOG_ERR, "Failed to move the downloaded blob %s from %s to %s.  errno = %d.", m_download->blob.c_str(), m_path.c_str(), m_dest_path.c_str(), errno);
+                            error = unknown_error;
+                            m_store->discard(*m_download);
+                        }
+                        else if (error == EAGAIN || m_cancelled)
+                        {
+                            // What was downloaded is of an older version of the blob, or no longer wanted.
+                            m_store->discard(*m_download);
+                        }
+                        else if (error != 0)
+                        {
+                            syslog(LOG_INFO, "Keeping %d of %d chunks of blob %s to resume its download into %s later.", static_cast<int>(m_download->chunks_done()), static_cast<int>(m_download->done.size()), m_download->blob.c_str(), m_dest_path.c_str());
+                            m_store->keep(m_dest_path, std::move(m_download));
+                        }
+                    }
+                    // A cancelled download straight into the destination has had it removed already, and the path may be another file's by now.
+                }
+
+                if (error == 0 && !m_resumed && m_streams > 0)
+                {
+                    m_tuner->record_transfer(m_length, std::chrono::steady_clock::now() - m_start, m_streams);
+                }
+                if (m_on_finished)
+                {
+                    m_on_finished(error, m_last_modified);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_error = error;
+                    m_finished = true;
+                }
+                m_cv.notify_all();
+            }
+
+            const std::shared_ptr<blob_client> m_client;
+            const std::shared_ptr<transfer_tuner> m_tuner;
+            const std::shared_ptr<partial_download_store> m_store; // Null if the data goes straight into the destination.
+            std::unique_ptr<partial_download> m_download; // Only changed by finish; chunk transfers only read what doesn't change.
+            const int m_fd;
+            const std::string m_dest_path;
+            const std::string m_path;
+            const unsigned long long m_length;
+            const unsigned long long m_chunk_size;
+            const time_t m_last_modified;
+            const bool m_resumed;
+            const std::function<void(int, time_t)> m_on_finished;
+            const std::chrono::steady_clock::time_point m_start;
+            transfer_scheduler *m_scheduler; // Set by start.  Runs every transfer queued on it, and waits for them to end, before it is destroyed.
+            unsigned long long m_flow; // Closed once the first transfers are queued; still open to them until the last has ended.
+
+            std::vector<char> m_done; // Whether each chunk is in the file, by index.
+            std::vector<char> m_started; // Whether each chunk is in the file or being downloaded, by index.
+            std::deque<size_t> m_wanted; // Chunks readers are waiting on, soonest wanted first.  May hold chunks since started.
+            size_t m_next; // No chunk before this one is still to be started, unless it is wanted.
+            size_t m_transfers; // The chunk transfers queued or running.
+            size_t m_streams; // The most chunks the download has had in flight.
+            int m_error; // The first error a chunk failed with, or ECANCELED.
+            bool m_all_wanted; // Someone is waiting for the whole file, so no chunk is only prefetched.
+            bool m_cancelled;
+            bool m_finishing;
+            bool m_finished;
+            std::mutex m_mutex;
+            std::condition_variable m_cv;
+        };
+
+        void blob_client_wrapper::download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel)
+        {
+            std::shared_ptr<download_progress> download = start_download(container, blob, destPath, nullptr, parallel, true);
+            if (download == nullptr)
+            {
+                // errno already set by start_download
+                return;
+            }
+            const int errcode = download->wait();
+            if (errcode == 0)
+            {
+                returned_last_modified = download->last_modified();
+            }
+            errno = errcode;
+        }
+
+        std::shared_ptr<download_progress> blob_client_wrapper::start_download_blob_to_file(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished, size_t parallel)
+        {
+            return start_download(container, blob, destPath, on_finished, parallel, false);
+        }
+
+        std::shared_ptr<download_progress> blob_client_wrapper::start_download(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished, size_t parallel, bool wait_for_all)
+        {
+            if(!is_valid())
+            {
+                errno = client_not_init;
+                return nullptr;
+            }
+
+            const size_t downloaders = parallel == 0 ? m_download_tuner->streams() : std::min(parallel, static_cast<size_t>(m_concurrency));
+
+            // Every chunk is written straight into the file at its offset, through this one descriptor.  With a partial download directory,
+            // the file is one of its own there, and is only moved to destPath once complete.
+            int fd = -1;
+            std::unique_ptr<partial_download> download;
+            bool resumed = false;
+            if (m_partial_downloads != nullptr)
+            {
+                download = m_partial_downloads->take(destPath, container, blob);
+                if (download != nullptr)
+                {
+                    fd = open(download->path.c_str(), O_WRONLY);
+                    if (fd == -1)
+                    {
+                        syslog(LOG_WARNING, "Failed to reopen %s to resume the download of blob %s; starting again.  errno = %d.", download->path.c_str(), blob.c_str(), errno);
+                        m_partial_downloads->discard(*download);
+                        download.reset();
+                    }
+                    else
+                    {
+                        resumed = true;
+                        syslog(LOG_INFO, "Resuming the download of blob %s into %s, with %d of %d chunks already done.", blob.c_str(), destPath.c_str(), static_cast<int>(download->chunks_done()), static_cast<int>(download->done.size()));
+                    }
+                }
+                if (download == nullptr)
+                {
+                    download = m_partial_downloads->create(container, blob, fd);
+                }
+            }
+            else
+            {
+                download.reset(new partial_download());
+                download->container = container;
+                download->blob = blob;
+                download->path = destPath;
+                fd = open(destPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            }
+            if (fd == -1)
+            {
+                syslog(LOG_ERR, "Failed to open a file to download blob %s into.  errno = %d, destPath = %s.", blob.c_str(), errno, destPath.c_str());
+                errno = unknown_error;
+                return nullptr;
+            }
+
+            int errcode = 0;
+            try
+            {
+                if (!resumed)
+                {
+                    // Download the first chunk of the blob. The response will contain required blob metadata as well.
+                    const unsigned long long chunk_size = m_download_tuner->block_size();
+                    storage_sink first_sink = storage_sink::file(fd, 0);
+                    storage_outcome<chunk_property> firstChunk;
+                    errcode = run_scheduled(m_scheduler, [&](std::function<void(int)> done) {
+                        const auto request_start = std::chrono::steady_clock::now();
+                        m_blobClient->get_chunk_to_sink(container, blob, 0, chunk_size, first_sink, std::string(), [&, request_start, done](const storage_outcome<chunk_property> &chunk) {
+                            firstChunk = chunk;
+                            if (first_sink.error() == 0 && firstChunk.success()) {
+                                m_download_tuner->record_request(static_cast<unsigned long long>(firstChunk.response().size), std::chrono::steady_clock::now() - request_start);
+                            }
+                            if (first_sink.error() != 0) {
+                                syslog(LOG_ERR, "get_chunk_to_sink failed to write the first chunk in download_blob_to_file.  container = %s, blob = %s, destPath = %s, write errno = %d.", container.c_str(), blob.c_str(), destPath.c_str(), first_sink.error());
+                                done(unknown_error);
+                            }
+                            else if (!firstChunk.success() && constants::code_request_range_not_satisfiable != firstChunk.error().code)
                             {
-                                // Looks like the blob has been replaced by smaller one - ask user to retry.
-                                if (constants::code_request_range_not_satisfiable == chunk.error().code) {
-                                    return EAGAIN;
-                                }
-                                return std::stoi(chunk.error().code);
+                                done(request_error(firstChunk.error()));
                             }
-                            // The etag has been changed - ask user to retry.
-                            if (originalEtag != chunk.response().etag) {
-                                return EAGAIN;
+                            // The only reason for constants::code_request_range_not_satisfiable on the first chunk is zero
+                            // blob size, so proceed as there is no error.
+                            // Smoke check if the total size is known, otherwise - fail.
+                            else if (firstChunk.response().totalSize < 0) {
+                                done(blob_no_content_range);
                             }
-                            // Check for any writing errors.
-                            if (!output) {
-                                syslog(LOG_ERR, "get_chunk_to_stream_async failure in download_blob_to_file.  container = %s, blob = %s, destPath = %s, offset = %llu, range = %llu.", container.c_str(), blob.c_str(), destPath.c_str(), offset, range);
-                                return unknown_error;
+                            else {
+                                done(0);
                             }
-                            return 0;
                         });
-                    task_list.push_back(std::move(single_download));
-                }
+                    });
 
-                // Wait for workers to complete downloading.
-                for(size_t i = 0; i < task_list.size(); ++i)
+                    if (errcode == 0)
+                    {
+                        // Get required metadata - etag to pin all future chunks to, and the total blob size.
+                        // Header values keep the "\r\n" that ends them, which would end the If-Match header early.
+                        download->etag = firstChunk.response().etag;
+                        download->etag.erase(download->etag.find_last_not_of("\r\n") + 1);
+                        download->length = static_cast<unsigned long long>(firstChunk.response().totalSize);
+                        download->chunk_size = chunk_size;
+                        download->last_modified = firstChunk.response().last_modified;
+                        download->done.assign(static_cast<size_t>((download->length + chunk_size - 1) / chunk_size), 0);
+                        if (!download->done.empty() && firstChunk.response().size == std::min(chunk_size, download->length))
+                        {
+                            download->done[0] = 1;
+                        }
+
+                        // Resize the target file to the blob's size.
+                        if (ftruncate(fd, static_cast<off_t>(download->length)) != 0) {
+                            syslog(LOG_ERR, "Failed to resize %s to %llu bytes in download_blob_to_file.  errno = %d.", download->path.c_str(), download->length, errno);
+                            errcode = unknown_error;
+                        }
+                    }
+                }
+                else
                 {
-                    task_list[i].wait();
-                    auto result = task_list[i].get();
-                    // let's report the first encountered error for consistency.
-                    if (0 != result && errcode == 0) 
+                    // Before picking up where the last download left off, make sure the blob is still the version it was of, by downloading
+                    // the first chunk still missing.
+                    const size_t index = static_cast<size_t>(std::find(download->done.begin(), download->done.end(), 0) - download->done.begin());
+                    if (index < download->done.size())
                     {
-                        errcode = result;
+                        for (int attempt = 1; ; attempt++)
+                        {
+                            bool retry = false;
+                            errcode = run_scheduled(m_scheduler, [&](std::function<void(int)> done) {
+                                download_chunk(*m_blobClient, *m_download_tuner, *download, fd, index, [&retry, done](int result, bool can_retry) {
+                                    retry = can_retry;
+                                    done(result);
+                                });
+                            });
+                            if (errcode == 0 || !retry || attempt >= max_chunk_attempts)
+                            {
+                                break;
+                            }
+                            log_chunk_retry(*download, index, errcode, attempt);
+                        }
+                        if (errcode == 0)
+                        {
+                            download->done[index] = 1;
+                        }
                     }
                 }
-                errno = errcode;
             }
             catch(std::exception& ex)
             {
                 syslog(LOG_ERR, "Unknown failure in download_blob_to_file.  ex.what() = %s, container = %s, blob = %s, destPath = %s.", ex.what(), container.c_str(), blob.c_str(), destPath.c_str());
-                errno = unknown_error;
-                return;
+                errcode = unknown_error;
+            }
+
+            if (errcode != 0)
+            {
+                close(fd);
+                if (m_partial_downloads != nullptr)
+                {
+                    if (resumed && errcode != EAGAIN)
+                    {
+                        syslog(LOG_INFO, "Keeping %d of %d chunks of blob %s to resume its download into %s later.", static_cast<int>(download->chunks_done()), static_cast<int>(download->done.size()), blob.c_str(), destPath.c_str());
+                        m_partial_downloads->keep(destPath, std::move(download));
+                    }
+                    else
+                    {
+                        m_partial_downloads->discard(*download);
+                    }
+                    if (resumed && errcode == EAGAIN)
+                    {
+                        // What was downloaded is of an older version of the blob, and no use.
+                        syslog(LOG_INFO, "Blob %s has changed since its download into %s started; starting again.", blob.c_str(), destPath.c_str());
+                        return start_download(container, blob, destPath, on_finished, parallel, wait_for_all);
+                    }
+                }
+                errno = errcode;
+                return nullptr;
             }
 
-            returned_last_modified = firstChunk.response().last_modified;
-            return;
+            // Download the rest.  The chunks are downloaded on the client's transfer workers, taking turns with the blocks and chunks of other files.
+            auto progress = std::make_shared<background_download>(m_blobClient, m_download_tuner, m_partial_downloads, std::move(download), fd, destPath, resumed, on_finished);
+            if (wait_for_all)
+            {
+                progress->want_all();
+            }
+            progress->start(*m_scheduler, downloaders);
+            errno = 0;
+            return progress;
         }
 
         blob_property blob_client_wrapper::get_blob_property(const std::string &container, const std::string &blob)
@@ -0,0 +1,207 @@
+#include "blob/compact_blob_property.h"
+
+#include <cstring>
+#include <limits>
+
+namespace microsoft_azure {
+    namespace storage {
+
+        namespace {
+            const std::string empty_string;
+
+            void append_to_arena(char *&cursor, const char *data, size_t length)
+            {
+                if (length == 0)
+                {
+                    return;
+                }
+                memcpy(cursor, data, length);
+                cursor += length;
+            }
+
+            void append_length_prefixed(char *&cursor, const std::string &value)
+            {
+                uint32_t length = static_cast<uint32_t>(value.size());
+                append_to_arena(cursor, reinterpret_cast<const char *>(&length), sizeof(length));
+                append_to_arena(cursor, value.data(), value.size());
+            }
+
+            std::string read_length_prefixed(const char *&cursor)
+            {
+                uint32_t length;
+                memcpy(&length, cursor, sizeof(length));
+                cursor += sizeof(length);
+                std::string value(cursor, length);
+                cursor += length;
+                return value;
+            }
+        }
+
+        const std::string *string_intern_pool::intern(const std::string &value)
+        {
+            if (value.empty())
+            {
+                return &empty_string;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto iter = m_index.find(value);
+            if (iter != m_index.end())
+            {
+                return iter->second;
+            }
+            m_strings.push_back(value);
+            const std::string *pooled_value = &m_strings.back();
+            m_index.emplace(value, pooled_value);
+            return pooled_value;
+        }
+
+        size_t string_intern_pool::size()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_strings.size();
+        }
+
+        bool compact_blob_property::assign(blob_property &props, string_intern_pool &pool)
+        {
+            // The lengths are held in 16 bits, and metadata lengths in 32.  Nothing the service returns comes near either, but a record that
+            // can't hold its values must not pretend to; leave it invalid and let the caller go back to the service.
+            const size_t max_length = std::numeric_limits<uint16_t>::max();
+            bool fits = props.etag.size() <= max_length && props.content_md5.size() <= max_length && props.cache_control.size() <= max_length
+                && props.content_disposition.size() <= max_length && props.metadata.size() <= max_length;
+            for (size_t i = 0; fits && i < props.metadata.size(); i++)
+            {
+                fits = props.metadata[i].first.size() <= std::numeric_limits<uint32_t>::max() && props.metadata[i].second.size() <= std::numeric_limits<uint32_t>::max();
+            }
+            if (!fits)
+            {
+                *this = compact_blob_property();
+                return false;
+            }
+
+            m_valid = props.valid();
+            m_size = props.size;
+            m_last_modified = static_cast<int64_t>(props.last_modified);
+
+            m_content_encoding = pool.intern(props.content_encoding);
+            m_content_language = pool.intern(props.content_language);
+            m_content_type = pool.intern(props.content_type);
+            m_copy_status = pool.intern(props.copy_status);
+
+            m_etag_length = static_cast<uint16_t>(props.etag.size());
+            m_content_md5_length = static_cast<uint16_t>(props.content_md5.size());
+            m_cache_control_length = static_cast<uint16_t>(props.cache_control.size());
+            m_content_disposition_length = static_cast<uint16_t>(props.content_disposition.size());
+            m_metadata_count = static_cast<uint16_t>(props.metadata.size());
+
+            // Size the arena for everything that doesn't fit in the fixed-width fields, and lay it out in a single pass.
+            size_t arena_size = 0;
+            if (m_etag_length > inline_etag_capacity)
+            {
+                arena_size += m_etag_length;
+            }
+            if (m_content_md5_length > inline_content_md5_capacity)
+            {
+                arena_size += m_content_md5_length;
+            }
+            arena_size += m_cache_control_length + m_content_disposition_length;
+            for (size_t i = 0; i < props.metadata.size(); i++)
+            {
+                arena_size += 2 * sizeof(uint32_t) + props.metadata[i].first.size() + props.metadata[i].second.size();
+            }
+
+            m_arena.reset(arena_size > 0 ? new char[arena_size] : nullptr);
+            char *cursor = m_arena.get();
+
+            if (m_etag_length > inline_etag_capacity)
+            {
+                append_to_arena(cursor, props.etag.data(), m_etag_length);
+            }
+            else
+            {
+                memcpy(m_etag, props.etag.data(), m_etag_length);
+            }
+
+            if (m_content_md5_length > inline_content_md5_capacity)
+            {
+                append_to_arena(cursor, props.content_md5.data(), m_content_md5_length);
+            }
+            else
+            {
+                memcpy(m_content_md5, props.content_md5.data(), m_content_md5_length);
+            }
+
+            append_to_arena(cursor, props.cache_control.data(), m_cache_control_length);
+            append_to_arena(cursor, props.content_disposition.data(), m_content_disposition_length);
+
+            for (size_t i = 0; i < props.metadata.size(); i++)
+            {
+                append_length_prefixed(cursor, props.metadata[i].first);
+                append_length_prefixed(cursor, props.metadata[i].second);
+            }
+            return true;
+        }
+
+        blob_property compact_blob_property::to_blob_property() const
+        {
+            blob_property props(m_valid);
+            if (!m_valid)
+            {
+                return props;
+            }
+
+            props.size = m_size;
+            props.last_modified = static_cast<time_t>(m_last_modified);
+
+            props.content_encoding = pooled(m_content_encoding);
+            props.content_language = pooled(m_content_language);
+            props.content_type = pooled(m_content_type);
+            props.copy_status = pooled(m_copy_status);
+
+            props.etag.assign(etag_data(), m_etag_length);
+            props.content_md5.assign(content_md5_data(), m_content_md5_length);
+
+            const char *cursor = m_arena.get();
+            if (m_etag_length > inline_etag_capacity)
+            {
+                cursor += m_etag_length;
+            }
+            if (m_content_md5_length > inline_content_md5_capacity)
+            {
+                cursor += m_content_md5_length;
+            }
+            props.cache_control.assign(cursor, m_cache_control_length);
+            cursor += m_cache_control_length;
+            props.content_disposition.assign(cursor, m_content_disposition_length);
+            cursor += m_content_disposition_length;
+            props.metadata.reserve(m_metadata_count);
+            for (uint16_t i = 0; i < m_metadata_count; i++)
+            {
+                std::string key = read_length_prefixed(cursor);
+                std::string value = read_length_prefixed(cursor);
+                props.metadata.push_back(std::make_pair(std::move(key), std::move(value)));
+            }
+
+            return props;
+        }
+
+        const std::string &compact_blob_property::pooled(const std::string *value)
+        {
+            return value != nullptr ? *value : empty_string;
+        }
+
+        const char *compact_blob_property::etag_data() const
+        {
+            return m_etag_length > inline_etag_capacity ? m_arena.get() : m_etag;
+        }
+
+        const char *compact_blob_property::content_md5_data() const
+        {
+            if (m_content_md5_length <= inline_content_md5_capacity)
+            {
+                return m_content_md5;
+            }
+            return m_arena.get() + (m_etag_length > inline_etag_capacity ? m_etag_length : 0);
+        }
+    }
+}
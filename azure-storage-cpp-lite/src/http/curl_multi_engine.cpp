@@ -0,0 +1,457 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "http/curl_multi_engine.h"
+
+namespace microsoft_azure {
+    namespace storage {
+
+        // One event-loop thread: a multi handle, the epoll instance watching its sockets, the transfers it is running, and its timers.
+        // Everything but the incoming queue and the stop flag is only touched from the loop thread, so the multi handle is never shared between threads.
+        // Work reaches the loop as timed tasks; starting a transfer is just a task due straight away.
+        class curl_multi_engine::loop
+        {
+        public:
+            loop() : m_multi(nullptr), m_epoll(-1), m_wakeup(-1), m_mutex(), m_incoming(), m_stopping(false),
+                m_delayed(), m_active(), m_curl_deadline(), m_has_curl_deadline(false)
+            {
+            }
+
+            ~loop()
+            {
+                if (m_multi != nullptr)
+                {
+                    curl_multi_cleanup(m_multi);
+                }
+                if (m_wakeup >= 0)
+                {
+                    close(m_wakeup);
+                }
+                if (m_epoll >= 0)
+                {
+                    close(m_epoll);
+                }
+            }
+
+            bool open()
+            {
+                m_epoll = epoll_create1(EPOLL_CLOEXEC);
+                m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                m_multi = curl_multi_init();
+                if (m_epoll < 0 || m_wakeup < 0 || m_multi == nullptr)
+                {
+                    syslog(LOG_ERR, "Failed to set up a curl event loop.  errno = %d.", errno);
+                    return false;
+                }
+
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.fd = m_wakeup;
+                if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &ev) != 0)
+                {
+                    syslog(LOG_ERR, "Failed to set up a curl event loop.  errno = %d.", errno);
+                    return false;
+                }
+
+                curl_multi_setopt(m_multi, CURLMOPT_SOCKETFUNCTION, on_socket);
+                curl_multi_setopt(m_multi, CURLMOPT_SOCKETDATA, this);
+                curl_multi_setopt(m_multi, CURLMOPT_TIMERFUNCTION, on_timer);
+                curl_multi_setopt(m_multi, CURLMOPT_TIMERDATA, this);
+                return true;
+            }
+
+            // Runs the task on the loop thread once the delay has passed.
+            void post(std::chrono::milliseconds delay, std::function<void()> fn)
+            {
+                task t;
+                t.due = clock::now() + delay;
+                t.fn = std::move(fn);
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_incoming.push(std::move(t));
+                }
+                wake();
+            }
+
+            // The transfers made for one request: usually just the one, but a hedged request may have a duplicate racing it.
+            // The group finishes when one of its transfers succeeds, or when the last one fails, and any still running are then dropped.
+            struct group
+            {
+                group() : running(), owned(), make_hedge(), on_done(), done(false)
+                {
+                }
+
+                std::vector<CURL *> running; // Handles of the group in the multi handle.
+                std::vector<CURL *> owned; // Duplicates made for hedging, cleaned up when the group finishes.
+                std::function<CURL *()> make_hedge;
+                std::function<void(CURL *, CURLcode)> on_done;
+                bool done;
+            };
+
+            // Adds a handle of the group to the multi handle.  Only called on the loop thread.
+            void start(CURL *handle, const std::shared_ptr<group> &g)
+            {
+                CURLMcode code = curl_multi_add_handle(m_multi, handle);
+                if (code != CURLM_OK)
+                {
+                    syslog(LOG_ERR, "Failed to start a request on a curl event loop.  curl_multi_add_handle returned %d.", static_cast<int>(code));
+                    if (g->running.empty())
+                    {
+                        finish(g, handle, CURLE_FAILED_INIT);
+                    }
+                    return;
+                }
+                g->running.push_back(handle);
+                m_active[handle] = g;
+            }
+
+            // Starts the group's duplicate transfer, if it is still running and still wants one.  Only called on the loop thread.
+            void hedge(const std::shared_ptr<group> &g)
+            {
+                if (g->done || !g->make_hedge)
+                {
+                    return;
+                }
+                CURL *duplicate = g->make_hedge();
+                if (duplicate == nullptr)
+                {
+                    return;
+                }
+                g->owned.push_back(duplicate);
+                start(duplicate, g);
+            }
+
+            void stop()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_stopping = true;
+                }
+                wake();
+            }
+
+            void run()
+            {
+                const int max_events = 64;
+                struct epoll_event events[max_events];
+                while (true)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        if (m_stopping)
+                        {
+                            break;
+                        }
+                    }
+
+                    int count = epoll_wait(m_epoll, events, max_events, next_timeout_ms());
+                    if (count < 0 && errno != EINTR)
+                    {
+                        syslog(LOG_ERR, "epoll_wait failed in a curl event loop.  errno = %d.", errno);
+                    }
+
+                    int running_handles = 0;
+                    for (int i = 0; i < count; i++)
+                    {
+                        if (events[i].data.fd == m_wakeup)
+                        {
+                            uint64_t ignored;
+                            while (read(m_wakeup, &ignored, sizeof(ignored)) > 0)
+                            {
+                            }
+                            continue;
+                        }
+                        int flags = 0;
+                        if (events[i].events & EPOLLIN)
+                        {
+                            flags |= CURL_CSELECT_IN;
+                        }
+                        if (events[i].events & EPOLLOUT)
+                        {
+                            flags |= CURL_CSELECT_OUT;
+                        }
+                        if (events[i].events & (EPOLLERR | EPOLLHUP))
+                        {
+                            flags |= CURL_CSELECT_ERR;
+                        }
+                        curl_multi_socket_action(m_multi, events[i].data.fd, flags, &running_handles);
+                    }
+
+                    if (m_has_curl_deadline && clock::now() >= m_curl_deadline)
+                    {
+                        // curl may ask for a new timeout while handling this one, so clear the old one first.
+                        m_has_curl_deadline = false;
+                        curl_multi_socket_action(m_multi, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+                    }
+
+                    take_incoming();
+                    run_due();
+                    finish_done();
+                }
+
+                // Nothing should be left running when the engine is stopped, but if anything is, give the handles back before dropping it.
+                for (auto iter = m_active.begin(); iter != m_active.end(); ++iter)
+                {
+                    curl_multi_remove_handle(m_multi, iter->first);
+                }
+                m_active.clear();
+            }
+
+        private:
+            typedef std::chrono::steady_clock clock;
+
+            struct task
+            {
+                clock::time_point due;
+                std::function<void()> fn;
+            };
+
+            void wake()
+            {
+                uint64_t one = 1;
+                if (write(m_wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                {
+                    syslog(LOG_ERR, "Failed to wake a curl event loop.  errno = %d.", errno);
+                }
+            }
+
+            // Returns how long epoll_wait may sleep: until curl next needs a timeout, or the next task is due, whichever is sooner.
+            int next_timeout_ms()
+            {
+                bool has_deadline = m_has_curl_deadline;
+                clock::time_point deadline = m_curl_deadline;
+                if (!m_delayed.empty() && (!has_deadline || m_delayed.begin()->first < deadline))
+                {
+                    has_deadline = true;
+                    deadline = m_delayed.begin()->first;
+                }
+                if (!has_deadline)
+                {
+                    return -1;
+                }
+                auto now = clock::now();
+                if (deadline <= now)
+                {
+                    return 0;
+                }
+                // Round up, so we don't wake just short of the deadline and spin.
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1);
+                return static_cast<int>(std::min<long long>(wait.count(), 60 * 1000));
+            }
+
+            void take_incoming()
+            {
+                std::queue<task> incoming;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    std::swap(incoming, m_incoming);
+                }
+                while (!incoming.empty())
+                {
+                    task &t = incoming.front();
+                    m_delayed.insert(std::make_pair(t.due, std::move(t)));
+                    incoming.pop();
+                }
+            }
+
+            void run_due()
+            {
+                auto now = clock::now();
+                while (!m_delayed.empty() && m_delayed.begin()->first <= now)
+                {
+                    task t = std::move(m_delayed.begin()->second);
+                    m_delayed.erase(m_delayed.begin());
+                    t.fn();
+                }
+            }
+
+            void finish_done()
+            {
+                int remaining = 0;
+                CURLMsg *message;
+                while ((message = curl_multi_info_read(m_multi, &remaining)) != nullptr)
+                {
+                    if (message->msg != CURLMSG_DONE)
+                    {
+                        continue;
+                    }
+                    CURL *handle = message->easy_handle;
+                    CURLcode result = message->data.result;
+                    curl_multi_remove_handle(m_multi, handle);
+
+                    auto iter = m_active.find(handle);
+                    if (iter == m_active.end())
+                    {
+                        continue;
+                    }
+                    std::shared_ptr<group> g = iter->second;
+                    m_active.erase(iter);
+                    g->running.erase(std::remove(g->running.begin(), g->running.end(), handle), g->running.end());
+                    if (result == CURLE_OK || g->running.empty())
+                    {
+                        finish(g, handle, result);
+                    }
+                }
+            }
+
+            void finish(const std::shared_ptr<group> &g, CURL *handle, CURLcode result)
+            {
+                for (size_t i = 0; i < g->running.size(); i++)
+                {
+                    curl_multi_remove_handle(m_multi, g->running[i]);
+                    m_active.erase(g->running[i]);
+                }
+                g->running.clear();
+                g->done = true;
+                g->make_hedge = nullptr;
+                // Take the callback out first: it may hand the same handle straight back to us for a retry.
+                std::function<void(CURL *, CURLcode)> on_done = std::move(g->on_done);
+                g->on_done = nullptr;
+                on_done(handle, result);
+                for (size_t i = 0; i < g->owned.size(); i++)
+                {
+                    curl_easy_cleanup(g->owned[i]);
+                }
+                g->owned.clear();
+            }
+
+            static int on_socket(CURL *, curl_socket_t socket, int what, void *userp, void *)
+            {
+                loop *self = static_cast<loop *>(userp);
+                if (what == CURL_POLL_REMOVE)
+                {
+                    epoll_ctl(self->m_epoll, EPOLL_CTL_DEL, socket, nullptr);
+                    return 0;
+                }
+
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = 0;
+                if (what & CURL_POLL_IN)
+                {
+                    ev.events |= EPOLLIN;
+                }
+                if (what & CURL_POLL_OUT)
+                {
+                    ev.events |= EPOLLOUT;
+                }
+                ev.data.fd = socket;
+                if (epoll_ctl(self->m_epoll, EPOLL_CTL_MOD, socket, &ev) != 0 && errno == ENOENT)
+                {
+                    epoll_ctl(self->m_epoll, EPOLL_CTL_ADD, socket, &ev);
+                }
+                return 0;
+            }
+
+            static int on_timer(CURLM *, long timeout_ms, void *userp)
+            {
+                loop *self = static_cast<loop *>(userp);
+                if (timeout_ms < 0)
+                {
+                    self->m_has_curl_deadline = false;
+                }
+                else
+                {
+                    self->m_has_curl_deadline = true;
+                    self->m_curl_deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+                }
+                return 0;
+            }
+
+            CURLM *m_multi;
+            int m_epoll;
+            int m_wakeup; // An eventfd, written to wake the loop when a task is posted or the loop is stopped.
+
+            std::mutex m_mutex; // Protects m_incoming and m_stopping.
+            std::queue<task> m_incoming;
+            bool m_stopping;
+
+            std::multimap<clock::time_point, task> m_delayed; // Posted tasks, by the time they are due.
+            std::map<CURL *, std::shared_ptr<group>> m_active; // Transfers added to the multi handle, and the groups they belong to.
+            clock::time_point m_curl_deadline;
+            bool m_has_curl_deadline;
+        };
+
+        curl_multi_engine::curl_multi_engine(int loop_count) : m_loops(), m_threads(), m_next_loop(0)
+        {
+            for (int i = 0; i < loop_count; i++)
+            {
+                auto l = std::make_shared<loop>();
+                if (!l->open())
+                {
+                    break;
+                }
+                m_loops.push_back(l);
+            }
+            // The thread shares ownership of its loop, so that a loop whose thread has to be detached on shutdown outlives the engine.
+            for (size_t i = 0; i < m_loops.size(); i++)
+            {
+                std::shared_ptr<loop> l = m_loops[i];
+                m_threads.push_back(std::thread([l]() { l->run(); }));
+            }
+        }
+
+        curl_multi_engine::~curl_multi_engine()
+        {
+            for (size_t i = 0; i < m_loops.size(); i++)
+            {
+                m_loops[i]->stop();
+            }
+            for (size_t i = 0; i < m_threads.size(); i++)
+            {
+                // The last request to finish may be what destroys the engine, in which case we are on one of the loop threads and can't join it.
+                if (m_threads[i].get_id() == std::this_thread::get_id())
+                {
+                    m_threads[i].detach();
+                }
+                else
+                {
+                    m_threads[i].join();
+                }
+            }
+        }
+
+        void curl_multi_engine::add(CURL *handle, std::function<void(CURLcode)> on_done)
+        {
+            // The task runs on the loop it was posted to, so it can safely hold a plain pointer to it.
+            loop *l = m_loops[m_next_loop++ % m_loops.size()].get();
+            auto g = std::make_shared<loop::group>();
+            g->on_done = [on_done](CURL *, CURLcode result) { on_done(result); };
+            l->post(std::chrono::milliseconds(0), [l, handle, g]() { l->start(handle, g); });
+        }
+
+        void curl_multi_engine::add_hedged(CURL *handle, std::chrono::milliseconds hedge_after, std::function<CURL *()> make_hedge, std::function<void(CURL *, CURLcode)> on_done)
+        {
+            // Both transfers go on the same loop, so the request's callbacks never run on two threads at once.
+            loop *l = m_loops[m_next_loop++ % m_loops.size()].get();
+            auto g = std::make_shared<loop::group>();
+            g->make_hedge = std::move(make_hedge);
+            g->on_done = std::move(on_done);
+            l->post(std::chrono::milliseconds(0), [l, handle, g]() { l->start(handle, g); });
+            l->post(hedge_after, [l, g]() { l->hedge(g); });
+        }
+
+        void curl_multi_engine::run_after(std::chrono::milliseconds delay, std::function<void()> fn)
+        {
+            m_loops[m_next_loop++ % m_loops.size()]->post(delay, std::move(fn));
+        }
+
+        int curl_multi_engine::default_loop_count()
+        {
+            int count = static_cast<int>(std::thread::hardware_concurrency() / 4);
+            return std::max(1, std::min(count, 4));
+        }
+    }
+}
@@ -21,27 +21,60 @@ namespace microsoft_azure {
             return out;
         }
 
-        CurlEasyRequest::CurlEasyRequest(std::shared_ptr<CurlEasyClient> client, CURL *h)
+        std::atomic<int> CurlEasyClient::s_hedge_percentile(0);
+        std::atomic<int> CurlEasyClient::s_warm_handles(0);
+
+        namespace {
+            thread_local request_priority t_priority_ceiling = request_priority::metadata;
+        }
+
+        request_priority_scope::request_priority_scope(request_priority ceiling)
+        : m_previous(t_priority_ceiling)
+        {
+            if (ceiling > t_priority_ceiling) {
+                t_priority_ceiling = ceiling;
+            }
+        }
+
+        request_priority_scope::~request_priority_scope() {
+            t_priority_ceiling = m_previous;
+        }
+
+        request_priority request_priority_scope::ceiling() {
+            return t_priority_ceiling;
+        }
+
+        CurlEasyRequest::CurlEasyRequest(std::shared_ptr<CurlEasyClient> client, CURL *h, request_priority priority)
         : m_client(client),
             m_curl(h),
-            m_slist(NULL)
+            m_slist(NULL),
+            m_winner(-1),
+            m_priority(priority)
         {
+            m_attempts[0].request = this;
+            m_attempts[0].handle = h;
+            m_attempts[0].index = 0;
+            m_attempts[1].request = this;
+            m_attempts[1].handle = NULL;
+            m_attempts[1].index = 1;
             m_input_content_length=0;
             m_is_input_length_known =false;
             check_code(curl_easy_setopt(m_curl, CURLOPT_HEADERFUNCTION, header_callback));
-            check_code(curl_easy_setopt(m_curl, CURLOPT_HEADERDATA, this));
+            check_code(curl_easy_setopt(m_curl, CURLOPT_HEADERDATA, &m_attempts[0]));
         }
 
         CurlEasyRequest::~CurlEasyRequest() {
             curl_easy_reset(m_curl);
-            m_client->release_handle(m_curl);
+            m_client->release_handle(m_curl, m_priority);
             if (m_slist) {
                 curl_slist_free_all(m_slist);
             }
         }
 
-        CURLcode CurlEasyRequest::perform() {
-            if (m_output_stream.valid()) {
+        void CurlEasyRequest::prepare() {
+            m_winner = -1;
+            check_code(curl_easy_setopt(m_curl, CURLOPT_NOPROGRESS, 1L));
+            if (m_output_stream.valid() || m_output_sink.valid()) {
                 check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, write));
                 check_code(curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this));
             }
@@ -66,18 +99,109 @@ namespace microsoft_azure {
             }
 
             check_code(curl_easy_setopt(m_curl, CURLOPT_URL, m_url.data()));
+            // Connections cached since the host last answered may all be dead, as after a network change, so while it isn't answering, don't reuse them.
+            check_code(curl_easy_setopt(m_curl, CURLOPT_FRESH_CONNECT, m_client->needs_fresh_connection(m_url) ? 1L : 0L));
 
             m_slist = curl_slist_append(m_slist, "Transfer-Encoding:");
             m_slist = curl_slist_append(m_slist, "Expect:");
             check_code(curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_slist));
+        }
 
+        CURLcode CurlEasyRequest::perform() {
+            prepare();
             const auto result = curl_easy_perform(m_curl);
             check_code(result); // has nothing to do with checks, just resets errno for succeeded ops.
             return result;
         }
 
+        void CurlEasyRequest::submit(std::function<void(http_code, storage_istream, CURLcode)> cb, std::chrono::milliseconds interval) {
+            curl_multi_engine *engine = m_client->engine();
+            if (engine == nullptr) {
+                std::this_thread::sleep_for(interval);
+                const auto curlCode = perform();
+                m_client->report_result(m_url, curlCode);
+                m_client->observe_response(m_code, curlCode);
+
+                syslog(curlCode != CURLE_OK || unsuccessful(m_code) ? LOG_ERR : LOG_DEBUG, "%s", format_request_response().c_str());
+
+                cb(m_code, m_error_stream, curlCode);
+                return;
+            }
+
+            prepare();
+            // The handle must stay ours until the engine hands it back, so the transfer keeps the request alive until then.
+            auto self = shared_from_this();
+            auto on_done = [self, cb](CURL *handle, CURLcode curlCode) {
+                check_code(curlCode);
+                self->m_client->report_result(self->m_url, curlCode);
+                self->m_client->observe_response(self->m_code, curlCode);
+                if (curlCode == CURLE_OK && (self->m_method == http_method::get || self->m_method == http_method::head)) {
+                    double first_byte_time = 0;
+                    if (curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &first_byte_time) == CURLE_OK) {
+                        self->m_client->record_first_byte(static_cast<long long>(first_byte_time * 1000));
+                    }
+                }
+                if (self->m_attempts[1].handle != NULL) {
+                    // The engine has dropped the hedge by now.
+                    self->m_client->end_hedge();
+                    self->m_attempts[1].handle = NULL;
+                }
+
+                syslog(curlCode != CURLE_OK || unsuccessful(self->m_code) ? LOG_ERR : LOG_DEBUG, "%s", self->format_request_response().c_str());
+
+                cb(self->m_code, self->m_error_stream, curlCode);
+            };
+            auto start = [self, engine, on_done]() {
+                const long long hedge_delay = (self->m_method == http_method::get || self->m_method == http_method::head) ? self->m_client->hedge_delay_in_ms() : -1;
+                if (hedge_delay < 0) {
+                    engine->add(self->m_curl, [self, on_done](CURLcode curlCode) { on_done(self->m_curl, curlCode); });
+                    return;
+                }
+
+                check_code(curl_easy_setopt(self->m_curl, CURLOPT_NOPROGRESS, 0L));
+                check_code(curl_easy_setopt(self->m_curl, CURLOPT_XFERINFOFUNCTION, progress_callback));
+                check_code(curl_easy_setopt(self->m_curl, CURLOPT_XFERINFODATA, &self->m_attempts[0]));
+                auto make_hedge = [self]() -> CURL * {
+                    // Only worth it if nothing has come back yet.  Once a response has started, the request is committed to it.
+                    if (self->m_winner >= 0 || !self->m_client->begin_hedge()) {
+                        return NULL;
+                    }
+                    CURL *duplicate = curl_easy_duphandle(self->m_curl);
+                    if (duplicate == NULL) {
+                        self->m_client->end_hedge();
+                        return NULL;
+                    }
+                    self->m_client->share_caches(duplicate);
+                    self->m_attempts[1].handle = duplicate;
+                    curl_easy_setopt(duplicate, CURLOPT_HEADERDATA, &self->m_attempts[1]);
+                    curl_easy_setopt(duplicate, CURLOPT_XFERINFODATA, &self->m_attempts[1]);
+                    syslog(LOG_DEBUG, "Hedging a request that has waited %lld ms for its first byte: %s %s", self->m_client->hedge_delay_in_ms(), self->http_method_label[self->m_method].c_str(), self->m_url.substr(0, self->m_url.find('?')).c_str());
+                    return duplicate;
+                };
+                engine->add_hedged(self->m_curl, std::chrono::milliseconds(hedge_delay), make_hedge, on_done);
+            };
+            if (interval.count() <= 0) {
+                start();
+                return;
+            }
+
+            // A retry: wait out the back-off on the engine's timers, without holding a thread, or a place in the handle pool.
+            m_client->begin_backoff();
+            engine->run_after(interval, [self, start]() {
+                self->m_client->end_backoff();
+                start();
+            });
+        }
+
         size_t CurlEasyRequest::header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
-            CurlEasyRequest::REQUEST_TYPE *p = static_cast<CurlEasyRequest::REQUEST_TYPE *>(userdata);
+            attempt *a = static_cast<attempt *>(userdata);
+            CurlEasyRequest::REQUEST_TYPE *p = a->request;
+            if (p->m_winner < 0) {
+                p->m_winner = a->index;
+            }
+            else if (p->m_winner != a->index) {
+                return 0; // Another attempt answered first; abort this one.
+            }
             std::string header(buffer, size * nitems);
             auto colon = header.find(':');
             if (colon == std::string::npos) {
@@ -86,8 +210,8 @@ namespace microsoft_azure {
                     std::istringstream iss(header.substr(space));
                     iss >> p->m_code;
                     if (p->m_switch_error_callback && (p->m_switch_error_callback)(p->m_code)) {
-                        curl_easy_setopt(p->m_curl, CURLOPT_WRITEFUNCTION, error);
-                        curl_easy_setopt(p->m_curl, CURLOPT_WRITEDATA, p);
+                        curl_easy_setopt(a->handle, CURLOPT_WRITEFUNCTION, error);
+                        curl_easy_setopt(a->handle, CURLOPT_WRITEDATA, p);
                     }
                 }
             }
@@ -97,5 +221,318 @@ namespace microsoft_azure {
             return size * nitems;
         }
 
+        namespace {
+            // Once this many requests in a row to a host have failed at the connection level, requests to it are sent on new connections.
+            const int max_connection_failures = 3;
+
+            // Handles above the pool's minimum are freed after sitting idle this long, unless the client is told otherwise.
+            const std::chrono::seconds idle_handle_lifetime(60);
+
+            // How often the pool's statistics are logged, if any request has had to wait for a handle, or been sent on a new connection after failures, since last time.
+            const std::chrono::minutes stats_report_interval(5);
+
+            // A wait for a handle longer than this is logged, as it means the pool is too small for the load.
+            const std::chrono::milliseconds slow_handle_wait(1000);
+
+            // Failures that say something about the connection, rather than about the request or the service.
+            bool is_connection_failure(CURLcode code) {
+                switch (code) {
+                case CURLE_COULDNT_RESOLVE_HOST:
+                case CURLE_COULDNT_CONNECT:
+                case CURLE_OPERATION_TIMEDOUT:
+                case CURLE_SSL_CONNECT_ERROR:
+                case CURLE_SEND_ERROR:
+                case CURLE_RECV_ERROR:
+                case CURLE_GOT_NOTHING:
+                case CURLE_PARTIAL_FILE:
+                    return true;
+                default:
+                    return false;
+                }
+            }
+        }
+
+        CurlEasyClient::CurlEasyClient(int size, const std::string& ca_path)
+        : m_size(std::max(size, 1)),
+            m_min_handles(std::min(std::max(static_cast<int>(s_warm_handles), 0), std::max(size, 1))),
+            m_ca_path(ca_path),
+            m_handle_count(0),
+            m_backing_off(0),
+            m_share(NULL),
+            m_idle_handle_lifetime(idle_handle_lifetime),
+            m_last_stats_report(std::chrono::steady_clock::now())
+        {
+            curl_global_init(CURL_GLOBAL_DEFAULT);
+            m_share = curl_share_init();
+            if (m_share != NULL) {
+                curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, lock_share);
+                curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+                curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+                curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+                // Not the connection cache: libcurl doesn't support sharing one between event loops running at once, and a connection one loop
+                // took from it would be invisible to that loop's multi handle.  Each loop's multi handle keeps a connection cache of its own instead.
+            }
+            else {
+                syslog(LOG_WARNING, "Failed to create a curl share; connections will not share DNS or TLS session caches.");
+            }
+            m_stats = curl_pool_stats();
+            m_reported_stats = curl_pool_stats();
+            std::fill(m_in_use, m_in_use + 3, 0);
+            std::fill(m_waiting, m_waiting + 3, 0);
+            const auto now = std::chrono::steady_clock::now();
+            for (int i = 0; i < m_min_handles; i++) {
+                m_idle_handles.push_back({ curl_easy_init(), now });
+                m_handle_count++;
+            }
+        }
+
+        CurlEasyClient::~CurlEasyClient() {
+            m_engine.reset();
+            for (auto &idle : m_idle_handles) {
+                curl_easy_cleanup(idle.handle);
+            }
+            m_idle_handles.clear();
+            // Every handle using the share is gone by now: requests hold the client alive until they are done with their handles.
+            if (m_share != NULL) {
+                curl_share_cleanup(m_share);
+            }
+            curl_global_cleanup();
+        }
+
+        void CurlEasyClient::lock_share(CURL *, curl_lock_data data, curl_lock_access, void *userptr) {
+            static_cast<CurlEasyClient *>(userptr)->m_share_locks[data].lock();
+        }
+
+        void CurlEasyClient::unlock_share(CURL *, curl_lock_data data, void *userptr) {
+            static_cast<CurlEasyClient *>(userptr)->m_share_locks[data].unlock();
+        }
+
+        void CurlEasyClient::configure_handle(CURL *h) {
+            share_caches(h);
+            if (!m_ca_path.empty()) {
+                curl_easy_setopt(h, CURLOPT_CAPATH, m_ca_path.c_str());
+            }
+        }
+
+        void CurlEasyClient::trim_idle_handles() {
+            const auto cutoff = std::chrono::steady_clock::now() - m_idle_handle_lifetime;
+            // The least recently used are at the front.
+            while (m_handle_count > m_min_handles && !m_idle_handles.empty() && m_idle_handles.front().since < cutoff) {
+                CURL *h = m_idle_handles.front().handle;
+                m_idle_handles.pop_front();
+                curl_easy_cleanup(h);
+                m_handle_count--;
+            }
+        }
+
+        int CurlEasyClient::handle_limit(request_priority priority) const {
+            // Keep an eighth of the pool for metadata, but only if there is more than one handle to go round.
+            const int reserved = m_size > 1 ? std::max(m_size / 8, 1) : 0;
+            switch (priority) {
+            case request_priority::metadata:
+                return m_size;
+            case request_priority::foreground:
+                return m_size - reserved;
+            default:
+                return std::max((m_size - reserved) / 2, 1);
+            }
+        }
+
+        std::shared_ptr<CurlEasyRequest> CurlEasyClient::get_handle(request_priority priority) {
+            priority = std::max(priority, request_priority_scope::ceiling());
+            const int level = static_cast<int>(priority);
+
+            std::unique_lock<std::mutex> lk(m_handles_mutex);
+            // A request waiting out a retry back-off keeps its handle, but gives up its place in the pool, so while any are waiting the pool may
+            // grow by that many.  Otherwise a burst of throttled requests would hold every handle and stall everything else behind them.
+            auto available = [this, priority, level]() {
+                for (int more_urgent = 0; more_urgent < level; more_urgent++) {
+                    if (m_waiting[more_urgent] > 0) {
+                        return false;
+                    }
+                }
+                int in_use = 0;
+                for (int i = level; i < 3; i++) {
+                    in_use += m_in_use[i];
+                }
+                // A class's limit covers the less urgent classes too, so that they can't take what it has been left.
+                return in_use < handle_limit(priority) + m_backing_off && (!m_idle_handles.empty() || m_handle_count < m_size + m_backing_off);
+            };
+            if (!available()) {
+                const auto wait_start = std::chrono::steady_clock::now();
+                m_waiting[level]++;
+                m_cv.wait(lk, available);
+                m_waiting[level]--;
+                const long long waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wait_start).count();
+                m_stats.waits++;
+                m_stats.total_wait_in_ms += waited;
+                m_stats.max_wait_in_ms = std::max(m_stats.max_wait_in_ms, waited);
+                m_reported_stats.max_wait_in_ms = std::max(m_reported_stats.max_wait_in_ms, waited);
+                if (waited >= slow_handle_wait.count() && priority != request_priority::background) {
+                    syslog(LOG_WARNING, "Waited %lld ms for a connection; all %d are in use.  Consider raising the maximum concurrency.", waited, m_size);
+                }
+                // Less urgent requests were held back while this one waited.
+                m_cv.notify_all();
+            }
+            m_in_use[level]++;
+
+            CURL *h;
+            if (!m_idle_handles.empty()) {
+                // Take the most recently used, as it is the most likely to still have a live connection behind it.
+                h = m_idle_handles.back().handle;
+                m_idle_handles.pop_back();
+            }
+            else {
+                h = curl_easy_init();
+                m_handle_count++;
+            }
+            trim_idle_handles();
+            lk.unlock();
+
+            configure_handle(h);
+            return std::make_shared<CurlEasyRequest>(shared_from_this(), h, priority);
+        }
+
+        void CurlEasyClient::release_handle(CURL *h, request_priority priority) {
+            std::lock_guard<std::mutex> lg(m_handles_mutex);
+            m_in_use[static_cast<int>(priority)]--;
+            if (m_handle_count > m_size + m_backing_off) {
+                // Back-offs have ended since the pool grew past its size; shrink it back.
+                curl_easy_cleanup(h);
+                m_handle_count--;
+            }
+            else {
+                m_idle_handles.push_back({ h, std::chrono::steady_clock::now() });
+            }
+            report_stats();
+            // Wake every waiter, as the one next in line may not be the one that would be woken.
+            m_cv.notify_all();
+        }
+
+        bool CurlEasyClient::begin_hedge() {
+            auto condition = std::atomic_load(&m_hedge_condition);
+            if (condition != nullptr && !(*condition)()) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lg(m_handles_mutex);
+            int in_use = 0;
+            for (int level = 0; level < 3; level++) {
+                if (m_waiting[level] > 0) {
+                    return false;
+                }
+                in_use += m_in_use[level];
+            }
+            if (in_use >= handle_limit(request_priority::background) + m_backing_off) {
+                return false;
+            }
+            m_in_use[static_cast<int>(request_priority::background)]++;
+            m_stats.hedges++;
+            return true;
+        }
+
+        void CurlEasyClient::end_hedge() {
+            std::lock_guard<std::mutex> lg(m_handles_mutex);
+            m_in_use[static_cast<int>(request_priority::background)]--;
+            m_cv.notify_all();
+        }
+
+        namespace {
+            // The scheme, host and port of a URL: the part connections are cached by.
+            std::string origin_of(const std::string &url) {
+                const auto scheme_end = url.find("://");
+                const auto host_start = scheme_end == std::string::npos ? 0 : scheme_end + 3;
+                return url.substr(0, url.find_first_of("/?", host_start));
+            }
+        }
+
+        void CurlEasyClient::report_result(const std::string &url, CURLcode code) {
+            const std::string origin = origin_of(url);
+            std::lock_guard<std::mutex> lg(m_handles_mutex);
+            if (is_connection_failure(code)) {
+                if (++m_connection_failures[origin] == max_connection_failures) {
+                    syslog(LOG_INFO, "%d requests in a row to %s have failed to connect; sending requests to it on new connections until one succeeds.", max_connection_failures, origin.c_str());
+                }
+            }
+            else {
+                m_connection_failures.erase(origin);
+            }
+        }
+
+        bool CurlEasyClient::needs_fresh_connection(const std::string &url) {
+            const std::string origin = origin_of(url);
+            std::lock_guard<std::mutex> lg(m_handles_mutex);
+            auto failures = m_connection_failures.find(origin);
+            if (failures == m_connection_failures.end() || failures->second < max_connection_failures) {
+                return false;
+            }
+            m_stats.fresh_connections++;
+            return true;
+        }
+
+        void CurlEasyClient::report_stats() {
+            const auto now = std::chrono::steady_clock::now();
+            if (now - m_last_stats_report < stats_report_interval) {
+                return;
+            }
+            const auto waits = m_stats.waits - m_reported_stats.waits;
+            const auto fresh_connections = m_stats.fresh_connections - m_reported_stats.fresh_connections;
+            if (waits > 0 || fresh_connections > 0) {
+                // The maximum kept in m_reported_stats is the one for the interval, rather than since the client was created.
+                syslog(LOG_INFO, "Connection pool: %llu requests waited for a handle in the last %lld s, %llu ms on average and %lld ms at most; %llu requests sent on new connections after connection failures; %d handles, %d idle.",
+                    waits,
+                    static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(now - m_last_stats_report).count()),
+                    waits > 0 ? (m_stats.total_wait_in_ms - m_reported_stats.total_wait_in_ms) / waits : 0ULL,
+                    m_reported_stats.max_wait_in_ms,
+                    fresh_connections,
+                    m_handle_count,
+                    static_cast<int>(m_idle_handles.size()));
+            }
+            m_reported_stats = m_stats;
+            m_reported_stats.max_wait_in_ms = 0;
+            m_last_stats_report = now;
+        }
+
+        curl_pool_stats CurlEasyClient::pool_stats() {
+            std::lock_guard<std::mutex> lg(m_handles_mutex);
+            curl_pool_stats stats = m_stats;
+            stats.handles = m_handle_count;
+            stats.idle = static_cast<int>(m_idle_handles.size());
+            return stats;
+        }
+
+        void CurlEasyClient::warm_up(const std::string &url) {
+            if (m_engine == nullptr || m_min_handles <= 0) {
+                return;
+            }
+
+            // Take all the warm handles at once, so that each opens a connection of its own, rather than one reusing another's.
+            std::vector<CURL *> handles;
+            {
+                std::lock_guard<std::mutex> lg(m_handles_mutex);
+                while (static_cast<int>(handles.size()) < m_min_handles && !m_idle_handles.empty()) {
+                    handles.push_back(m_idle_handles.back().handle);
+                    m_idle_handles.pop_back();
+                    m_in_use[static_cast<int>(request_priority::background)]++;
+                }
+            }
+
+            auto self = shared_from_this();
+            for (CURL *h : handles) {
+                configure_handle(h);
+                curl_easy_setopt(h, CURLOPT_URL, url.c_str());
+                curl_easy_setopt(h, CURLOPT_NOBODY, 1L);
+                curl_easy_setopt(h, CURLOPT_TIMEOUT, 30L);
+                m_engine->add(h, [self, h](CURLcode code) {
+                    if (code != CURLE_OK) {
+                        syslog(LOG_DEBUG, "Failed to open a warm connection: %s", curl_easy_strerror(code));
+                    }
+                    curl_easy_reset(h);
+                    self->release_handle(h, request_priority::background);
+                });
+            }
+            syslog(LOG_DEBUG, "Opening %d warm connections to %s", static_cast<int>(handles.size()), url.c_str());
+        }
+
     }
 }
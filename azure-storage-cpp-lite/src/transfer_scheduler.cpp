@@ -0,0 +1,232 @@
+#include "transfer_scheduler.h"
+
+#include <algorithm>
+#include <syslog.h>
+
+namespace microsoft_azure {
+    namespace storage {
+
+        namespace {
+            // Responses to requests sent before the window was last halved say nothing about the new window, so busy responses within
+            // this long of a decrease don't decrease it again.
+            const std::chrono::milliseconds decrease_hold(1000);
+        }
+
+        transfer_scheduler::transfer_scheduler(int worker_count, int thread_count)
+            : m_worker_count(worker_count > 0 ? worker_count : 1),
+            m_thread_count(thread_count > 0 && thread_count < m_worker_count ? thread_count : m_worker_count),
+            m_next_flow(0),
+            m_running(0),
+            m_window(m_worker_count),
+            m_stopping(false)
+        {
+        }
+
+        transfer_scheduler::~transfer_scheduler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_cv.notify_all();
+            for (auto &worker : m_workers)
+            {
+                worker.join();
+            }
+        }
+
+        unsigned long long transfer_scheduler::open_flow(size_t max_running)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const unsigned long long flow = ++m_next_flow;
+            m_flows[flow].max_running = max_running;
+            return flow;
+        }
+
+        void transfer_scheduler::close_flow(unsigned long long flow)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto state = m_flows.find(flow);
+            if (state == m_flows.end())
+            {
+                return;
+            }
+            if (state->second.queue.empty() && state->second.running == 0)
+            {
+                m_flows.erase(state);
+            }
+            else
+            {
+                // The last of its transfers to finish will erase it.
+                state->second.closed = true;
+            }
+        }
+
+        std::future<int> transfer_scheduler::submit(unsigned long long flow, std::function<int()> transfer)
+        {
+            auto task = std::make_shared<std::packaged_task<int()>>(std::move(transfer));
+            std::future<int> result = task->get_future();
+            enqueue(flow, [task](std::function<void()> done) {
+                (*task)();
+                done();
+            });
+            return result;
+        }
+
+        std::future<int> transfer_scheduler::submit_async(unsigned long long flow, std::function<void(std::function<void(int)>)> transfer)
+        {
+            auto promise = std::make_shared<std::promise<int>>();
+            std::future<int> result = promise->get_future();
+            enqueue(flow, [transfer, promise](std::function<void()> done) {
+                transfer([promise, done](int error) {
+                    // Free the transfer's place before anyone waiting on the result is woken.
+                    done();
+                    promise->set_value(error);
+                });
+            });
+            return result;
+        }
+
+        void transfer_scheduler::enqueue(unsigned long long flow, std::function<void(std::function<void()>)> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_workers.empty())
+                {
+                    for (int i = 0; i < m_thread_count; ++i)
+                    {
+                        m_workers.emplace_back(&transfer_scheduler::run, this);
+                    }
+                    syslog(LOG_DEBUG, "Started %d transfer workers.", m_thread_count);
+                }
+
+                flow_state &state = m_flows[flow];
+                const bool was_ready = ready(state);
+                state.queue.push_back(std::move(task));
+                if (!was_ready && ready(state))
+                {
+                    m_turns.push_back(flow);
+                }
+            }
+            m_cv.notify_one();
+        }
+
+        void transfer_scheduler::run()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                // An asynchronous transfer still running may yet queue another on its flow, so the workers stay until none is.
+                m_cv.wait(lock, [this]() { return (!m_turns.empty() && m_running < allowed_running()) || (m_stopping && m_turns.empty() && m_running == 0); });
+                if (m_turns.empty())
+                {
+                    return;
+                }
+
+                const unsigned long long flow = m_turns.front();
+                m_turns.pop_front();
+                flow_state &state = m_flows[flow];
+                std::function<void(std::function<void()>)> task(std::move(state.queue.front()));
+                state.queue.pop_front();
+                state.running++;
+                m_running++;
+                if (ready(state))
+                {
+                    m_turns.push_back(flow);
+                }
+
+                lock.unlock();
+                task([this, flow]() { finish(flow); });
+                lock.lock();
+            }
+        }
+
+        void transfer_scheduler::finish(unsigned long long flow)
+        {
+            bool drained;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                // std::map references stay valid while other flows come and go.
+                flow_state &state = m_flows[flow];
+                const bool was_ready = ready(state);
+                state.running--;
+                m_running--;
+                if (state.closed && state.queue.empty() && state.running == 0)
+                {
+                    m_flows.erase(flow);
+                }
+                else if (!was_ready && ready(state))
+                {
+                    // The flow was held back by its limit, and may now run another.
+                    m_turns.push_back(flow);
+                }
+                drained = m_stopping && m_running == 0;
+            }
+            if (drained)
+            {
+                // Every worker may be waiting for the last transfer to be done before stopping.
+                m_cv.notify_all();
+            }
+            else
+            {
+                // Another worker may have been held back by the window, or by the flow's limit.
+                m_cv.notify_one();
+            }
+        }
+
+        void transfer_scheduler::record_response(int status)
+        {
+            const bool busy = status == 503 || status == 500;
+            const bool success = status >= 200 && status < 300;
+            if (!busy && !success)
+            {
+                return;
+            }
+
+            bool grew = false;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (busy)
+                {
+                    const auto now = std::chrono::steady_clock::now();
+                    if (now - m_last_decrease < decrease_hold)
+                    {
+                        return;
+                    }
+                    m_last_decrease = now;
+                    const size_t before = allowed_running();
+                    m_window = std::max(m_window / 2, 1.0);
+                    syslog(LOG_INFO, "The service is busy (status %d); running at most %d transfers at once, down from %d.", status, static_cast<int>(allowed_running()), static_cast<int>(before));
+                }
+                else if (m_window < m_worker_count)
+                {
+                    const size_t before = allowed_running();
+                    m_window = std::min(m_window + 1 / m_window, static_cast<double>(m_worker_count));
+                    grew = allowed_running() > before;
+                }
+            }
+            if (grew)
+            {
+                m_cv.notify_one();
+            }
+        }
+
+        size_t transfer_scheduler::window()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return allowed_running();
+        }
+
+        bool transfer_scheduler::throttled()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_window < m_worker_count;
+        }
+
+        size_t transfer_scheduler::flow_count()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_flows.size();
+        }
+    }
+}
@@ -0,0 +1,123 @@
+#include "transfer_tuner.h"
+
+#include <algorithm>
+#include <syslog.h>
+
+namespace microsoft_azure {
+    namespace storage {
+
+        namespace {
+            const unsigned long long block_alignment = 4 * 1024 * 1024;
+
+            // How long a request for one block should take.
+            const double target_request_seconds = 2.0;
+
+            // How much weight the latest request has in the moving average of request throughput.
+            const double request_rate_weight = 0.2;
+
+            // Files shorter than this say more about the round trip than about the link, and don't count towards the number of blocks in flight.
+            const std::chrono::milliseconds min_counted_transfer(500);
+
+            double seconds(std::chrono::steady_clock::duration elapsed)
+            {
+                return std::chrono::duration_cast<std::chrono::duration<double>>(elapsed).count();
+            }
+        }
+
+        transfer_tuner::transfer_tuner(size_t initial_streams, size_t max_streams, unsigned long long initial_block_size, unsigned long long min_block_size, unsigned long long max_block_size)
+            : m_max_streams(std::max<size_t>(max_streams, 1)),
+            m_min_block_size(min_block_size),
+            m_max_block_size(std::max(max_block_size, min_block_size)),
+            m_streams(std::min(std::max<size_t>(initial_streams, 1), std::max<size_t>(max_streams, 1))),
+            m_direction(1),
+            m_last_throughput(0),
+            m_last_bytes(0),
+            m_block_size(initial_block_size),
+            m_request_rate(0)
+        {
+        }
+
+        size_t transfer_tuner::streams()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_streams;
+        }
+
+        unsigned long long transfer_tuner::block_size()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_block_size;
+        }
+
+        void transfer_tuner::record_request(unsigned long long bytes, std::chrono::steady_clock::duration elapsed)
+        {
+            const double elapsed_seconds = seconds(elapsed);
+            // Requests smaller than the smallest block, such as for the tail of a file, say more about the round trip than about the link.
+            if (bytes < m_min_block_size || elapsed_seconds <= 0)
+            {
+                return;
+            }
+            const double rate = bytes / elapsed_seconds;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_request_rate = m_request_rate == 0 ? rate : m_request_rate + request_rate_weight * (rate - m_request_rate);
+
+            const double wanted = m_request_rate * target_request_seconds;
+            unsigned long long block_size = m_max_block_size;
+            if (wanted < static_cast<double>(m_max_block_size))
+            {
+                // Round up to a whole number of 4MB.
+                block_size = (static_cast<unsigned long long>(wanted) + block_alignment - 1) / block_alignment * block_alignment;
+                block_size = std::min(std::max(block_size, m_min_block_size), m_max_block_size);
+            }
+            m_block_size = block_size;
+        }
+
+        void transfer_tuner::record_transfer(unsigned long long bytes, std::chrono::steady_clock::duration elapsed, size_t streams)
+        {
+            if (elapsed < min_counted_transfer)
+            {
+                return;
+            }
+            const double throughput = bytes / seconds(elapsed);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (streams != m_streams)
+            {
+                // Too small a file to use every stream, or made before the last step; either way it says nothing about the current setting.
+                return;
+            }
+
+            if (m_last_throughput > 0 && (bytes > 2 * m_last_bytes || m_last_bytes > 2 * bytes))
+            {
+                // Too different in size to compare; start again from this one.
+                m_last_throughput = throughput;
+                m_last_bytes = bytes;
+                return;
+            }
+            if (m_last_throughput > 0)
+            {
+                // Adding streams has to pay for itself, but taking them away only has to cost nothing.
+                const bool better = m_direction > 0 ? throughput > m_last_throughput * 1.05 : throughput >= m_last_throughput * 0.95;
+                if (!better)
+                {
+                    m_direction = -m_direction;
+                }
+            }
+            m_last_throughput = throughput;
+            m_last_bytes = bytes;
+
+            const size_t step = std::max<size_t>(m_streams / 4, 1);
+            size_t next = m_direction > 0 ? std::min(m_streams + step, m_max_streams) : (m_streams > step ? m_streams - step : 1);
+            if (next == m_streams)
+            {
+                // Against a bound.  Step the other way after the next file, whatever it shows, as there is nothing here to compare it with.
+                m_direction = -m_direction;
+                m_last_throughput = 0;
+                return;
+            }
+            syslog(LOG_DEBUG, "Moving from %d to %d blocks in flight after a transfer at %.1f MB/s; block size is %llu MB.", static_cast<int>(m_streams), static_cast<int>(next), throughput / (1024 * 1024), m_block_size / (1024 * 1024));
+            m_streams = next;
+        }
+    }
+}
@@ -29,6 +29,14 @@ struct options
     const char *container_name; //container to mount. Used only if config_file is not provided
     const char *log_level; // Sets the level at which the process should log to syslog.
     const char *use_attr_cache; // True if the cache for blob attributes should be used.
+    const char *attr_cache_timeout_in_seconds; // Timeout for items in the blob attribute cache (defaults to 120 seconds, 0 for no timeout)
+    const char *attr_cache_max_entries; // Maximum number of blobs kept in the blob attribute cache (defaults to 500000, 0 for no limit)
+    const char *dir_cache_timeout_in_seconds; // Timeout for cached directory listings (defaults to 0, which disables the directory listing cache)
+    const char *stat_burst_threshold; // Number of lookups in one unlisted directory within a couple of seconds that triggers a listing of it (defaults to 0, disabled)
+    const char *change_poll_interval_in_seconds; // Interval between checks of the listed directories for changes on the service (defaults to 0, disabled)
+    const char *read_hedge_percentile; // Percentile of recent times to first byte after which a read is hedged with a duplicate request (defaults to 0, disabled)
+    const char *max_concurrency; // Maximum number of requests to the service in flight at once (defaults to 20)
+    const char *warm_connections; // Number of connections to the service to open at mount and keep open (defaults to 0)
     const char *version; // print blobfuse version
     const char *help; // print blobfuse usage
 };
@@ -72,6 +80,14 @@ const struct fuse_opt option_spec[] =
     OPTION("--container-name=%s", container_name),
     OPTION("--log-level=%s", log_level),
     OPTION("--use-attr-cache=%s", use_attr_cache),
+    OPTION("--attr-cache-timeout-in-seconds=%s", attr_cache_timeout_in_seconds),
+    OPTION("--attr-cache-max-entries=%s", attr_cache_max_entries),
+    OPTION("--dir-cache-timeout-in-seconds=%s", dir_cache_timeout_in_seconds),
+    OPTION("--stat-burst-threshold=%s", stat_burst_threshold),
+    OPTION("--change-poll-interval-in-seconds=%s", change_poll_interval_in_seconds),
+    OPTION("--read-hedge-percentile=%s", read_hedge_percentile),
+    OPTION("--max-concurrency=%s", max_concurrency),
+    OPTION("--warm-connections=%s", warm_connections),
     OPTION("--version", version),
     OPTION("-v", version),
     OPTION("--help", help),
@@ -373,6 +389,15 @@ int read_config(const std::string configFile)
 
 void *azs_init(struct fuse_conn_info * conn)
 {
+    // Must be set before any blob client is made.
+    CurlEasyClient::set_hedge_percentile(str_options.read_hedge_percentile);
+    CurlEasyClient::set_warm_handles(str_options.warm_connections);
+    // Next to the file cache's root, so that a finished download can be moved into the cache, but outside it, so it's never listed or opened.
+    blob_client_wrapper::set_partial_download_directory(str_options.tmpPath + "/partial");
+    // So that a flush that fails part way through a large file doesn't have to send its blocks again when it's retried.  Only within a
+    // mount: the cached files the journals are for are removed at unmount, along with the journals, and a mount starts with an empty tmp-path.
+    blob_client_wrapper::set_upload_journal_directory(str_options.tmpPath + "/uploads");
+
     // TODO: Make all of this go down roughly the same pipeline, rather than having spaghettified code
     auth_type AuthType = get_auth_type();
 
@@ -404,26 +429,32 @@ void *azs_init(struct fuse_conn_info * conn)
             azure_blob_client_wrapper = std::make_shared<blob_client_attr_cache_wrapper>(
                     blob_client_attr_cache_wrapper::blob_client_attr_cache_wrapper_oauth(
                      str_options.accountName,
-                     constants::max_concurrency_blob_wrapper,
-                     str_options.blobEndpoint));
+                     str_options.max_concurrency,
+                     str_options.blobEndpoint,
+                     str_options.attr_cache_timeout_in_seconds,
+                     str_options.attr_cache_max_entries));
         }
         else if(AuthType == KEY_AUTH) {
             azure_blob_client_wrapper = std::make_shared<blob_client_attr_cache_wrapper>(
                 blob_client_attr_cache_wrapper::blob_client_attr_cache_wrapper_init_accountkey(
                     str_options.accountName,
                     str_options.accountKey,
-                    constants::max_concurrency_blob_wrapper,
+                    str_options.max_concurrency,
                     str_options.use_https,
-                    str_options.blobEndpoint));
+                    str_options.blobEndpoint,
+                    str_options.attr_cache_timeout_in_seconds,
+                    str_options.attr_cache_max_entries));
         }
         else if(AuthType == SAS_AUTH) {
             azure_blob_client_wrapper = std::make_shared<blob_client_attr_cache_wrapper>(
                 blob_client_attr_cache_wrapper::blob_client_attr_cache_wrapper_init_sastoken(
                     str_options.accountName,
                     str_options.sasToken,
-                    constants::max_concurrency_blob_wrapper,
+                    str_options.max_concurrency,
                      str_options.use_https,
-                    str_options.blobEndpoint));
+                    str_options.blobEndpoint,
+                    str_options.attr_cache_timeout_in_seconds,
+                    str_options.attr_cache_max_entries));
         }
         else
         {
@@ -457,14 +488,14 @@ void *azs_init(struct fuse_conn_info * conn)
             //2. try to make blob client wrapper using oauth token
             azure_blob_client_wrapper = blob_client_wrapper_init_oauth(
                     str_options.accountName,
-                    constants::max_concurrency_blob_wrapper,
+                    str_options.max_concurrency,
                     str_options.blobEndpoint);
         }
         else if(AuthType == KEY_AUTH) {
             azure_blob_client_wrapper = blob_client_wrapper_init_accountkey(
             str_options.accountName,
             str_options.accountKey,
-            constants::max_concurrency_blob_wrapper,
+            str_options.max_concurrency,
             str_options.use_https,
             str_options.blobEndpoint);
         }
@@ -472,7 +503,7 @@ void *azs_init(struct fuse_conn_info * conn)
             azure_blob_client_wrapper = blob_client_wrapper_init_sastoken(
             str_options.accountName,
             str_options.sasToken,
-            constants::max_concurrency_blob_wrapper,
+            str_options.max_concurrency,
             str_options.use_https,
             str_options.blobEndpoint);
         }
@@ -506,6 +537,9 @@ void *azs_init(struct fuse_conn_info * conn)
     //  conn->want |= FUSE_CAP_WRITEBACK_CACHE | FUSE_CAP_EXPORT_SUPPORT; // TODO: Investigate putting this back in when we downgrade to fuse 2.9
 
     g_gc_cache.run();
+    g_dir_listing_cache.set_timeout(str_options.dir_cache_timeout_in_seconds);
+    g_dir_listing_cache.set_burst_threshold(str_options.stat_burst_threshold);
+    g_change_poller.run(str_options.change_poll_interval_in_seconds);
 
     return NULL;
 }
@@ -514,7 +548,10 @@ void *azs_init(struct fuse_conn_info * conn)
 void print_usage()
 {
     fprintf(stdout, "Usage: blobfuse <mount-folder> --tmp-path=</path/to/fusecache> [--config-file=</path/to/config.cfg> | --container-name=<containername>]");
-    fprintf(stdout, "    [--use-https=true] [--file-cache-timeout-in-seconds=120] [--log-level=LOG_OFF|LOG_CRIT|LOG_ERR|LOG_WARNING|LOG_INFO|LOG_DEBUG] [--use-attr-cache=true]\n\n");
+    fprintf(stdout, "    [--use-https=true] [--file-cache-timeout-in-seconds=120] [--log-level=LOG_OFF|LOG_CRIT|LOG_ERR|LOG_WARNING|LOG_INFO|LOG_DEBUG] [--use-attr-cache=true]");
+    fprintf(stdout, "    [--attr-cache-timeout-in-seconds=120] [--attr-cache-max-entries=500000] [--dir-cache-timeout-in-seconds=0]");
+    fprintf(stdout, "    [--stat-burst-threshold=0] [--change-poll-interval-in-seconds=0] [--read-hedge-percentile=0]");
+    fprintf(stdout, "    [--max-concurrency=20] [--warm-connections=0]\n\n");
     fprintf(stdout, "In addition to setting --tmp-path parameter, you must also do one of the following:\n");
     fprintf(stdout, "1. Specify a config file (using --config-file]=) with account name (accountName), container name (containerName), and\n");
     fprintf(stdout,  "\ta. account key (accountKey),\n");
@@ -886,6 +923,80 @@ int read_and_set_arguments(int argc, char *argv[], struct fuse_args *args)
         }
     }
 
+    str_options.attr_cache_timeout_in_seconds = 120;
+    if (options.attr_cache_timeout_in_seconds != NULL)
+    {
+        std::string timeout(options.attr_cache_timeout_in_seconds);
+        str_options.attr_cache_timeout_in_seconds = stoi(timeout);
+    }
+
+    str_options.attr_cache_max_entries = 500000;
+    if (options.attr_cache_max_entries != NULL)
+    {
+        std::string max_entries(options.attr_cache_max_entries);
+        str_options.attr_cache_max_entries = stoul(max_entries);
+    }
+
+    str_options.dir_cache_timeout_in_seconds = 0;
+    if (options.dir_cache_timeout_in_seconds != NULL)
+    {
+        std::string timeout(options.dir_cache_timeout_in_seconds);
+        str_options.dir_cache_timeout_in_seconds = stoi(timeout);
+    }
+
+    str_options.stat_burst_threshold = 0;
+    if (options.stat_burst_threshold != NULL)
+    {
+        std::string threshold(options.stat_burst_threshold);
+        str_options.stat_burst_threshold = stoi(threshold);
+    }
+
+    str_options.change_poll_interval_in_seconds = 0;
+    if (options.change_poll_interval_in_seconds != NULL)
+    {
+        std::string interval(options.change_poll_interval_in_seconds);
+        str_options.change_poll_interval_in_seconds = stoi(interval);
+    }
+
+    str_options.read_hedge_percentile = 0;
+    if (options.read_hedge_percentile != NULL)
+    {
+        std::string percentile(options.read_hedge_percentile);
+        str_options.read_hedge_percentile = stoi(percentile);
+        if (str_options.read_hedge_percentile < 0 || str_options.read_hedge_percentile > 99)
+        {
+            syslog(LOG_CRIT, "Unable to start blobfuse. --read-hedge-percentile must be between 0 and 99.");
+            fprintf(stderr, "Error: --read-hedge-percentile must be between 0 and 99.\n");
+            return 1;
+        }
+    }
+
+    str_options.max_concurrency = constants::max_concurrency_blob_wrapper;
+    if (options.max_concurrency != NULL)
+    {
+        std::string concurrency(options.max_concurrency);
+        str_options.max_concurrency = stoi(concurrency);
+        if (str_options.max_concurrency < 1)
+        {
+            syslog(LOG_CRIT, "Unable to start blobfuse. --max-concurrency must be at least 1.");
+            fprintf(stderr, "Error: --max-concurrency must be at least 1.\n");
+            return 1;
+        }
+    }
+
+    str_options.warm_connections = 0;
+    if (options.warm_connections != NULL)
+    {
+        std::string connections(options.warm_connections);
+        str_options.warm_connections = stoi(connections);
+        if (str_options.warm_connections < 0 || str_options.warm_connections > str_options.max_concurrency)
+        {
+            syslog(LOG_CRIT, "Unable to start blobfuse. --warm-connections must be between 0 and --max-concurrency.");
+            fprintf(stderr, "Error: --warm-connections must be between 0 and --max-concurrency.\n");
+            return 1;
+        }
+    }
+
     if (options.file_cache_timeout_in_seconds != NULL)
     {
         std::string timeout(options.file_cache_timeout_in_seconds);
@@ -951,14 +1062,14 @@ int validate_storage_connection()
             //2. try to make blob client wrapper using oauth token
             temp_azure_blob_client_wrapper = blob_client_wrapper_init_oauth(
                     str_options.accountName,
-                    constants::max_concurrency_blob_wrapper,
+                    str_options.max_concurrency,
                     str_options.blobEndpoint);
         }
         else if(AuthType == KEY_AUTH) {
             temp_azure_blob_client_wrapper = blob_client_wrapper_init_accountkey(
             str_options.accountName,
             str_options.accountKey,
-            constants::max_concurrency_blob_wrapper,
+            str_options.max_concurrency,
             str_options.use_https,
             str_options.blobEndpoint);
         }
@@ -966,7 +1077,7 @@ int validate_storage_connection()
             temp_azure_blob_client_wrapper = blob_client_wrapper_init_sastoken(
             str_options.accountName,
             str_options.sasToken,
-            constants::max_concurrency_blob_wrapper,
+            str_options.max_concurrency,
             str_options.use_https,
             str_options.blobEndpoint);
         }
@@ -1025,7 +1136,8 @@ void configure_fuse(struct fuse_args *args)
     fuse_opt_add_arg(args, "-ohard_remove");
     fuse_opt_add_arg(args, "-obig_writes");
     fuse_opt_add_arg(args, "-ofsname=blobfuse");
-    fuse_opt_add_arg(args, "-okernel_cache");
+    // We don't pass "-okernel_cache", as that would make FUSE keep the kernel's page cache across every open, even once the blob has changed.
+    // Instead azs_open decides for each open whether the kernel's cached pages are still good.
     umask(0);
 }
 
@@ -30,6 +30,7 @@
 #include <fuse.h>
 #include <stddef.h>
 #include "blob/blob_client.h"
+#include "path_tree.h"
 #include "OAuthToken.h"
 #include "OAuthTokenCredentialManager.h"
 
@@ -63,6 +64,7 @@ using namespace microsoft_azure::storage;
 // This class contains mutexes that we use to lock file paths during blob upload / download / delete.
 // Each blob / file path gets its own mutex.
 // This mutex should never be held when control is not in an open(), flush(), or unlink() method.
+// The mutexes are kept in a path_tree, so a directory name shared by many files is only stored once.
 class file_lock_map
 {
 public:
@@ -76,8 +78,7 @@ private:
 
     static std::shared_ptr<file_lock_map> s_instance;
     static std::mutex s_mutex;
-    std::mutex m_mutex;
-    std::map<std::string, std::shared_ptr<std::mutex>> m_lock_map;
+    microsoft_azure::storage::path_tree<std::mutex> m_lock_map;
 };
 
 // deque to age cached files based on timeout
@@ -93,6 +94,8 @@ class gc_cache
         gc_cache() : disk_threshold_reached(false){}
         void run();
         void add_file(std::string path);
+        // Whether the file at the path is waiting to be considered for cleanup.
+        bool is_pending(const std::string &path);
 
     private:
         bool disk_threshold_reached;
@@ -106,13 +109,132 @@ class gc_cache
 
 extern gc_cache g_gc_cache;
 
+// One child of a directory, as recorded in a cached directory listing.
+struct dir_entry_info
+{
+    bool is_directory;
+    unsigned long long size;
+    time_t last_modified;
+    // True if last_modified is only the local time of a change made through this mount, as the service didn't tell us its own time for it.
+    // A local time can't be compared with the service's, so the change poller only compares the size of such an entry.
+    bool local_last_modified;
+};
+
+// Caches complete listings of directories on the service, so that repeated readdir calls on the same directory, and getattr calls
+// for names that do not exist in a listed directory, can be answered without a call to Storage.
+// Listings expire after a timeout.  Changes made through this mount (create, unlink, mkdir, rmdir, rename) patch the cached listings in place,
+// so they are visible immediately; changes made by other clients are only picked up once the listing expires.
+// Paths are the paths passed in from FUSE - "/" for the root, otherwise "/a/b" with no trailing slash.
+//
+// The cache also watches for bursts of lookups of siblings in a directory that has not been listed (globbing, or stat-ing a list of files from a manifest.)
+// Past a threshold, it's cheaper to list the whole directory once than to carry on with a list + HEAD per name, so getattr does that,
+// and keeps the listing for at least burst_listing_lifetime_in_seconds even if the cache is otherwise disabled.
+class dir_listing_cache
+{
+    public:
+        dir_listing_cache() : m_timeout_in_seconds(0), m_generation(0), m_burst_threshold(0){}
+        void set_timeout(int timeout_in_seconds);
+
+        // Sets the number of lookups in one directory within burst_window_in_seconds that trigger a listing of the directory.  0 disables burst detection.
+        void set_burst_threshold(int threshold);
+
+        static const int burst_window_in_seconds = 2;
+        static const int burst_listing_lifetime_in_seconds = 10;
+
+        // Returns a token to pass to store_listing once a listing from the service is complete.
+        // If any change is recorded in the cache while the listing is in progress, the listing may not include it, so it is discarded rather than stored.
+        unsigned long long begin_listing();
+        // The listing is kept for the configured timeout, or for min_lifetime_in_seconds if that is longer.
+        void store_listing(const std::string& dir, const std::map<std::string, dir_entry_info>& entries, unsigned long long token, int min_lifetime_in_seconds = 0);
+
+        // Copies the listing of the directory into entries and returns true if there is an unexpired listing for it.
+        bool get_listing(const std::string& dir, std::map<std::string, dir_entry_info>& entries);
+
+        // Returns 1 if the directory has an unexpired listing with any entries in it, 0 if it has one with none, and -1 if we don't know.
+        int has_children(const std::string& dir);
+
+        // Returns the paths of all the directories with an unexpired listing.
+        std::vector<std::string> listed_directories();
+
+        // Looks up a path in the listing of its parent directory.
+        // Returns 1 (and fills in info) if it is listed, 0 if the parent has an unexpired listing that does not contain it, and -1 if we don't know.
+        int lookup(const std::string& path, dir_entry_info& info);
+
+        // Records a lookup of a path that could not be answered from the cache.
+        // Returns true if it completes a burst of lookups in the same directory, in which case the caller should list the directory and store the listing.
+        bool record_lookup_miss(const std::string& path);
+
+        // Record a file or directory created, overwritten or removed through this mount in the listing of its parent.
+        void add_entry(const std::string& path, const dir_entry_info& info);
+        void remove_entry(const std::string& path);
+
+        // Drop the listings of the directory and of everything under it.
+        void invalidate_tree(const std::string& dir);
+
+    private:
+        struct dir_listing
+        {
+            time_t listed_time;
+            time_t expiry_time;
+            std::map<std::string, dir_entry_info> entries;
+        };
+
+        // Lookup misses in one directory since the start of the current burst window.
+        struct lookup_misses
+        {
+            time_t window_start;
+            int count;
+        };
+
+        // Bounds the memory used by the cache; the least recently listed directories are dropped past this.
+        static const size_t max_listings = 10000;
+        // Bounds the number of directories tracked for burst detection; past this, tracking starts over.
+        static const size_t max_tracked_directories = 1000;
+
+        bool is_fresh(const dir_listing& listing, time_t now);
+        static void split_path(const std::string& path, std::string& parent, std::string& name);
+
+        int m_timeout_in_seconds;
+        unsigned long long m_generation; // Incremented on every change recorded in the cache.
+        // Keyed by directory path.  Dropping the listings under a directory only touches that directory's subtree.
+        // The path_tree has its own lock, but m_mutex is still held across each operation so that listings and m_generation change together.
+        microsoft_azure::storage::path_tree<dir_listing> m_listings;
+        int m_burst_threshold;
+        std::map<std::string, lookup_misses> m_misses; // Keyed by directory path.
+        std::mutex m_mutex;
+};
+
+extern dir_listing_cache g_dir_listing_cache;
+
+// Watches the service for changes made by other clients to the directories in the directory listing cache.
+// Every interval, each listed directory is listed again and compared with the cached listing.  Blobs that changed or went away have their cached
+// attributes invalidated and any idle copy in the file cache removed, and subdirectories that went away have their listings dropped; everything
+// that did not change stays cached, and the fresh listing replaces the old one, starting its timeout over.
+// This lets the cache timeouts be set much longer than the window of staleness that's acceptable, with the poll interval bounding that window instead.
+class change_poller
+{
+    public:
+        change_poller() : m_interval_in_seconds(0){}
+        // Starts polling in the background.  An interval of 0 disables polling.
+        void run(int interval_in_seconds);
+
+    private:
+        int m_interval_in_seconds;
+        void run_change_poller();
+        void poll_directory(const std::string& dir);
+        void discard_stale_file(const std::string& path);
+};
+
+extern change_poller g_change_poller;
+
 // FUSE gives you one 64-bit pointer to use for communication between API's.
 // An instance of this struct is pointed to by that pointer.
 struct fhwrapper
 {
     int fh; // The handle to the file in the file cache to use for read/write operations.
     bool upload; // True if the blob should be uploaded when the file is closed.  (False when the file was opened in read-only mode.)
-    fhwrapper(int fh, bool upload) : fh(fh), upload(upload)
+    std::shared_ptr<download_progress> download; // Set if the file was still downloading when opened; reads wait for their range to land.
+    fhwrapper(int fh, bool upload, std::shared_ptr<download_progress> download = nullptr) : fh(fh), upload(upload), download(download)
     {
 
     }
@@ -141,6 +263,14 @@ struct str_options
     std::string logLevel;
     bool use_https;
     bool use_attr_cache;
+    unsigned int attr_cache_timeout_in_seconds;
+    size_t attr_cache_max_entries;
+    int dir_cache_timeout_in_seconds;
+    int stat_burst_threshold;
+    int change_poll_interval_in_seconds;
+    int read_hedge_percentile;
+    int max_concurrency;
+    int warm_connections;
 };
 
 extern struct str_options str_options;
@@ -191,6 +321,10 @@ int ensure_files_directory_exists_in_cache(const std::string& file_path);
 // Greedily list all blobs using the input params.
 std::vector<std::pair<std::vector<list_blobs_hierarchical_item>, bool>> list_all_blobs_hierarchical(const std::string& container, const std::string& delimiter, const std::string& prefix, const std::size_t maxresults=0);
 
+// Lists the immediate children of a directory on the service, keyed by name, in the form kept by the directory listing cache.
+// dir is the path as passed in from FUSE ("/" or "/a/b").  Returns 0 on success, or the (unmapped) errno from the failed listing.
+int list_directory_entries(const std::string& dir, std::map<std::string, dir_entry_info>& entries);
+
 // Returns:
 // 0 if there's nothing there (the directory does not exist)
 // 1 If there's either the ".directory" blob, or the hdfs-type directory blob
@@ -200,6 +334,10 @@ int is_directory_empty(const std::string& container, const std::string& dir_name
 // Returns true if the input has zero length and the "hdi_isfolder=true" metadata.
 bool is_directory_blob(unsigned long long size, std::vector<std::pair<std::string, std::string>> metadata);
 
+// Stops any download into the cache of the file at the path, before the file is created, removed, truncated, renamed or found stale; otherwise
+// the download would put the old contents back in the cache when it finished.  Must be called with the path's mutex held (see file_lock_map.)
+void cancel_pending_download(const std::string& path);
+
 /**
  * get_attr is the general-purpose "get information about the file or directory at this path"
  * function called by FUSE.  Most important is to return whether the item is a file or a directory.
@@ -208,7 +346,7 @@ bool is_directory_blob(unsigned long long size, std::vector<std::pair<std::strin
  * Note that this is called many times, so perf here is important.
  *
  * TODO: Minimize calls to Storage
- * TODO: Returned cached information, especially from a prior List call
+ * Answered from the directory listing cache when the parent directory has been listed recently.
  *
  * @param  path  The path for which information should be evaluated.
  * @param  stbuf The 'stat' struct containing the output information.
@@ -24,12 +24,20 @@ int azs_mkdir(const char *path, mode_t)
     {
         syslog(LOG_INFO, "Successfully uploaded zero-length directory marker for path %s to blob %s. ", path, pathstr.c_str()+1);
     }
+
+    dir_entry_info entry;
+    entry.is_directory = true;
+    entry.size = 0;
+    entry.last_modified = time(NULL);
+    entry.local_last_modified = true;
+    g_dir_listing_cache.add_entry(pathstr, entry);
     return 0;
 }
 
 /**
  * Read the contents of a directory.  For each entry to add, call the filler function with the input buffer,
- * the name of the entry, and additional data about the entry.  TODO: Keep the data (somehow) for latter getattr calls.
+ * the name of the entry, and additional data about the entry.
+ * The listing from the service is kept in the directory listing cache, for later readdir and getattr calls.
  *
  * @param  path   Path to the directory to read.
  * @param  buf    Buffer to pass into the filler function.  Not otherwise used in this function.
@@ -101,17 +109,24 @@ int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, stru
         AZS_DEBUGLOGV("Directory %s not found in file cache during readdir operation for %s.\n", mntPathString.c_str(), path);
     }
 
-    errno = 0;
-    std::vector<std::pair<std::vector<list_blobs_hierarchical_item>, bool>> listResults = list_all_blobs_hierarchical(str_options.containerName, "/", pathStr.substr(1));
-    if (errno != 0)
+    // The directory's path as FUSE passes it to us, without the trailing slash.
+    std::string dirPathStr(path);
+    std::map<std::string, dir_entry_info> service_entries;
+    if (g_dir_listing_cache.get_listing(dirPathStr, service_entries))
     {
-        int storage_errno = errno;
-        syslog(LOG_ERR, "Failed to list blobs under directory %s on the service during readdir operation.  errno = %d.\n", mntPathString.c_str(), storage_errno);
-        return 0 - map_errno(storage_errno);
+        AZS_DEBUGLOGV("Using the cached listing of directory %s.  Total entries = %s.\n", path, to_str(service_entries.size()).c_str());
     }
     else
     {
-        AZS_DEBUGLOGV("Reading blobs of directory %s on the service.  Total blob lists found = %s.\n", pathStr.c_str()+1, to_str(listResults.size()).c_str());
+        unsigned long long listing_token = g_dir_listing_cache.begin_listing();
+        int storage_errno = list_directory_entries(dirPathStr, service_entries);
+        if (storage_errno != 0)
+        {
+            syslog(LOG_ERR, "Failed to list blobs under directory %s on the service during readdir operation.  errno = %d.\n", mntPathString.c_str(), storage_errno);
+            return 0 - map_errno(storage_errno);
+        }
+
+        g_dir_listing_cache.store_listing(dirPathStr, service_entries, listing_token);
     }
 
     // Fill the blobfuse current and parent directories
@@ -122,71 +137,41 @@ int azs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, stru
     filler(buf, ".", &stcurrentbuf, 0);
     filler(buf, "..", &stparentbuf, 0);
 
-    // Enumerating segments of list_blobs response
-    for (size_t result_lists_index = 0; result_lists_index < listResults.size(); result_lists_index++)
+    for (auto iter = service_entries.begin(); iter != service_entries.end(); ++iter)
     {
-        // Check to see if the first list_blobs__hierarchical_item can be skipped to avoid duplication
-        int start = listResults[result_lists_index].second ? 1 : 0;
-        for (size_t i = start; i < listResults[result_lists_index].first.size(); i++)
+        int fillerResult;
+        const std::string& prev_token_str = iter->first;
+
+        // Any files that exist both on the service and in the local cache will be in both lists, we need to de-dup them.
+        // TODO: order or hash the list to improve perf
+        if (std::find(local_list_results.begin(), local_list_results.end(), prev_token_str) == local_list_results.end())
         {
-            int fillerResult;
-            // We need to parse out just the trailing part of the path name.
-            int len = listResults[result_lists_index].first[i].name.size();
-            if (len > 0)
+            if (!iter->second.is_directory)
             {
-                std::string prev_token_str;
-                if (listResults[result_lists_index].first[i].name.back() == '/')
-                {
-                    prev_token_str = listResults[result_lists_index].first[i].name.substr(pathStr.size() - 1, listResults[result_lists_index].first[i].name.size() - pathStr.size());
-                }
-                else
-                {
-                    prev_token_str = listResults[result_lists_index].first[i].name.substr(pathStr.size() - 1);
-                }
-
-                // Any files that exist both on the service and in the local cache will be in both lists, we need to de-dup them.
-                // TODO: order or hash the list to improve perf
-                if (std::find(local_list_results.begin(), local_list_results.end(), prev_token_str) == local_list_results.end())
-                {
-                    if (!listResults[result_lists_index].first[i].is_directory && !is_directory_blob(listResults[result_lists_index].first[i].content_length, listResults[result_lists_index].first[i].metadata))
-                    {
-                        if ((prev_token_str.size() > 0) && (strcmp(prev_token_str.c_str(), former_directory_signifier.c_str()) != 0))
-                        {
-                            struct stat stbuf;
-                            stbuf.st_mode = S_IFREG | default_permission; // Regular file (not a directory)
-                            stbuf.st_uid = fuse_get_context()->uid;
-                            stbuf.st_gid = fuse_get_context()->gid;
-                            stbuf.st_nlink = 1;
-                            stbuf.st_size = listResults[result_lists_index].first[i].content_length;
-                            fillerResult = filler(buf, prev_token_str.c_str(), &stbuf, 0); // TODO: Add stat information.  Consider FUSE_FILL_DIR_PLUS.
-                            AZS_DEBUGLOGV("Blob %s found in directory %s on the service during readdir operation.  Adding to readdir list; fillerResult = %d.\n", prev_token_str.c_str(), pathStr.c_str()+1, fillerResult);
-                        }
-                    }
-                    else
-                    {
-                        if (prev_token_str.size() > 0)
-                        {
-
-                            // Avoid duplicate directories - this avoids duplicate entries of legacy WASB and HNS directories
-                               local_list_results.push_back(prev_token_str);
-
-                            struct stat stbuf;
-                            stbuf.st_mode = S_IFDIR | default_permission;
-                            stbuf.st_uid = fuse_get_context()->uid;
-                            stbuf.st_gid = fuse_get_context()->gid;
-                            stbuf.st_nlink = 2;
-                            fillerResult = filler(buf, prev_token_str.c_str(), &stbuf, 0);
-                            AZS_DEBUGLOGV("Blob directory %s found in directory %s on the service during readdir operation.  Adding to readdir list; fillerResult = %d. uid=%u. gid = %u\n", prev_token_str.c_str(), pathStr.c_str()+1, fillerResult, stbuf.st_uid, stbuf.st_gid);
-                        }
-                    }
-
-                }
-                else
-                {
-                    AZS_DEBUGLOGV("Skipping adding blob %s to readdir results because it was already added from the local cache.\n", prev_token_str.c_str());
-                }
+                struct stat stbuf;
+                stbuf.st_mode = S_IFREG | default_permission; // Regular file (not a directory)
+                stbuf.st_uid = fuse_get_context()->uid;
+                stbuf.st_gid = fuse_get_context()->gid;
+                stbuf.st_nlink = 1;
+                stbuf.st_size = iter->second.size;
+                fillerResult = filler(buf, prev_token_str.c_str(), &stbuf, 0); // TODO: Add stat information.  Consider FUSE_FILL_DIR_PLUS.
+                AZS_DEBUGLOGV("Blob %s found in directory %s on the service during readdir operation.  Adding to readdir list; fillerResult = %d.\n", prev_token_str.c_str(), pathStr.c_str()+1, fillerResult);
+            }
+            else
+            {
+                struct stat stbuf;
+                stbuf.st_mode = S_IFDIR | default_permission;
+                stbuf.st_uid = fuse_get_context()->uid;
+                stbuf.st_gid = fuse_get_context()->gid;
+                stbuf.st_nlink = 2;
+                fillerResult = filler(buf, prev_token_str.c_str(), &stbuf, 0);
+                AZS_DEBUGLOGV("Blob directory %s found in directory %s on the service during readdir operation.  Adding to readdir list; fillerResult = %d. uid=%u. gid = %u\n", prev_token_str.c_str(), pathStr.c_str()+1, fillerResult, stbuf.st_uid, stbuf.st_gid);
             }
         }
+        else
+        {
+            AZS_DEBUGLOGV("Skipping adding blob %s to readdir results because it was already added from the local cache.\n", prev_token_str.c_str());
+        }
     }
     return 0;
 }
@@ -258,6 +243,8 @@ int azs_rmdir(const char *path)
         return 0 - map_errno(dir_blob_delete_errno);        
     }
 
+    g_dir_listing_cache.remove_entry(std::string(path));
+    g_dir_listing_cache.invalidate_tree(std::string(path));
     return 0;
 }
 
@@ -16,18 +16,7 @@ file_lock_map* file_lock_map::get_instance()
 
 std::shared_ptr<std::mutex> file_lock_map::get_mutex(const std::string& path)
 {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    auto iter = m_lock_map.find(path);
-    if(iter == m_lock_map.end())
-    {
-        auto file_mutex = std::make_shared<std::mutex>();
-        m_lock_map[path] = file_mutex;
-        return file_mutex;
-    }
-    else
-    {
-        return iter->second;
-    }
+    return m_lock_map.get_or_create(path, [](){ return std::make_shared<std::mutex>(); });
 }
 
 std::shared_ptr<file_lock_map> file_lock_map::s_instance;
@@ -36,6 +25,38 @@ std::mutex file_lock_map::s_mutex;
 std::deque<file_to_delete> cleanup;
 std::mutex deque_lock;
 
+// Downloads into the file cache that azs_open returned from before they finished, by path.  A finished one is dropped the next time its
+// path is looked up.
+static std::map<std::string, std::shared_ptr<download_progress>> pending_downloads;
+static std::mutex pending_downloads_mutex;
+
+// Returns the download into the cache of the file at the path, if one is still running.
+static std::shared_ptr<download_progress> find_pending_download(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(pending_downloads_mutex);
+    auto entry = pending_downloads.find(path);
+    if (entry == pending_downloads.end())
+    {
+        return nullptr;
+    }
+    if (entry->second->finished())
+    {
+        pending_downloads.erase(entry);
+        return nullptr;
+    }
+    return entry->second;
+}
+
+void cancel_pending_download(const std::string& path)
+{
+    std::shared_ptr<download_progress> download = find_pending_download(path);
+    if (download != nullptr)
+    {
+        AZS_DEBUGLOGV("Cancelling the download of %s into the file cache.\n", path.c_str());
+        download->cancel();
+    }
+}
+
 // Opens a file for reading or writing
 // Behavior is defined by a normal, open() system call.
 // In all methods in this file, the variables "path" and "pathString" refer to the input path - the path as seen by the application using FUSE as a file system.
@@ -53,13 +74,32 @@ int azs_open(const char *path, struct fuse_file_info *fi)
     auto fmutex = file_lock_map::get_instance()->get_mutex(path);
     std::lock_guard<std::mutex> lock(*fmutex);
 
+    // A file opened only for reading can be read while it downloads, so the open returns as soon as the first chunk is in (see azs_read.)
+    // One opened for writing can't, as the download would overwrite what was written.
+    const bool readOnly = (fi->flags & O_ACCMODE) == O_RDONLY;
+    std::shared_ptr<download_progress> download = find_pending_download(pathString);
+    if (download != nullptr && !readOnly)
+    {
+        // If the download fails, the file isn't in the cache, and is downloaded again below.
+        download->wait();
+        download = nullptr;
+    }
+
     // If the file/blob being opened does not exist in the cache, or the version in the cache is too old, we need to download / refresh the data from the service.
     // If the file hasn't been modified, st_ctime is the time when the file was originally downloaded or created.  st_mtime is the time when the file was last modified.  
     // We only want to refresh if enough time has passed that both are more than cache_timeout seconds ago.
     struct stat buf;
     int statret = stat(mntPath, &buf);
     time_t now = time(NULL);
-    if ((statret != 0) || (((now - buf.st_mtime) > file_cache_timeout_in_seconds) && ((now - buf.st_ctime) > file_cache_timeout_in_seconds)))
+
+    // Whether the kernel may keep the pages it has cached for this file (see the end of this function.)
+    bool keepKernelCache = true;
+    if (download != nullptr)
+    {
+        // An earlier open left the file downloading, and this one joins it.  The kernel can't have its pages from before the download started.
+        keepKernelCache = false;
+    }
+    else if ((statret != 0) || (((now - buf.st_mtime) > file_cache_timeout_in_seconds) && ((now - buf.st_ctime) > file_cache_timeout_in_seconds)))
     {
         bool skipCacheUpdate = false;
         if (statret == 0) // File exists
@@ -111,28 +151,76 @@ int azs_open(const char *path, struct fuse_file_info *fi)
                 return -1;
             }
 
-            errno = 0;
-            time_t last_modified = {};
-            azure_blob_client_wrapper->download_blob_to_file(str_options.containerName, pathString.substr(1), mntPathString, last_modified);
-            if (errno != 0)
+            if (readOnly)
             {
-                int storage_errno = errno;
-                syslog(LOG_ERR, "Failed to download blob into cache.  Blob name: %s, file name = %s, storage errno = %d.\n", pathString.c_str()+1, mntPathString.c_str(),  errno);
+                errno = 0;
+                download = azure_blob_client_wrapper->start_download_blob_to_file(str_options.containerName, pathString.substr(1), mntPathString,
+                    [pathString, mntPathString](int error, time_t last_modified) {
+                        if (error == 0)
+                        {
+                            // preserve the last modified time
+                            struct utimbuf new_time;
+                            new_time.modtime = last_modified;
+                            new_time.actime = 0;
+                            utime(mntPathString.c_str(), &new_time);
+                            syslog(LOG_INFO, "Successfully downloaded blob %s into file cache as %s.\n", pathString.c_str()+1, mntPathString.c_str());
+
+                            // Every handle on the file may have been released before it was moved into the cache, and azs_release only hands
+                            // the GC files it finds there.  The GC passes over a file that is still open, and azs_release adds it again later.
+                            g_gc_cache.add_file(pathString);
+                        }
+                        else if (error != ECANCELED)
+                        {
+                            syslog(LOG_ERR, "Failed to download blob into cache.  Blob name: %s, file name = %s, storage errno = %d.\n", pathString.c_str()+1, mntPathString.c_str(), error);
+                        }
+                    });
+                if (download == nullptr)
+                {
+                    int storage_errno = errno;
+                    syslog(LOG_ERR, "Failed to download blob into cache.  Blob name: %s, file name = %s, storage errno = %d.\n", pathString.c_str()+1, mntPathString.c_str(), storage_errno);
+                    return 0 - map_errno(storage_errno);
+                }
+                {
+                    std::lock_guard<std::mutex> pendingLock(pending_downloads_mutex);
+                    pending_downloads[pathString] = download;
+                }
 
-                remove(mntPath);
-                return 0 - map_errno(storage_errno);
+                // As below, but with the blob's last modified time and size from the first chunk, as the file isn't finished.
+                keepKernelCache = (statret == 0) && (buf.st_mtime == download->last_modified()) && (buf.st_size == static_cast<off_t>(download->length()));
             }
             else
             {
-                syslog(LOG_INFO, "Successfully downloaded blob %s into file cache as %s.\n", pathString.c_str()+1, mntPathString.c_str());
-            }
-            
-            // preserve the last modified time
-            struct utimbuf new_time;
-            new_time.modtime = last_modified;
-            new_time.actime = 0;
-            utime(mntPathString.c_str(), &new_time);
+                errno = 0;
+                time_t last_modified = {};
+                azure_blob_client_wrapper->download_blob_to_file(str_options.containerName, pathString.substr(1), mntPathString, last_modified);
+                if (errno != 0)
+                {
+                    int storage_errno = errno;
+                    syslog(LOG_ERR, "Failed to download blob into cache.  Blob name: %s, file name = %s, storage errno = %d.\n", pathString.c_str()+1, mntPathString.c_str(),  errno);
 
+                    remove(mntPath);
+                    return 0 - map_errno(storage_errno);
+                }
+                else
+                {
+                    syslog(LOG_INFO, "Successfully downloaded blob %s into file cache as %s.\n", pathString.c_str()+1, mntPathString.c_str());
+                }
+            
+                // preserve the last modified time
+                struct utimbuf new_time;
+                new_time.modtime = last_modified;
+                new_time.actime = 0;
+                utime(mntPathString.c_str(), &new_time);
+
+                // The cached copy we replaced had the blob's last modified time as its mtime too, so if that and the size are unchanged, so is the data.
+                // If there was no cached copy, we can't tell what the kernel might be holding from an earlier open, so assume it's out of date.
+                struct stat newbuf;
+                keepKernelCache = (statret == 0) && (stat(mntPath, &newbuf) == 0) && (newbuf.st_mtime == buf.st_mtime) && (newbuf.st_size == buf.st_size);
+            }
+            if (!keepKernelCache)
+            {
+                AZS_DEBUGLOGV("Contents of %s may have changed on the service; the kernel's cached pages for it will be dropped.\n", path);
+            }
         }
     }
 
@@ -141,7 +229,15 @@ int azs_open(const char *path, struct fuse_file_info *fi)
 
     // Open a file handle to the file in the cache.
     // This will be stored in 'fi', and used for later read/write operations.
-    res = open(mntPath, fi->flags);
+    // A file still downloading is opened where the download is writing it, and the handle stays on it once it is moved into the cache.
+    res = open(download != nullptr ? download->path().c_str() : mntPath, fi->flags);
+    if (res == -1 && download != nullptr && errno == ENOENT)
+    {
+        // The download has just finished, and moved the file into the cache.
+        download = nullptr;
+        errno = 0;
+        res = open(mntPath, fi->flags);
+    }
 
     if (res == -1)
     {
@@ -163,9 +259,14 @@ int azs_open(const char *path, struct fuse_file_info *fi)
 
     // Store the open file handle, and whether or not the file should be uploaded on close().
     // TODO: Optimize the scenario where the file is open for read/write, but no actual writing occurs, to not upload the blob.
-    struct fhwrapper *fhwrap = new fhwrapper(res, (((fi->flags & O_WRONLY) == O_WRONLY) || ((fi->flags & O_RDWR) == O_RDWR)));
+    struct fhwrapper *fhwrap = new fhwrapper(res, (((fi->flags & O_WRONLY) == O_WRONLY) || ((fi->flags & O_RDWR) == O_RDWR)), download);
     fi->fh = (long unsigned int)fhwrap; // Store the file handle for later use.
 
+    // Let the kernel keep serving this file from its page cache across opens, unless we've just fetched a version of the blob that may differ from what it has.
+    // FUSE 2.9's high-level API gives us no way to reach the kernel's caches outside of a call like this one, so a change found elsewhere
+    // (on revalidation, or by the change poller) reaches the kernel when the file is next opened: the stale copy is dropped from the file cache, and this re-fetches it.
+    fi->keep_cache = keepKernelCache ? 1 : 0;
+
     AZS_DEBUGLOGV("Returning success from azs_open, file = %s\n", path);
     return 0;
 }
@@ -183,7 +284,19 @@ int azs_open(const char *path, struct fuse_file_info *fi)
  */
 int azs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int fd = ((struct fhwrapper *)fi->fh)->fh;
+    struct fhwrapper *fhwrap = (struct fhwrapper *)fi->fh;
+    int fd = fhwrap->fh;
+
+    // If the file was still downloading when it was opened, wait for the range being read to land.  It is downloaded next if it hasn't been started on.
+    if (fhwrap->download != nullptr)
+    {
+        int download_errno = fhwrap->download->wait_for_range(offset, size);
+        if (download_errno != 0)
+        {
+            syslog(LOG_ERR, "Failed to read %s, as its download into the file cache failed.  storage errno = %d.\n", path, download_errno);
+            return 0 - map_errno(download_errno);
+        }
+    }
 
     errno = 0;
     int res = pread(fd, buf, size, offset);
@@ -208,6 +321,7 @@ int azs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     std::string mntPathString = prepend_mnt_path_string(pathString);
     mntPath = mntPathString.c_str();
     int res;
+    cancel_pending_download(pathString);
     ensure_files_directory_exists_in_cache(mntPathString);
 
     // FUSE will set the O_CREAT and O_WRONLY flags, but not O_EXCL, which is generally assumed for 'create' semantics.
@@ -286,6 +400,8 @@ int azs_flush(const char *path, struct fuse_file_info *fi)
     // Note that we don't have to prepend the tmpPath, because we already have it, because we're not using the input path but instead are querying for it.
     std::string mntPathString(path_buffer);
     const char * mntPath = path_buffer;
+    // The path as the application sees it, recovered from mntPath ("<tmpPath>/root/<path>") since path may be null.
+    const std::string pathString = mntPathString.substr(str_options.tmpPath.size() + 5);
     if (access(mntPath, F_OK) != -1 )
     {
         // We cannot close the actual file handle to the temp file, because of the possibility of flush being called multiple times for a given call to open().
@@ -299,7 +415,7 @@ int azs_flush(const char *path, struct fuse_file_info *fi)
             // If the blob upload occurred during that window, this could result in the blob being over-written with a zero-length blob, causing data loss.
             // An flock exclusive lock is not good enough here, because it does not hold across unlink and re-creates, and because the flosk is not acquired in open() before remove() is called during cache refresh.
             // We are not concerned with the possibility of writes from another process occurring during blob upload, because when that other process flushes the file, it will re-upload the blob, correcting any potential errors.
-            auto fmutex = file_lock_map::get_instance()->get_mutex(mntPathString.substr(str_options.tmpPath.size() + 5));
+            auto fmutex = file_lock_map::get_instance()->get_mutex(pathString);
             std::lock_guard<std::mutex> lock(*fmutex);
 
             // Check to ensure that the file still exists; that unlink() hasn't been called previously.
@@ -338,7 +454,9 @@ int azs_flush(const char *path, struct fuse_file_info *fi)
             }
             
             errno = 0;
-            azure_blob_client_wrapper->upload_file_to_blob(mntPath, str_options.containerName, blob_name, metadata, 8);
+            // Writing back data that is already safe in the cache mustn't hold up the lookups and reads of other callers.
+            request_priority_scope background(request_priority::background);
+            blob_property uploaded = azure_blob_client_wrapper->upload_file_to_blob(mntPath, str_options.containerName, blob_name, metadata);
             if (errno != 0)
             {
                 int storage_errno = errno;
@@ -349,6 +467,14 @@ int azs_flush(const char *path, struct fuse_file_info *fi)
             else
             {
                 syslog(LOG_INFO, "Successfully uploaded file %s to blob %s.\n", path, blob_name.c_str());
+
+                // Record the blob's time as the service has it, so that the change poller doesn't take our own upload for someone else's.
+                dir_entry_info entry;
+                entry.is_directory = false;
+                entry.size = buf.st_size;
+                entry.local_last_modified = !uploaded.valid();
+                entry.last_modified = uploaded.valid() ? uploaded.last_modified : time(NULL);
+                g_dir_listing_cache.add_entry(pathString, entry);
             }
         }
     }
@@ -376,6 +502,12 @@ int azs_release(const char *path, struct fuse_file_info * fi)
     // This must be done, even if the file no longer exists, otherwise we're leaking file handles.
     close(((struct fhwrapper *)fi->fh)->fh);
 
+    if (((struct fhwrapper *)fi->fh)->download != nullptr)
+    {
+        // Drops the record of the download if it has finished.
+        find_pending_download(path);
+    }
+
 // TODO: Make this method resiliant to renames of the file (same way flush() is)
     std::string pathString(path);
     const char * mntPath;
@@ -417,6 +549,7 @@ int azs_unlink(const char *path)
     // Acquiring the mutex here guards against that condition.
     auto fmutex = file_lock_map::get_instance()->get_mutex(path);
     std::lock_guard<std::mutex> lock(*fmutex);
+    cancel_pending_download(pathString);
     int remove_success = remove(mntPath);
     // We don't fail if the remove() failed, because that's just removing the file in the local file cache, which may or may not be there.
 
@@ -451,6 +584,10 @@ int azs_unlink(const char *path)
     {
         syslog(LOG_INFO, "Successfully deleted blob %s.", pathString.c_str()+1);
     }
+    if (retval == 0)
+    {
+        g_dir_listing_cache.remove_entry(pathString);
+    }
 
     // Try removing the directory from the local file cache
     // This will fail in the case when the directory is not empty, which is intended.
@@ -465,6 +602,18 @@ int azs_unlink(const char *path)
     return retval;
 }
 
+// Records a blob that azs_truncate has replaced with a zero-length blob in the directory listing cache.
+// uploaded is what the upload returned, which has the blob's new time on the service if the response said.
+static void record_truncated_blob(const std::string& pathString, blob_property& uploaded)
+{
+    dir_entry_info entry;
+    entry.is_directory = false;
+    entry.size = 0;
+    entry.local_last_modified = !uploaded.valid();
+    entry.last_modified = uploaded.valid() ? uploaded.last_modified : time(NULL);
+    g_dir_listing_cache.add_entry(pathString, entry);
+}
+
 int azs_truncate(const char * path, off_t off)
 {
     AZS_DEBUGLOGV("azs_truncate called.  Path = %s, offset = %s\n", path, to_str(off).c_str());
@@ -513,6 +662,7 @@ int azs_truncate(const char * path, off_t off)
 
     auto fmutex = file_lock_map::get_instance()->get_mutex(path);
     std::lock_guard<std::mutex> lock(*fmutex);
+    cancel_pending_download(pathString);
 
     struct stat buf;
     int statret = stat(mntPath, &buf);
@@ -529,7 +679,7 @@ int azs_truncate(const char * path, off_t off)
 
             std::vector<std::pair<std::string, std::string>> metadata;
             errno = 0;
-            azure_blob_client_wrapper->upload_block_blob_from_stream(str_options.containerName, pathString.substr(1), emptyDataStream, metadata);
+            blob_property uploaded = azure_blob_client_wrapper->upload_block_blob_from_stream(str_options.containerName, pathString.substr(1), emptyDataStream, metadata);
             if (errno != 0)
             {
                 syslog(LOG_ERR, "Failed to upload zero-length blob to %s from azs_truncate.  errno = %d\n.", pathString.c_str()+1, errno);
@@ -538,6 +688,7 @@ int azs_truncate(const char * path, off_t off)
             else
             {
                 syslog(LOG_INFO, "Successfully uploaded zero-length blob to path %s from azs_truncate.", pathString.c_str()+1);
+                record_truncated_blob(pathString, uploaded);
                 return 0;
             }
 
@@ -569,7 +720,7 @@ int azs_truncate(const char * path, off_t off)
 
             std::vector<std::pair<std::string, std::string>> metadata;
             errno = 0;
-            azure_blob_client_wrapper->upload_block_blob_from_stream(str_options.containerName, pathString.substr(1), emptyDataStream, metadata);
+            blob_property uploaded = azure_blob_client_wrapper->upload_block_blob_from_stream(str_options.containerName, pathString.substr(1), emptyDataStream, metadata);
             if (errno != 0)
             {
                 int storage_errno = errno;
@@ -579,6 +730,7 @@ int azs_truncate(const char * path, off_t off)
             else
             {
                 syslog(LOG_INFO, "Successfully uploaded zero-length blob to path %s from azs_truncate.", pathString.c_str()+1);
+                record_truncated_blob(pathString, uploaded);
                 return 0;
             }
         }
@@ -603,6 +755,10 @@ int azs_rename_single_file(const char *src, const char *dst)
     auto fdstmutex = file_lock_map::get_instance()->get_mutex(dst);
     std::lock_guard<std::mutex> lockdst(*fdstmutex);
 
+    // A download of either file is of contents that won't be at its path anymore.
+    cancel_pending_download(src);
+    cancel_pending_download(dst);
+
     std::string srcPathString(src);
     const char * srcMntPath;
     std::string srcMntPathString = prepend_mnt_path_string(srcPathString);
@@ -1,7 +1,10 @@
 #include "blobfuse.h"
 #include <sys/file.h>
+#include <curl/curl.h>
 
 gc_cache g_gc_cache;
+dir_listing_cache g_dir_listing_cache;
+change_poller g_change_poller;
 
 int map_errno(int error)
 {
@@ -68,6 +71,19 @@ void gc_cache::add_file(std::string path)
     m_cleanup.push_back(file);
 }
 
+bool gc_cache::is_pending(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(m_deque_lock);
+    for (const file_to_delete &file : m_cleanup)
+    {
+        if (file.path == path)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 void gc_cache::run()
 {
     std::thread t1(std::bind(&gc_cache::run_gc_cache,this));
@@ -177,6 +193,331 @@ void gc_cache::run_gc_cache()
 
 }
 
+void dir_listing_cache::set_timeout(int timeout_in_seconds)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_timeout_in_seconds = timeout_in_seconds;
+    m_listings.erase_subtree("/");
+}
+
+void dir_listing_cache::set_burst_threshold(int threshold)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_burst_threshold = threshold;
+    m_misses.clear();
+}
+
+bool dir_listing_cache::is_fresh(const dir_listing& listing, time_t now)
+{
+    return now < listing.expiry_time;
+}
+
+// Splits "/a/b/c" into "/a/b" and "c", and "/a" into "/" and "a".
+void dir_listing_cache::split_path(const std::string& path, std::string& parent, std::string& name)
+{
+    size_t last_slash_idx = path.rfind('/');
+    if (last_slash_idx == std::string::npos)
+    {
+        parent = "/";
+        name = path;
+        return;
+    }
+    parent = last_slash_idx == 0 ? "/" : path.substr(0, last_slash_idx);
+    name = path.substr(last_slash_idx + 1);
+}
+
+unsigned long long dir_listing_cache::begin_listing()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_generation;
+}
+
+void dir_listing_cache::store_listing(const std::string& dir, const std::map<std::string, dir_entry_info>& entries, unsigned long long token, int min_lifetime_in_seconds)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int lifetime_in_seconds = std::max(m_timeout_in_seconds, min_lifetime_in_seconds);
+    if (lifetime_in_seconds <= 0 || token != m_generation)
+    {
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (m_listings.size() >= max_listings && !m_listings.find(dir))
+    {
+        // Make room - first by dropping everything that has expired, then if that isn't enough, the oldest listing.
+        std::vector<std::string> expired;
+        std::string oldest;
+        time_t oldest_time = 0;
+        m_listings.for_each("/", [&](const std::string& path, const std::shared_ptr<dir_listing>& listing) {
+            if (!is_fresh(*listing, now))
+            {
+                expired.push_back(path);
+            }
+            else if (oldest.empty() || listing->listed_time < oldest_time)
+            {
+                oldest = path;
+                oldest_time = listing->listed_time;
+            }
+        });
+        for (size_t i = 0; i < expired.size(); i++)
+        {
+            m_listings.erase(expired[i]);
+        }
+        if (m_listings.size() >= max_listings && !oldest.empty())
+        {
+            m_listings.erase(oldest);
+        }
+    }
+
+    auto listing = std::make_shared<dir_listing>();
+    listing->listed_time = now;
+    listing->expiry_time = now + lifetime_in_seconds;
+    listing->entries = entries;
+    m_listings.erase(dir);
+    m_listings.get_or_create(dir, [&listing](){ return listing; });
+}
+
+bool dir_listing_cache::get_listing(const std::string& dir, std::map<std::string, dir_entry_info>& entries)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto listing = m_listings.find(dir);
+    if (!listing)
+    {
+        return false;
+    }
+    if (!is_fresh(*listing, time(NULL)))
+    {
+        m_listings.erase(dir);
+        return false;
+    }
+    entries = listing->entries;
+    return true;
+}
+
+int dir_listing_cache::has_children(const std::string& dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto listing = m_listings.find(dir);
+    if (!listing || !is_fresh(*listing, time(NULL)))
+    {
+        return -1;
+    }
+    return listing->entries.empty() ? 0 : 1;
+}
+
+std::vector<std::string> dir_listing_cache::listed_directories()
+{
+    std::vector<std::string> dirs;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    time_t now = time(NULL);
+    m_listings.for_each("/", [&](const std::string& path, const std::shared_ptr<dir_listing>& listing) {
+        if (is_fresh(*listing, now))
+        {
+            dirs.push_back(path);
+        }
+    });
+    return dirs;
+}
+
+int dir_listing_cache::lookup(const std::string& path, dir_entry_info& info)
+{
+    std::string parent, name;
+    split_path(path, parent, name);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto listing = m_listings.find(parent);
+    if (!listing || !is_fresh(*listing, time(NULL)))
+    {
+        return -1;
+    }
+    auto entry = listing->entries.find(name);
+    if (entry == listing->entries.end())
+    {
+        return 0;
+    }
+    info = entry->second;
+    return 1;
+}
+
+bool dir_listing_cache::record_lookup_miss(const std::string& path)
+{
+    std::string parent, name;
+    split_path(path, parent, name);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_burst_threshold <= 0)
+    {
+        return false;
+    }
+
+    time_t now = time(NULL);
+    if (m_misses.size() >= max_tracked_directories && m_misses.find(parent) == m_misses.end())
+    {
+        m_misses.clear();
+    }
+    lookup_misses& misses = m_misses[parent];
+    if (misses.count == 0 || (now - misses.window_start) >= burst_window_in_seconds)
+    {
+        misses.window_start = now;
+        misses.count = 0;
+    }
+    misses.count++;
+    if (misses.count < m_burst_threshold)
+    {
+        return false;
+    }
+
+    // Only the lookup that completes the burst lists the directory; the count starts over for the next one.
+    m_misses.erase(parent);
+    return true;
+}
+
+void dir_listing_cache::add_entry(const std::string& path, const dir_entry_info& info)
+{
+    std::string parent, name;
+    split_path(path, parent, name);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    auto listing = m_listings.find(parent);
+    if (listing)
+    {
+        listing->entries[name] = info;
+    }
+}
+
+void dir_listing_cache::remove_entry(const std::string& path)
+{
+    std::string parent, name;
+    split_path(path, parent, name);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    auto listing = m_listings.find(parent);
+    if (listing)
+    {
+        listing->entries.erase(name);
+    }
+}
+
+void dir_listing_cache::invalidate_tree(const std::string& dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    m_listings.erase_subtree(dir);
+}
+
+void change_poller::run(int interval_in_seconds)
+{
+    m_interval_in_seconds = interval_in_seconds;
+    if (m_interval_in_seconds <= 0)
+    {
+        return;
+    }
+    std::thread t1(std::bind(&change_poller::run_change_poller, this));
+    t1.detach();
+}
+
+void change_poller::run_change_poller()
+{
+    // Nobody is waiting on the poller, so it mustn't take connections from requests that someone is.
+    request_priority_scope background(request_priority::background);
+    while (true)
+    {
+        sleep(m_interval_in_seconds);
+
+        std::vector<std::string> dirs = g_dir_listing_cache.listed_directories();
+        AZS_DEBUGLOGV("Polling %s listed directories for changes on the service.\n", to_str(dirs.size()).c_str());
+        for (size_t i = 0; i < dirs.size(); i++)
+        {
+            poll_directory(dirs[i]);
+        }
+    }
+}
+
+void change_poller::poll_directory(const std::string& dir)
+{
+    std::map<std::string, dir_entry_info> previous;
+    if (!g_dir_listing_cache.get_listing(dir, previous))
+    {
+        return; // Expired or dropped since we started this round.
+    }
+
+    // Listing goes through the attribute cache, which refreshes the cached properties of every blob that is still there.
+    unsigned long long listing_token = g_dir_listing_cache.begin_listing();
+    std::map<std::string, dir_entry_info> current;
+    int list_errno = list_directory_entries(dir, current);
+    if (list_errno != 0)
+    {
+        syslog(LOG_WARNING, "Failed to list directory %s while polling for changes.  errno = %d.\n", dir.c_str(), list_errno);
+        return;
+    }
+
+    std::shared_ptr<blob_client_attr_cache_wrapper> attr_cache_wrapper = std::dynamic_pointer_cast<blob_client_attr_cache_wrapper>(azure_blob_client_wrapper);
+    std::string dir_prefix = dir.size() > 1 ? dir + "/" : dir;
+    for (auto iter = previous.begin(); iter != previous.end(); ++iter)
+    {
+        auto now_entry = current.find(iter->first);
+        bool removed = now_entry == current.end();
+        // A directory's own time says nothing about what's in it (its listing is polled separately), so only its disappearance counts.
+        if (!removed
+            && now_entry->second.is_directory == iter->second.is_directory
+            && (iter->second.is_directory
+                || (now_entry->second.size == iter->second.size
+                    && (iter->second.local_last_modified || now_entry->second.last_modified == iter->second.last_modified))))
+        {
+            continue;
+        }
+
+        std::string path = dir_prefix + iter->first;
+        AZS_DEBUGLOGV("%s changed on the service since its directory was listed.\n", path.c_str());
+        if (iter->second.is_directory)
+        {
+            if (removed || !now_entry->second.is_directory)
+            {
+                g_dir_listing_cache.invalidate_tree(path);
+            }
+        }
+        else
+        {
+            if (removed && attr_cache_wrapper)
+            {
+                attr_cache_wrapper->invalidate_cached_blob(path.substr(1));
+            }
+            discard_stale_file(path);
+        }
+    }
+
+    g_dir_listing_cache.store_listing(dir, current, listing_token);
+}
+
+// Removes the copy of a blob in the file cache, unless it's open - an open file is refreshed on its next open after it's closed, as usual.
+void change_poller::discard_stale_file(const std::string& path)
+{
+    std::string mntPathString = prepend_mnt_path_string(path);
+    const char *mntPath = mntPathString.c_str();
+
+    auto fmutex = file_lock_map::get_instance()->get_mutex(path);
+    std::lock_guard<std::mutex> lock(*fmutex);
+
+    // A download of the old version still running would put it back in the cache once finished.
+    cancel_pending_download(path);
+
+    int fd = open(mntPath, O_WRONLY);
+    if (fd == -1)
+    {
+        return; // Not in the file cache.
+    }
+    // As in the GC, an exclusive flock only succeeds if there are no open handles to the file.
+    if (flock(fd, LOCK_EX|LOCK_NB) == 0)
+    {
+        unlink(mntPath);
+        flock(fd, LOCK_UN);
+        AZS_DEBUGLOGV("Removed stale copy of %s from the file cache.\n", path.c_str());
+    }
+    close(fd);
+}
+
 // Acquire shared lock utility function
 int shared_lock_file(int flags, int fd)
 {
@@ -317,6 +658,60 @@ std::vector<std::pair<std::vector<list_blobs_hierarchical_item>, bool>> list_all
     return results;
 }
 
+int list_directory_entries(const std::string& dir, std::map<std::string, dir_entry_info>& entries)
+{
+    // Blob names under the directory start with its path, minus the leading slash, plus a trailing slash (or nothing, for the root.)
+    std::string pathStr(dir);
+    if (pathStr.size() > 1)
+    {
+        pathStr.push_back('/');
+    }
+
+    errno = 0;
+    std::vector<std::pair<std::vector<list_blobs_hierarchical_item>, bool>> listResults = list_all_blobs_hierarchical(str_options.containerName, "/", pathStr.substr(1));
+    if (errno != 0)
+    {
+        return errno;
+    }
+    AZS_DEBUGLOGV("Read blobs of directory %s on the service.  Total blob lists found = %s.\n", pathStr.c_str()+1, to_str(listResults.size()).c_str());
+
+    // Enumerating segments of list_blobs response
+    for (size_t result_lists_index = 0; result_lists_index < listResults.size(); result_lists_index++)
+    {
+        // Check to see if the first list_blobs__hierarchical_item can be skipped to avoid duplication
+        int start = listResults[result_lists_index].second ? 1 : 0;
+        for (size_t i = start; i < listResults[result_lists_index].first.size(); i++)
+        {
+            const list_blobs_hierarchical_item& item = listResults[result_lists_index].first[i];
+            // We need to parse out just the trailing part of the path name.
+            if (item.name.size() > 0)
+            {
+                std::string prev_token_str;
+                if (item.name.back() == '/')
+                {
+                    prev_token_str = item.name.substr(pathStr.size() - 1, item.name.size() - pathStr.size());
+                }
+                else
+                {
+                    prev_token_str = item.name.substr(pathStr.size() - 1);
+                }
+
+                bool is_directory = item.is_directory || is_directory_blob(item.content_length, item.metadata);
+                if ((prev_token_str.size() > 0) && (is_directory || (strcmp(prev_token_str.c_str(), former_directory_signifier.c_str()) != 0)))
+                {
+                    // The same directory can show up both as a prefix and as a directory blob (legacy WASB and HNS directories); keep a single entry for it.
+                    dir_entry_info& entry = entries[prev_token_str];
+                    entry.is_directory = entry.is_directory || is_directory;
+                    entry.size = is_directory ? 0 : item.content_length;
+                    entry.last_modified = item.last_modified.empty() ? 0 : curl_getdate(item.last_modified.c_str(), NULL);
+                    entry.local_last_modified = false;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
 /*
  * Check if the directory is empty or not by checking if there is any blob with prefix exists in the specified container.
  *
@@ -440,6 +835,63 @@ int azs_getattr(const char *path, struct stat *stbuf)
     {
         AZS_DEBUGLOGV("Object %s is not in the local cache during get_attr.\n", mntPathString.c_str());
     }
+
+    // If the parent directory was listed recently, the listing tells us whether this exists, and for files, everything else we need.
+    dir_entry_info cached_entry;
+    int cached = g_dir_listing_cache.lookup(pathString, cached_entry);
+    if (cached == -1 && g_dir_listing_cache.record_lookup_miss(pathString))
+    {
+        // Siblings of this path are being looked up one at a time.  List the parent once, so that this lookup and the ones that follow
+        // are answered from the listing (and the blobs' properties land in the attribute cache) rather than each costing a list and a HEAD.
+        size_t last_slash_idx = pathString.rfind('/');
+        std::string parentString = last_slash_idx == 0 ? std::string("/") : pathString.substr(0, last_slash_idx);
+        unsigned long long listing_token = g_dir_listing_cache.begin_listing();
+        std::map<std::string, dir_entry_info> siblings;
+        int list_errno = list_directory_entries(parentString, siblings);
+        if (list_errno == 0)
+        {
+            AZS_DEBUGLOGV("Listed directory %s after a burst of lookups in it.  Total entries = %s.\n", parentString.c_str(), to_str(siblings.size()).c_str());
+            g_dir_listing_cache.store_listing(parentString, siblings, listing_token, dir_listing_cache::burst_listing_lifetime_in_seconds);
+            cached = g_dir_listing_cache.lookup(pathString, cached_entry);
+        }
+        else
+        {
+            syslog(LOG_WARNING, "Failed to list directory %s after a burst of lookups in it; carrying on with individual lookups.  errno = %d.\n", parentString.c_str(), list_errno);
+        }
+    }
+
+    if (cached == 0)
+    {
+        AZS_DEBUGLOGV("%s is not in the cached listing of its parent directory.  It will be treated as a new blob.\n", path);
+        return -(ENOENT);
+    }
+    else if (cached == 1 && !cached_entry.is_directory)
+    {
+        AZS_DEBUGLOGV("Blob %s, representing a file, found in the cached listing of its parent directory during get_attr.\n", path);
+        stbuf->st_mode = S_IFREG | default_permission; // Regular file (not a directory)
+        stbuf->st_uid = fuse_get_context()->uid;
+        stbuf->st_gid = fuse_get_context()->gid;
+        stbuf->st_mtime = cached_entry.last_modified;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = cached_entry.size;
+        return 0;
+    }
+    else if (cached == 1)
+    {
+        // We also need to know if the directory is empty, which we only know if the directory itself has been listed.
+        int has_children = g_dir_listing_cache.has_children(pathString);
+        if (has_children != -1)
+        {
+            AZS_DEBUGLOGV("Blob %s, representing a directory, found in the cached listing of its parent directory during get_attr.\n", path);
+            stbuf->st_mode = S_IFDIR | default_permission;
+            stbuf->st_uid = fuse_get_context()->uid;
+            stbuf->st_gid = fuse_get_context()->gid;
+            stbuf->st_nlink = has_children == 1 ? 3 : 2;
+            stbuf->st_size = 4096;
+            return 0;
+        }
+    }
+
     //It's not in the local cache. Check to see if it's a directory using list 
     std::string blobNameStr(&(path[1]));
     errno = 0;
@@ -578,6 +1030,14 @@ void azs_destroy(void * /*private_data*/)
     errno = 0;
     // FTW_DEPTH instructs FTW to do a post-order traversal (children of a directory before the actual directory.)
     nftw(rootPath.c_str(), rm, 20, FTW_DEPTH); 
+
+    // Unfinished downloads can't be resumed by the next mount, which starts with no record of them.
+    std::string partialPath(str_options.tmpPath + "/partial");
+    nftw(partialPath.c_str(), rm, 20, FTW_DEPTH);
+
+    // Nor can unfinished uploads, as the cached files they were of are gone.
+    std::string uploadsPath(str_options.tmpPath + "/uploads");
+    nftw(uploadsPath.c_str(), rm, 20, FTW_DEPTH);
 }
 
 
@@ -779,13 +1239,45 @@ int azs_rename(const char *src, const char *dst)
     {
         return getattrret;
     }
+    std::string srcPathStr(src);
+    std::string dstPathStr(dst);
     if ((statbuf.st_mode & S_IFDIR) == S_IFDIR)
     {
         azs_rename_directory(src, dst);
+
+        // Everything under both directories has changed, one file at a time; rather than patch each listing, drop them.
+        g_dir_listing_cache.invalidate_tree(srcPathStr);
+        g_dir_listing_cache.invalidate_tree(dstPathStr);
+        g_dir_listing_cache.remove_entry(srcPathStr);
+        dir_entry_info entry;
+        entry.is_directory = true;
+        entry.size = 0;
+        entry.last_modified = time(NULL);
+        entry.local_last_modified = true;
+        g_dir_listing_cache.add_entry(dstPathStr, entry);
     }
     else
     {
-        azs_rename_single_file(src, dst);
+        int renameret = azs_rename_single_file(src, dst);
+        if (renameret == 0)
+        {
+            g_dir_listing_cache.remove_entry(srcPathStr);
+            dir_entry_info entry;
+            entry.is_directory = false;
+            entry.size = statbuf.st_size;
+            // The copy has a new time on the service, which the rename doesn't learn.
+            entry.last_modified = time(NULL);
+            entry.local_last_modified = true;
+            g_dir_listing_cache.add_entry(dstPathStr, entry);
+        }
+        else
+        {
+            // We don't know how far the rename got; have both sides listed again.
+            std::string srcParent = srcPathStr.substr(0, srcPathStr.rfind('/'));
+            std::string dstParent = dstPathStr.substr(0, dstPathStr.rfind('/'));
+            g_dir_listing_cache.invalidate_tree(srcParent.empty() ? "/" : srcParent);
+            g_dir_listing_cache.invalidate_tree(dstParent.empty() ? "/" : dstParent);
+        }
     }
 
     return 0;
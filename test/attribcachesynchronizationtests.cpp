@@ -10,11 +10,12 @@ class MockBlobClient : public sync_blob_client {
 public:
     MOCK_CONST_METHOD0(is_valid, bool());
     MOCK_METHOD5(list_blobs_hierarchical, list_blobs_hierarchical_response(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix, int maxresults));
-    MOCK_METHOD4(put_blob, void(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata));
-    MOCK_METHOD4(upload_block_blob_from_stream, void(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata));
-    MOCK_METHOD5(upload_file_to_blob, void(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel));
+    MOCK_METHOD4(put_blob, blob_property(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata));
+    MOCK_METHOD4(upload_block_blob_from_stream, blob_property(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata));
+    MOCK_METHOD5(upload_file_to_blob, blob_property(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel));
     MOCK_METHOD5(download_blob_to_stream, void(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os));
     MOCK_METHOD5(download_blob_to_file, void(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel));
+    MOCK_METHOD5(start_download_blob_to_file, std::shared_ptr<download_progress>(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished, size_t parallel));
     MOCK_METHOD2(get_blob_property, blob_property(const std::string &container, const std::string &blob));
     MOCK_METHOD2(blob_exists, bool(const std::string &container, const std::string &blob));
     MOCK_METHOD2(delete_blob, void(const std::string &container, const std::string &blob));    
@@ -45,10 +46,13 @@ public:
        container_name = "container";
        mockClient = std::make_shared<::testing::NiceMock<MockBlobClient>>();
        attrib_cache_wrapper = std::make_shared<blob_client_attr_cache_wrapper>(mockClient);
+       // blob_property has no default constructor; uploads the test doesn't give a result for report nothing about the blob.
+       ::testing::DefaultValue<blob_property>::Set(blob_property(false));
     }
 
     virtual void TearDown()
     {
+       ::testing::DefaultValue<blob_property>::Clear();
     }
 };
 
@@ -92,16 +96,19 @@ void AttribCacheSynchronizationTest::prep_mock(std::shared_ptr<std::mutex> m, st
     .WillByDefault(::testing::InvokeWithoutArgs([=] ()
     {
         prep(m, cv, calls, sleep_finished);
+        return blob_property(false);
     }));
     ON_CALL(*mockClient, upload_block_blob_from_stream(_, _, _, _))
     .WillByDefault(::testing::InvokeWithoutArgs([=] ()
     {
         prep(m, cv, calls, sleep_finished);
+        return blob_property(false);
     }));
     ON_CALL(*mockClient, upload_file_to_blob(_, _, _, _, _))
     .WillByDefault(::testing::InvokeWithoutArgs([=] ()
     {
         prep(m, cv, calls, sleep_finished);
+        return blob_property(false);
     }));
     ON_CALL(*mockClient, download_blob_to_stream(_, _, _, _, _))
     .WillByDefault(::testing::InvokeWithoutArgs([=] ()
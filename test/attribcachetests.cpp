@@ -11,11 +11,12 @@ class MockBlobClient : public sync_blob_client {
 public:
     MOCK_CONST_METHOD0(is_valid, bool());
     MOCK_METHOD5(list_blobs_hierarchical, list_blobs_hierarchical_response(const std::string &container, const std::string &delimiter, const std::string &continuation_token, const std::string &prefix, int maxresults));
-    MOCK_METHOD4(put_blob, void(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata));
-    MOCK_METHOD4(upload_block_blob_from_stream, void(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata));
-    MOCK_METHOD5(upload_file_to_blob, void(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel));
+    MOCK_METHOD4(put_blob, blob_property(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata));
+    MOCK_METHOD4(upload_block_blob_from_stream, blob_property(const std::string &container, const std::string blob, std::istream &is, const std::vector<std::pair<std::string, std::string>> &metadata));
+    MOCK_METHOD5(upload_file_to_blob, blob_property(const std::string &sourcePath, const std::string &container, const std::string blob, const std::vector<std::pair<std::string, std::string>> &metadata, size_t parallel));
     MOCK_METHOD5(download_blob_to_stream, void(const std::string &container, const std::string &blob, unsigned long long offset, unsigned long long size, std::ostream &os));
     MOCK_METHOD5(download_blob_to_file, void(const std::string &container, const std::string &blob, const std::string &destPath, time_t &returned_last_modified, size_t parallel));
+    MOCK_METHOD5(start_download_blob_to_file, std::shared_ptr<download_progress>(const std::string &container, const std::string &blob, const std::string &destPath, std::function<void(int, time_t)> on_finished, size_t parallel));
     MOCK_METHOD2(get_blob_property, blob_property(const std::string &container, const std::string &blob));
     MOCK_METHOD2(blob_exists, bool(const std::string &container, const std::string &blob));
     MOCK_METHOD2(delete_blob, void(const std::string &container, const std::string &blob));
@@ -43,10 +44,13 @@ public:
        container_name = "container";
        mockClient = std::make_shared<::testing::StrictMock<MockBlobClient>>();
        attrib_cache_wrapper = std::make_shared<blob_client_attr_cache_wrapper>(mockClient);
+       // blob_property has no default constructor; uploads the test doesn't give a result for report nothing about the blob.
+       ::testing::DefaultValue<blob_property>::Set(blob_property(false));
     }
 
     virtual void TearDown()
     {
+       ::testing::DefaultValue<blob_property>::Clear();
     }
 };
 
@@ -379,7 +383,303 @@ TEST_F(AttribCacheTest, GetBlobPropertiesListRepeated)
     assert_blob_property_objects_equal(prop5_v2, propcache5_2);
 }
 
+// Check that properties too large for the fixed-width fields of the cached record survive the round-trip through the cache.
+TEST_F(AttribCacheTest, GetBlobPropertiesLargeValues)
+{
+    std::string blob = "blob";
+
+    blob_property prop = create_blob_property("\"0x8D7A2B3C4D5E6F7-an-etag-longer-than-usual\"", 42);
+    prop.content_md5 = "not-an-md5-but-longer-than-twenty-four-characters";
+    prop.content_type = "application/octet-stream";
+    prop.metadata.push_back(std::make_pair("hdi_isfolder", "true"));
+    prop.metadata.push_back(std::make_pair("", ""));
+    prop.metadata.push_back(std::make_pair("large", std::string(4096, 'x')));
+
+    EXPECT_CALL(*mockClient, get_blob_property(container_name, blob))
+    .Times(1)
+    .WillOnce(Return(prop));
+
+    blob_property propcache1 = attrib_cache_wrapper->get_blob_property(container_name, blob);
+    blob_property propcache2 = attrib_cache_wrapper->get_blob_property(container_name, blob);
+
+    assert_blob_property_objects_equal(prop, propcache1);
+    assert_blob_property_objects_equal(prop, propcache2);
+}
+
+// Check that only the low-cardinality properties are interned, so that a property with a value per blob doesn't grow the pool without bound.
+TEST_F(AttribCacheTest, CompactPropertiesInternLowCardinalityOnly)
+{
+    string_intern_pool pool;
+    std::vector<compact_blob_property> records(100);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        blob_property prop = create_blob_property("\"0x8D7A2B3C4D5E6F7\"", i);
+        prop.cache_control = "max-age=" + std::to_string(i);
+        prop.content_disposition = "attachment; filename=\"file" + std::to_string(i) + "\"";
+        records[i].assign(prop, pool);
+        blob_property round_tripped = records[i].to_blob_property();
+        assert_blob_property_objects_equal(prop, round_tripped);
+    }
+
+    // content_encoding, content_language, content_type and copy_status.
+    EXPECT_EQ(4u, pool.size());
+}
+
+// Check that a record refuses values too long for its fixed-width lengths, rather than truncating them, and that the cache then doesn't serve it.
+TEST_F(AttribCacheTest, CompactPropertiesRejectOversizedValues)
+{
+    string_intern_pool pool;
+    compact_blob_property record;
+    blob_property prop = create_blob_property("\"0x8D7A2B3C4D5E6F7\"", 4);
+    ASSERT_TRUE(record.assign(prop, pool));
+    EXPECT_TRUE(record.valid());
+
+    prop.cache_control = std::string(70000, 'x');
+    EXPECT_FALSE(record.assign(prop, pool));
+    EXPECT_FALSE(record.valid());
+    EXPECT_FALSE(record.to_blob_property().valid());
+
+    std::string blob = "blob";
+    EXPECT_CALL(*mockClient, get_blob_property(container_name, blob))
+    .Times(2)
+    .WillRepeatedly(Return(prop));
+
+    blob_property propcache1 = attrib_cache_wrapper->get_blob_property(container_name, blob);
+    blob_property propcache2 = attrib_cache_wrapper->get_blob_property(container_name, blob); // not cached, so fetched again
+
+    assert_blob_property_objects_equal(prop, propcache1);
+    assert_blob_property_objects_equal(prop, propcache2);
+}
+
+// A cached blob's record sits in its node in the map, and the cache is sized for tens of millions of blobs, so the record's size decides
+// whether the cache fits in memory.  Typical etags and MD5s are held inline; only longer values and metadata go to the heap.
+static_assert(sizeof(compact_blob_property) <= 112, "compact_blob_property has grown");
+
+// Check that blobs are keyed by their directory and name: a directory is stored once for all its blobs, and isn't evicted while any of them is cached.
+TEST(AttribCacheKeyTest, BlobsShareTheirDirectory)
+{
+    blob_client_attr_cache_wrapper::attribute_cache cache(0, 2);
+    blob_property prop = create_blob_property("etag", 4);
+
+    std::shared_ptr<blob_client_attr_cache_wrapper::dir_cache_item> dir1 = cache.get_dir_item("dir1");
+    cache.store(dir1, "dir1/blob1", prop);
+    cache.store(dir1, "dir1/blob2", prop);
+    dir1.reset();
+    EXPECT_EQ(1u, cache.dir_count());
+    EXPECT_EQ(2u, cache.blob_count());
+
+    // Two more directories go over the directory limit, but dir1 still has blobs in the cache, so it stays.
+    cache.get_dir_item("dir2");
+    cache.get_dir_item("dir3");
+    blob_property cached(false);
+    EXPECT_TRUE(cache.get_fresh(cache.get_dir_item("dir1"), "dir1/blob1", cached));
+    assert_blob_property_objects_equal(prop, cached);
+
+    // The same name in another directory is another blob.
+    EXPECT_FALSE(cache.get_fresh(cache.get_dir_item("dir2"), "dir2/blob1", cached));
+    cache.invalidate(cache.get_dir_item("dir1"), "dir1/blob1");
+    EXPECT_FALSE(cache.get_fresh(cache.get_dir_item("dir1"), "dir1/blob1", cached));
+    EXPECT_TRUE(cache.get_fresh(cache.get_dir_item("dir1"), "dir1/blob2", cached));
+}
+
+// Check that cached properties are re-fetched from the service once the cache timeout has passed.
+TEST_F(AttribCacheTest, GetBlobPropertiesTimeout)
+{
+    std::string blob1 = "blob1";
+
+    blob_property prop1_v1 = create_blob_property("etag1_1", 4);
+    blob_property prop1_v2 = create_blob_property("etag1_2", 5);
+
+    std::shared_ptr<blob_client_attr_cache_wrapper> timeout_wrapper = std::make_shared<blob_client_attr_cache_wrapper>(mockClient, 1);
+
+    {
+        ::testing::InSequence seq;
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob1))
+        .Times(1)
+        .WillOnce(Return(prop1_v1));
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob1))
+        .Times(1)
+        .WillOnce(Return(prop1_v2));
+    }
+
+    blob_property propcache1_1 = timeout_wrapper->get_blob_property(container_name, blob1);
+    blob_property propcache1_2 = timeout_wrapper->get_blob_property(container_name, blob1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    blob_property propcache1_3 = timeout_wrapper->get_blob_property(container_name, blob1);
+
+    assert_blob_property_objects_equal(prop1_v1, propcache1_1);
+    assert_blob_property_objects_equal(prop1_v1, propcache1_2);
+    assert_blob_property_objects_equal(prop1_v2, propcache1_3);
+}
+
+// Check that the cache holds at most the configured number of blobs, and evicts the least recently used ones first.
+TEST_F(AttribCacheTest, GetBlobPropertiesEviction)
+{
+    std::string blob1 = "blob1";
+    std::string blob2 = "blob2";
+    std::string blob3 = "blob3";
+
+    blob_property prop1 = create_blob_property("etag1", 4);
+    blob_property prop2 = create_blob_property("etag2", 15);
+    blob_property prop3 = create_blob_property("etag3", 16);
+
+    std::shared_ptr<blob_client_attr_cache_wrapper> bounded_wrapper = std::make_shared<blob_client_attr_cache_wrapper>(mockClient, 0, 2);
+
+    {
+        ::testing::InSequence seq;
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob1))
+        .Times(1)
+        .WillOnce(Return(prop1));
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob2))
+        .Times(1)
+        .WillOnce(Return(prop2));
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob3))
+        .Times(1)
+        .WillOnce(Return(prop3));
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob2))
+        .Times(1)
+        .WillOnce(Return(prop2));
+    }
+
+    bounded_wrapper->get_blob_property(container_name, blob1);
+    bounded_wrapper->get_blob_property(container_name, blob2);
+    bounded_wrapper->get_blob_property(container_name, blob1); // blob1 is now more recently used than blob2
+    bounded_wrapper->get_blob_property(container_name, blob3); // evicts blob2
+    blob_property propcache1 = bounded_wrapper->get_blob_property(container_name, blob1);
+    blob_property propcache3 = bounded_wrapper->get_blob_property(container_name, blob3);
+    blob_property propcache2 = bounded_wrapper->get_blob_property(container_name, blob2); // fetched again
+
+    assert_blob_property_objects_equal(prop1, propcache1);
+    assert_blob_property_objects_equal(prop2, propcache2);
+    assert_blob_property_objects_equal(prop3, propcache3);
+}
+
+// Check that the properties returned by an upload are cached, so that the next get_blob_property doesn't go to the service.
+TEST_F(AttribCacheTest, GetBlobPropertiesAfterUpload)
+{
+    std::string blob1 = "blob1";
+    std::vector<std::pair<std::string, std::string>> metadata;
+
+    blob_property prop1_v1 = create_blob_property("etag1_1", 4);
+    blob_property prop1_v2 = create_blob_property("etag1_2", 5);
+
+    {
+        ::testing::InSequence seq;
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob1))
+        .Times(1)
+        .WillOnce(Return(prop1_v1));
+        EXPECT_CALL(*mockClient, upload_file_to_blob(_, container_name, blob1, _, _))
+        .Times(1)
+        .WillOnce(Return(prop1_v2));
+    }
+
+    blob_property propcache1_1 = attrib_cache_wrapper->get_blob_property(container_name, blob1);
+    errno = 0;
+    blob_property uploaded = attrib_cache_wrapper->upload_file_to_blob("source_path", container_name, blob1, metadata, 10);
+    blob_property propcache1_2 = attrib_cache_wrapper->get_blob_property(container_name, blob1);
+
+    assert_blob_property_objects_equal(prop1_v1, propcache1_1);
+    assert_blob_property_objects_equal(prop1_v2, uploaded);
+    assert_blob_property_objects_equal(prop1_v2, propcache1_2);
+}
+
+// Check that invalidating a cached blob makes the next get_blob_property go to the service, without affecting other blobs.
+TEST_F(AttribCacheTest, GetBlobPropertiesAfterInvalidate)
+{
+    std::string blob1 = "dir1/blob1";
+    std::string blob2 = "dir1/blob2";
+
+    blob_property prop1_v1 = create_blob_property("etag1_1", 4);
+    blob_property prop1_v2 = create_blob_property("etag1_2", 5);
+    blob_property prop2 = create_blob_property("etag2", 6);
+
+    {
+        ::testing::InSequence seq;
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob1))
+        .Times(1)
+        .WillOnce(Return(prop1_v1));
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob2))
+        .Times(1)
+        .WillOnce(Return(prop2));
+        EXPECT_CALL(*mockClient, get_blob_property(container_name, blob1))
+        .Times(1)
+        .WillOnce(Return(prop1_v2));
+    }
+
+    attrib_cache_wrapper->get_blob_property(container_name, blob1);
+    attrib_cache_wrapper->get_blob_property(container_name, blob2);
+    attrib_cache_wrapper->invalidate_cached_blob(blob1);
+    blob_property propcache1 = attrib_cache_wrapper->get_blob_property(container_name, blob1);
+    blob_property propcache2 = attrib_cache_wrapper->get_blob_property(container_name, blob2);
+
+    assert_blob_property_objects_equal(prop1_v2, propcache1);
+    assert_blob_property_objects_equal(prop2, propcache2);
+}
+
+// Check that cache misses on the same blob that overlap are answered by a single service call, and that a "not found" is shared too.
+TEST_F(AttribCacheTest, GetBlobPropertiesConcurrentMisses)
+{
+    std::string blob1 = "blob1";
+    auto wrapper = std::make_shared<blob_client_attr_cache_wrapper>(mockClient);
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool call_started = false;
+    bool release_call = false;
+
+    // The service call doesn't return until the second caller is waiting on it.
+    EXPECT_CALL(*mockClient, get_blob_property(container_name, blob1))
+    .Times(1)
+    .WillOnce(::testing::InvokeWithoutArgs([&] ()
+    {
+        std::unique_lock<std::mutex> lk(m);
+        call_started = true;
+        cv.notify_all();
+        cv.wait(lk, [&] { return release_call; });
+        errno = 404;
+        return blob_property(false);
+    }));
+
+    int first_errno = 0;
+    bool first_valid = true;
+    std::thread first_call([&] ()
+    {
+        first_valid = wrapper->get_blob_property(container_name, blob1).valid();
+        first_errno = errno;
+    });
+    {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [&] { return call_started; });
+    }
+
+    int second_errno = 0;
+    bool second_valid = true;
+    std::thread second_call([&] ()
+    {
+        errno = 0;
+        second_valid = wrapper->get_blob_property(container_name, blob1).valid();
+        second_errno = errno;
+    });
+    while (wrapper->property_fetch_waiters(container_name, blob1) == 0)
+    {
+        std::this_thread::yield();
+    }
+    {
+        std::lock_guard<std::mutex> lk(m);
+        release_call = true;
+    }
+    cv.notify_all();
+    first_call.join();
+    second_call.join();
+
+    EXPECT_FALSE(first_valid);
+    EXPECT_EQ(404, first_errno);
+    EXPECT_FALSE(second_valid);
+    EXPECT_EQ(404, second_errno);
+}
+
 // These tests ensure that methods other than get_blob_properties and list_blobs invalidate the cache when called.
+// (Uploads here don't return the new properties, as when the upload fails, so they invalidate too.)
 // We use GoogleTest's parameterized testing to generate one test per method.
 class AttribCacheInvalidateCacheTest : public AttribCacheTest, public ::testing::WithParamInterface<std::string> {
 };
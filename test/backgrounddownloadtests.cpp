@@ -0,0 +1,497 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "blob/blob_client.h"
+#include "blobfuse.h"
+#include "loopback_server.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    // The chunk size downloads start with, before the client has any transfers to tune it to.
+    const unsigned long long chunk_size = 16 * 1024 * 1024;
+    // Four whole chunks and a short one.
+    const unsigned long long blob_length = 4 * chunk_size + 1024 * 1024;
+
+    char blob_byte(unsigned long long offset)
+    {
+        return static_cast<char>(offset % 251);
+    }
+
+    const std::string original_etag = "\"0x8D0000000000001\"";
+
+    // Serves ranges of one blob over HTTP on the loopback interface, and can hold back the responses for chosen chunks until told to send them,
+    // fail them, or change the blob under the download.  Honours If-Match, and answers ranges past the end of the blob with 416.
+    class range_server
+    {
+    public:
+        range_server() : m_stopping(false), m_etag(original_etag), m_length(blob_length),
+            m_server([this](int connection, const std::string &request) { return respond(connection, request); })
+        {
+        }
+
+        ~range_server()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_cv.notify_all();
+        }
+
+        std::string endpoint() const
+        {
+            return m_server.endpoint();
+        }
+
+        int port() const
+        {
+            return m_server.port();
+        }
+
+        void hold(size_t chunk)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_held.insert(chunk);
+        }
+
+        void release(size_t chunk)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_held.erase(chunk);
+            }
+            m_cv.notify_all();
+        }
+
+        // Answers the next given number of requests for the chunk with the given status.
+        void fail(size_t chunk, int times, int status)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_failures[chunk] = std::make_pair(times, status);
+        }
+
+        // Replaces the blob with a new version, of the given length, whose bytes are where they were.
+        void replace_blob(const std::string &etag, unsigned long long length)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_etag = etag;
+            m_length = length;
+        }
+
+        // Waits for the chunk to be asked for.
+        bool wait_for_request(size_t chunk)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            return m_cv.wait_for(lock, std::chrono::seconds(30), [this, chunk]() { return std::find(m_requested.begin(), m_requested.end(), chunk) != m_requested.end(); });
+        }
+
+        // The chunks asked for, in the order they were asked for.
+        std::vector<size_t> requested()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_requested;
+        }
+
+    private:
+        bool respond(int connection, const std::string &request)
+        {
+            unsigned long long first = 0;
+            unsigned long long last = ~0ULL;
+            const std::string range_header = "x-ms-range: bytes=";
+            const size_t range = request.find(range_header);
+            if (range != std::string::npos)
+            {
+                sscanf(request.c_str() + range + range_header.size(), "%llu-%llu", &first, &last);
+            }
+            std::string if_match;
+            const std::string if_match_header = "If-Match: ";
+            const size_t match = request.find(if_match_header);
+            if (match != std::string::npos)
+            {
+                const size_t value = match + if_match_header.size();
+                if_match = request.substr(value, request.find("\r\n", value) - value);
+            }
+            const size_t chunk = static_cast<size_t>(first / chunk_size);
+            int status = 0;
+            std::string etag;
+            unsigned long long length;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_requested.push_back(chunk);
+                m_cv.notify_all();
+                m_cv.wait(lock, [this, chunk]() { return m_stopping || m_held.count(chunk) == 0; });
+                if (m_stopping)
+                {
+                    return false;
+                }
+                auto failure = m_failures.find(chunk);
+                if (failure != m_failures.end() && failure->second.first > 0)
+                {
+                    failure->second.first--;
+                    status = failure->second.second;
+                }
+                etag = m_etag;
+                length = m_length;
+            }
+            if (status == 0 && !if_match.empty() && if_match != etag)
+            {
+                status = 412;
+            }
+            if (status == 0 && first >= length)
+            {
+                status = 416;
+            }
+            if (status != 0)
+            {
+                const std::string error = "HTTP/1.1 " + std::to_string(status) + " Error\r\nContent-Length: 0\r\n\r\n";
+                return loopback_server::send_all(connection, error);
+            }
+            last = std::min(last, length - 1);
+
+            const std::string headers = "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Length: " + std::to_string(last - first + 1) + "\r\n"
+                "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(length) + "\r\n"
+                "ETag: " + etag + "\r\n"
+                "Last-Modified: Wed, 01 Jan 2020 00:00:00 GMT\r\n"
+                "\r\n";
+            if (!loopback_server::send_all(connection, headers))
+            {
+                return false;
+            }
+            std::vector<char> body(1024 * 1024);
+            for (unsigned long long offset = first; offset <= last; )
+            {
+                const size_t count = static_cast<size_t>(std::min<unsigned long long>(body.size(), last - offset + 1));
+                for (size_t i = 0; i < count; i++)
+                {
+                    body[i] = blob_byte(offset + i);
+                }
+                if (!loopback_server::send_all(connection, body.data(), count))
+                {
+                    return false;
+                }
+                offset += count;
+            }
+            return true;
+        }
+
+        bool m_stopping;
+        std::string m_etag;
+        unsigned long long m_length;
+        std::set<size_t> m_held;
+        std::map<size_t, std::pair<int, int>> m_failures; // Requests still to fail, and the status to fail them with, by chunk.
+        std::vector<size_t> m_requested;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        loopback_server m_server; // Last, so that it stops serving before the rest goes.
+    };
+
+    std::shared_ptr<blob_client_wrapper> make_client(const range_server &server)
+    {
+        return blob_client_wrapper_init_sastoken("account", "sv=2018-03-28&sig=test", 4, false, server.endpoint());
+    }
+
+    // A client whose requests are never retried by the retry policy, so that a failed request is left to the download to retry.
+    std::shared_ptr<blob_client_wrapper> make_client_without_retries(const range_server &server)
+    {
+        auto credential = std::make_shared<shared_access_signature_credential>("sv=2018-03-28&sig=test");
+        auto account = std::make_shared<storage_account>("account", credential, false, server.endpoint());
+        auto client = std::make_shared<blob_client>(account, 4);
+        client->set_retry_policy(std::make_shared<retry_policy>(0));
+        return std::make_shared<blob_client_wrapper>(client);
+    }
+
+    std::string temp_path()
+    {
+        char path[] = "/tmp/backgrounddownloadtestXXXXXX";
+        close(mkstemp(path));
+        return path;
+    }
+
+    // Whether the file holds the blob's bytes over the range.
+    bool file_has_range(const std::string &path, unsigned long long offset, unsigned long long size)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        std::vector<char> data(static_cast<size_t>(size));
+        const bool read_all = pread(fd, data.data(), data.size(), static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+        close(fd);
+        if (!read_all)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            if (data[i] != blob_byte(offset + i))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+// Check that a reader waiting on a chunk has it downloaded ahead of the chunks before it, and that the rest then follow in order.
+TEST(BackgroundDownloadTest, WaitForRangeJumpsTheQueue)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    const std::string dest = temp_path();
+    auto client = make_client(server);
+
+    // One chunk at a time, so that the order is the order the download picks them in.
+    server.hold(1);
+    auto download = client->start_download_blob_to_file("container", "blob", dest, nullptr, 1);
+    ASSERT_NE(nullptr, download) << "errno = " << errno;
+    EXPECT_EQ(blob_length, download->length());
+    ASSERT_TRUE(server.wait_for_request(1));
+
+    auto reader = std::async(std::launch::async, [&download]() { return download->wait_for_range(3 * chunk_size + 100, 10); });
+    // Give the reader time to say which chunk it wants before the chunk in the way comes in.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    server.release(1);
+
+    ASSERT_EQ(std::future_status::ready, reader.wait_for(std::chrono::seconds(30)));
+    EXPECT_EQ(0, reader.get());
+    EXPECT_TRUE(file_has_range(dest, 3 * chunk_size, chunk_size));
+
+    EXPECT_EQ(0, download->wait());
+    EXPECT_TRUE(download->finished());
+    std::vector<size_t> expected = {0, 1, 3, 2, 4};
+    EXPECT_EQ(expected, server.requested());
+    EXPECT_TRUE(file_has_range(dest, 0, blob_length));
+    EXPECT_EQ(0, download->wait_for_range(0, blob_length));
+    unlink(dest.c_str());
+}
+
+// Check that cancelling returns without waiting for the chunk being downloaded, removes the destination at once, and that the chunk,
+// when it does come in, leaves alone a new file made at the destination in the meantime.
+TEST(BackgroundDownloadTest, CancelDoesNotWaitForChunks)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    const std::string dest = temp_path();
+    auto client = make_client(server);
+
+    server.hold(1);
+    std::promise<int> finished;
+    auto download = client->start_download_blob_to_file("container", "blob", dest, [&finished](int error, time_t) { finished.set_value(error); }, 1);
+    ASSERT_NE(nullptr, download) << "errno = " << errno;
+    ASSERT_TRUE(server.wait_for_request(1));
+
+    auto cancelled = std::async(std::launch::async, [&download]() { download->cancel(); });
+    if (cancelled.wait_for(std::chrono::seconds(10)) != std::future_status::ready)
+    {
+        server.release(1);
+        FAIL() << "cancel waited for the chunk being downloaded.";
+    }
+    EXPECT_NE(0, access(dest.c_str(), F_OK)) << "The partly downloaded file should be gone as soon as cancel returns.";
+    EXPECT_EQ(ECANCELED, download->wait_for_range(2 * chunk_size, 10));
+    EXPECT_FALSE(download->finished());
+
+    const int replacement = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, replacement);
+    ASSERT_EQ(3, write(replacement, "new", 3));
+    close(replacement);
+
+    server.release(1);
+    EXPECT_EQ(ECANCELED, download->wait());
+    EXPECT_EQ(ECANCELED, finished.get_future().get());
+    std::vector<size_t> expected = {0, 1};
+    EXPECT_EQ(expected, server.requested()) << "No chunk should be started after the download is cancelled.";
+
+    char contents[16] = {};
+    const int fd = open(dest.c_str(), O_RDONLY);
+    ASSERT_NE(-1, fd);
+    EXPECT_EQ(3, read(fd, contents, sizeof(contents)));
+    close(fd);
+    EXPECT_STREQ("new", contents) << "The cancelled download must not touch a file made at its destination afterwards.";
+    unlink(dest.c_str());
+}
+
+// Check that a chunk whose request fails with a retryable error is tried again, and the download completes.
+TEST(BackgroundDownloadTest, RetriesFailedChunk)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    const std::string dest = temp_path();
+    auto client = make_client_without_retries(server);
+
+    server.fail(2, 2, 500);
+    auto download = client->start_download_blob_to_file("container", "blob", dest, nullptr, 1);
+    ASSERT_NE(nullptr, download) << "errno = " << errno;
+    EXPECT_EQ(0, download->wait());
+    // A retry is queued behind the chunks not yet started.
+    std::vector<size_t> expected = {0, 1, 2, 3, 4, 2, 2};
+    EXPECT_EQ(expected, server.requested()) << "The chunk should have been tried until it succeeded, on its third try.";
+    EXPECT_TRUE(file_has_range(dest, 0, blob_length));
+    unlink(dest.c_str());
+}
+
+// Check that a chunk is given up on after its last try, failing the download.
+TEST(BackgroundDownloadTest, GivesUpOnChunkAfterLastTry)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    const std::string dest = temp_path();
+    auto client = make_client_without_retries(server);
+
+    server.fail(2, 3, 500);
+    auto download = client->start_download_blob_to_file("container", "blob", dest, nullptr, 1);
+    ASSERT_NE(nullptr, download) << "errno = " << errno;
+    EXPECT_EQ(500, download->wait());
+    std::vector<size_t> requested = server.requested();
+    EXPECT_EQ(3, std::count(requested.begin(), requested.end(), 2u));
+    unlink(dest.c_str());
+}
+
+// Check that a blob changed after the first chunk fails the download with EAGAIN, through If-Match, rather than mixing two versions.
+TEST(BackgroundDownloadTest, ChangedBlobFailsWithEagain)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    const std::string dest = temp_path();
+    auto client = make_client(server);
+
+    server.hold(1);
+    auto download = client->start_download_blob_to_file("container", "blob", dest, nullptr, 1);
+    ASSERT_NE(nullptr, download) << "errno = " << errno;
+    ASSERT_TRUE(server.wait_for_request(1));
+    server.replace_blob("\"0x8D0000000000002\"", blob_length);
+    server.release(1);
+
+    EXPECT_EQ(EAGAIN, download->wait());
+    std::vector<size_t> expected = {0, 1};
+    EXPECT_EQ(expected, server.requested()) << "A changed blob isn't worth retrying, or downloading any more of.";
+    unlink(dest.c_str());
+}
+
+// Check that a blob cut short after the first chunk fails the download with EAGAIN, when a chunk is asked for past its new end.
+TEST(BackgroundDownloadTest, ShrunkBlobFailsWithEagain)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    const std::string dest = temp_path();
+    auto client = make_client(server);
+
+    server.hold(1);
+    auto download = client->start_download_blob_to_file("container", "blob", dest, nullptr, 1);
+    ASSERT_NE(nullptr, download) << "errno = " << errno;
+    ASSERT_TRUE(server.wait_for_request(1));
+    server.replace_blob(original_etag, chunk_size);
+    server.release(1);
+
+    EXPECT_EQ(EAGAIN, download->wait());
+    std::vector<size_t> expected = {0, 1};
+    EXPECT_EQ(expected, server.requested());
+    unlink(dest.c_str());
+}
+
+// Check that with a partial download directory, a failed download keeps the chunks it got, and the next download of the blob to the same
+// file only fetches the chunks still missing.
+TEST(BackgroundDownloadTest, ResumesWithMissingChunks)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    const std::string dest = temp_path();
+    char directory[] = "/tmp/backgrounddownloadpartialXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directory));
+    blob_client_wrapper::set_partial_download_directory(directory);
+    auto client = make_client_without_retries(server);
+    blob_client_wrapper::set_partial_download_directory(std::string());
+
+    server.fail(1, 3, 500);
+    server.fail(3, 3, 500);
+    auto failed = client->start_download_blob_to_file("container", "blob", dest, nullptr, 1);
+    ASSERT_NE(nullptr, failed) << "errno = " << errno;
+    EXPECT_EQ(500, failed->wait());
+    const size_t first_requests = server.requested().size();
+
+    auto resumed = client->start_download_blob_to_file("container", "blob", dest, nullptr, 1);
+    ASSERT_NE(nullptr, resumed) << "errno = " << errno;
+    EXPECT_EQ(0, resumed->wait());
+    std::vector<size_t> requested = server.requested();
+    std::vector<size_t> expected = {1, 3};
+    EXPECT_EQ(expected, std::vector<size_t>(requested.begin() + first_requests, requested.end())) << "Only the chunks that failed should be fetched the second time.";
+    EXPECT_TRUE(file_has_range(dest, 0, blob_length));
+
+    unlink(dest.c_str());
+    DIR *d = opendir(directory);
+    ASSERT_NE(nullptr, d);
+    int left = 0;
+    while (struct dirent *entry = readdir(d))
+    {
+        const std::string name = entry->d_name;
+        if (name != "." && name != "..")
+        {
+            left++;
+            unlink((std::string(directory) + "/" + name).c_str());
+        }
+    }
+    closedir(d);
+    rmdir(directory);
+    EXPECT_EQ(0, left) << "A finished download leaves nothing behind in the partial download directory.";
+}
+
+// Check that a file opened read-only, and closed again before its download into the file cache has finished, is handed to the cache's GC
+// once the download has moved it into place.
+TEST(BackgroundDownloadTest, FileClosedBeforeDownloadFinishesIsCollected)
+{
+    range_server server;
+    ASSERT_NE(0, server.port());
+    char directory[] = "/tmp/backgrounddownloadcacheXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(directory));
+    const std::string tmp_path = directory;
+    ASSERT_EQ(0, mkdir((tmp_path + "/root").c_str(), 0700));
+
+    const std::string old_tmp_path = str_options.tmpPath;
+    const std::string old_container = str_options.containerName;
+    std::shared_ptr<sync_blob_client> old_client = azure_blob_client_wrapper;
+    str_options.tmpPath = tmp_path;
+    str_options.containerName = "container";
+    // Through a partial download directory, so that the file is only in the cache once the download is finished.
+    blob_client_wrapper::set_partial_download_directory(tmp_path + "/partial");
+    azure_blob_client_wrapper = make_client(server);
+    blob_client_wrapper::set_partial_download_directory(std::string());
+
+    server.hold(1);
+    struct fuse_file_info fi = {};
+    fi.flags = O_RDONLY;
+    ASSERT_EQ(0, azs_open("/blob", &fi));
+    ASSERT_TRUE(server.wait_for_request(1));
+    EXPECT_EQ(0, azs_release("/blob", &fi));
+    EXPECT_FALSE(g_gc_cache.is_pending("/blob")) << "The file isn't in the cache yet.";
+
+    server.release(1);
+    const std::string cached = tmp_path + "/root/blob";
+    for (int i = 0; i < 300 && !g_gc_cache.is_pending("/blob"); i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_TRUE(g_gc_cache.is_pending("/blob")) << "The finished download should have been handed to the GC.";
+    EXPECT_TRUE(file_has_range(cached, 0, blob_length));
+
+    azure_blob_client_wrapper = old_client;
+    str_options.tmpPath = old_tmp_path;
+    str_options.containerName = old_container;
+    unlink(cached.c_str());
+    rmdir((tmp_path + "/root").c_str());
+    rmdir((tmp_path + "/partial").c_str());
+    rmdir(tmp_path.c_str());
+}
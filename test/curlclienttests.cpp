@@ -0,0 +1,172 @@
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "http/libcurl_http_client.h"
+#include "loopback_server.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    std::future<std::shared_ptr<CurlEasyRequest>> get_handle_async(std::shared_ptr<CurlEasyClient> client, request_priority priority)
+    {
+        return std::async(std::launch::async, [client, priority]() { return client->get_handle(priority); });
+    }
+}
+
+// Check that the pool creates handles on demand, and keeps them for reuse once they are released.
+TEST(CurlClientTest, GrowsOnDemand)
+{
+    auto client = std::make_shared<CurlEasyClient>(4);
+    EXPECT_EQ(0, client->pool_stats().handles);
+
+    std::vector<std::shared_ptr<CurlEasyRequest>> requests;
+    for (int i = 0; i < 3; i++)
+    {
+        requests.push_back(client->get_handle());
+    }
+    auto stats = client->pool_stats();
+    EXPECT_EQ(3, stats.handles);
+    EXPECT_EQ(0, stats.idle);
+
+    requests.clear();
+    stats = client->pool_stats();
+    EXPECT_EQ(3, stats.handles);
+    EXPECT_EQ(3, stats.idle);
+
+    auto reused = client->get_handle();
+    stats = client->pool_stats();
+    EXPECT_EQ(3, stats.handles) << "An idle handle should be reused rather than a new one created.";
+    EXPECT_EQ(2, stats.idle);
+    EXPECT_EQ(0u, stats.waits);
+}
+
+// Check that the pool grows past its size while a request backs off, and shrinks back once the back-off is over.
+TEST(CurlClientTest, ShrinksAfterBackoff)
+{
+    auto client = std::make_shared<CurlEasyClient>(1);
+    auto backing_off = client->get_handle();
+    client->begin_backoff();
+    auto extra = client->get_handle();
+    EXPECT_EQ(2, client->pool_stats().handles);
+
+    client->end_backoff();
+    backing_off.reset();
+    auto stats = client->pool_stats();
+    EXPECT_EQ(1, stats.handles) << "A handle released while the pool is over its size should be freed.";
+    EXPECT_EQ(0, stats.idle);
+
+    extra.reset();
+    stats = client->pool_stats();
+    EXPECT_EQ(1, stats.handles);
+    EXPECT_EQ(1, stats.idle);
+}
+
+// Check that an eighth of the pool is kept for metadata, and half of the rest is as much as background requests get.
+TEST(CurlClientTest, ReservesMetadataCapacity)
+{
+    auto client = std::make_shared<CurlEasyClient>(8);
+    std::vector<std::shared_ptr<CurlEasyRequest>> requests;
+    for (int i = 0; i < 3; i++)
+    {
+        requests.push_back(client->get_handle(request_priority::background));
+    }
+    auto background = get_handle_async(client, request_priority::background);
+    EXPECT_EQ(std::future_status::timeout, background.wait_for(std::chrono::milliseconds(100))) << "Background requests get at most 3 of 8.";
+
+    for (int i = 0; i < 4; i++)
+    {
+        requests.push_back(client->get_handle(request_priority::foreground));
+    }
+    auto foreground = get_handle_async(client, request_priority::foreground);
+    EXPECT_EQ(std::future_status::timeout, foreground.wait_for(std::chrono::milliseconds(100))) << "Foreground requests get at most 7 of 8.";
+
+    auto metadata = get_handle_async(client, request_priority::metadata);
+    EXPECT_EQ(std::future_status::ready, metadata.wait_for(std::chrono::seconds(5))) << "The last handle is kept for metadata.";
+    metadata.get();
+
+    requests.clear();
+    EXPECT_EQ(std::future_status::ready, foreground.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ(std::future_status::ready, background.wait_for(std::chrono::seconds(5)));
+}
+
+// Check that when a handle comes free, a waiting request of a more urgent class gets it before one of a less urgent class that waited longer.
+TEST(CurlClientTest, MoreUrgentWaitersGoFirst)
+{
+    auto client = std::make_shared<CurlEasyClient>(8);
+    std::vector<std::shared_ptr<CurlEasyRequest>> requests;
+    for (int i = 0; i < 8; i++)
+    {
+        requests.push_back(client->get_handle(request_priority::metadata));
+    }
+    auto background = get_handle_async(client, request_priority::background);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto foreground = get_handle_async(client, request_priority::foreground);
+    EXPECT_EQ(std::future_status::timeout, foreground.wait_for(std::chrono::milliseconds(100)));
+
+    requests.pop_back();
+    EXPECT_EQ(std::future_status::ready, foreground.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ(std::future_status::timeout, background.wait_for(std::chrono::milliseconds(100))) << "The background request must wait behind the foreground one.";
+
+    requests.pop_back();
+    EXPECT_EQ(std::future_status::ready, background.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ(2u, client->pool_stats().waits);
+}
+
+// Check that idle handles above the minimum are freed once they have been idle for the lifetime, and not before.
+TEST(CurlClientTest, TrimsIdleHandles)
+{
+    auto client = std::make_shared<CurlEasyClient>(4);
+    client->set_idle_handle_lifetime(std::chrono::milliseconds(100));
+    {
+        std::vector<std::shared_ptr<CurlEasyRequest>> requests;
+        for (int i = 0; i < 3; i++)
+        {
+            requests.push_back(client->get_handle());
+        }
+    }
+
+    client->get_handle();
+    EXPECT_EQ(3, client->pool_stats().handles) << "Handles that have only just been released should be kept.";
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto request = client->get_handle();
+    auto stats = client->pool_stats();
+    EXPECT_EQ(1, stats.handles);
+    EXPECT_EQ(0, stats.idle);
+}
+
+// Check that requests to a host go out on new connections once it has failed to connect several times in a row, that other hosts are
+// unaffected, and that one request getting through puts the host back on cached connections.
+TEST(CurlClientTest, FreshConnectionsAfterConnectionFailures)
+{
+    auto client = std::make_shared<CurlEasyClient>(1);
+    const std::string url = refused_url();
+    auto send = [&client](const std::string &target)
+    {
+        CURLcode result = CURLE_OK;
+        auto request = client->get_handle();
+        request->set_url(target);
+        request->set_method(http_base::http_method::get);
+        request->submit([&result](http_base::http_code, storage_istream, CURLcode code) { result = code; }, std::chrono::milliseconds(0));
+        return result;
+    };
+
+    for (int attempt = 1; attempt <= 3; attempt++)
+    {
+        ASSERT_EQ(CURLE_COULDNT_CONNECT, send(url));
+    }
+    EXPECT_EQ(0u, client->pool_stats().fresh_connections) << "The first three requests may use cached connections.";
+    EXPECT_FALSE(client->needs_fresh_connection("http://127.0.0.2:1/container")) << "Other hosts keep their cached connections.";
+
+    ASSERT_EQ(CURLE_COULDNT_CONNECT, send(url + "container/blob"));
+    EXPECT_EQ(1u, client->pool_stats().fresh_connections);
+    EXPECT_EQ(1, client->pool_stats().handles) << "Handles are not dropped for their connections' failures.";
+
+    client->report_result(url, CURLE_OK);
+    ASSERT_EQ(CURLE_COULDNT_CONNECT, send(url));
+    EXPECT_EQ(1u, client->pool_stats().fresh_connections) << "A request that got through should clear the host's failures.";
+}
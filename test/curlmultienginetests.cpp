@@ -0,0 +1,350 @@
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "http/curl_multi_engine.h"
+#include "http/libcurl_http_client.h"
+#include "loopback_server.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    // A port on the loopback interface that accepts connections, but never answers a request on them.
+    class silent_listener : public loopback_server
+    {
+    public:
+        silent_listener() : loopback_server([](int, const std::string &) { return true; })
+        {
+        }
+    };
+
+    // Answers every request on the loopback interface with an empty 200, except that it can be told to sit on the next few for a while first.
+    class answering_server
+    {
+    public:
+        answering_server() : m_stalls(0), m_requests(0), m_stopping(false), m_server([this](int connection, const std::string &) { return respond(connection); })
+        {
+        }
+
+        ~answering_server()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_cv.notify_all();
+        }
+
+        std::string url() const
+        {
+            return m_server.url();
+        }
+
+        int port() const
+        {
+            return m_server.port();
+        }
+
+        // Holds back the answers to the next count requests for the given time.
+        void stall_next(int count, std::chrono::milliseconds delay)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stalls = count;
+            m_stall_delay = delay;
+        }
+
+        int requests()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_requests;
+        }
+
+    private:
+        bool respond(int connection)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_requests++;
+            if (m_stalls > 0)
+            {
+                m_stalls--;
+                if (m_cv.wait_for(lock, m_stall_delay, [this]() { return m_stopping; }))
+                {
+                    return false;
+                }
+            }
+            lock.unlock();
+            return loopback_server::send_all(connection, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+        }
+
+        int m_stalls;
+        std::chrono::milliseconds m_stall_delay;
+        int m_requests;
+        bool m_stopping;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        loopback_server m_server; // Last, so that it stops serving before the rest goes.
+    };
+
+    CURL *make_handle(const std::string &url, long timeout_ms)
+    {
+        CURL *handle = curl_easy_init();
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, timeout_ms);
+        curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+        return handle;
+    }
+
+    // Waits for a callback from a loop thread.
+    class completion
+    {
+    public:
+        completion() : m_done(false)
+        {
+        }
+
+        void set()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done = true;
+            m_cv.notify_all();
+        }
+
+        bool wait()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            return m_cv.wait_for(lock, std::chrono::seconds(30), [this]() { return m_done; });
+        }
+
+    private:
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_done;
+    };
+}
+
+// Check that delayed tasks on a loop run in the order they fall due, not the order they were posted.
+TEST(CurlMultiEngineTest, RunAfterOrdering)
+{
+    curl_multi_engine engine(1);
+    ASSERT_TRUE(engine.running());
+
+    std::mutex m;
+    std::vector<int> order;
+    completion done;
+    auto record = [&m, &order, &done](int value) {
+        std::lock_guard<std::mutex> lock(m);
+        order.push_back(value);
+        if (order.size() == 4)
+        {
+            done.set();
+        }
+    };
+
+    const auto posted = std::chrono::steady_clock::now();
+    engine.run_after(std::chrono::milliseconds(150), [&record]() { record(3); });
+    engine.run_after(std::chrono::milliseconds(50), [&record]() { record(1); });
+    engine.run_after(std::chrono::milliseconds(0), [&record]() { record(0); });
+    engine.run_after(std::chrono::milliseconds(100), [&record]() { record(2); });
+
+    ASSERT_TRUE(done.wait());
+    EXPECT_GE(std::chrono::steady_clock::now() - posted, std::chrono::milliseconds(150));
+    std::vector<int> expected = {0, 1, 2, 3};
+    EXPECT_EQ(expected, order);
+}
+
+// Check that a plain transfer's failure is reported to its callback.
+TEST(CurlMultiEngineTest, AddReportsFailure)
+{
+    curl_multi_engine engine(1);
+    ASSERT_TRUE(engine.running());
+
+    CURL *handle = make_handle(refused_url(), 5000);
+    CURLcode result = CURLE_OK;
+    completion done;
+    engine.add(handle, [&result, &done](CURLcode code) {
+        result = code;
+        done.set();
+    });
+
+    ASSERT_TRUE(done.wait());
+    EXPECT_EQ(CURLE_COULDNT_CONNECT, result);
+    curl_easy_cleanup(handle);
+}
+
+// Check that when a hedged request and its duplicate both fail, the one that failed last decides the result.
+// The original hangs on a port that never answers until it times out, well after the duplicate has been refused.
+TEST(CurlMultiEngineTest, HedgedBothFailReportsLast)
+{
+    curl_multi_engine engine(1);
+    ASSERT_TRUE(engine.running());
+    silent_listener listener;
+    ASSERT_NE(0, listener.port());
+
+    CURL *original = make_handle(listener.url(), 500);
+    const std::string duplicate_url = refused_url();
+    int hedges = 0;
+    CURL *reported = nullptr;
+    CURLcode result = CURLE_OK;
+    completion done;
+    engine.add_hedged(original, std::chrono::milliseconds(50),
+        [&hedges, &duplicate_url]() {
+            hedges++;
+            return make_handle(duplicate_url, 5000);
+        },
+        [&reported, &result, &done](CURL *handle, CURLcode code) {
+            reported = handle;
+            result = code;
+            done.set();
+        });
+
+    ASSERT_TRUE(done.wait());
+    EXPECT_EQ(1, hedges);
+    EXPECT_EQ(original, reported);
+    EXPECT_EQ(CURLE_OPERATION_TIMEDOUT, result);
+    curl_easy_cleanup(original);
+}
+
+// Check that a request that finishes before the hedge delay is never duplicated.
+TEST(CurlMultiEngineTest, HedgedFastFailureIsNotDuplicated)
+{
+    curl_multi_engine engine(1);
+    ASSERT_TRUE(engine.running());
+
+    CURL *original = make_handle(refused_url(), 5000);
+    int hedges = 0;
+    CURLcode result = CURLE_OK;
+    completion done;
+    engine.add_hedged(original, std::chrono::milliseconds(200),
+        [&hedges]() -> CURL * {
+            hedges++;
+            return nullptr;
+        },
+        [&result, &done](CURL *, CURLcode code) {
+            result = code;
+            done.set();
+        });
+
+    ASSERT_TRUE(done.wait());
+    EXPECT_EQ(CURLE_COULDNT_CONNECT, result);
+
+    // Give the hedge timer time to fire; it must find the request already decided.
+    completion timer_passed;
+    engine.run_after(std::chrono::milliseconds(300), [&timer_passed]() { timer_passed.set(); });
+    ASSERT_TRUE(timer_passed.wait());
+    EXPECT_EQ(0, hedges);
+    curl_easy_cleanup(original);
+}
+
+// Check that a hedge answered quickly wins against an original the server sits on, and that the original is dropped rather than waited for.
+TEST(CurlMultiEngineTest, HedgeWinsAgainstSlowOriginal)
+{
+    curl_multi_engine engine(1);
+    ASSERT_TRUE(engine.running());
+    answering_server server;
+    ASSERT_NE(0, server.port());
+    server.stall_next(1, std::chrono::milliseconds(10000));
+
+    CURL *original = make_handle(server.url(), 20000);
+    CURL *duplicate = nullptr;
+    CURL *reported = nullptr;
+    CURLcode result = CURLE_COULDNT_CONNECT;
+    completion done;
+    const auto start = std::chrono::steady_clock::now();
+    engine.add_hedged(original, std::chrono::milliseconds(50),
+        [&duplicate, &server]() {
+            duplicate = make_handle(server.url(), 20000);
+            return duplicate;
+        },
+        [&reported, &result, &done](CURL *handle, CURLcode code) {
+            reported = handle;
+            result = code;
+            done.set();
+        });
+
+    ASSERT_TRUE(done.wait());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5)) << "The stalled original should not have been waited for.";
+    EXPECT_EQ(CURLE_OK, result);
+    ASSERT_NE(nullptr, duplicate);
+    EXPECT_EQ(duplicate, reported);
+    EXPECT_EQ(2, server.requests());
+    curl_easy_cleanup(original);
+}
+
+// Check that no percentile is given until 32 times have been recorded, that it is taken over the latest 256, and how it is rounded.
+TEST(CurlMultiEngineTest, FirstByteTrackerPercentile)
+{
+    first_byte_tracker tracker;
+    for (long long i = 1; i <= 31; i++)
+    {
+        tracker.record(i);
+    }
+    EXPECT_EQ(-1, tracker.percentile(50)) << "31 samples are too few to go on.";
+    tracker.record(32);
+    // The sample at index (count - 1) * p / 100 in sorted order.
+    EXPECT_EQ(16, tracker.percentile(50));
+    EXPECT_EQ(31, tracker.percentile(99));
+    EXPECT_EQ(1, tracker.percentile(1));
+
+    for (int i = 0; i < 256; i++)
+    {
+        tracker.record(1000);
+    }
+    EXPECT_EQ(1000, tracker.percentile(1)) << "Only the latest 256 times count.";
+}
+
+// Check that a client only hedges reads once it has enough first-byte times to go on, that the hedge takes a place in the pool while it runs,
+// and that none is made while the hedge condition says no.
+TEST(CurlMultiEngineTest, ClientHedgesSlowReads)
+{
+    answering_server server;
+    ASSERT_NE(0, server.port());
+    auto client = std::make_shared<CurlEasyClient>(8);
+    client->start_event_loops(1);
+    ASSERT_NE(nullptr, client->engine());
+    CurlEasyClient::set_hedge_percentile(50);
+
+    for (int i = 0; i < 31; i++)
+    {
+        client->record_first_byte(5);
+    }
+    EXPECT_EQ(-1, client->hedge_delay_in_ms()) << "Too few reads to judge a slow one by.";
+    client->record_first_byte(5);
+    EXPECT_EQ(10, client->hedge_delay_in_ms()) << "Hedging sooner than 10 ms is more likely to add load than to save time.";
+    for (int i = 0; i < 64; i++)
+    {
+        client->record_first_byte(50);
+    }
+    ASSERT_EQ(50, client->hedge_delay_in_ms());
+
+    auto head = [&client, &server]() {
+        auto request = client->get_handle(request_priority::foreground);
+        request->set_url(server.url());
+        request->set_method(http_base::http_method::head);
+        auto result = std::make_shared<std::promise<http_base::http_code>>();
+        request->submit([result](http_base::http_code status, storage_istream, CURLcode code) { result->set_value(code == CURLE_OK ? status : 0); }, std::chrono::milliseconds(0));
+        return result->get_future();
+    };
+
+    server.stall_next(1, std::chrono::milliseconds(10000));
+    const auto start = std::chrono::steady_clock::now();
+    auto hedged = head();
+    ASSERT_EQ(std::future_status::ready, hedged.wait_for(std::chrono::seconds(5))) << "The hedge should have answered for the stalled read.";
+    EXPECT_EQ(200, hedged.get());
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+    EXPECT_EQ(1u, client->pool_stats().hedges);
+
+    client->set_hedge_condition([]() { return false; });
+    server.stall_next(1, std::chrono::milliseconds(300));
+    auto unhedged = head();
+    ASSERT_EQ(std::future_status::ready, unhedged.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ(200, unhedged.get());
+    EXPECT_EQ(1u, client->pool_stats().hedges) << "The condition forbids hedging, so the read should have waited out the stall.";
+    EXPECT_EQ(3, server.requests());
+
+    CurlEasyClient::set_hedge_percentile(0);
+}
@@ -0,0 +1,62 @@
+#include <future>
+#include <thread>
+#include "gtest/gtest.h"
+#include "lock_table.h"
+
+using namespace microsoft_azure::storage;
+
+// Check that a key's lock is only in the table while somebody has a handle on it, and that handles for the same key share one lock.
+TEST(LockTableTest, LockOnlyExistsWhileHeld)
+{
+    lock_table<std::mutex> table;
+    EXPECT_FALSE(table.busy("a"));
+    {
+        lock_table<std::mutex>::handle first = table.get("a");
+        lock_table<std::mutex>::handle second = table.get("a");
+        lock_table<std::mutex>::handle other = table.get("b");
+        EXPECT_EQ(&first.mutex(), &second.mutex());
+        EXPECT_NE(&first.mutex(), &other.mutex());
+        EXPECT_TRUE(table.busy("a"));
+        EXPECT_EQ(2u, table.size());
+    }
+    EXPECT_FALSE(table.busy("a"));
+    EXPECT_EQ(0u, table.size());
+}
+
+// Check that a handle moved out of a function keeps the lock until the last handle is gone.
+TEST(LockTableTest, MovedHandleKeepsLock)
+{
+    lock_table<std::mutex> table;
+    auto take = [&table]() { return table.get("a"); };
+    lock_table<std::mutex>::handle moved = take();
+    EXPECT_TRUE(table.busy("a"));
+    {
+        lock_table<std::mutex>::handle again = table.get("a");
+        EXPECT_EQ(&moved.mutex(), &again.mutex());
+    }
+    EXPECT_TRUE(table.busy("a"));
+}
+
+// Check that the lock orders two threads working on the same key, while a different key doesn't wait.
+TEST(LockTableTest, SameKeyWaitsOtherKeyDoesNot)
+{
+    lock_table<std::mutex> table;
+    lock_table<std::mutex>::handle held = table.get("a");
+    std::unique_lock<std::mutex> lock(held.mutex());
+
+    std::future<void> same = std::async(std::launch::async, [&table]()
+    {
+        lock_table<std::mutex>::handle h = table.get("a");
+        std::lock_guard<std::mutex> l(h.mutex());
+    });
+    std::future<void> other = std::async(std::launch::async, [&table]()
+    {
+        lock_table<std::mutex>::handle h = table.get("b");
+        std::lock_guard<std::mutex> l(h.mutex());
+    });
+
+    EXPECT_EQ(std::future_status::ready, other.wait_for(std::chrono::seconds(5)));
+    EXPECT_EQ(std::future_status::timeout, same.wait_for(std::chrono::milliseconds(100)));
+    lock.unlock();
+    EXPECT_EQ(std::future_status::ready, same.wait_for(std::chrono::seconds(5)));
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Takes HTTP requests on a port on the loopback interface, and hands each one to a callback to answer.  Each connection is served on its own
+// thread.  Request bodies are read and dropped; a callback that cares how big one was reads its Content-Length header.
+class loopback_server
+{
+public:
+    // Given the connection and the request line and headers, writes the response, or none, and returns false to close the connection.
+    // Callbacks that wait on anything must stop waiting once their owner starts to destroy the server.
+    typedef std::function<bool(int connection, const std::string &request)> responder;
+
+    explicit loopback_server(responder respond) : m_respond(std::move(respond)), m_socket(socket(AF_INET, SOCK_STREAM, 0)), m_port(0), m_stopping(false)
+    {
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        if (bind(m_socket, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0
+            && listen(m_socket, 16) == 0
+            && getsockname(m_socket, reinterpret_cast<struct sockaddr *>(&addr), &length) == 0)
+        {
+            m_port = ntohs(addr.sin_port);
+            m_acceptor = std::thread(&loopback_server::accept_connections, this);
+        }
+    }
+
+    ~loopback_server()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            for (int connection : m_connections)
+            {
+                shutdown(connection, SHUT_RDWR);
+            }
+        }
+        shutdown(m_socket, SHUT_RDWR);
+        if (m_acceptor.joinable())
+        {
+            m_acceptor.join();
+        }
+        for (auto &t : m_handlers)
+        {
+            t.join();
+        }
+        close(m_socket);
+    }
+
+    loopback_server(const loopback_server &) = delete;
+    loopback_server &operator=(const loopback_server &) = delete;
+
+    std::string endpoint() const
+    {
+        return "127.0.0.1:" + std::to_string(m_port);
+    }
+
+    std::string url() const
+    {
+        return "http://" + endpoint() + "/";
+    }
+
+    int port() const
+    {
+        return m_port;
+    }
+
+    static bool send_all(int connection, const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t count = send(connection, data, size, MSG_NOSIGNAL);
+            if (count <= 0)
+            {
+                return false;
+            }
+            data += count;
+            size -= static_cast<size_t>(count);
+        }
+        return true;
+    }
+
+    static bool send_all(int connection, const std::string &data)
+    {
+        return send_all(connection, data.data(), data.size());
+    }
+
+private:
+    void accept_connections()
+    {
+        while (true)
+        {
+            const int connection = accept(m_socket, nullptr, nullptr);
+            if (connection < 0)
+            {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stopping)
+            {
+                close(connection);
+                return;
+            }
+            m_connections.push_back(connection);
+            m_handlers.emplace_back(&loopback_server::serve, this, connection);
+        }
+    }
+
+    void serve(int connection)
+    {
+        std::string received;
+        char buffer[64 * 1024];
+        while (true)
+        {
+            const size_t end = received.find("\r\n\r\n");
+            if (end == std::string::npos)
+            {
+                const ssize_t count = recv(connection, buffer, sizeof(buffer), 0);
+                if (count <= 0)
+                {
+                    break;
+                }
+                received.append(buffer, static_cast<size_t>(count));
+                continue;
+            }
+            const std::string request = received.substr(0, end);
+            received.erase(0, end + 4);
+            if (!skip_body(connection, request, received, buffer, sizeof(buffer)) || !m_respond(connection, request))
+            {
+                break;
+            }
+        }
+        close(connection);
+    }
+
+    // Drops the request's body, whether it has already arrived or is still to come.
+    static bool skip_body(int connection, const std::string &request, std::string &received, char *buffer, size_t buffer_size)
+    {
+        const std::string length_header = "Content-Length: ";
+        const size_t length = request.find(length_header);
+        if (length == std::string::npos)
+        {
+            return true;
+        }
+        const unsigned long long content_length = std::stoull(request.substr(length + length_header.size()));
+        unsigned long long body = std::min<unsigned long long>(received.size(), content_length);
+        received.erase(0, static_cast<size_t>(body));
+        while (body < content_length)
+        {
+            const ssize_t count = recv(connection, buffer, static_cast<size_t>(std::min<unsigned long long>(buffer_size, content_length - body)), 0);
+            if (count <= 0)
+            {
+                return false;
+            }
+            body += static_cast<unsigned long long>(count);
+        }
+        return true;
+    }
+
+    responder m_respond;
+    int m_socket;
+    int m_port;
+    bool m_stopping;
+    std::vector<int> m_connections;
+    std::vector<std::thread> m_handlers;
+    std::thread m_acceptor;
+    std::mutex m_mutex;
+};
+
+// A port on the loopback interface with nothing listening on it, found by opening one and closing it again.
+inline std::string refused_url()
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    bind(s, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    getsockname(s, reinterpret_cast<struct sockaddr *>(&addr), &length);
+    close(s);
+    return "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/";
+}
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <thread>
+#include "gtest/gtest.h"
+#include "path_tree.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    std::shared_ptr<int> make_int(int value)
+    {
+        return std::make_shared<int>(value);
+    }
+
+    std::vector<std::string> paths_under(path_tree<int>& tree, const std::string& path)
+    {
+        std::vector<std::string> paths;
+        tree.for_each(path, [&paths](const std::string& p, const std::shared_ptr<int>&) { paths.push_back(p); });
+        return paths;
+    }
+}
+
+// Check that the factory is only called for a path with no entry, and that every spelling of a path finds the same entry.
+TEST(PathTreeTest, GetOrCreateAndFind)
+{
+    path_tree<int> tree;
+    int calls = 0;
+    auto a = tree.get_or_create("/a/b", [&calls]() { calls++; return make_int(1); });
+    auto b = tree.get_or_create("a//b/", [&calls]() { calls++; return make_int(2); });
+
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(a, tree.find("a/b"));
+    EXPECT_EQ(nullptr, tree.find("/a")) << "A directory on the way to an entry is not an entry itself.";
+    EXPECT_EQ(nullptr, tree.find("/a/b/c"));
+    EXPECT_EQ(1u, tree.size());
+
+    auto root = tree.get_or_create("/", []() { return make_int(0); });
+    EXPECT_EQ(root, tree.find(""));
+    EXPECT_EQ(2u, tree.size());
+}
+
+// Check that erasing an entry leaves the entries under it, and that erasing the last entry under a directory prunes it.
+TEST(PathTreeTest, Erase)
+{
+    path_tree<int> tree;
+    tree.get_or_create("/a", []() { return make_int(1); });
+    tree.get_or_create("/a/b/c", []() { return make_int(2); });
+
+    EXPECT_TRUE(tree.erase("/a"));
+    EXPECT_FALSE(tree.erase("/a"));
+    EXPECT_FALSE(tree.erase("/a/b")) << "/a/b has no entry of its own.";
+    EXPECT_EQ(nullptr, tree.find("/a"));
+    ASSERT_NE(nullptr, tree.find("/a/b/c"));
+    EXPECT_EQ(2, *tree.find("/a/b/c"));
+    EXPECT_EQ(1u, tree.size());
+
+    EXPECT_TRUE(tree.erase("/a/b/c"));
+    EXPECT_EQ(0u, tree.size());
+    EXPECT_TRUE(paths_under(tree, "/").empty());
+}
+
+// Check that erasing a subtree removes everything at and under the path, and nothing beside it.
+TEST(PathTreeTest, EraseSubtree)
+{
+    path_tree<int> tree;
+    tree.get_or_create("/a", []() { return make_int(1); });
+    tree.get_or_create("/a/b", []() { return make_int(2); });
+    tree.get_or_create("/a/b/c", []() { return make_int(3); });
+    tree.get_or_create("/ab", []() { return make_int(4); });
+    tree.get_or_create("/x/y", []() { return make_int(5); });
+
+    EXPECT_EQ(3u, tree.erase_subtree("/a"));
+    EXPECT_EQ(0u, tree.erase_subtree("/a"));
+    EXPECT_EQ(2u, tree.size());
+    EXPECT_NE(nullptr, tree.find("/ab")) << "A sibling sharing a prefix with the erased directory must survive.";
+    EXPECT_NE(nullptr, tree.find("/x/y"));
+
+    EXPECT_EQ(2u, tree.erase_subtree("/"));
+    EXPECT_EQ(0u, tree.size());
+    EXPECT_EQ(nullptr, tree.find("/x/y"));
+}
+
+// Check that for_each visits every entry under the path, with its full path.
+TEST(PathTreeTest, ForEach)
+{
+    path_tree<int> tree;
+    tree.get_or_create("/", []() { return make_int(0); });
+    tree.get_or_create("/a/b", []() { return make_int(1); });
+    tree.get_or_create("/a/c", []() { return make_int(2); });
+    tree.get_or_create("/d", []() { return make_int(3); });
+
+    std::vector<std::string> all = paths_under(tree, "/");
+    std::sort(all.begin(), all.end());
+    std::vector<std::string> expected = {"/", "/a/b", "/a/c", "/d"};
+    EXPECT_EQ(expected, all);
+
+    std::vector<std::string> under_a = paths_under(tree, "a/");
+    std::sort(under_a.begin(), under_a.end());
+    std::vector<std::string> expected_under_a = {"/a/b", "/a/c"};
+    EXPECT_EQ(expected_under_a, under_a);
+
+    EXPECT_TRUE(paths_under(tree, "/nothing").empty());
+}
+
+// Check that threads racing to create the same path all get the one entry.
+TEST(PathTreeTest, ConcurrentGetOrCreate)
+{
+    path_tree<int> tree;
+    const int thread_count = 8;
+    std::vector<std::shared_ptr<int>> results(thread_count);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; i++)
+    {
+        threads.emplace_back([&tree, &results, i]() {
+            for (int j = 0; j < 1000; j++)
+            {
+                tree.get_or_create("/dir/file" + std::to_string(j), [j]() { return make_int(j); });
+            }
+            results[i] = tree.get_or_create("/dir/file0", []() { return make_int(-1); });
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    EXPECT_EQ(1000u, tree.size());
+    for (int i = 0; i < thread_count; i++)
+    {
+        EXPECT_EQ(results[0], results[i]);
+    }
+    EXPECT_EQ(0, *results[0]);
+}
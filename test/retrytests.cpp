@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+#include "retry.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    // Evaluating a policy draws a random back-off, so each check is made over many draws.
+    const int draws = 1000;
+}
+
+// Check that the first attempt is made straight away.
+TEST(RetryPolicyTest, FirstAttemptIsImmediate)
+{
+    retry_policy policy;
+    retry_info info = policy.evaluate(retry_context());
+    EXPECT_TRUE(info.should_retry());
+    EXPECT_EQ(0, info.interval().count());
+}
+
+// Check that the first retry waits a random point in the upper half of the first 200ms window, and that the waits vary.
+TEST(RetryPolicyTest, FirstRetryWindow)
+{
+    retry_policy policy;
+    long long shortest = 1000000;
+    long long longest = 0;
+    for (int i = 0; i < draws; i++)
+    {
+        retry_info info = policy.evaluate(retry_context(1, 503));
+        ASSERT_TRUE(info.should_retry());
+        shortest = std::min(shortest, static_cast<long long>(info.interval().count()));
+        longest = std::max(longest, static_cast<long long>(info.interval().count()));
+    }
+    EXPECT_GE(shortest, 100);
+    EXPECT_LE(longest, 200);
+    EXPECT_LT(shortest, longest) << "Back-offs should be jittered.";
+}
+
+// Check that the window doubles with each retry, and stops growing at 30 seconds.
+TEST(RetryPolicyTest, WindowDoublesUpToCap)
+{
+    retry_policy policy;
+    const long long expected_windows[] = {200, 400, 800, 1600, 3200, 6400, 12800, 25600, 30000, 30000};
+    for (int retry = 1; retry <= 10; retry++)
+    {
+        const long long window = expected_windows[retry - 1];
+        for (int i = 0; i < draws; i++)
+        {
+            retry_info info = policy.evaluate(retry_context(retry, 500));
+            ASSERT_TRUE(info.should_retry());
+            ASSERT_GE(info.interval().count(), window / 2) << "retry " << retry;
+            ASSERT_LE(info.interval().count(), window) << "retry " << retry;
+        }
+    }
+    // Far past the point where the shift would overflow.
+    retry_info info = policy.evaluate(retry_context(25, 500));
+    ASSERT_TRUE(info.should_retry());
+    EXPECT_LE(info.interval().count(), 30000);
+}
+
+// Check that only retryable failures are retried, and no more than the given number of times.
+TEST(RetryPolicyTest, RetryableAndCount)
+{
+    retry_policy policy(3);
+    EXPECT_FALSE(policy.evaluate(retry_context(1, 404)).should_retry());
+    EXPECT_FALSE(policy.evaluate(retry_context(1, 412)).should_retry());
+    EXPECT_TRUE(policy.evaluate(retry_context(1, 408)).should_retry());
+    EXPECT_TRUE(policy.evaluate(retry_context(3, 503)).should_retry());
+    EXPECT_FALSE(policy.evaluate(retry_context(4, 503)).should_retry());
+}
+
+// Check that a retry is given up on if waiting out its back-off would take the operation past its time budget.
+TEST(RetryPolicyTest, BudgetCutsOffRetries)
+{
+    const auto budget = std::chrono::seconds(10);
+    retry_policy policy(25, budget);
+    const auto now = std::chrono::steady_clock::now();
+
+    // The first retry waits at most 200ms, so it fits with 250ms of the budget left.
+    for (int i = 0; i < draws; i++)
+    {
+        ASSERT_TRUE(policy.evaluate(retry_context(1, 503, now - budget + std::chrono::milliseconds(250))).should_retry());
+    }
+    // But not with less than the shortest wait (100ms) left.
+    for (int i = 0; i < draws; i++)
+    {
+        ASSERT_FALSE(policy.evaluate(retry_context(1, 503, now - budget + std::chrono::milliseconds(90))).should_retry());
+    }
+    // A long back-off is refused well before the budget is spent: the 10th retry waits at least 15 seconds.
+    EXPECT_FALSE(policy.evaluate(retry_context(10, 503, now)).should_retry());
+    EXPECT_TRUE(retry_policy(25, std::chrono::minutes(1)).evaluate(retry_context(10, 503, now)).should_retry());
+}
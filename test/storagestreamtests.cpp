@@ -0,0 +1,148 @@
+#include <cerrno>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "storage_stream.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    // What the next pwrite calls on this thread do: a positive value writes at most that many bytes, and a negative one fails with that errno.
+    thread_local std::deque<int> injected_writes;
+}
+
+// Stands in for the C library's pwrite (or pwrite64, which it is renamed to when off_t is 64 bits), so that tests can make writes come up
+// short or be interrupted.  Calls on threads with nothing injected go straight to the system call.
+extern "C" ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    if (!injected_writes.empty())
+    {
+        const int next = injected_writes.front();
+        injected_writes.pop_front();
+        if (next < 0)
+        {
+            errno = -next;
+            return -1;
+        }
+        count = std::min(count, static_cast<size_t>(next));
+    }
+    return syscall(SYS_pwrite64, fd, buf, count, offset);
+}
+
+namespace
+{
+    // A temporary file, removed when the test is done with it.
+    class temp_file
+    {
+    public:
+        temp_file() : m_path("/tmp/storagestreamtestXXXXXX")
+        {
+            m_fd = mkstemp(&m_path[0]);
+        }
+
+        ~temp_file()
+        {
+            close(m_fd);
+            unlink(m_path.c_str());
+        }
+
+        int fd() const
+        {
+            return m_fd;
+        }
+
+        std::string contents() const
+        {
+            std::string data(static_cast<size_t>(lseek(m_fd, 0, SEEK_END)), '\0');
+            EXPECT_EQ(static_cast<ssize_t>(data.size()), pread(m_fd, &data[0], data.size(), 0));
+            return data;
+        }
+
+    private:
+        std::string m_path;
+        int m_fd;
+    };
+}
+
+// Check that a file sink writes from its offset on, and that copies carry on from where each other left off.
+TEST(StorageSinkTest, WritesFromOffset)
+{
+    temp_file file;
+    ASSERT_NE(-1, file.fd());
+    ASSERT_EQ(4, pwrite(file.fd(), "....", 4, 0));
+
+    storage_sink sink = storage_sink::file(file.fd(), 4);
+    storage_sink copy = sink;
+    EXPECT_EQ(5u, sink.write("hello", 5));
+    EXPECT_EQ(5u, copy.write("world", 5));
+
+    EXPECT_EQ(10u, sink.written());
+    EXPECT_EQ(0, sink.error());
+    EXPECT_EQ("....helloworld", file.contents());
+}
+
+// Check that a reset sink overwrites what was written before it from the start, as a retried request's does.
+TEST(StorageSinkTest, ResetOverwritesFromStart)
+{
+    temp_file file;
+    ASSERT_NE(-1, file.fd());
+
+    storage_sink sink = storage_sink::file(file.fd(), 2);
+    injected_writes = {3, -EIO};
+    EXPECT_EQ(3u, sink.write("abcdef", 6));
+    EXPECT_EQ(EIO, sink.error());
+
+    sink.reset();
+    EXPECT_EQ(0u, sink.written());
+    EXPECT_EQ(0, sink.error());
+    EXPECT_EQ(6u, sink.write("ABCDEF", 6));
+    EXPECT_EQ(std::string("\0\0ABCDEF", 8), file.contents());
+}
+
+// Check that an interrupted write is tried again, rather than failing the sink.
+TEST(StorageSinkTest, RetriesInterruptedWrite)
+{
+    temp_file file;
+    ASSERT_NE(-1, file.fd());
+
+    storage_sink sink = storage_sink::file(file.fd(), 0);
+    injected_writes = {-EINTR, -EINTR};
+    EXPECT_EQ(6u, sink.write("abcdef", 6));
+    EXPECT_TRUE(injected_writes.empty());
+    EXPECT_EQ(0, sink.error());
+    EXPECT_EQ("abcdef", file.contents());
+}
+
+// Check that a short write carries on with the rest, from where the short one stopped.
+TEST(StorageSinkTest, ContinuesAfterShortWrite)
+{
+    temp_file file;
+    ASSERT_NE(-1, file.fd());
+
+    storage_sink sink = storage_sink::file(file.fd(), 0);
+    injected_writes = {2, 1, -EINTR, 2};
+    EXPECT_EQ(6u, sink.write("abcdef", 6));
+    EXPECT_TRUE(injected_writes.empty());
+    EXPECT_EQ(6u, sink.written());
+    EXPECT_EQ(0, sink.error());
+    EXPECT_EQ("abcdef", file.contents());
+}
+
+// Check that a failed write reports how much was written before it failed, and why it failed.
+TEST(StorageSinkTest, ReportsFailure)
+{
+    temp_file file;
+    ASSERT_NE(-1, file.fd());
+
+    storage_sink sink = storage_sink::file(file.fd(), 0);
+    EXPECT_EQ(3u, sink.write("abc", 3));
+    injected_writes = {2, -ENOSPC};
+    EXPECT_EQ(2u, sink.write("defg", 4));
+    EXPECT_EQ(5u, sink.written());
+    EXPECT_EQ(ENOSPC, sink.error());
+    EXPECT_EQ("abcde", file.contents());
+}
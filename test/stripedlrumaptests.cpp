@@ -0,0 +1,165 @@
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "striped_lru_map.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    bool contains(striped_lru_map<int>& map, const std::string& key)
+    {
+        return map.find(key, [](int&) {});
+    }
+
+    std::shared_ptr<int> get_shared(striped_lru_map<std::shared_ptr<int>>& map, const std::string& key)
+    {
+        return map.access(key, [](std::shared_ptr<int>& entry)
+        {
+            if (!entry)
+            {
+                entry = std::make_shared<int>(0);
+            }
+            return entry;
+        });
+    }
+}
+
+// Check that entries are created on first access and kept by value, and that find neither creates entries nor loses updates.
+TEST(StripedLruMapTest, AccessAndFind)
+{
+    striped_lru_map<int> map(0);
+    EXPECT_FALSE(contains(map, "a"));
+    EXPECT_EQ(0u, map.size()) << "find must not create an entry.";
+
+    EXPECT_EQ(0, map.access("a", [](int& value) { return value; })) << "A new entry is value-initialized.";
+    map.access("a", [](int& value) { value = 42; });
+    int seen = 0;
+    EXPECT_TRUE(map.find("a", [&seen](int& value) { seen = value; }));
+    EXPECT_EQ(42, seen);
+    EXPECT_EQ(1u, map.size());
+}
+
+// Check that the least recently used entry is evicted first, and that both access and find count as a use.
+TEST(StripedLruMapTest, EvictsLeastRecentlyUsed)
+{
+    striped_lru_map<int> map(3);
+    ASSERT_EQ(1u, map.shard_count()) << "A small map is a single shard, so its eviction order is exact.";
+
+    map.access("a", [](int&) {});
+    map.access("b", [](int&) {});
+    map.access("c", [](int&) {});
+    contains(map, "a"); // b is now the least recently used.
+    map.access("d", [](int&) {});
+
+    EXPECT_EQ(3u, map.size());
+    EXPECT_FALSE(contains(map, "b"));
+    EXPECT_TRUE(contains(map, "a"));
+    EXPECT_TRUE(contains(map, "c"));
+    EXPECT_TRUE(contains(map, "d"));
+
+    map.access("c", [](int&) {}); // a is now the least recently used.
+    map.access("e", [](int&) {});
+    EXPECT_FALSE(contains(map, "a"));
+    EXPECT_TRUE(contains(map, "c"));
+}
+
+// Check that a shared entry somebody still holds is passed over by eviction, keeping its key, and that the shard goes over its limit rather than drop it.
+TEST(StripedLruMapTest, EntriesInUseSurviveEviction)
+{
+    striped_lru_map<std::shared_ptr<int>> map(2);
+    std::shared_ptr<int> held = get_shared(map, "a");
+    *held = 7;
+    get_shared(map, "b");
+    get_shared(map, "c"); // a is the oldest, but in use, so b goes instead.
+
+    EXPECT_EQ(2u, map.size());
+    EXPECT_EQ(held, get_shared(map, "a"));
+    EXPECT_EQ(7, *get_shared(map, "a"));
+    EXPECT_FALSE(map.find("b", [](std::shared_ptr<int>&) {}));
+
+    std::shared_ptr<int> held_c = get_shared(map, "c");
+    get_shared(map, "d"); // Everything older is in use; the shard goes over its limit.
+    EXPECT_EQ(3u, map.size());
+
+    held.reset();
+    held_c.reset();
+    get_shared(map, "e"); // Back under the limit once the old entries are let go.
+    EXPECT_EQ(2u, map.size());
+    EXPECT_TRUE(map.find("d", [](std::shared_ptr<int>&) {}));
+    EXPECT_TRUE(map.find("e", [](std::shared_ptr<int>&) {}));
+}
+
+// Check how many shards a map gets for its size limit: one per thousand or so entries, between 1 and 64, and 64 when unbounded.
+TEST(StripedLruMapTest, ShardSizing)
+{
+    EXPECT_EQ(64u, striped_lru_map<int>(0).shard_count());
+    EXPECT_EQ(1u, striped_lru_map<int>(1).shard_count());
+    EXPECT_EQ(1u, striped_lru_map<int>(2047).shard_count());
+    EXPECT_EQ(2u, striped_lru_map<int>(2048).shard_count());
+    EXPECT_EQ(16u, striped_lru_map<int>(16 * 1024).shard_count());
+    EXPECT_EQ(64u, striped_lru_map<int>(64 * 1024).shard_count());
+    EXPECT_EQ(64u, striped_lru_map<int>(50 * 1000 * 1000).shard_count());
+
+    // Each shard holds its share of the limit, so the map as a whole never holds more than the limit (rounded up to a multiple of the shard count.)
+    striped_lru_map<int> map(4096);
+    ASSERT_EQ(4u, map.shard_count());
+    for (int i = 0; i < 20000; i++)
+    {
+        map.access(std::to_string(i), [](int&) {});
+    }
+    EXPECT_LE(map.size(), 4096u);
+    EXPECT_GT(map.size(), 3500u) << "Keys should spread roughly evenly over the shards.";
+}
+
+// Check that shrinking the limit evicts down to it straight away, keeping the most recently used entries, and that growing it keeps everything.
+TEST(StripedLruMapTest, ShrinkingLimit)
+{
+    striped_lru_map<int> map(5);
+    for (int i = 0; i < 5; i++)
+    {
+        map.access(std::to_string(i), [i](int& value) { value = i; });
+    }
+    EXPECT_EQ(5u, map.size());
+
+    map.set_max_entries(2);
+    EXPECT_EQ(2u, map.max_entries());
+    EXPECT_EQ(2u, map.size());
+    EXPECT_TRUE(contains(map, "3"));
+    EXPECT_TRUE(contains(map, "4"));
+
+    map.set_max_entries(0);
+    for (int i = 0; i < 10; i++)
+    {
+        map.access("new" + std::to_string(i), [](int&) {});
+    }
+    EXPECT_EQ(12u, map.size()) << "0 means no limit.";
+}
+
+// Check that the limit can be changed while other threads use the map.
+TEST(StripedLruMapTest, ConfigureUnderLoad)
+{
+    striped_lru_map<int> map(2048);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.push_back(std::thread([&map, t]()
+        {
+            for (int i = 0; i < 20000; i++)
+            {
+                map.access(std::to_string(t) + "/" + std::to_string(i), [](int& value) { value++; });
+            }
+        }));
+    }
+    for (int i = 0; i < 100; i++)
+    {
+        map.set_max_entries(i % 2 == 0 ? 256 : 2048);
+        EXPECT_TRUE(map.max_entries() == 256 || map.max_entries() == 2048);
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+    map.set_max_entries(256);
+    EXPECT_LE(map.size(), 256u);
+}
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "transfer_scheduler.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    // A transfer that holds its worker until it is opened, so that tests can queue work behind it.
+    class gate
+    {
+    public:
+        gate() : m_opened(m_open.get_future().share())
+        {
+        }
+
+        std::function<int()> transfer()
+        {
+            std::shared_future<void> opened = m_opened;
+            std::promise<void> *started = &m_started;
+            return [opened, started]() {
+                started->set_value();
+                opened.wait();
+                return 0;
+            };
+        }
+
+        // Waits for a worker to start the transfer.
+        void wait_started()
+        {
+            m_started.get_future().wait();
+        }
+
+        void open()
+        {
+            m_open.set_value();
+        }
+
+    private:
+        std::promise<void> m_started;
+        std::promise<void> m_open;
+        std::shared_future<void> m_opened;
+    };
+
+    // Records the order transfers ran in.
+    class run_log
+    {
+    public:
+        std::function<int()> transfer(const std::string &name)
+        {
+            return [this, name]() {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_order.push_back(name);
+                return 0;
+            };
+        }
+
+        std::vector<std::string> order()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_order;
+        }
+
+    private:
+        std::mutex m_mutex;
+        std::vector<std::string> m_order;
+    };
+}
+
+// Check that flows with transfers queued take turns, rather than one flow's queue running to the end before the next one's starts.
+TEST(TransferSchedulerTest, RoundRobinAcrossFlows)
+{
+    transfer_scheduler scheduler(1);
+    gate blocker;
+    const auto blocker_flow = scheduler.open_flow();
+    auto blocked = scheduler.submit(blocker_flow, blocker.transfer());
+    blocker.wait_started();
+
+    run_log log;
+    const auto a = scheduler.open_flow();
+    const auto b = scheduler.open_flow();
+    std::vector<std::future<int>> results;
+    for (int i = 1; i <= 3; i++)
+    {
+        results.push_back(scheduler.submit(a, log.transfer("a" + std::to_string(i))));
+    }
+    for (int i = 1; i <= 3; i++)
+    {
+        results.push_back(scheduler.submit(b, log.transfer("b" + std::to_string(i))));
+    }
+
+    blocker.open();
+    for (auto &result : results)
+    {
+        EXPECT_EQ(0, result.get());
+    }
+    std::vector<std::string> expected = {"a1", "b1", "a2", "b2", "a3", "b3"};
+    EXPECT_EQ(expected, log.order());
+}
+
+// Check that no more of a flow's transfers run at once than it allows, even with workers to spare.
+TEST(TransferSchedulerTest, FlowMaxRunning)
+{
+    transfer_scheduler scheduler(4);
+    const auto flow = scheduler.open_flow(2);
+
+    std::mutex m;
+    std::condition_variable cv;
+    int running = 0;
+    int most_running = 0;
+    auto transfer = [&m, &cv, &running, &most_running]() {
+        std::unique_lock<std::mutex> lock(m);
+        running++;
+        most_running = std::max(most_running, running);
+        cv.notify_all();
+        // Hold on until another is running too, or it is clear that none will be, so that a third would have the chance to start.
+        cv.wait_for(lock, std::chrono::milliseconds(100), [&running]() { return running >= 2; });
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        lock.lock();
+        running--;
+        return 0;
+    };
+
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 6; i++)
+    {
+        results.push_back(scheduler.submit(flow, transfer));
+    }
+    for (auto &result : results)
+    {
+        EXPECT_EQ(0, result.get());
+    }
+    EXPECT_EQ(2, most_running);
+}
+
+// Check that closing an idle flow forgets it at once, and that a closed flow with work queued is forgotten once that work has run.
+TEST(TransferSchedulerTest, ClosedFlowErasedOnceDrained)
+{
+    transfer_scheduler scheduler(1);
+    const auto idle = scheduler.open_flow();
+    EXPECT_EQ(1u, scheduler.flow_count());
+    scheduler.close_flow(idle);
+    EXPECT_EQ(0u, scheduler.flow_count());
+
+    gate blocker;
+    const auto blocker_flow = scheduler.open_flow();
+    auto blocked = scheduler.submit(blocker_flow, blocker.transfer());
+    blocker.wait_started();
+
+    run_log log;
+    const auto flow = scheduler.open_flow();
+    auto queued = scheduler.submit(flow, log.transfer("queued"));
+    scheduler.close_flow(flow);
+    EXPECT_EQ(2u, scheduler.flow_count()) << "A closed flow with work queued must be kept until the work has run.";
+
+    // With one worker, the closed flow has been dealt with by the time the worker gets to the next transfer.
+    auto after = scheduler.submit(blocker_flow, log.transfer("after"));
+    blocker.open();
+    EXPECT_EQ(0, queued.get());
+    EXPECT_EQ(0, after.get());
+    EXPECT_EQ(1u, scheduler.flow_count());
+}
+
+// Check that destroying the scheduler runs every transfer already queued before the workers stop.
+TEST(TransferSchedulerTest, DestructorDrainsQueue)
+{
+    std::atomic<int> ran(0);
+    std::vector<std::future<int>> results;
+    gate blocker;
+    std::thread opener;
+    {
+        transfer_scheduler scheduler(1);
+        const auto flow = scheduler.open_flow();
+        results.push_back(scheduler.submit(flow, blocker.transfer()));
+        blocker.wait_started();
+        for (int i = 0; i < 5; i++)
+        {
+            results.push_back(scheduler.submit(flow, [&ran]() { ran++; return 0; }));
+        }
+        opener = std::thread([&blocker]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            blocker.open();
+        });
+    }
+    opener.join();
+
+    EXPECT_EQ(5, ran);
+    for (auto &result : results)
+    {
+        ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(0)));
+        EXPECT_EQ(0, result.get());
+    }
+}
+
+// Check that the window halves when the service is busy, down to one transfer, and that busy responses straight after a decrease are ignored.
+TEST(TransferSchedulerTest, WindowHalvesOnBusy)
+{
+    transfer_scheduler scheduler(8);
+    EXPECT_EQ(8u, scheduler.window());
+
+    scheduler.record_response(503);
+    EXPECT_EQ(4u, scheduler.window());
+    scheduler.record_response(503);
+    scheduler.record_response(500);
+    EXPECT_EQ(4u, scheduler.window()) << "Responses within a second of a decrease were to requests sent before it.";
+    scheduler.record_response(404);
+    EXPECT_EQ(4u, scheduler.window()) << "Other failures say nothing about load.";
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    scheduler.record_response(500);
+    EXPECT_EQ(2u, scheduler.window());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    scheduler.record_response(503);
+    EXPECT_EQ(1u, scheduler.window());
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    scheduler.record_response(503);
+    EXPECT_EQ(1u, scheduler.window()) << "The window never closes altogether.";
+}
+
+// Check that the window grows by one transfer for about each window's worth of successes, up to the number of workers.
+TEST(TransferSchedulerTest, WindowGrowsOnSuccess)
+{
+    transfer_scheduler scheduler(8);
+    scheduler.record_response(503);
+    ASSERT_EQ(4u, scheduler.window());
+
+    for (int i = 0; i < 3; i++)
+    {
+        scheduler.record_response(200);
+    }
+    EXPECT_EQ(4u, scheduler.window());
+    for (int i = 0; i < 2; i++)
+    {
+        scheduler.record_response(201);
+    }
+    EXPECT_EQ(5u, scheduler.window());
+
+    for (int i = 0; i < 1000; i++)
+    {
+        scheduler.record_response(200);
+    }
+    EXPECT_EQ(8u, scheduler.window());
+}
+
+// Check that a transfer held back by the window starts as soon as the window grows, without waiting for a running transfer to finish.
+TEST(TransferSchedulerTest, WindowGrowthWakesWorker)
+{
+    transfer_scheduler scheduler(2);
+    scheduler.record_response(503);
+    ASSERT_EQ(1u, scheduler.window());
+
+    gate blocker;
+    auto blocked = scheduler.submit(scheduler.open_flow(), blocker.transfer());
+    blocker.wait_started();
+
+    std::atomic<bool> ran(false);
+    auto held = scheduler.submit(scheduler.open_flow(), [&ran]() { ran = true; return 0; });
+    EXPECT_EQ(std::future_status::timeout, held.wait_for(std::chrono::milliseconds(100))) << "The window only allows one transfer at a time.";
+    EXPECT_FALSE(ran);
+
+    scheduler.record_response(200);
+    ASSERT_EQ(2u, scheduler.window());
+    EXPECT_EQ(std::future_status::ready, held.wait_for(std::chrono::seconds(5)));
+    EXPECT_TRUE(ran);
+
+    blocker.open();
+    EXPECT_EQ(0, blocked.get());
+}
+
+// Check that an asynchronous transfer keeps its place in the window until it is done, but not its worker, so one thread can keep several in flight.
+TEST(TransferSchedulerTest, AsyncTransfersFreeTheirWorker)
+{
+    transfer_scheduler scheduler(3, 1);
+    std::mutex mutex;
+    std::vector<std::function<void(int)>> in_flight;
+    auto start = [&mutex, &in_flight](std::function<void(int)> done) {
+        std::lock_guard<std::mutex> lock(mutex);
+        in_flight.push_back(done);
+    };
+
+    const auto flow = scheduler.open_flow();
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 4; i++)
+    {
+        results.push_back(scheduler.submit_async(flow, start));
+    }
+    auto started = [&mutex, &in_flight]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return in_flight.size();
+    };
+    for (int i = 0; i < 500 && started() < 3; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(3u, started()) << "The one worker should have started as many as the window allows.";
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(3u, started()) << "The fourth must wait for a place in the window.";
+    EXPECT_EQ(std::future_status::timeout, results[0].wait_for(std::chrono::seconds(0)));
+
+    // Finishing one from another thread, as the curl engine would, lets the fourth start.
+    std::function<void(int)> first;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        first = in_flight[0];
+    }
+    std::thread([first]() { first(7); }).join();
+    EXPECT_EQ(7, results[0].get());
+    for (int i = 0; i < 500 && started() < 4; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(4u, started());
+
+    for (size_t i = 1; i < in_flight.size(); i++)
+    {
+        in_flight[i](0);
+    }
+    for (size_t i = 1; i < results.size(); i++)
+    {
+        EXPECT_EQ(0, results[i].get());
+    }
+    scheduler.close_flow(flow);
+    EXPECT_EQ(0u, scheduler.flow_count());
+}
+
+// Check that destroying the scheduler waits for asynchronous transfers to be done, and runs what they queue on their flow before they are.
+TEST(TransferSchedulerTest, DestructorWaitsForAsyncTransfers)
+{
+    std::atomic<bool> follow_up_ran(false);
+    std::function<void(int)> pending;
+    std::promise<void> started;
+    std::thread finisher;
+    {
+        transfer_scheduler scheduler(2);
+        const auto flow = scheduler.open_flow();
+        scheduler.submit_async(flow, [&pending, &started](std::function<void(int)> done) {
+            pending = done;
+            started.set_value();
+        });
+        scheduler.close_flow(flow);
+        started.get_future().wait();
+        transfer_scheduler *s = &scheduler;
+        finisher = std::thread([s, flow, &pending, &follow_up_ran]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            s->submit(flow, [&follow_up_ran]() { follow_up_ran = true; return 0; });
+            pending(0);
+        });
+    }
+    finisher.join();
+    EXPECT_TRUE(follow_up_ran);
+}
@@ -0,0 +1,105 @@
+#include <chrono>
+#include "gtest/gtest.h"
+#include "transfer_tuner.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    const unsigned long long MB = 1024 * 1024;
+
+    // A 100MB file transfer at the given throughput, long enough to count.
+    void record_file(transfer_tuner &tuner, double mb_per_second, size_t streams)
+    {
+        tuner.record_transfer(100 * MB, std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(100 / mb_per_second)), streams);
+    }
+}
+
+// Check that the block size is what a request takes two seconds to carry, rounded up to a whole number of 4MB.
+TEST(TransferTunerTest, BlockSizeRoundsUpTo4MB)
+{
+    transfer_tuner tuner(8, 16, 16 * MB, 4 * MB, 100 * MB);
+    EXPECT_EQ(16 * MB, tuner.block_size());
+
+    tuner.record_request(10 * MB, std::chrono::seconds(2));
+    EXPECT_EQ(12 * MB, tuner.block_size()) << "5MB/s for two seconds is 10MB, rounded up to 12MB.";
+
+    transfer_tuner exact(8, 16, 16 * MB, 4 * MB, 100 * MB);
+    exact.record_request(8 * MB, std::chrono::seconds(1));
+    EXPECT_EQ(16 * MB, exact.block_size());
+}
+
+// Check that the block size stays between the bounds, and that requests smaller than the smallest block are ignored.
+TEST(TransferTunerTest, BlockSizeClamped)
+{
+    transfer_tuner slow(8, 16, 16 * MB, 8 * MB, 100 * MB);
+    slow.record_request(8 * MB, std::chrono::seconds(100));
+    EXPECT_EQ(8 * MB, slow.block_size());
+
+    transfer_tuner fast(8, 16, 16 * MB, 4 * MB, 100 * MB);
+    fast.record_request(100 * MB, std::chrono::milliseconds(100));
+    EXPECT_EQ(100 * MB, fast.block_size());
+
+    transfer_tuner tail(8, 16, 16 * MB, 4 * MB, 100 * MB);
+    tail.record_request(1 * MB, std::chrono::seconds(10));
+    EXPECT_EQ(16 * MB, tail.block_size());
+}
+
+// Check that the number of blocks in flight keeps climbing while files get faster, turns around at the upper bound, and climbs back
+// up once stepping down makes files slower.
+TEST(TransferTunerTest, HillClimbReversesAtUpperBound)
+{
+    transfer_tuner tuner(8, 10, 16 * MB, 4 * MB, 100 * MB);
+    record_file(tuner, 100, 8);
+    EXPECT_EQ(10u, tuner.streams());
+
+    record_file(tuner, 200, 10);
+    EXPECT_EQ(10u, tuner.streams()) << "Already at the most allowed.";
+    record_file(tuner, 200, 10);
+    EXPECT_EQ(8u, tuner.streams()) << "After a file at the bound, the tuner should step the other way.";
+
+    record_file(tuner, 100, 8);
+    EXPECT_EQ(10u, tuner.streams()) << "Fewer streams made files slower, so the tuner should turn back.";
+}
+
+// Check that the number of blocks in flight keeps falling while that costs nothing, and turns around at one.
+TEST(TransferTunerTest, HillClimbReversesAtLowerBound)
+{
+    transfer_tuner tuner(2, 4, 16 * MB, 4 * MB, 100 * MB);
+    record_file(tuner, 100, 2);
+    EXPECT_EQ(3u, tuner.streams());
+
+    record_file(tuner, 50, 3);
+    EXPECT_EQ(2u, tuner.streams()) << "More streams made files slower.";
+    record_file(tuner, 50, 2);
+    EXPECT_EQ(1u, tuner.streams()) << "Fewer streams cost nothing, so the tuner should keep going.";
+
+    record_file(tuner, 50, 1);
+    EXPECT_EQ(1u, tuner.streams());
+    record_file(tuner, 50, 1);
+    EXPECT_EQ(2u, tuner.streams()) << "After a file at the bound, the tuner should step the other way.";
+}
+
+// Check that files too short to count, or made with a different number of blocks in flight, leave the tuner alone.
+TEST(TransferTunerTest, IgnoresTransfersThatDontCount)
+{
+    transfer_tuner tuner(8, 16, 16 * MB, 4 * MB, 100 * MB);
+    tuner.record_transfer(100 * MB, std::chrono::milliseconds(100), 8);
+    EXPECT_EQ(8u, tuner.streams());
+    record_file(tuner, 100, 3);
+    EXPECT_EQ(8u, tuner.streams());
+}
+
+// Check that a file of a very different size isn't compared with the one before, but is what the next file of its size is compared with.
+TEST(TransferTunerTest, ComparesFilesOfSimilarSize)
+{
+    transfer_tuner tuner(8, 16, 16 * MB, 4 * MB, 100 * MB);
+    record_file(tuner, 100, 8);
+    EXPECT_EQ(10u, tuner.streams());
+
+    tuner.record_transfer(1000 * MB, std::chrono::seconds(5), 10);
+    EXPECT_EQ(10u, tuner.streams()) << "A file ten times the size is faster for its size alone, so says nothing about the extra streams.";
+
+    tuner.record_transfer(1200 * MB, std::chrono::seconds(10), 10);
+    EXPECT_EQ(8u, tuner.streams()) << "Compared with the last file of similar size, this one was slower, so the tuner should turn back.";
+}
@@ -0,0 +1,338 @@
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "blob/blob_client.h"
+#include "loopback_server.h"
+
+using namespace microsoft_azure::storage;
+
+namespace
+{
+    const unsigned long long MB = 1024 * 1024;
+    // The block size uploads start with, before the client has any transfers to tune it to.
+    const unsigned long long block_size = 16 * MB;
+    // Two whole blocks and a short one: too big to go up in one request.
+    const unsigned long long file_length = 2 * block_size + 8 * MB;
+
+    // Takes block uploads for blobs over HTTP on the loopback interface, keeping the IDs and sizes of the blocks staged, and can fail the
+    // upload of a chosen block or misreport the sizes of staged blocks.
+    class block_server
+    {
+    public:
+        block_server() : m_fail_block(-1), m_blocks_put(0), m_size_error(0),
+            m_server([this](int connection, const std::string &request) { return loopback_server::send_all(connection, respond(request)); })
+        {
+        }
+
+        std::string endpoint() const
+        {
+            return m_server.endpoint();
+        }
+
+        int port() const
+        {
+            return m_server.port();
+        }
+
+        // Fails the upload of the given block, counting from 0 in the order they arrive, with 400.
+        void fail_block(int index)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fail_block = index;
+            m_blocks_put = 0;
+        }
+
+        // Reports staged blocks as this many bytes bigger than they are.
+        void misreport_sizes(unsigned long long error)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_size_error = error;
+        }
+
+        // The requests made so far - "block <size>", "blob <size>", "get blocklist" or "put blocklist" - and forgets them.
+        std::vector<std::string> take_requests()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::vector<std::string> requests;
+            requests.swap(m_requests);
+            return requests;
+        }
+
+        // The IDs of the blocks staged, and not yet committed.
+        std::vector<std::string> staged()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::vector<std::string> ids;
+            for (const auto &block : m_staged)
+            {
+                ids.push_back(block.first);
+            }
+            return ids;
+        }
+
+    private:
+        std::string respond(const std::string &request)
+        {
+            // Only the size of the body matters.
+            unsigned long long content_length = 0;
+            const std::string length_header = "Content-Length: ";
+            const size_t length = request.find(length_header);
+            if (length != std::string::npos)
+            {
+                content_length = std::stoull(request.substr(length + length_header.size()));
+            }
+            const bool put = request.compare(0, 4, "PUT ") == 0;
+            const std::string target = request.substr(0, request.find(" HTTP/"));
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (put && target.find("comp=block&") != std::string::npos)
+            {
+                m_requests.push_back("block " + std::to_string(content_length));
+                if (m_blocks_put++ == m_fail_block)
+                {
+                    return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+                }
+                m_staged[query_value(target, "blockid")] = content_length;
+                return "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+            }
+            if (put && target.find("comp=") == std::string::npos)
+            {
+                m_requests.push_back("blob " + std::to_string(content_length));
+                m_staged.clear();
+                return "HTTP/1.1 201 Created\r\nContent-Length: 0\r\nETag: \"0x8D0000000000001\"\r\nLast-Modified: Wed, 01 Jan 2020 00:00:00 GMT\r\n\r\n";
+            }
+            if (target.find("comp=blocklist") != std::string::npos)
+            {
+                if (put)
+                {
+                    m_requests.push_back("put blocklist");
+                    m_staged.clear();
+                    return "HTTP/1.1 201 Created\r\nContent-Length: 0\r\nETag: \"0x8D0000000000001\"\r\nLast-Modified: Wed, 01 Jan 2020 00:00:00 GMT\r\n\r\n";
+                }
+                m_requests.push_back("get blocklist");
+                std::string xml = "<?xml version=\"1.0\" encoding=\"utf-8\"?><BlockList><CommittedBlocks /><UncommittedBlocks>";
+                for (const auto &block : m_staged)
+                {
+                    xml += "<Block><Name>" + block.first + "</Name><Size>" + std::to_string(block.second + m_size_error) + "</Size></Block>";
+                }
+                xml += "</UncommittedBlocks></BlockList>";
+                return "HTTP/1.1 200 OK\r\nContent-Type: application/xml\r\nContent-Length: " + std::to_string(xml.size()) + "\r\n\r\n" + xml;
+            }
+            return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        }
+
+        // The URL-decoded value of a query parameter.
+        static std::string query_value(const std::string &target, const std::string &name)
+        {
+            const size_t start = target.find(name + "=");
+            if (start == std::string::npos)
+            {
+                return std::string();
+            }
+            const size_t value = start + name.size() + 1;
+            const std::string encoded = target.substr(value, target.find('&', value) - value);
+            std::string decoded;
+            for (size_t i = 0; i < encoded.size(); i++)
+            {
+                if (encoded[i] == '%' && i + 2 < encoded.size())
+                {
+                    decoded += static_cast<char>(std::stoi(encoded.substr(i + 1, 2), nullptr, 16));
+                    i += 2;
+                }
+                else
+                {
+                    decoded += encoded[i];
+                }
+            }
+            return decoded;
+        }
+
+        int m_fail_block;
+        int m_blocks_put;
+        unsigned long long m_size_error;
+        std::map<std::string, unsigned long long> m_staged; // Sizes of the blocks staged, by ID.
+        std::vector<std::string> m_requests;
+        std::mutex m_mutex;
+        loopback_server m_server; // Last, so that it stops serving before the rest goes.
+    };
+
+    // Makes a file of the given length in a new directory, with a directory beside it for upload journals, and removes them both when done.
+    class upload_fixture
+    {
+    public:
+        explicit upload_fixture(unsigned long long length)
+        {
+            char directory[] = "/tmp/uploadjournaltestXXXXXX";
+            m_directory = mkdtemp(directory) != nullptr ? directory : std::string();
+            m_journals = m_directory + "/uploads";
+            m_source = m_directory + "/source";
+            const int fd = open(m_source.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            std::vector<char> data(static_cast<size_t>(MB), 'x');
+            for (unsigned long long written = 0; fd != -1 && written < length; written += MB)
+            {
+                if (write(fd, data.data(), static_cast<size_t>(std::min<unsigned long long>(MB, length - written))) < 0)
+                {
+                    break;
+                }
+            }
+            close(fd);
+        }
+
+        ~upload_fixture()
+        {
+            unlink(m_source.c_str());
+            DIR *d = opendir(m_journals.c_str());
+            while (d != nullptr)
+            {
+                struct dirent *entry = readdir(d);
+                if (entry == nullptr)
+                {
+                    break;
+                }
+                unlink((m_journals + "/" + entry->d_name).c_str());
+            }
+            if (d != nullptr)
+            {
+                closedir(d);
+            }
+            rmdir(m_journals.c_str());
+            rmdir(m_directory.c_str());
+        }
+
+        upload_fixture(const upload_fixture &) = delete;
+        upload_fixture &operator=(const upload_fixture &) = delete;
+
+        // A client keeping its upload journals in the fixture's directory.
+        std::shared_ptr<blob_client_wrapper> make_client(const block_server &server)
+        {
+            blob_client_wrapper::set_upload_journal_directory(m_journals);
+            auto client = blob_client_wrapper_init_sastoken("account", "sv=2018-03-28&sig=test", 4, false, server.endpoint());
+            blob_client_wrapper::set_upload_journal_directory(std::string());
+            return client;
+        }
+
+        const std::string &source() const
+        {
+            return m_source;
+        }
+
+        // The number of journals kept.
+        int journals() const
+        {
+            int count = 0;
+            DIR *d = opendir(m_journals.c_str());
+            while (d != nullptr)
+            {
+                struct dirent *entry = readdir(d);
+                if (entry == nullptr)
+                {
+                    break;
+                }
+                if (entry->d_name[0] != '.')
+                {
+                    count++;
+                }
+            }
+            if (d != nullptr)
+            {
+                closedir(d);
+            }
+            return count;
+        }
+
+    private:
+        std::string m_directory;
+        std::string m_journals;
+        std::string m_source;
+    };
+
+    // Uploads the file one block at a time, so that the blocks go in order, and returns errno.
+    int upload(blob_client_wrapper &client, const std::string &source)
+    {
+        errno = 0;
+        client.upload_file_to_blob(source, "container", "blob", std::vector<std::pair<std::string, std::string>>(), 1);
+        return errno;
+    }
+}
+
+// Check that an upload that fails part way through keeps its journal, and that the next upload of the file asks which blocks are staged
+// and only sends the rest, then removes the journal once the blob is committed.
+TEST(UploadJournalTest, ResumeReusesStagedBlocks)
+{
+    block_server server;
+    ASSERT_NE(0, server.port());
+    upload_fixture files(file_length);
+    auto client = files.make_client(server);
+
+    server.fail_block(1);
+    EXPECT_EQ(400, upload(*client, files.source()));
+    std::vector<std::string> expected = {"block " + std::to_string(block_size), "block " + std::to_string(block_size)};
+    EXPECT_EQ(expected, server.take_requests()) << "Blocks after the failed one should be skipped.";
+    EXPECT_EQ(1u, server.staged().size());
+    EXPECT_EQ(1, files.journals());
+
+    server.fail_block(-1);
+    EXPECT_EQ(0, upload(*client, files.source()));
+    expected = {"get blocklist", "block " + std::to_string(block_size), "block " + std::to_string(8 * MB), "put blocklist"};
+    EXPECT_EQ(expected, server.take_requests()) << "Only the blocks not already staged should be sent.";
+    EXPECT_EQ(0, files.journals()) << "The journal should go once the blocks are committed.";
+}
+
+// Check that a staged block of the wrong size isn't taken for the block it is named after, and is sent again.
+TEST(UploadJournalTest, ResumeResendsBlocksOfWrongSize)
+{
+    block_server server;
+    ASSERT_NE(0, server.port());
+    upload_fixture files(file_length);
+    auto client = files.make_client(server);
+
+    server.fail_block(2);
+    EXPECT_EQ(400, upload(*client, files.source()));
+    EXPECT_EQ(2u, server.staged().size());
+    server.take_requests();
+
+    server.fail_block(-1);
+    server.misreport_sizes(1);
+    EXPECT_EQ(0, upload(*client, files.source()));
+    std::vector<std::string> expected = {"get blocklist", "block " + std::to_string(block_size), "block " + std::to_string(block_size), "block " + std::to_string(8 * MB), "put blocklist"};
+    EXPECT_EQ(expected, server.take_requests());
+}
+
+// Check that the journal is ignored once the file has changed, so that the whole file is sent again rather than any staged block reused.
+TEST(UploadJournalTest, ChangedSourceStartsAgain)
+{
+    block_server server;
+    ASSERT_NE(0, server.port());
+    upload_fixture files(file_length);
+    auto client = files.make_client(server);
+
+    server.fail_block(1);
+    EXPECT_EQ(400, upload(*client, files.source()));
+    ASSERT_EQ(1u, server.staged().size());
+    server.take_requests();
+
+    const int fd = open(files.source().c_str(), O_WRONLY | O_APPEND);
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(1, write(fd, "y", 1));
+    close(fd);
+
+    server.fail_block(-1);
+    EXPECT_EQ(0, upload(*client, files.source()));
+    // The block size may have been tuned since, so the file may go up in blocks of another size, or in one request.
+    unsigned long long sent = 0;
+    for (const std::string &request : server.take_requests())
+    {
+        EXPECT_NE("get blocklist", request) << "A changed file's upload shouldn't ask for the staged blocks.";
+        if (request.compare(0, 6, "block ") == 0 || request.compare(0, 5, "blob ") == 0)
+        {
+            sent += std::stoull(request.substr(request.find(' ') + 1));
+        }
+    }
+    EXPECT_EQ(file_length + 1, sent);
+    EXPECT_EQ(0, files.journals());
+}